@@ -1,6 +1,10 @@
 #include "ast.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "util.h"
 
 struct ast_position ast_position_create(uint32_t row, uint32_t col) {
     struct ast_position pos;
@@ -25,6 +29,14 @@ void ast_literal_discard(struct ast_literal literal) {
     free(literal.value);
 }
 
+struct ast_literal ast_literal_clone(const struct ast_literal literal) {
+    return ast_literal_create(literal.type, strdup(literal.value), literal.pos);
+}
+
+bool ast_literal_equals(const struct ast_literal a, const struct ast_literal b) {
+    return a.type == b.type && strcmp(a.value, b.value) == 0;
+}
+
 struct ast_transformation_args *
 ast_transformation_args_new(struct ast_literal argument, struct ast_transformation_args * next) {
     struct ast_transformation_args * args = malloc(sizeof(struct ast_transformation_args));
@@ -65,6 +77,16 @@ ast_transformation_args_reverse(struct ast_transformation_args * transformation_
     return result;
 }
 
+struct ast_transformation_args * ast_transformation_args_clone(const struct ast_transformation_args * transformation_args) {
+    struct ast_transformation_args * result = NULL;
+
+    for (; transformation_args; transformation_args = transformation_args->next) {
+        result = ast_transformation_args_new(ast_literal_clone(transformation_args->argument), result);
+    }
+
+    return ast_transformation_args_reverse(result);
+}
+
 struct ast_transformation
 ast_transformation_create(char * module, char * name, struct ast_transformation_args * args, struct ast_position pos) {
     struct ast_transformation transformation;
@@ -84,6 +106,52 @@ void ast_transformation_discard(struct ast_transformation transformation) {
     ast_transformation_args_delete(transformation.args);
 }
 
+struct ast_transformation ast_transformation_clone(const struct ast_transformation transformation) {
+    return ast_transformation_create(
+        strdup(transformation.module),
+        strdup(transformation.name),
+        ast_transformation_args_clone(transformation.args),
+        transformation.pos
+    );
+}
+
+bool ast_transformation_equals(const struct ast_transformation a, const struct ast_transformation b) {
+    const struct ast_transformation_args * a_args = a.args, * b_args = b.args;
+
+    if ((a.module || b.module) && (!a.module || !b.module || strcmp(a.module, b.module) != 0)) {
+        return false;
+    }
+
+    if (strcmp(a.name, b.name) != 0) {
+        return false;
+    }
+
+    for (; a_args && b_args; a_args = a_args->next, b_args = b_args->next) {
+        if (!ast_literal_equals(a_args->argument, b_args->argument)) {
+            return false;
+        }
+    }
+
+    return !a_args && !b_args;
+}
+
+/* Prints transformation as script statement */
+void ast_transformation_print(const struct ast_transformation transformation, FILE * file) {
+    const struct ast_transformation_args * args;
+
+    if (transformation.module) {
+        fprintf(file, "%s.", transformation.module);
+    }
+
+    fprintf(file, "%s(", transformation.name);
+
+    for (args = transformation.args; args; args = args->next) {
+        fprintf(file, args->next ? "%s, " : "%s", args->argument.value);
+    }
+
+    fputs(");\n", file);
+}
+
 struct ast_script * ast_script_new(struct ast_transformation transformation, struct ast_script * next) {
     struct ast_script * script = malloc(sizeof(struct ast_script));
 
@@ -120,3 +188,31 @@ struct ast_script * ast_script_reverse(struct ast_script * script) {
 
     return result;
 }
+
+/* Every string is hashed with its terminator, so boundaries of fields are hashed too */
+uint64_t ast_transformation_hash(const struct ast_transformation * transformation, uint64_t seed) {
+    const struct ast_transformation_args * args;
+    uint32_t type;
+
+    seed = transformation->module
+        ? hash_bytes(transformation->module, strlen(transformation->module) + 1, seed)
+        : hash_bytes("", 0, seed);
+    seed = hash_bytes(transformation->name, strlen(transformation->name) + 1, seed);
+
+    for (args = transformation->args; args; args = args->next) {
+        type = args->argument.type;
+        seed = hash_bytes(&type, sizeof(type), seed);
+        seed = hash_bytes(args->argument.value, strlen(args->argument.value) + 1, seed);
+    }
+
+    /* end of statement */
+    return hash_bytes(";", 1, seed);
+}
+
+uint64_t ast_script_hash(const struct ast_script * script, uint64_t seed) {
+    for (; script; script = script->next) {
+        seed = ast_transformation_hash(&script->transformation, seed);
+    }
+
+    return seed;
+}
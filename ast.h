@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 struct ast_position {
     uint32_t row;
@@ -49,6 +51,9 @@ struct ast_position ast_position_create(uint32_t row, uint32_t col);
 struct ast_literal ast_literal_create(enum ast_literal_type type, char * value, struct ast_position pos);
 void ast_literal_discard(struct ast_literal literal);
 
+struct ast_literal ast_literal_clone(const struct ast_literal literal);
+bool ast_literal_equals(const struct ast_literal a, const struct ast_literal b);
+
 /* ast_transformation_args */
 
 struct ast_transformation_args *
@@ -56,6 +61,7 @@ ast_transformation_args_new(struct ast_literal argument, struct ast_transformati
 void ast_transformation_args_delete(struct ast_transformation_args * transformation_args);
 
 struct ast_transformation_args * ast_transformation_args_reverse(struct ast_transformation_args * transformation_args);
+struct ast_transformation_args * ast_transformation_args_clone(const struct ast_transformation_args * transformation_args);
 
 /* transformation */
 
@@ -63,9 +69,19 @@ struct ast_transformation
 ast_transformation_create(char * module, char * name, struct ast_transformation_args * args, struct ast_position pos);
 void ast_transformation_discard(struct ast_transformation transformation);
 
+struct ast_transformation ast_transformation_clone(const struct ast_transformation transformation);
+bool ast_transformation_equals(const struct ast_transformation a, const struct ast_transformation b);
+void ast_transformation_print(const struct ast_transformation transformation, FILE * file);
+
 /* script */
 
 struct ast_script * ast_script_new(struct ast_transformation transformation, struct ast_script * next);
 void ast_script_delete(struct ast_script * script);
 
 struct ast_script * ast_script_reverse(struct ast_script * script);
+
+/* Hash of module, name and literal arguments of statement, positions are not hashed */
+uint64_t ast_transformation_hash(const struct ast_transformation * transformation, uint64_t seed);
+
+/* Chained hashes of statements */
+uint64_t ast_script_hash(const struct ast_script * script, uint64_t seed);
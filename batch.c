@@ -0,0 +1,832 @@
+#define _GNU_SOURCE
+
+#include "batch.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <strings.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bmp.h"
+#include "cache.h"
+#include "cancel.h"
+#include "pool.h"
+#include "uring.h"
+#include "util.h"
+
+/* Initial capacity of inputs list */
+#define BATCH_INITIAL_CAPACITY (64)
+
+/* Largest transfer of one request, larger files take several */
+#define BATCH_CHUNK (1 << 30)
+
+/* Files transformed at once per worker of host pool */
+#define BATCH_WINDOW_PER_THREAD (2)
+
+/* Memory for contents of a file, it follows the header and is kept for the next files */
+struct batch_block {
+    size_t capacity;
+    struct batch_block * next;
+};
+
+/* Pipeline stages of a file */
+enum batch_stage {
+    BATCH_WAITING, /* not opened yet */
+    BATCH_OPENED,  /* input is opened, read waits for queue or memory */
+    BATCH_READING,
+    BATCH_READ,    /* contents are in memory, after transformation they are result */
+    BATCH_WRITING,
+    BATCH_DONE     /* written or failed */
+};
+
+struct batch_file {
+    enum batch_stage stage;
+    int fd;
+
+    uint8_t * data; /* contents of input or output */
+    size_t size;
+    size_t done; /* bytes transferred */
+    size_t reserved; /* bytes counted in memory of job */
+    bool cached; /* output was taken from cache, there is nothing to write */
+    char * output; /* set if output is written to a temporary file, renamed when file is finished */
+
+    char * error; /* reported when file is finished */
+};
+
+/* Image buffers of a range of files in flight, reused by the next range */
+struct batch_buffers {
+    struct bmp_image bmp_image;
+    struct image image;
+
+    struct batch_buffers * next;
+};
+
+/* Three-stage pipeline: the calling thread reads files ahead and writes results through io_uring,
+ * files of a window are tasks of host pool, rows and tiles of their images are nested tasks
+ */
+struct batch_job {
+    const struct batch * batch;
+    const struct interpreter * interpreter;
+    struct cache_key script_key;
+    FILE * log;
+
+    struct batch_file * files;
+    struct uring * uring;
+    size_t memory; /* contents read ahead or waiting to be written */
+    uint32_t failed;
+
+    uint32_t window; /* first file transformed */
+    pthread_mutex_t mutex;
+    struct batch_buffers * spare;
+    struct batch_block * spare_blocks;
+    size_t spare_capacity;
+};
+
+struct batch batch_create(const char * output_template) {
+    struct batch batch;
+
+    batch.output_template = output_template;
+    batch.inputs = NULL;
+    batch.count = 0;
+    batch.capacity = 0;
+
+    batch.queue_depth = BATCH_QUEUE_DEPTH;
+    batch.memory_limit = BATCH_MEMORY_LIMIT;
+    batch.cache = NULL;
+    batch.atomic = false;
+    batch.sequence = NULL;
+    batch.deadline = 0;
+    batch.finished = NULL;
+    batch.context = NULL;
+
+    return batch;
+}
+
+void batch_clear(struct batch * batch) {
+    uint32_t i;
+
+    for (i = 0; i < batch->count; ++i) {
+        free(batch->inputs[i]);
+    }
+
+    batch->count = 0;
+}
+
+void batch_discard(struct batch batch) {
+    batch_clear(&batch);
+    free(batch.inputs);
+}
+
+/* Takes ownership of `path` */
+void batch_push(struct batch * batch, char * path) {
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : BATCH_INITIAL_CAPACITY;
+        batch->inputs = realloc(batch->inputs, sizeof(char *) * batch->capacity);
+    }
+
+    batch->inputs[batch->count++] = path;
+}
+
+int batch_compare(const void * a, const void * b) {
+    return strcmp(*((char * const *) a), *((char * const *) b));
+}
+
+const char * batch_add_directory(struct batch * batch, const char * path) {
+    const uint32_t first = batch->count;
+    const struct dirent * entry;
+    size_t length;
+    struct stat st;
+    char * file;
+    DIR * dir;
+
+    if (!(dir = opendir(path))) {
+        return strerror(errno);
+    }
+
+    while ((entry = readdir(dir))) {
+        length = strlen(entry->d_name);
+
+        if (length < 4 || strcasecmp(entry->d_name + length - 4, ".bmp") != 0) {
+            continue;
+        }
+
+        file = malloc(sizeof(char) * (strlen(path) + length + 2));
+        sprintf(file, "%s/%s", path, entry->d_name);
+
+        if (stat(file, &st) == 0 && S_ISREG(st.st_mode)) {
+            batch_push(batch, file);
+        } else {
+            free(file);
+        }
+    }
+
+    closedir(dir);
+
+    qsort(batch->inputs + first, batch->count - first, sizeof(char *), batch_compare);
+    return NULL;
+}
+
+const char * batch_add(struct batch * batch, const char * path) {
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        return batch_add_directory(batch, path);
+    }
+
+    /* missing files are reported with the rest of failures */
+    batch_push(batch, strdup(path));
+    return NULL;
+}
+
+const char * batch_add_manifest(struct batch * batch, FILE * file) {
+    size_t capacity = 256, length = 0;
+    char * line = malloc(sizeof(char) * capacity);
+    const char * error = NULL;
+    int c;
+
+    while (!error) {
+        c = fgetc(file);
+
+        if (c != EOF && c != '\n') {
+            if (length + 1 == capacity) {
+                line = realloc(line, sizeof(char) * (capacity *= 2));
+            }
+
+            line[length++] = c;
+            continue;
+        }
+
+        if (length > 0 && line[length - 1] == '\r') {
+            --length;
+        }
+
+        line[length] = '\0';
+
+        if (length > 0) {
+            error = batch_add(batch, line);
+        }
+
+        if (c == EOF) {
+            break;
+        }
+
+        length = 0;
+    }
+
+    if (!error && ferror(file)) {
+        error = "cannot read manifest";
+    }
+
+    free(line);
+    return error;
+}
+
+char * batch_output_name(const char * output_template, const char * input, uint32_t index) {
+    const char * slash = strrchr(input, '/');
+    const char * name = slash ? slash + 1 : input;
+    const char * dot = strrchr(name, '.');
+    size_t name_length = dot && dot != name ? (size_t) (dot - name) : strlen(name);
+    size_t dir_length = slash ? (size_t) (slash - input) : 1;
+    size_t length = 0;
+    const char * next;
+    char * result;
+
+    /* every placeholder is shorter than the longest replacement */
+    for (next = output_template; *next; ++next) {
+        length += *next == '%' ? name_length + dir_length + 11 : 1;
+    }
+
+    result = malloc(sizeof(char) * (length + 1));
+
+    for (next = output_template, length = 0; *next; ++next) {
+        if (*next != '%' || !next[1]) {
+            result[length++] = *next;
+            continue;
+        }
+
+        switch (*++next) {
+        case 'n':
+            memcpy(result + length, name, name_length);
+            length += name_length;
+            break;
+
+        case 'd':
+            memcpy(result + length, slash ? input : ".", dir_length);
+            length += dir_length;
+            break;
+
+        case 'i':
+            length += sprintf(result + length, "%lu", (unsigned long) index);
+            break;
+
+        case '%':
+            result[length++] = '%';
+            break;
+
+        default:
+            result[length++] = '%';
+            result[length++] = *next;
+        }
+    }
+
+    result[length] = '\0';
+    return result;
+}
+
+/* Sets `error` to "<stage> failed: <message>" */
+bool batch_fail(char ** error, const char * stage, const char * message) {
+    *error = malloc(sizeof(char) * (strlen(stage) + strlen(message) + 10));
+    sprintf(*error, "%s failed: %s", stage, message);
+
+    return false;
+}
+
+/* Fresh memory of a large file costs a page fault per page, so blocks are reused */
+uint8_t * batch_block_take(struct batch_job * job, size_t size) {
+    struct batch_block ** link;
+    struct batch_block * block;
+
+    pthread_mutex_lock(&job->mutex);
+
+    for (link = &job->spare_blocks; *link && (*link)->capacity < size; link = &(*link)->next) {
+    }
+
+    if ((block = *link)) {
+        *link = block->next;
+        job->spare_capacity -= block->capacity;
+    }
+
+    pthread_mutex_unlock(&job->mutex);
+
+    if (!block) {
+        block = malloc(sizeof(struct batch_block) + size);
+        block->capacity = size;
+    }
+
+    return (uint8_t *) (block + 1);
+}
+
+void batch_block_give(struct batch_job * job, uint8_t * data) {
+    struct batch_block * block;
+
+    if (!data) {
+        return;
+    }
+
+    block = (struct batch_block *) data - 1;
+    pthread_mutex_lock(&job->mutex);
+
+    /* spare blocks are limited like contents in flight */
+    if (job->spare_capacity + block->capacity <= job->batch->memory_limit) {
+        block->next = job->spare_blocks;
+        job->spare_blocks = block;
+        job->spare_capacity += block->capacity;
+        block = NULL;
+    }
+
+    pthread_mutex_unlock(&job->mutex);
+    free(block);
+}
+
+/* Result should be freed */
+char * batch_temporary_name(const char * output) {
+    const char * name = strrchr(output, '/') ? strrchr(output, '/') + 1 : output;
+    char * temporary = malloc(sizeof(char) * (strlen(output) + 7));
+
+    sprintf(temporary, "%.*s.%s.tmp", (int) (name - output), output, name);
+    return temporary;
+}
+
+/* Temporary output becomes output if file succeeded, otherwise it is removed */
+void batch_rename(struct batch_file * file) {
+    char * temporary = batch_temporary_name(file->output);
+
+    if (!file->error && rename(temporary, file->output)) {
+        batch_fail(&file->error, "Output file renaming", strerror(errno));
+    }
+
+    if (file->error) {
+        unlink(temporary);
+    }
+
+    free(temporary);
+    free(file->output);
+    file->output = NULL;
+}
+
+/* Reports failure if any and releases the file */
+void batch_finish(struct batch_job * job, struct batch_file * file) {
+    const uint32_t index = file - job->files;
+
+    if (file->fd >= 0) {
+        close(file->fd);
+        file->fd = -1;
+    }
+
+    if (file->output) {
+        batch_rename(file);
+    }
+
+    if (file->error) {
+        fprintf(job->log, "%s: %s.\n", job->batch->inputs[index], file->error);
+        ++job->failed;
+    }
+
+    if (job->batch->finished) {
+        job->batch->finished(job->batch->context, index, !file->error);
+    }
+
+    free(file->error);
+    file->error = NULL;
+
+    batch_block_give(job, file->data);
+    file->data = NULL;
+
+    job->memory -= file->reserved;
+    file->reserved = 0;
+    file->stage = BATCH_DONE;
+}
+
+/* Queues the next chunk of contents */
+void batch_transfer(struct batch_job * job, struct batch_file * file) {
+    const size_t rest = file->size - file->done;
+    const uint32_t length = rest < BATCH_CHUNK ? rest : BATCH_CHUNK;
+
+    if (file->stage == BATCH_READING) {
+        uring_read(job->uring, file->fd, file->data + file->done, length, file->done, file);
+    } else {
+        uring_write(job->uring, file->fd, file->data + file->done, length, file->done, file);
+    }
+}
+
+void batch_open_input(struct batch_job * job, struct batch_file * file) {
+    struct stat st;
+
+    if ((file->fd = open(job->batch->inputs[file - job->files], O_RDONLY)) < 0) {
+        batch_fail(&file->error, "Input file opening", strerror(errno));
+        batch_finish(job, file);
+        return;
+    }
+
+    if (fstat(file->fd, &st)) {
+        batch_fail(&file->error, "Input file reading", strerror(errno));
+        batch_finish(job, file);
+        return;
+    }
+
+    file->size = st.st_size;
+    file->stage = BATCH_OPENED;
+}
+
+void batch_start_read(struct batch_job * job, struct batch_file * file) {
+    file->data = batch_block_take(job, file->size);
+    file->done = 0;
+    file->reserved = file->size;
+    job->memory += file->size;
+
+    if (file->size == 0) {
+        file->stage = BATCH_READ;
+        return;
+    }
+
+    file->stage = BATCH_READING;
+    batch_transfer(job, file);
+}
+
+/* Opens and reads files ahead of transformation while queue and memory allow */
+void batch_read_ahead(struct batch_job * job, uint32_t * next) {
+    struct batch_file * file;
+
+    for (; *next < job->batch->count; ++*next) {
+        file = job->files + *next;
+
+        if (file->stage == BATCH_WAITING) {
+            batch_open_input(job, file);
+        }
+
+        if (file->stage == BATCH_OPENED) {
+            if (uring_pending(job->uring) >= job->batch->queue_depth
+             || (job->memory > 0 && job->memory + file->size > job->batch->memory_limit)) {
+                return;
+            }
+
+            batch_start_read(job, file);
+        }
+    }
+}
+
+/* Result of transformation is written to output */
+void batch_start_write(struct batch_job * job, struct batch_file * file) {
+    char * output;
+
+    if (file->error || file->cached) {
+        batch_finish(job, file);
+        return;
+    }
+
+    job->memory += file->size - file->reserved;
+    file->reserved = file->size;
+
+    output = batch_output_name(job->batch->output_template, job->batch->inputs[file - job->files], file - job->files);
+
+    if (job->batch->atomic) {
+        file->output = output;
+        output = batch_temporary_name(output);
+    }
+
+    file->fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    free(output);
+
+    if (file->fd < 0) {
+        batch_fail(&file->error, "Output file opening", strerror(errno));
+        batch_finish(job, file);
+        return;
+    }
+
+    file->done = 0;
+    file->stage = BATCH_WRITING;
+
+    if (file->size == 0) {
+        batch_finish(job, file);
+        return;
+    }
+
+    batch_transfer(job, file);
+}
+
+/* Handles completed request, the next chunk is queued if the file is not transferred */
+void batch_complete(struct batch_job * job, const struct uring_completion completion) {
+    struct batch_file * file = completion.tag;
+
+    if (completion.result < 0) {
+        batch_fail(&file->error, file->stage == BATCH_READING ? "Input file reading" : "Output file writing",
+            strerror(-completion.result));
+        batch_finish(job, file);
+        return;
+    }
+
+    if (completion.result == 0 && file->stage == BATCH_READING) {
+        /* file was truncated after it was opened */
+        file->size = file->done;
+    }
+
+    file->done += completion.result;
+
+    if (completion.result == 0 && file->stage == BATCH_WRITING) {
+        batch_fail(&file->error, "Output file writing", "nothing was written");
+        batch_finish(job, file);
+        return;
+    }
+
+    if (file->done < file->size) {
+        batch_transfer(job, file);
+        return;
+    }
+
+    if (file->stage == BATCH_READING) {
+        close(file->fd);
+        file->fd = -1;
+        file->stage = BATCH_READ;
+        return;
+    }
+
+    if (close(file->fd)) {
+        batch_fail(&file->error, "Output file writing", strerror(errno));
+    }
+
+    file->fd = -1;
+    batch_finish(job, file);
+}
+
+/* Waits for a request of any file, returns false if io_uring failed */
+bool batch_wait(struct batch_job * job) {
+    struct uring_completion completion;
+
+    if (!uring_wait(job->uring, &completion)) {
+        return false;
+    }
+
+    batch_complete(job, completion);
+    return true;
+}
+
+/* Handles requests completed meanwhile, so outputs are finished as soon as they are written */
+void batch_reap(struct batch_job * job) {
+    struct uring_completion completion;
+
+    while (uring_peek(job->uring, &completion)) {
+        batch_complete(job, completion);
+    }
+}
+
+/* Output is taken from cache on hit, contents are released then */
+bool batch_fetch(struct batch_job * job, struct batch_file * file, const struct cache_key key) {
+    const uint32_t index = file - job->files;
+    const char * message;
+    char * output;
+
+    output = batch_output_name(job->batch->output_template, job->batch->inputs[index], index);
+
+    if (job->batch->atomic) {
+        file->output = output;
+        output = batch_temporary_name(output);
+    }
+
+    file->cached = cache_fetch_file(job->batch->cache, key, output, &message);
+    free(output);
+
+    if (!file->cached) {
+        free(file->output);
+        file->output = NULL;
+        return false;
+    }
+
+    batch_block_give(job, file->data);
+    file->data = NULL;
+    file->size = 0;
+
+    if (message) {
+        batch_fail(&file->error, "Output file writing", message);
+    }
+
+    return true;
+}
+
+/* Decodes contents, runs script and encodes result in place of contents */
+bool batch_transform(struct batch_job * job, struct batch_file * file, struct batch_buffers * buffers) {
+    char * run_error = NULL;
+    struct cache_key key;
+    struct cancel cancel;
+    const char * message;
+    FILE * stream;
+
+    if (job->batch->cache) {
+        key = cache_key_create(job->script_key, file->data, file->size);
+
+        if (batch_fetch(job, file, key)) {
+            return !file->error;
+        }
+    }
+
+    if (!(stream = fmemopen(file->data, file->size, "rb"))) {
+        return batch_fail(&file->error, "Input file reading", strerror(errno));
+    }
+
+    message = bmp_image_read_reusing(&buffers->bmp_image, stream);
+    fclose(stream);
+
+    batch_block_give(job, file->data);
+    file->data = NULL;
+    file->size = 0;
+
+    if (message) {
+        return batch_fail(&file->error, "Input file reading", message);
+    }
+
+    buffers->image = bmp_image_to_image_reusing(buffers->bmp_image, buffers->image);
+    cancel = cancel_create(job->batch->deadline);
+
+    /* image stays valid on failure, so it is reused by the next file either way */
+    if (job->batch->sequence
+            ? interpreter_run_sequence(*job->interpreter, job->batch->sequence, &buffers->image, &cancel, &run_error)
+            : interpreter_run_cancellable(*job->interpreter, &buffers->image, &cancel, &run_error)) {
+        batch_fail(&file->error, "Interpretation", run_error);
+        free(run_error);
+        return false;
+    }
+
+    bmp_image_replace(&buffers->bmp_image, buffers->image);
+
+    file->size = buffers->bmp_image.header.bfSize;
+    file->data = batch_block_take(job, file->size + 1);
+
+    /* stream terminates written contents with a null byte */
+    if (!(stream = fmemopen(file->data, file->size + 1, "wb"))) {
+        return batch_fail(&file->error, "Output file writing", strerror(errno));
+    }
+
+    message = bmp_image_write(buffers->bmp_image, stream);
+    file->size = ftell(stream);
+
+    if (fclose(stream) && !message) {
+        message = strerror(errno);
+    }
+
+    if (message) {
+        return batch_fail(&file->error, "Output file writing", message);
+    }
+
+    if (job->batch->cache) {
+        cache_store(job->batch->cache, key, file->data, file->size);
+    }
+
+    return true;
+}
+
+/* Transforms files of the window read successfully */
+const char * batch_files_run(void * context, uint32_t from, uint32_t to) {
+    struct batch_job * job = context;
+    struct batch_buffers * buffers;
+    struct batch_file * file;
+    uint32_t i;
+
+    pthread_mutex_lock(&job->mutex);
+
+    if ((buffers = job->spare)) {
+        job->spare = buffers->next;
+    }
+
+    pthread_mutex_unlock(&job->mutex);
+
+    if (!buffers) {
+        buffers = malloc(sizeof(struct batch_buffers));
+        buffers->bmp_image.bitmap = NULL;
+        buffers->image.width = buffers->image.height = 0;
+        buffers->image.pixels = NULL;
+    }
+
+    for (i = from; i < to; ++i) {
+        file = job->files + job->window + i;
+
+        if (file->stage == BATCH_READ) {
+            batch_transform(job, file, buffers);
+        }
+    }
+
+    pthread_mutex_lock(&job->mutex);
+    buffers->next = job->spare;
+    job->spare = buffers;
+    pthread_mutex_unlock(&job->mutex);
+
+    return NULL;
+}
+
+uint32_t batch_run(const struct batch * batch, const struct interpreter interpreter, FILE * log) {
+    const struct module_host * host = interpreter.pool ? pool_host(interpreter.pool) : NULL;
+    const uint32_t window = (host ? host->threads : 1) * BATCH_WINDOW_PER_THREAD;
+    uint32_t i, end, next = 0, next_read = 0;
+    struct batch_buffers * buffers;
+    struct batch_block * block;
+    struct batch_job job;
+    bool working = true, abandoned;
+
+    job.batch = batch;
+    job.interpreter = &interpreter;
+    job.log = log;
+
+    if (batch->cache) {
+        job.script_key = cache_script_key(interpreter);
+    }
+
+    job.files = malloc(sizeof(struct batch_file) * (batch->count > 0 ? batch->count : 1));
+    job.uring = uring_new(batch->queue_depth);
+    job.memory = 0;
+    job.failed = 0;
+    job.spare = NULL;
+    job.spare_blocks = NULL;
+    job.spare_capacity = 0;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    for (i = 0; i < batch->count; ++i) {
+        job.files[i].stage = BATCH_WAITING;
+        job.files[i].fd = -1;
+        job.files[i].data = NULL;
+        job.files[i].size = job.files[i].done = job.files[i].reserved = 0;
+        job.files[i].cached = false;
+        job.files[i].output = NULL;
+        job.files[i].error = NULL;
+    }
+
+    /* reads of the next window and writes of the previous one go on while the window is transformed */
+    while (next < batch->count && working) {
+        batch_read_ahead(&job, &next_read);
+        end = next_read - next < window ? next_read : next + window;
+
+        if (end == next) {
+            /* queue or memory is taken by writes */
+            working = batch_wait(&job);
+            continue;
+        }
+
+        for (i = next; i < end && working; ++i) {
+            while (job.files[i].stage == BATCH_READING && (working = batch_wait(&job))) {
+            }
+        }
+
+        if (!working) {
+            break;
+        }
+
+        batch_read_ahead(&job, &next_read);
+        uring_submit(job.uring);
+
+        job.window = next;
+
+        /* frames of a sequence depend on the previous ones, their tiles are tasks of host pool instead */
+        if (batch->sequence) {
+            batch_files_run(&job, 0, end - next);
+        } else {
+            MODULE_PARALLEL_FOR(host, end - next, 1, batch_files_run, &job);
+        }
+
+        batch_reap(&job);
+
+        for (i = next; i < end && working; ++i) {
+            if (job.files[i].stage == BATCH_READ) {
+                while (uring_pending(job.uring) >= batch->queue_depth && (working = batch_wait(&job))) {
+                }
+
+                if (working) {
+                    batch_start_write(&job, job.files + i);
+                }
+            }
+        }
+
+        uring_submit(job.uring);
+        next = end;
+    }
+
+    while (working && uring_pending(job.uring) > 0) {
+        working = batch_wait(&job);
+    }
+
+    /* requests are pending only if io_uring failed, the kernel may still read or write their contents
+     * after the ring is closed, so blocks of such files are leaked instead of being reused or freed
+     */
+    abandoned = uring_pending(job.uring) > 0;
+    uring_delete(job.uring);
+
+    for (i = 0; i < batch->count; ++i) {
+        if (abandoned && (job.files[i].stage == BATCH_READING || job.files[i].stage == BATCH_WRITING)) {
+            job.files[i].data = NULL;
+        }
+
+        if (job.files[i].stage != BATCH_DONE) {
+            batch_fail(&job.files[i].error, "Asynchronous I/O", "io_uring failed");
+            batch_finish(&job, job.files + i);
+        }
+    }
+
+    while ((buffers = job.spare)) {
+        job.spare = buffers->next;
+
+        bmp_image_discard(buffers->bmp_image);
+        image_discard(buffers->image);
+        free(buffers);
+    }
+
+    while ((block = job.spare_blocks)) {
+        job.spare_blocks = block->next;
+        free(block);
+    }
+
+    pthread_mutex_destroy(&job.mutex);
+    free(job.files);
+    return job.failed;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cache.h"
+#include "interpreter.h"
+
+/* Default count of reads and writes in flight */
+#define BATCH_QUEUE_DEPTH (32)
+
+/* Default limit of file contents read ahead or waiting to be written, in bytes */
+#define BATCH_MEMORY_LIMIT ((size_t) 256 << 20)
+
+/* Batch mode: one processed script applied to many files
+ *
+ * Inputs are added as files, directories (their *.bmp files in name order) or
+ * manifests listing one path per line. Output names are built from a template:
+ * `%n` is input name without extension, `%d` is its directory, `%i` is index
+ * of input in batch and `%%` is percent sign.
+ */
+struct batch {
+    const char * output_template;
+
+    char ** inputs;
+    uint32_t count;
+    uint32_t capacity;
+
+    uint32_t queue_depth; /* reads and writes in flight */
+    size_t memory_limit; /* file contents in flight, a larger file is read when nothing else is */
+
+    struct cache * cache; /* results are looked up and stored if not NULL */
+    bool atomic; /* outputs are written to temporary files `.<name>.tmp` and renamed */
+    struct sequence * sequence; /* inputs are frames of it transformed in order if not NULL (see sequence.h) */
+    uint32_t deadline; /* milliseconds transformation of a file may take, 0 if unlimited (see cancel.h) */
+
+    /* called on the calling thread when input of `index` is written or failed, may be NULL */
+    void (* finished)(void * context, uint32_t index, bool succeeded);
+    void * context;
+};
+
+struct batch batch_create(const char * output_template);
+void batch_discard(struct batch batch);
+
+/* Removes inputs, so batch may be run again with the next ones */
+void batch_clear(struct batch * batch);
+
+const char * batch_add(struct batch * batch, const char * path);
+const char * batch_add_manifest(struct batch * batch, FILE * file);
+
+/* Result should be freed */
+char * batch_output_name(const char * output_template, const char * input, uint32_t index);
+
+/* Files go through a pipeline: the next ones are read and the previous results are written
+ * through io_uring while a window of files is transformed concurrently on interpreter pool.
+ * Image buffers are reused between files. Failures are reported to `log` and do not stop
+ * the batch. Outputs found in cache are copied from it without decoding. Returns count of failed files.
+ */
+uint32_t batch_run(const struct batch * batch, const struct interpreter interpreter, FILE * log);
@@ -13,13 +13,26 @@ void bmp_image_discard(struct bmp_image image) {
 }
 
 struct image bmp_image_to_image(const struct bmp_image bmp_image) {
+    struct image empty = { 0, 0, NULL };
+
+    return bmp_image_to_image_reusing(bmp_image, empty);
+}
+
+struct image bmp_image_to_image_reusing(const struct bmp_image bmp_image, struct image spare) {
     uint32_t size = bmp_image.header.biWidth * bmp_image.header.biHeight;
-    struct image image = image_create(
-        bmp_image.header.biWidth,
-        bmp_image.header.biHeight
-    );
+    struct image image;
 
     uint32_t i;
+
+    if ((size_t) spare.width * spare.height >= size) {
+        image = spare;
+        image.width = bmp_image.header.biWidth;
+        image.height = bmp_image.header.biHeight;
+    } else {
+        image_discard(spare);
+        image = image_create(bmp_image.header.biWidth, bmp_image.header.biHeight);
+    }
+
     for (i = 0; i < size; ++i) {
         image.pixels[i].red = bmp_image.bitmap[i].r;
         image.pixels[i].green = bmp_image.bitmap[i].g;
@@ -57,12 +70,15 @@ void bmp_image_replace(struct bmp_image * bmp_image, const struct image image) {
     uint32_t size = image.width * image.height;
     uint32_t i;
 
+    /* bitmap of the same or larger image is reused */
+    if ((size_t) bmp_image->header.biWidth * bmp_image->header.biHeight < size) {
+        free(bmp_image->bitmap);
+        bmp_image->bitmap = malloc(sizeof(struct bmp_pixel) * size);
+    }
+
     bmp_image->header.biWidth = image.width;
     bmp_image->header.biHeight = image.height;
 
-    free(bmp_image->bitmap);
-    bmp_image->bitmap = malloc(sizeof(struct bmp_pixel) * size);
-
     for (i = 0; i < size; ++i) {
         bmp_image->bitmap[i].r = image.pixels[i].red;
         bmp_image->bitmap[i].g = image.pixels[i].green;
@@ -72,17 +88,25 @@ void bmp_image_replace(struct bmp_image * bmp_image, const struct image image) {
     bmp_image_repair(bmp_image);
 }
 
-const char * bmp_image_read(struct bmp_image * image, FILE * file) {
+const char * bmp_image_read_failed(struct bmp_image * image, const char * error) {
+    free(image->bitmap);
+    image->bitmap = NULL;
+
+    return error;
+}
+
+/* Bitmap of `capacity` pixels is reused if it is large enough, it is freed on failure */
+const char * bmp_image_do_read(struct bmp_image * image, size_t capacity, FILE * file) {
     int32_t row, rowOffset;
+    size_t read_count;
 
-    size_t read_count = fread(&(image->header), sizeof(struct bmp_header), 1, file);
-    if (read_count < 1) {
-        return "cannot read BMP file";
+    if ((read_count = fread(&(image->header), sizeof(struct bmp_header), 1, file)) < 1) {
+        return bmp_image_read_failed(image, "cannot read BMP file");
     }
 
     /* Check file type signature */
     if (image->header.bfType[0] != 'B' || image->header.bfType[1] != 'M') {
-        return "invalid BMP file";
+        return bmp_image_read_failed(image, "invalid BMP file");
     }
 
     if ((image->header.biSizeImage         /* Check size if biSizeImage != 0 */
@@ -91,45 +115,56 @@ const char * bmp_image_read(struct bmp_image * image, FILE * file) {
      || (image->header.biBitCount != 24)   /* Check pixel bits count, only 24 is supported */
      || (image->header.biCompression != 0) /* Check biCompression, only 0 is supported */
     ) {
-        return "invalid BMP file";
+        return bmp_image_read_failed(image, "invalid BMP file");
     }
 
     /* Check file size */
     if (fseek(file, 0L, SEEK_END)) {
-        return strerror(errno);
+        return bmp_image_read_failed(image, strerror(errno));
     }
 
     if (ftell(file) != image->header.bfSize) {
-        return strerror(errno);
+        return bmp_image_read_failed(image, strerror(errno));
     }
 
     /* Go to bitmap */
     if (fseek(file, image->header.bfOffBits, SEEK_SET)) {
-        return strerror(errno);
+        return bmp_image_read_failed(image, strerror(errno));
     }
 
-    image->bitmap = malloc(sizeof(struct bmp_pixel) * image->header.biWidth * image->header.biHeight);
+    if (!image->bitmap || capacity < (size_t) image->header.biWidth * image->header.biHeight) {
+        free(image->bitmap);
+        image->bitmap = malloc(sizeof(struct bmp_pixel) * image->header.biWidth * image->header.biHeight);
+    }
 
     rowOffset = image->header.biWidth % 4;
     for (row = image->header.biHeight - 1; row >= 0; --row) {
         read_count = fread(image->bitmap + row * image->header.biWidth, sizeof(struct bmp_pixel), image->header.biWidth, file);
 
         if (read_count < image->header.biWidth) {
-            free(image->bitmap);
-            return "cannot read BMP file";
+            return bmp_image_read_failed(image, "cannot read BMP file");
         }
 
         if (fseek(file, rowOffset, SEEK_CUR)) {
-            free(image->bitmap);
-            return strerror(errno);
+            return bmp_image_read_failed(image, strerror(errno));
         }
     }
 
     return NULL;
 }
 
+const char * bmp_image_read(struct bmp_image * image, FILE * file) {
+    image->bitmap = NULL;
+    return bmp_image_do_read(image, 0, file);
+}
+
+const char * bmp_image_read_reusing(struct bmp_image * image, FILE * file) {
+    return bmp_image_do_read(image, image->bitmap
+        ? (size_t) image->header.biWidth * image->header.biHeight : 0, file);
+}
+
 const char * bmp_image_write(const struct bmp_image image, FILE * file) {
-    static uint8_t offsetBuffer[] = { 0, 0, 0 };
+    static const uint8_t offsetBuffer[] = { 0, 0, 0 };
     int32_t row, rowOffset;
 
     if (fwrite(&(image.header), sizeof(struct bmp_header), 1, file) < 1) {
@@ -35,5 +35,11 @@ void bmp_image_discard(struct bmp_image bmp_image);
 struct image bmp_image_to_image(const struct bmp_image);
 void bmp_image_replace(struct bmp_image * bmp_image, const struct image image);
 
+/* Pixels of `spare` are reused if it is large enough, otherwise it is discarded */
+struct image bmp_image_to_image_reusing(const struct bmp_image bmp_image, struct image spare);
+
 const char * bmp_image_read(struct bmp_image * bmp_image, FILE * file);
+
+/* Reuses bitmap of previously read `bmp_image` (or one with NULL bitmap) if it is large enough */
+const char * bmp_image_read_reusing(struct bmp_image * bmp_image, FILE * file);
 const char * bmp_image_write(const struct bmp_image bmp_image, FILE * file);
@@ -0,0 +1,37 @@
+#include "builtin.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct builtin_module * builtin_modules[BUILTIN_MAX_MODULES];
+static uint32_t builtin_modules_count = 0;
+
+void builtin_register(const struct builtin_module * module) {
+    if (builtin_modules_count < BUILTIN_MAX_MODULES) {
+        builtin_modules[builtin_modules_count++] = module;
+    }
+}
+
+const struct builtin_module * builtin_find(const char * name) {
+    uint32_t i;
+
+    for (i = 0; i < builtin_modules_count; ++i) {
+        if (strcmp(builtin_modules[i]->name, name) == 0) {
+            return builtin_modules[i];
+        }
+    }
+
+    return NULL;
+}
+
+int builtin_compare(const void * name, const void * symbol) {
+    return strcmp(name, ((const struct builtin_symbol *) symbol)->name);
+}
+
+void * builtin_symbol(const struct builtin_module * module, const char * name) {
+    const struct builtin_symbol * found = bsearch(name, module->symbols, module->count,
+        sizeof(struct builtin_symbol), builtin_compare);
+
+    return found ? found->symbol : NULL;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Modules compiled into executable
+ *
+ * `make builtin` links bundled modules into the executable, each of them registers a table
+ * of its exported symbols from a constructor (see modules/builtin.sh). The interpreter looks
+ * modules up here before loading shared objects.
+ */
+
+/* Largest count of registered modules */
+#define BUILTIN_MAX_MODULES (64)
+
+struct builtin_symbol {
+    const char * name;
+    void * symbol;
+};
+
+struct builtin_module {
+    const char * name;
+
+    const struct builtin_symbol * symbols; /* sorted by name */
+    uint32_t count;
+};
+
+/* Called by constructors before main, so registry is not locked */
+void builtin_register(const struct builtin_module * module);
+
+/* Returns NULL if module is not compiled in */
+const struct builtin_module * builtin_find(const char * name);
+
+/* Returns NULL if module does not export the symbol */
+void * builtin_symbol(const struct builtin_module * module, const char * name);
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "bmp.h"
+#include "hash.h"
+#include "store.h"
+
+/* Seeds of the two hashes of a key */
+#define CACHE_SEED_0 UINT64_C(0x696d6167652d7472)
+#define CACHE_SEED_1 UINT64_C(0x616e73666f726d65)
+
+/* Buffer of copies where files cannot be reflinked or copied by kernel */
+#define CACHE_COPY_BUFFER (1 << 16)
+
+/* Entries are output files */
+struct cache {
+    struct store * store;
+};
+
+struct cache * cache_open(const char * directory, size_t limit, const char ** error) {
+    struct store * store = store_open(directory, ".bmp", limit, error);
+    struct cache * cache;
+
+    if (!store) {
+        return NULL;
+    }
+
+    cache = malloc(sizeof(struct cache));
+    cache->store = store;
+    return cache;
+}
+
+void cache_close(struct cache * cache) {
+    if (!cache) {
+        return;
+    }
+
+    store_close(cache->store);
+    free(cache);
+}
+
+struct cache_key cache_script_key(const struct interpreter interpreter) {
+    struct cache_key key;
+
+    key.hash[0] = interpreter_script_hash(interpreter, CACHE_SEED_0);
+    key.hash[1] = interpreter_script_hash(interpreter, CACHE_SEED_1);
+
+    return key;
+}
+
+struct cache_key cache_transformer_key(const struct transformer_script * script) {
+    struct cache_key key;
+
+    key.hash[0] = transformer_script_hash(script, CACHE_SEED_0);
+    key.hash[1] = transformer_script_hash(script, CACHE_SEED_1);
+
+    return key;
+}
+
+struct cache_key cache_key_create(const struct cache_key script, const uint8_t * bmp, size_t size) {
+    struct cache_key key = script;
+    struct bmp_header header;
+    uint64_t row_size, stride;
+    uint32_t i, row;
+    bool valid;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, bmp, size < sizeof(header) ? size : sizeof(header));
+
+    /* layout read by bmp_image_read */
+    row_size = (uint64_t) header.biWidth * 3;
+    stride = row_size + header.biWidth % 4;
+    valid = size >= sizeof(header) && header.bfType[0] == 'B' && header.bfType[1] == 'M'
+        && header.biBitCount == 24 && header.biCompression == 0 && header.biWidth > 0 && header.biHeight > 0
+        && header.bfOffBits + stride * header.biHeight <= size;
+
+    for (i = 0; i < 2; ++i) {
+        if (!valid) {
+            key.hash[i] = hash_bytes(bmp, size, key.hash[i]);
+            continue;
+        }
+
+        /* other fields of header are copied to output */
+        key.hash[i] = hash_bytes(&header, sizeof(header), key.hash[i]);
+
+        if (stride == row_size) {
+            key.hash[i] = hash_bytes(bmp + header.bfOffBits, stride * header.biHeight, key.hash[i]);
+        } else {
+            for (row = 0; row < (uint32_t) header.biHeight; ++row) {
+                key.hash[i] = hash_bytes(bmp + header.bfOffBits + stride * row, row_size, key.hash[i]);
+            }
+        }
+    }
+
+    return key;
+}
+
+/* Copies `size` bytes, by kernel if it can (on some filesystems it shares extents too) */
+const char * cache_copy(int from, int to, size_t size) {
+    uint8_t * buffer = NULL;
+    ssize_t count = 0;
+    off_t offset;
+
+    while (size > 0 && (count = copy_file_range(from, NULL, to, NULL, size, 0)) > 0) {
+        size -= count;
+    }
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (count < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+        return strerror(errno);
+    }
+
+    /* pipes and filesystems without copy_file_range take a plain copy of the rest */
+    buffer = malloc(CACHE_COPY_BUFFER);
+    offset = lseek(from, 0, SEEK_CUR);
+
+    while (size > 0 && (count = pread(from, buffer, size < CACHE_COPY_BUFFER ? size : CACHE_COPY_BUFFER, offset)) > 0) {
+        if (write(to, buffer, count) != count) {
+            free(buffer);
+            return strerror(errno);
+        }
+
+        offset += count;
+        size -= count;
+    }
+
+    free(buffer);
+    return count < 0 ? strerror(errno) : size > 0 ? "cache entry was truncated" : NULL;
+}
+
+bool cache_fetch_file(struct cache * cache, const struct cache_key key, const char * output, const char ** error) {
+    bool stdoutFilename = output[0] == '-' && output[1] == '\0';
+    struct stat st;
+    int from, to;
+
+    if ((from = store_open_entry(cache->store, key.hash, &st)) < 0) {
+        return false;
+    }
+
+    *error = NULL;
+
+    if (stdoutFilename) {
+        to = STDOUT_FILENO;
+    } else if ((to = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+        *error = strerror(errno);
+        close(from);
+        return true;
+    }
+
+    if (stdoutFilename || ioctl(to, FICLONE, from)) {
+        *error = cache_copy(from, to, st.st_size);
+    }
+
+    if (!stdoutFilename && close(to) && !*error) {
+        *error = strerror(errno);
+    }
+
+    close(from);
+    return true;
+}
+
+bool cache_fetch(struct cache * cache, const struct cache_key key, uint8_t ** buffer, size_t * capacity, size_t * size) {
+    ssize_t count = 0;
+    struct stat st;
+    int fd;
+
+    if ((fd = store_open_entry(cache->store, key.hash, &st)) < 0) {
+        return false;
+    }
+
+    if (*capacity < (size_t) st.st_size) {
+        free(*buffer);
+        *buffer = malloc(st.st_size);
+        *capacity = st.st_size;
+    }
+
+    for (*size = 0; *size < (size_t) st.st_size; *size += count) {
+        if ((count = pread(fd, *buffer + *size, st.st_size - *size, *size)) <= 0) {
+            break;
+        }
+    }
+
+    close(fd);
+    return *size == (size_t) st.st_size;
+}
+
+void cache_store(struct cache * cache, const struct cache_key key, const void * data, size_t size) {
+    ssize_t count = 0;
+    size_t done = 0;
+    char * path;
+    int fd;
+
+    if ((fd = store_create(cache->store, &path)) < 0) {
+        return;
+    }
+
+    for (; done < size && (count = write(fd, (const uint8_t *) data + done, size - done)) > 0; done += count) {
+    }
+
+    store_commit(cache->store, key.hash, fd, path, size, done == size);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interpreter.h"
+#include "transformer.h"
+
+/* Content-addressed cache of results
+ *
+ * An entry is an output BMP file named by the key of input pixels and script, so a hit
+ * skips decoding, transformation and encoding. Script part of a key covers its statements
+ * and identities of module files, so rebuilt modules miss. Directory is a store (see store.h):
+ * processes may share it and the least recently used entries are removed above the limit.
+ */
+
+/* Default limit of directory size, in bytes */
+#define CACHE_SIZE_LIMIT ((size_t) 1 << 30)
+
+/* Two independent hashes of everything result depends on */
+struct cache_key {
+    uint64_t hash[2];
+};
+
+struct cache;
+
+/* Creates directory if it is missing, returns NULL and sets `error` on failure */
+struct cache * cache_open(const char * directory, size_t limit, const char ** error);
+void cache_close(struct cache * cache);
+
+struct cache_key cache_script_key(const struct interpreter interpreter);
+struct cache_key cache_transformer_key(const struct transformer_script * script);
+
+/* Key of result of script for BMP file contents: header and pixels are hashed, without padding of rows,
+ * contents which are not a supported BMP file are hashed whole
+ */
+struct cache_key cache_key_create(const struct cache_key script, const uint8_t * bmp, size_t size);
+
+/* Returns false on miss. On hit `output` ("-" is stdout) becomes a reflink or a copy of entry,
+ * `error` is set if it cannot be written
+ */
+bool cache_fetch_file(struct cache * cache, const struct cache_key key, const char * output, const char ** error);
+
+/* Returns false on miss, on hit entry is read to `buffer`, it is reallocated if `capacity` is smaller */
+bool cache_fetch(struct cache * cache, const struct cache_key key, uint8_t ** buffer, size_t * capacity, size_t * size);
+
+/* Failure to store only loses the entry. May be called from several threads at once, like fetching */
+void cache_store(struct cache * cache, const struct cache_key key, const void * data, size_t size);
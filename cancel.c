@@ -0,0 +1,65 @@
+#define _GNU_SOURCE
+
+#include "cancel.h"
+
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Current token of a thread, created once per process */
+static pthread_key_t cancel_key;
+static pthread_once_t cancel_once = PTHREAD_ONCE_INIT;
+
+uint64_t cancel_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void cancel_key_create(void) {
+    pthread_key_create(&cancel_key, NULL);
+}
+
+struct cancel cancel_create(uint32_t milliseconds) {
+    struct cancel cancel;
+
+    cancel.deadline = milliseconds > 0 ? cancel_now() + (uint64_t) milliseconds * 1000000 : 0;
+    cancel.requested = 0;
+    return cancel;
+}
+
+void cancel_request(struct cancel * cancel) {
+    __atomic_store_n(&cancel->requested, 1, __ATOMIC_RELAXED);
+}
+
+/* Reading monotonic clock goes through vDSO, so it is cheap enough for every row */
+const char * cancel_check(const struct cancel * cancel) {
+    if (!cancel) {
+        return NULL;
+    }
+
+    if (__atomic_load_n(&cancel->requested, __ATOMIC_RELAXED)) {
+        return CANCEL_REQUESTED;
+    }
+
+    return cancel->deadline > 0 && cancel_now() >= cancel->deadline ? CANCEL_DEADLINE_EXCEEDED : NULL;
+}
+
+const struct cancel * cancel_enter(const struct cancel * cancel) {
+    const struct cancel * previous;
+
+    pthread_once(&cancel_once, cancel_key_create);
+    previous = pthread_getspecific(cancel_key);
+
+    if (previous != cancel) {
+        pthread_setspecific(cancel_key, cancel);
+    }
+
+    return previous;
+}
+
+const struct cancel * cancel_current(void) {
+    pthread_once(&cancel_once, cancel_key_create);
+    return pthread_getspecific(cancel_key);
+}
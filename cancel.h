@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Cooperative cancellation of runs
+ *
+ * A token is current for the thread running a script (see interpreter_run_cancellable) and
+ * tasks of host pool take the token of the thread which called parallel_for. The interpreter checks
+ * it between steps and tiles, kernels check it between rows or tiles through host table (see module.h),
+ * so a run stops within a row or a tile of work after its deadline and releases its buffers.
+ */
+
+/* Messages of stopped steps */
+#define CANCEL_DEADLINE_EXCEEDED "deadline exceeded"
+#define CANCEL_REQUESTED "cancelled"
+
+struct cancel {
+    uint64_t deadline; /* nanoseconds of CLOCK_MONOTONIC, 0 if there is none */
+    int requested; /* accessed atomically */
+};
+
+/* Token expiring after `milliseconds` from now, never if it is 0 */
+struct cancel cancel_create(uint32_t milliseconds);
+
+/* Stops runs checking the token, may be called from any thread */
+void cancel_request(struct cancel * cancel);
+
+/* Returns message if a run should stop, NULL otherwise or if `cancel` is NULL.
+ * A failed run whose token returns message was stopped by it.
+ */
+const char * cancel_check(const struct cancel * cancel);
+
+/* Makes `cancel` (may be NULL) current for calling thread, returns the previous one to be restored */
+const struct cancel * cancel_enter(const struct cancel * cancel);
+const struct cancel * cancel_current(void);
@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+/* Local client of serve mode, it sends one request or generates load and reports latency */
+
+struct args {
+    const char * socket; /* socket of server */
+    const char * script; /* script filename */
+    const char * input; /* input BMP filename */
+    const char * output; /* output BMP filename */
+
+    bool code; /* assume that script is code instead of filename */
+    bool help; /* print help and exit */
+    uint32_t requests; /* generate load of this many requests, 0 sends one request */
+    uint32_t connections; /* concurrent connections of load */
+};
+
+/* Request contents shared by connections of load */
+struct load {
+    const struct args * args;
+    const char * code;
+    const uint8_t * image;
+    uint32_t image_length;
+
+    double * latencies; /* of every request, in milliseconds */
+    uint32_t next; /* of request to be sent */
+    uint32_t failed;
+    const char * error; /* first failure */
+    pthread_mutex_t mutex;
+};
+
+struct load_connection {
+    struct load * load;
+    pthread_t thread;
+};
+
+struct args args_create() {
+    struct args args = { NULL, NULL, "-", "-", false, false, 0, 1 };
+    return args;
+}
+
+void print_usage(FILE * file, const char * program) {
+    static const char * const usage = ""
+        "Usage: %s [-c] <socket> <script> [<input>] [<output>]\n"
+        "       %s [-c] -n <requests> [-C <connections>] <socket> <script> <input>\n"
+        "Arguments:\n"
+        "  - socket - Unix socket of image-transformer --serve\n"
+        "  - script - script filename\n"
+        "  - input - input BMP filename or stdin if is - (default is -)\n"
+        "  - output - output BMP filename or stdout if is - (default is -)\n";
+
+    static const char * const options = ""
+        "Options:\n"
+        "  - -c - assume that script is code instead of filename\n"
+        "  - -n <requests> - send requests on -C connections, then print throughput and p50/p99 latency\n"
+        "  - -C <connections> - set count of concurrent connections of load (default is 1)\n";
+
+    fprintf(file, usage, program, program);
+    fputs(options, file);
+}
+
+bool parse_count(const char * text, uint32_t * count, const char * error) {
+    char * end;
+    long value = strtol(text, &end, 10);
+
+    if (*text == '\0' || *end != '\0' || value < 1 || value > 1000000) {
+        fputs(error, stderr);
+        return false;
+    }
+
+    *count = value;
+    return true;
+}
+
+bool parse_args(struct args * args, int argc, char ** argv) {
+    const char ** positional[4];
+    uint32_t i;
+    int opt;
+
+    positional[0] = &args->socket;
+    positional[1] = &args->script;
+    positional[2] = &args->input;
+    positional[3] = &args->output;
+
+    while ((opt = getopt(argc, argv, "cn:C:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            args->code = true;
+            break;
+
+        case 'n':
+            if (!parse_count(optarg, &args->requests, "Request count should be a number from 1 to 1000000.\n")) {
+                return false;
+            }
+
+            break;
+
+        case 'C':
+            if (!parse_count(optarg, &args->connections, "Connection count should be a number from 1 to 1000000.\n")) {
+                return false;
+            }
+
+            break;
+
+        case 'h':
+            args->help = true;
+            break;
+
+        default:
+            print_usage(stderr, argv[0]);
+            return false;
+        }
+    }
+
+    if (args->help) {
+        print_usage(stdout, argv[0]);
+        return true;
+    }
+
+    for (i = optind; i < argc && i - optind < 4; ++i) {
+        *positional[i - optind] = argv[i];
+    }
+
+    if (i < argc) {
+        fputs("There are some extra arguments on the tail, skipping.\n", stderr);
+    }
+
+    if (i - optind < 2) {
+        fputs("Socket and script should be specified.\n", stderr);
+        print_usage(stderr, argv[0]);
+        return false;
+    }
+
+    return true;
+}
+
+/* Reads whole file, "-" is stdin. Result should be freed */
+uint8_t * read_file(const char * filename, size_t * length) {
+    bool stdinFilename = filename[0] == '-' && filename[1] == '\0';
+    size_t capacity = 1 << 16;
+    uint8_t * data = malloc(capacity + 1);
+    FILE * file;
+
+    if (stdinFilename) {
+        file = stdin;
+    } else if (!(file = fopen(filename, "rb"))) {
+        free(data);
+        return NULL;
+    }
+
+    *length = 0;
+
+    while ((*length += fread(data + *length, 1, capacity - *length, file)) == capacity) {
+        data = realloc(data, (capacity *= 2) + 1);
+    }
+
+    if (ferror(file)) {
+        free(data);
+        data = NULL;
+    } else {
+        data[*length] = '\0';
+    }
+
+    if (!stdinFilename) {
+        fclose(file);
+    }
+
+    return data;
+}
+
+int client_connect(const char * socket_path) {
+    struct sockaddr_un address;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (const struct sockaddr *) &address, sizeof(address))) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Sends script as code if `id` is NULL or *id otherwise, `body` is result or error message to be freed.
+ * Returns false on failure of connection.
+ */
+bool client_request(int fd, const char * code, const uint32_t * id, const uint8_t * image, uint32_t image_length,
+        struct protocol_response * response, uint8_t ** body) {
+    struct protocol_request request;
+    uint32_t wire_id;
+
+    request.magic = PROTOCOL_MAGIC;
+    request.script = id ? PROTOCOL_SCRIPT_ID : PROTOCOL_SCRIPT_CODE;
+    request.script_length = id ? sizeof(uint32_t) : strlen(code);
+    request.image_length = image_length;
+    protocol_request_order(&request);
+
+    if (id) {
+        wire_id = htole32(*id);
+        code = (const char *) &wire_id;
+    }
+
+    if (!protocol_write(fd, &request, sizeof(request))
+     || !protocol_write(fd, code, le32toh(request.script_length))
+     || !protocol_write(fd, image, image_length)
+     || !protocol_read(fd, response, sizeof(struct protocol_response))) {
+        return false;
+    }
+
+    protocol_response_order(response);
+    *body = malloc(response->length + 1);
+
+    if (!protocol_read(fd, *body, response->length)) {
+        free(*body);
+        return false;
+    }
+
+    (*body)[response->length] = '\0';
+    return true;
+}
+
+const char * connection_error(void) {
+    return errno ? strerror(errno) : "connection closed by server";
+}
+
+void load_fail(struct load * load, const char * error) {
+    pthread_mutex_lock(&load->mutex);
+    ++load->failed;
+
+    if (!load->error) {
+        load->error = error;
+    }
+
+    pthread_mutex_unlock(&load->mutex);
+}
+
+double elapsed(const struct timespec from) {
+    struct timespec to;
+
+    clock_gettime(CLOCK_MONOTONIC, &to);
+    return (to.tv_sec - from.tv_sec) * 1e3 + (to.tv_nsec - from.tv_nsec) / 1e6;
+}
+
+/* Sends requests until all of them are taken, the first one compiles the script */
+void * load_connection_run(void * context) {
+    struct load * load = ((struct load_connection *) context)->load;
+    struct protocol_response response;
+    struct timespec start;
+    bool known = false, answered;
+    uint32_t index, id = 0;
+    uint8_t * body;
+    int fd;
+
+    if ((fd = client_connect(load->args->socket)) < 0) {
+        load_fail(load, strerror(errno));
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&load->mutex);
+        index = load->next < load->args->requests ? load->next++ : load->args->requests;
+        pthread_mutex_unlock(&load->mutex);
+
+        if (index == load->args->requests) {
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        /* server drops scripts not used for a while, code is sent again then */
+        while ((answered = client_request(fd, load->code, known ? &id : NULL, load->image, load->image_length,
+                &response, &body)) && known && response.status == PROTOCOL_UNKNOWN_SCRIPT) {
+            free(body);
+            known = false;
+        }
+
+        if (!answered) {
+            load_fail(load, connection_error());
+            break;
+        }
+
+        load->latencies[index] = elapsed(start);
+
+        if (response.status == PROTOCOL_OK) {
+            id = response.script_id;
+            known = true;
+        } else {
+            load_fail(load, "server reported failure");
+        }
+
+        free(body);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+int compare_latencies(const void * a, const void * b) {
+    const double x = *((const double *) a), y = *((const double *) b);
+    return (x > y) - (x < y);
+}
+
+/* Latency below which `percent` of answered requests are */
+double percentile(const double * sorted, uint32_t count, uint32_t percent) {
+    return sorted[count * percent / 100 < count ? count * percent / 100 : count - 1];
+}
+
+/* Returns exit code */
+int run_load(const struct args args, const char * code, const uint8_t * image, uint32_t image_length) {
+    struct load_connection * connections = malloc(sizeof(struct load_connection) * args.connections);
+    struct timespec start;
+    struct load load;
+    uint32_t i, answered;
+    double total;
+
+    load.args = &args;
+    load.code = code;
+    load.image = image;
+    load.image_length = image_length;
+    load.latencies = malloc(sizeof(double) * args.requests);
+    load.next = 0;
+    load.failed = 0;
+    load.error = NULL;
+    pthread_mutex_init(&load.mutex, NULL);
+
+    for (i = 0; i < args.requests; ++i) {
+        load.latencies[i] = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = 0; i < args.connections; ++i) {
+        connections[i].load = &load;
+        pthread_create(&connections[i].thread, NULL, load_connection_run, connections + i);
+    }
+
+    for (i = 0; i < args.connections; ++i) {
+        pthread_join(connections[i].thread, NULL);
+    }
+
+    total = elapsed(start);
+
+    /* requests not answered are sorted first */
+    qsort(load.latencies, args.requests, sizeof(double), compare_latencies);
+
+    for (i = 0; i < args.requests && load.latencies[i] < 0; ++i) {
+    }
+
+    answered = args.requests - i;
+
+    printf("Requests: %lu on %lu connections, %lu failed\n", (unsigned long) args.requests,
+        (unsigned long) args.connections, (unsigned long) load.failed);
+
+    if (answered > 0) {
+        printf("Throughput: %.1f requests/s\n", answered * 1e3 / total);
+        printf("Latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", percentile(load.latencies + i, answered, 50),
+            percentile(load.latencies + i, answered, 99), load.latencies[args.requests - 1]);
+    }
+
+    if (load.error) {
+        fprintf(stderr, "Load failed: %s.\n", load.error);
+    }
+
+    pthread_mutex_destroy(&load.mutex);
+    free(load.latencies);
+    free(connections);
+    return load.failed > 0 ? 7 : 0;
+}
+
+/* Returns exit code, status of server is exit code of a single run */
+int run_request(const struct args args, const char * code, const uint8_t * image, uint32_t image_length) {
+    bool stdoutFilename = args.output[0] == '-' && args.output[1] == '\0';
+    struct protocol_response response;
+    uint8_t * body;
+    FILE * file;
+    int fd;
+
+    if ((fd = client_connect(args.socket)) < 0) {
+        perror("Connection failed");
+        return 8;
+    }
+
+    if (!client_request(fd, code, NULL, image, image_length, &response, &body)) {
+        fprintf(stderr, "Request failed: %s.\n", connection_error());
+        close(fd);
+        return 8;
+    }
+
+    close(fd);
+
+    if (response.status != PROTOCOL_OK) {
+        fprintf(stderr, "Server failed: %s.\n", (const char *) body);
+        free(body);
+        return response.status;
+    }
+
+    if (stdoutFilename) {
+        file = stdout;
+    } else if (!(file = fopen(args.output, "wb"))) {
+        perror("Output file opening failed");
+        free(body);
+        return 6;
+    }
+
+    if (fwrite(body, 1, response.length, file) < response.length || (!stdoutFilename && fclose(file))) {
+        perror("Output file writing failed");
+        free(body);
+        return 6;
+    }
+
+    free(body);
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    struct args args = args_create();
+    size_t code_length, image_length;
+    uint8_t * image;
+    char * code;
+    int result;
+
+    if (!parse_args(&args, argc, argv)) {
+        return 1;
+    }
+
+    if (args.help) {
+        return 0;
+    }
+
+    if (args.code) {
+        code = strdup(args.script);
+    } else if (!(code = (char *) read_file(args.script, &code_length))) {
+        perror("Script file reading failed");
+        return 2;
+    }
+
+    if (!(image = read_file(args.input, &image_length))) {
+        perror("Input file reading failed");
+        free(code);
+        return 4;
+    }
+
+    result = args.requests > 0
+        ? run_load(args, code, image, image_length)
+        : run_request(args, code, image, image_length);
+
+    free(image);
+    free(code);
+    return result;
+}
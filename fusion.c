@@ -0,0 +1,302 @@
+#include "fusion.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cancel.h"
+
+/* Rows of image computed by tiles on host pool, shared by chunks */
+struct fusion_rows {
+    const struct fusion * fusion;
+    struct image image;
+    struct image result;
+    uint32_t from;
+    uint32_t to;
+    uint32_t columns; /* of tiles */
+
+    pthread_mutex_t mutex;
+    const char * error; /* the first one */
+    uint32_t failed_stage;
+};
+
+/* Rectangle of tile buffer in image coordinates */
+struct fusion_area {
+    int64_t x, y;
+    uint32_t width;
+    uint32_t height;
+};
+
+bool fusion_is_fusable(const struct module_descriptor * descriptor) {
+    if (!descriptor->region || (descriptor->flags & MODULE_RESIZES)) {
+        return false;
+    }
+
+    return descriptor->access == MODULE_ACCESS_POINTWISE
+        || (descriptor->access == MODULE_ACCESS_STENCIL && descriptor->radius <= FUSION_MAX_RADIUS);
+}
+
+struct fusion_stage fusion_stage_create(const struct module_descriptor * descriptor, uint32_t argc, const struct value * argv) {
+    struct fusion_stage stage;
+
+    stage.region = descriptor->region;
+    stage.argc = argc;
+    stage.argv = argv;
+    stage.radius = descriptor->access == MODULE_ACCESS_STENCIL ? descriptor->radius : 0;
+    stage.border = descriptor->border;
+
+    return stage;
+}
+
+struct fusion * fusion_new(const struct fusion_stage * stages, uint32_t count) {
+    struct fusion * fusion = malloc(sizeof(struct fusion));
+    uint32_t i;
+
+    fusion->stages = malloc(sizeof(struct fusion_stage) * count);
+    fusion->count = count;
+    memcpy(fusion->stages, stages, sizeof(struct fusion_stage) * count);
+
+    for (i = 0, fusion->halo = 0; i < count; ++i) {
+        fusion->halo += stages[i].radius;
+    }
+
+    return fusion;
+}
+
+void fusion_delete(struct fusion * fusion) {
+    if (!fusion) {
+        return;
+    }
+
+    free(fusion->stages);
+    free(fusion);
+}
+
+/* Fills pixels of `area` outside of image from pixels inside it */
+void fusion_fill_border(struct pixel * buffer, const struct fusion_area area,
+        uint32_t width, uint32_t height, enum module_border border) {
+    static const struct pixel black_pixel = { 0, 0, 0 };
+    int64_t x0, y0, x1, y1, x, y;
+    struct pixel * row;
+
+    /* part of area inside of image, in buffer coordinates */
+    x0 = area.x < 0 ? -area.x : 0;
+    y0 = area.y < 0 ? -area.y : 0;
+    x1 = area.x + area.width > width ? width - area.x : area.width;
+    y1 = area.y + area.height > height ? height - area.y : area.height;
+
+    for (y = y0; y < y1; ++y) {
+        row = buffer + area.width * y;
+
+        for (x = 0; x < x0; ++x) {
+            row[x] = border == MODULE_BORDER_ZERO ? black_pixel : row[x0];
+        }
+
+        for (x = x1; x < area.width; ++x) {
+            row[x] = border == MODULE_BORDER_ZERO ? black_pixel : row[x1 - 1];
+        }
+    }
+
+    for (y = 0; y < area.height; ++y) {
+        if (y >= y0 && y < y1) {
+            continue;
+        }
+
+        row = buffer + area.width * y;
+
+        if (border == MODULE_BORDER_ZERO) {
+            memset(row, 0, sizeof(struct pixel) * area.width);
+        } else {
+            memcpy(row, buffer + area.width * (y < y0 ? y0 : y1 - 1), sizeof(struct pixel) * area.width);
+        }
+    }
+}
+
+/* Copies pixels of `area` inside of image to buffer and fills the rest */
+void fusion_load(const struct image image, struct pixel * buffer, const struct fusion_area area, enum module_border border) {
+    int64_t x0 = area.x < 0 ? 0 : area.x, x1 = area.x + area.width > image.width ? image.width : area.x + area.width;
+    int64_t y0 = area.y < 0 ? 0 : area.y, y1 = area.y + area.height > image.height ? image.height : area.y + area.height;
+    int64_t y;
+
+    for (y = y0; y < y1; ++y) {
+        memcpy(buffer + area.width * (y - area.y) + (x0 - area.x),
+            image.pixels + image.width * y + x0, sizeof(struct pixel) * (x1 - x0));
+    }
+
+    fusion_fill_border(buffer, area, image.width, image.height, border);
+}
+
+/* Tile is processed by stages from the widest area to the tile itself, each stage shrinks halo by its radius.
+ * Current cancel token is checked before every tile.
+ */
+const char * fusion_run_tile(const struct fusion * fusion, struct pixel * buffers[2], const struct image image,
+        struct image result, uint32_t tile_x, uint32_t tile_y, uint32_t tile_w, uint32_t tile_h, uint32_t * failed_stage) {
+    const struct fusion_stage * stage;
+    struct fusion_area area, next_area;
+    struct module_region region;
+    struct pixel * src, * dst;
+    int64_t x0, y0, x1, y1;
+    uint32_t halo, i;
+    const char * error;
+
+    /* a stopped run is reported by the first step of fused run */
+    if ((error = cancel_check(cancel_current()))) {
+        *failed_stage = 0;
+        return error;
+    }
+
+    halo = fusion->halo;
+    area.x = (int64_t) tile_x - halo;
+    area.y = (int64_t) tile_y - halo;
+    area.width = tile_w + 2 * halo;
+    area.height = tile_h + 2 * halo;
+
+    src = buffers[0];
+    dst = buffers[1];
+    fusion_load(image, src, area, fusion->stages[0].border);
+
+    for (i = 0, stage = fusion->stages; i < fusion->count; ++i, ++stage) {
+        halo -= stage->radius;
+
+        next_area.x = (int64_t) tile_x - halo;
+        next_area.y = (int64_t) tile_y - halo;
+        next_area.width = tile_w + 2 * halo;
+        next_area.height = tile_h + 2 * halo;
+
+        /* only pixels inside of image are computed, the rest is border */
+        x0 = next_area.x < 0 ? 0 : next_area.x;
+        y0 = next_area.y < 0 ? 0 : next_area.y;
+        x1 = next_area.x + next_area.width > image.width ? image.width : next_area.x + next_area.width;
+        y1 = next_area.y + next_area.height > image.height ? image.height : next_area.y + next_area.height;
+
+        region.src = src + area.width * (y0 - area.y) + (x0 - area.x);
+        region.src_stride = area.width;
+        region.width = x1 - x0;
+        region.height = y1 - y0;
+
+        if (i + 1 == fusion->count) {
+            region.dst = result.pixels + result.width * y0 + x0;
+            region.dst_stride = result.width;
+        } else {
+            region.dst = dst + next_area.width * (y0 - next_area.y) + (x0 - next_area.x);
+            region.dst_stride = next_area.width;
+        }
+
+        if ((error = stage->region(&region, stage->argc, stage->argv))) {
+            *failed_stage = i;
+            return error;
+        }
+
+        if (i + 1 < fusion->count) {
+            fusion_fill_border(dst, next_area, image.width, image.height, stage[1].border);
+        }
+
+        area = next_area;
+        src = dst;
+        dst = src == buffers[0] ? buffers[1] : buffers[0];
+    }
+
+    return NULL;
+}
+
+const char * fusion_run(const struct fusion * fusion, struct image * image, uint32_t * failed_stage) {
+    const uint32_t side = FUSION_TILE + 2 * fusion->halo;
+    uint32_t tile_x, tile_y, tile_w, tile_h;
+    const char * error = NULL;
+    struct pixel * buffers[2];
+    struct image result;
+
+    result = image_create(image->width, image->height);
+    buffers[0] = malloc(sizeof(struct pixel) * side * side);
+    buffers[1] = malloc(sizeof(struct pixel) * side * side);
+
+    for (tile_y = 0; tile_y < image->height && !error; tile_y += FUSION_TILE) {
+        tile_h = image->height - tile_y < FUSION_TILE ? image->height - tile_y : FUSION_TILE;
+
+        for (tile_x = 0; tile_x < image->width && !error; tile_x += FUSION_TILE) {
+            tile_w = image->width - tile_x < FUSION_TILE ? image->width - tile_x : FUSION_TILE;
+            error = fusion_run_tile(fusion, buffers, *image, result, tile_x, tile_y, tile_w, tile_h, failed_stage);
+        }
+    }
+
+    free(buffers[1]);
+    free(buffers[0]);
+
+    if (error) {
+        image_discard(result);
+        return error;
+    }
+
+    image_discard(*image);
+    *image = result;
+    return NULL;
+}
+
+/* Computes tiles [from, to) of rows, row by row, with buffers of the chunk */
+const char * fusion_rows_run(void * context, uint32_t from, uint32_t to) {
+    struct fusion_rows * rows = context;
+    const uint32_t side = FUSION_TILE + 2 * rows->fusion->halo;
+    uint32_t tile_x, tile_y, tile_w, tile_h, failed_stage;
+    const char * error = NULL;
+    struct pixel * buffers[2];
+
+    buffers[0] = malloc(sizeof(struct pixel) * side * side);
+    buffers[1] = malloc(sizeof(struct pixel) * side * side);
+
+    for (; from < to && !error; ++from) {
+        tile_x = from % rows->columns * FUSION_TILE;
+        tile_y = rows->from + from / rows->columns * FUSION_TILE;
+        tile_w = rows->image.width - tile_x < FUSION_TILE ? rows->image.width - tile_x : FUSION_TILE;
+        tile_h = rows->to - tile_y < FUSION_TILE ? rows->to - tile_y : FUSION_TILE;
+
+        error = fusion_run_tile(rows->fusion, buffers, rows->image, rows->result, tile_x, tile_y, tile_w, tile_h, &failed_stage);
+    }
+
+    free(buffers[1]);
+    free(buffers[0]);
+
+    if (error) {
+        pthread_mutex_lock(&rows->mutex);
+
+        if (!rows->error) {
+            rows->error = error;
+            rows->failed_stage = failed_stage;
+        }
+
+        pthread_mutex_unlock(&rows->mutex);
+    }
+
+    return error;
+}
+
+const char * fusion_run_rows(const struct fusion * fusion, const struct image image, struct image result,
+        uint32_t from, uint32_t to, const struct module_host * host, uint32_t * failed_stage) {
+    struct fusion_rows rows;
+    const char * error;
+    uint32_t count;
+
+    if (from >= to || image.width == 0) {
+        return NULL;
+    }
+
+    rows.fusion = fusion;
+    rows.image = image;
+    rows.result = result;
+    rows.from = from;
+    rows.to = to;
+    rows.columns = (image.width + FUSION_TILE - 1) / FUSION_TILE;
+    rows.error = NULL;
+    pthread_mutex_init(&rows.mutex, NULL);
+
+    count = rows.columns * ((to - from + FUSION_TILE - 1) / FUSION_TILE);
+    error = MODULE_PARALLEL_FOR(host, count, 1, fusion_rows_run, &rows);
+
+    pthread_mutex_destroy(&rows.mutex);
+
+    /* chunks of a stopped run may be skipped by host pool without reporting a stage */
+    if (error) {
+        *failed_stage = rows.error ? rows.failed_stage : 0;
+    }
+
+    return rows.error ? rows.error : error;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "image.h"
+#include "value.h"
+#include "module.h"
+
+/* Largest stencil radius of a fusable step */
+#define FUSION_MAX_RADIUS (4)
+
+/* Largest sum of radii of fused steps, halo is recomputed for every tile */
+#define FUSION_MAX_HALO (16)
+
+/* Side of square output tile, in pixels */
+#define FUSION_TILE (128)
+
+/* Step of fused run, computed by its region function */
+struct fusion_stage {
+    module_region_function region;
+
+    uint32_t argc;
+    const struct value * argv;
+
+    uint32_t radius;
+    enum module_border border;
+};
+
+/* Run of consecutive steps executed tile by tile in a single pass over image */
+struct fusion {
+    struct fusion_stage * stages;
+    uint32_t count;
+
+    uint32_t halo; /* sum of stages radii */
+};
+
+bool fusion_is_fusable(const struct module_descriptor * descriptor);
+struct fusion_stage fusion_stage_create(const struct module_descriptor * descriptor, uint32_t argc, const struct value * argv);
+
+struct fusion * fusion_new(const struct fusion_stage * stages, uint32_t count);
+void fusion_delete(struct fusion * fusion);
+
+/* On error `failed_stage` is set to index of stage returned it, tile buffers are owned by the call */
+const char * fusion_run(const struct fusion * fusion, struct image * image, uint32_t * failed_stage);
+
+/* Computes rows [from, to) of `result` from `image` of the same size tile by tile on host pool, if `host` is set */
+const char * fusion_run_rows(const struct fusion * fusion, const struct image image, struct image result,
+    uint32_t from, uint32_t to, const struct module_host * host, uint32_t * failed_stage);
+
+/* Computes a tile of `result` from `image` of the same size, other pixels of `result` are kept.
+ * Each of `buffers` holds a square of tile side plus halo on both sides.
+ */
+const char * fusion_run_tile(const struct fusion * fusion, struct pixel * buffers[2], const struct image image,
+    struct image result, uint32_t tile_x, uint32_t tile_y, uint32_t tile_w, uint32_t tile_h, uint32_t * failed_stage);
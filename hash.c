@@ -0,0 +1,88 @@
+#include "hash.h"
+
+#include <string.h>
+
+#define HASH_PRIME_1 UINT64_C(0x9E3779B185EBCA87)
+#define HASH_PRIME_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define HASH_PRIME_3 UINT64_C(0x165667B19E3779F9)
+#define HASH_PRIME_4 UINT64_C(0x85EBCA77C2B2AE63)
+#define HASH_PRIME_5 UINT64_C(0x27D4EB2F165667C5)
+
+uint64_t hash_rotate(uint64_t value, uint32_t count) {
+    return (value << count) | (value >> (64 - count));
+}
+
+/* Little-endian hosts only, like the rest of file formats */
+uint64_t hash_read64(const uint8_t * data) {
+    uint64_t value;
+
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint32_t hash_read32(const uint8_t * data) {
+    uint32_t value;
+
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint64_t hash_round(uint64_t accumulator, uint64_t input) {
+    return hash_rotate(accumulator + input * HASH_PRIME_2, 31) * HASH_PRIME_1;
+}
+
+uint64_t hash_merge(uint64_t hash, uint64_t accumulator) {
+    return (hash ^ hash_round(0, accumulator)) * HASH_PRIME_1 + HASH_PRIME_4;
+}
+
+uint64_t hash_bytes(const void * data, size_t size, uint64_t seed) {
+    const uint8_t * next = data;
+    const uint8_t * const end = next + size;
+    uint64_t hash, v1, v2, v3, v4;
+
+    if (size >= 32) {
+        v1 = seed + HASH_PRIME_1 + HASH_PRIME_2;
+        v2 = seed + HASH_PRIME_2;
+        v3 = seed;
+        v4 = seed - HASH_PRIME_1;
+
+        /* four independent lanes of 8 bytes */
+        for (; end - next >= 32; next += 32) {
+            v1 = hash_round(v1, hash_read64(next));
+            v2 = hash_round(v2, hash_read64(next + 8));
+            v3 = hash_round(v3, hash_read64(next + 16));
+            v4 = hash_round(v4, hash_read64(next + 24));
+        }
+
+        hash = hash_rotate(v1, 1) + hash_rotate(v2, 7) + hash_rotate(v3, 12) + hash_rotate(v4, 18);
+        hash = hash_merge(hash, v1);
+        hash = hash_merge(hash, v2);
+        hash = hash_merge(hash, v3);
+        hash = hash_merge(hash, v4);
+    } else {
+        hash = seed + HASH_PRIME_5;
+    }
+
+    hash += size;
+
+    for (; end - next >= 8; next += 8) {
+        hash = hash_rotate(hash ^ hash_round(0, hash_read64(next)), 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+
+    if (end - next >= 4) {
+        hash = hash_rotate(hash ^ (hash_read32(next) * HASH_PRIME_1), 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        next += 4;
+    }
+
+    for (; next < end; ++next) {
+        hash = hash_rotate(hash ^ (*next * HASH_PRIME_5), 11) * HASH_PRIME_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* XXH64 of `size` bytes, hashes are chained by passing the previous one as `seed` */
+uint64_t hash_bytes(const void * data, size_t size, uint64_t seed);
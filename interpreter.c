@@ -1,45 +1,169 @@
+#define _GNU_SOURCE
+
 #include "interpreter.h"
 
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 #include <dlfcn.h>
-
+#include <link.h>
+#include <sys/stat.h>
+
+#include "module.h"
+#include "fusion.h"
+#include "lut.h"
+#include "remap.h"
+#include "pool.h"
+#include "builtin.h"
 #include "value.h"
+#include "hash.h"
+#include "snapshot.h"
+#include "sequence.h"
+#include "cancel.h"
 #include "util.h"
 
+/* Bytes of remap tables kept by interpreter */
+#define INTERPRETER_REMAP_CACHE_SIZE (64 << 20)
+
 typedef const char * (* transformation_function)(struct image * image, uint32_t argc, const struct value * argv);
 
-struct interpreter_ids {
+/* Loaded shared object, each module is opened once */
+struct interpreter_module {
+    const char * name;
+    void * handle;
+    const struct builtin_module * builtin; /* set instead of handle for modules compiled into executable */
+
+    struct interpreter_module * next;
+};
+
+/* Entry of symbols hash table */
+struct interpreter_symbol {
     const char * module;
     const char * name;
 
-    void * handle;
     void * symbol;
 
-    struct interpreter_ids * next;
+    struct interpreter_symbol * next;
+};
+
+/* Symbols hash table with separate chaining */
+struct interpreter_ids {
+    struct interpreter_symbol ** buckets;
+    uint32_t buckets_count;
+    uint32_t count;
+
+    struct interpreter_module * modules;
+};
+
+/* Resolved transformation with pre-built arguments */
+struct interpreter_step {
+    transformation_function function;
+    struct module_descriptor descriptor; /* specialized for arguments */
+
+    uint32_t argc;
+    struct value * argv;
+
+    const struct ast_transformation * transformation;
+
+    struct fusion * fusion; /* set if step leads a run of fusion->count fused steps */
+    struct lut * lut; /* set for steps providing lookup tables */
+
+    struct snapshot_key prefix; /* of optimized script up to this step, set if snapshots are kept */
+};
+
+/* Kind of consecutive steps optimizer merges */
+enum interpreter_merge_kind {
+    INTERPRETER_MERGE_NONE,
+    INTERPRETER_MERGE_AFFINE,
+    INTERPRETER_MERGE_LUT
+};
+
+/* Pending run of mergeable steps */
+struct interpreter_merge {
+    enum interpreter_merge_kind kind;
+
+    struct ast_script * steps; /* cloned, in reverse order */
+    uint32_t count;
+
+    double matrix[4]; /* composed, for affine steps */
+    struct lut lut; /* composed, for lookup table steps */
+};
+
+/* Pass of leading steps computable band by band, a fused run is one pass */
+struct interpreter_band {
+    struct fusion * fusion;
+    uint32_t first; /* step */
+};
+
+/* Immutable sequence of steps built from script */
+struct interpreter_plan {
+    struct interpreter_step * steps;
+    uint32_t count;
+
+    uint32_t passes_saved; /* by composition and fusion */
+
+    struct fusion * local; /* leading steps computed by tiles in frame sequences, NULL if there are none */
+
+    struct interpreter_band * bands; /* leading passes computed by bands in shards */
+    uint32_t bands_count;
 };
 
-struct interpreter_ids *
-interpreter_ids_new(const char * module, const char * name, void * handle, void * symbol, struct interpreter_ids * next);
+struct interpreter_ids * interpreter_ids_new(void);
 void interpreter_ids_delete(struct interpreter_ids * interpreter_ids);
 
-const struct interpreter_ids *
+const struct interpreter_symbol *
 interpreter_ids_lookup(const struct interpreter_ids * interpreter_ids, const char * module, const char * name);
+void interpreter_ids_insert(struct interpreter_ids * interpreter_ids, const char * module, const char * name, void * symbol);
+
+struct interpreter_module *
+interpreter_ids_find_module(const struct interpreter_ids * interpreter_ids, const char * module);
+struct interpreter_module *
+interpreter_ids_add_module(struct interpreter_ids * interpreter_ids, const char * module,
+    void * handle, const struct builtin_module * builtin);
+void interpreter_ids_remove_module(struct interpreter_ids * interpreter_ids, struct interpreter_module * loaded);
+void interpreter_ids_close_module(struct interpreter_module * loaded);
+
+const char * interpreter_load_descriptor(
+    const struct interpreter interpreter,
+    struct module_descriptor * descriptor,
+    const struct ast_transformation transformation
+);
+
+const char * interpreter_optimize(struct interpreter * interpreter);
+const char * interpreter_plan_compile(struct interpreter * interpreter);
+const char * interpreter_step_remap(const struct interpreter interpreter, struct interpreter_step * step);
+void interpreter_plan_compose(struct interpreter_plan * plan);
+void interpreter_plan_fuse(struct interpreter_plan * plan);
+void interpreter_plan_localize(struct interpreter_plan * plan);
+void interpreter_plan_band(struct interpreter_plan * plan);
+void interpreter_plan_delete(struct interpreter_plan * plan);
 
 struct interpreter interpreter_create(const struct ast_script * script) {
     struct interpreter interpreter;
 
     interpreter.modules_prefix = "";
+    interpreter.threads = 0;
     interpreter.script = script;
-    interpreter.identifiers = NULL;
+    interpreter.identifiers = interpreter_ids_new();
+    interpreter.optimized = NULL;
+    interpreter.plan = NULL;
+    interpreter.remaps = remap_cache_new(INTERPRETER_REMAP_CACHE_SIZE);
+    interpreter.pool = NULL;
+    interpreter.snapshots = NULL;
+    interpreter.error = NULL;
 
     return interpreter;
 }
 
 void interpreter_discard(struct interpreter interpreter) {
+    interpreter_plan_delete(interpreter.plan);
+    ast_script_delete(interpreter.optimized);
     interpreter_ids_delete(interpreter.identifiers);
+    remap_cache_delete(interpreter.remaps);
+    pool_delete(interpreter.pool);
+    free(interpreter.error);
 }
 
 const char * interpreter_do_load_module(void ** handle, const char * filename) {
@@ -50,45 +174,63 @@ const char * interpreter_do_load_module(void ** handle, const char * filename) {
     return NULL;
 }
 
-const char * interpreter_load_module(const struct interpreter interpreter, void ** handle, const char * module) {
+/* Error of dlopen() is kept in interpreter error, it would be overwritten by the next call */
+const char * interpreter_load_module(struct interpreter * interpreter, void ** handle, const char * module) {
     size_t prefix_length, module_length;
-    static char * error = NULL;
     char * filename;
 
     if (!module) {
-        return strset(&error, interpreter_do_load_module(handle, NULL));
+        return strset(&interpreter->error, interpreter_do_load_module(handle, NULL));
     }
 
-    prefix_length = strlen(interpreter.modules_prefix);
+    prefix_length = strlen(interpreter->modules_prefix);
     module_length = strlen(module);
 
     filename = malloc(sizeof(char) * (prefix_length + module_length + 4));
 
-    sprintf(filename, "%s%s.so", interpreter.modules_prefix, module);
-    if (!strset(&error, interpreter_do_load_module(handle, filename))) {
+    sprintf(filename, "%s%s.so", interpreter->modules_prefix, module);
+    if (!strset(&interpreter->error, interpreter_do_load_module(handle, filename))) {
         free(filename);
         return NULL;
     }
 
-    sprintf(filename, "%s%s", interpreter.modules_prefix, module);
+    sprintf(filename, "%s%s", interpreter->modules_prefix, module);
     if (!interpreter_do_load_module(handle, filename)) {
         free(filename);
         return NULL;
     }
 
     free(filename);
-    return error;
+    return interpreter->error;
 }
 
-const char * interpreter_do_load_symbol(void ** symbol, void * handle, const char * name) {
+const char * interpreter_do_load_symbol(void ** symbol, const struct interpreter_module * loaded, const char * name) {
+    if (loaded->builtin) {
+        *symbol = builtin_symbol(loaded->builtin, name);
+        return *symbol ? NULL : "undefined symbol of built-in module";
+    }
+
     dlerror();
 
-    *symbol = dlsym(handle, name);
+    *symbol = dlsym(loaded->handle, name);
     return dlerror();
 }
 
+/* Passes host table to init function of the module, if it exports one */
+const char * interpreter_init_module(const struct interpreter interpreter, const struct interpreter_module * loaded) {
+    module_init_function init;
+
+    if (interpreter_do_load_symbol((void **) (&init), loaded, MODULE_INIT_SYMBOL) || !init) {
+        return NULL;
+    }
+
+    return init(pool_host(interpreter.pool));
+}
+
 const char * interpreter_load_symbol(struct interpreter * interpreter, const char * module, const char * name) {
-    static char * error = NULL;
+    const struct builtin_module * builtin = NULL;
+    struct interpreter_module * loaded;
+    const char * error;
     void * handle;
     void * symbol;
 
@@ -96,40 +238,39 @@ const char * interpreter_load_symbol(struct interpreter * interpreter, const cha
         return NULL;
     }
 
-    if (strset(&error, interpreter_load_module(*interpreter, &handle, module))) {
-        return error;
+    if (!(loaded = interpreter_ids_find_module(interpreter->identifiers, module))) {
+        if (module && (builtin = builtin_find(module))) {
+            handle = NULL;
+        } else if ((error = interpreter_load_module(interpreter, &handle, module))) {
+            return error;
+        }
+
+        loaded = interpreter_ids_add_module(interpreter->identifiers, module, handle, builtin);
+
+        if (module && (error = interpreter_init_module(*interpreter, loaded))) {
+            error = strset(&interpreter->error, error);
+            interpreter_ids_remove_module(interpreter->identifiers, loaded);
+            return error;
+        }
     }
 
-    if (strset(&error, interpreter_do_load_symbol(&symbol, handle, name))) {
-        dlclose(handle);
-        return error;
+    if ((error = interpreter_do_load_symbol(&symbol, loaded, name))) {
+        return strset(&interpreter->error, error);
     }
 
-    interpreter->identifiers = interpreter_ids_new(module, name, handle, symbol, interpreter->identifiers);
+    interpreter_ids_insert(interpreter->identifiers, module, name, symbol);
     return NULL;
 }
 
-const char * interpreter_print_pos(struct ast_position pos) {
-    static char * result = NULL;
-
-    free(result);
-    result = malloc(sizeof(char) * 53);
-
-    sprintf(result, "at %u:%u", pos.row, pos.col);
-    return result;
-}
-
+/* Replaces `*error` with formatted message, `source` may point to `*error` itself */
 const char *
-interpreter_print_positional_error(struct ast_position pos, const char * message, const char * source) {
-    static char * error = NULL;
-
-    const char * pos_str = interpreter_print_pos(pos);
+interpreter_print_positional_error(char ** error, struct ast_position pos, const char * message, const char * source) {
+    char * result = malloc(sizeof(char) * (strlen(message) + strlen(source) + 56));
 
-    free(error);
-    error = malloc(sizeof(char) * (strlen(pos_str) + strlen(message) + strlen(source) + 5));
+    sprintf(result, "at %u:%u: %s: %s", pos.row, pos.col, message, source);
 
-    sprintf(error, "%s: %s: %s", pos_str, message, source);
-    return error;
+    free(*error);
+    return *error = result;
 }
 
 const char * interpreter_process_script(struct interpreter * interpreter) {
@@ -139,11 +280,16 @@ const char * interpreter_process_script(struct interpreter * interpreter) {
     struct ast_literal literal;
     const char * error;
 
+    if (!interpreter->pool) {
+        interpreter->pool = pool_new(interpreter->threads);
+    }
+
     for (next_script = interpreter->script; next_script; next_script = next_script->next) {
         transformation = next_script->transformation;
 
         if ((error = interpreter_load_symbol(interpreter, transformation.module, transformation.name))) {
-            return interpreter_print_positional_error(transformation.pos, "cannot load transformation", error);
+            return interpreter_print_positional_error(&interpreter->error, transformation.pos,
+                "cannot load transformation", error);
         }
 
         for (
@@ -155,13 +301,18 @@ const char * interpreter_process_script(struct interpreter * interpreter) {
 
             if (literal.type == L_IDENTIFIER) {
                 if ((error = interpreter_load_symbol(interpreter, transformation.module, literal.value))) {
-                    return interpreter_print_positional_error(literal.pos, "cannot load identifier", error);
+                    return interpreter_print_positional_error(&interpreter->error, literal.pos,
+                        "cannot load identifier", error);
                 }
             }
         }
     }
 
-    return NULL;
+    if ((error = interpreter_optimize(interpreter))) {
+        return error;
+    }
+
+    return interpreter_plan_compile(interpreter);
 }
 
 uint32_t interpreter_count_args(const struct ast_transformation_args * transformation_args) {
@@ -245,87 +396,888 @@ void interpreter_delete_args(uint32_t argc, struct value * args) {
     free(args);
 }
 
-const char * interpreter_run(const struct interpreter interpreter, struct image * image) {
-    static char * transformation_name = NULL;
+void interpreter_print_script(const struct interpreter interpreter, FILE * file) {
+    const struct ast_script * next;
+
+    for (next = interpreter.optimized; next; next = next->next) {
+        ast_transformation_print(next->transformation, file);
+    }
+}
+
+uint32_t interpreter_passes_saved(const struct interpreter interpreter) {
+    return interpreter.plan ? interpreter.plan->passes_saved : 0;
+}
+
+/* Identity of a file is its device, inode, size and modification time */
+uint64_t interpreter_hash_file(const char * filename, uint64_t seed) {
+    uint64_t identity[5] = { 0, 0, 0, 0, 0 };
+    struct stat st;
+
+    if (filename && stat(filename, &st) == 0) {
+        identity[0] = st.st_dev;
+        identity[1] = st.st_ino;
+        identity[2] = st.st_size;
+        identity[3] = st.st_mtim.tv_sec;
+        identity[4] = st.st_mtim.tv_nsec;
+    }
+
+    return hash_bytes(identity, sizeof(identity), seed);
+}
+
+/* Hash of identities of files script runs */
+uint64_t interpreter_files_hash(const struct interpreter interpreter, uint64_t seed) {
+    uint64_t (* self)(const struct interpreter, uint64_t) = interpreter_files_hash;
+    const struct interpreter_module * loaded;
+    const struct link_map * map;
+    Dl_info info;
+
+    /* the object interpreter is linked into holds standard library and built-in modules */
+    seed = interpreter_hash_file(dladdr(*((void **) (&self)), &info) ? info.dli_fname : NULL, seed);
+
+    for (loaded = interpreter.identifiers->modules; loaded; loaded = loaded->next) {
+        if (!loaded->name || loaded->builtin) {
+            continue;
+        }
+
+        seed = hash_bytes(loaded->name, strlen(loaded->name) + 1, seed);
+        seed = interpreter_hash_file(dlinfo(loaded->handle, RTLD_DI_LINKMAP, &map) == 0 ? map->l_name : NULL, seed);
+    }
+
+    return seed;
+}
+
+uint64_t interpreter_script_hash(const struct interpreter interpreter, uint64_t seed) {
+    return interpreter_files_hash(interpreter, ast_script_hash(interpreter.script, seed));
+}
+
+void interpreter_snapshot(const struct interpreter interpreter, const struct snapshot_key * input,
+        const struct interpreter_step * step, const struct image image) {
+    if (input) {
+        snapshot_store(interpreter.snapshots, snapshot_key_combine(*input, step->prefix), image);
+    }
+}
+
+/* Replaces image with snapshot of the longest prefix of plan kept, returns count of steps it made */
+uint32_t interpreter_resume(const struct interpreter interpreter, const struct snapshot_key input, struct image * image) {
+    const struct interpreter_plan * plan = interpreter.plan;
+    uint32_t * ends = malloc(sizeof(uint32_t) * (plan->count > 0 ? plan->count : 1));
+    uint32_t i, count = 0;
+
+    /* snapshots are taken after every pass, a fused run is one pass */
+    for (i = 0; i < plan->count; i += plan->steps[i].fusion ? plan->steps[i].fusion->count : 1) {
+        ends[count++] = i + (plan->steps[i].fusion ? plan->steps[i].fusion->count : 1);
+    }
+
+    while (count > 0 && !snapshot_load(interpreter.snapshots,
+            snapshot_key_combine(input, plan->steps[ends[count - 1] - 1].prefix), image)) {
+        --count;
+    }
+
+    i = count > 0 ? ends[count - 1] : 0;
+    free(ends);
+    return i;
+}
+
+/* Reports failure of step with its position in script */
+const char * interpreter_step_error(const struct interpreter_step * step, const char * message, char ** error) {
+    const struct ast_transformation * transformation = step->transformation;
+    char * transformation_name;
+
+    transformation_name = malloc(sizeof(char) * ((transformation->module
+        ? strlen(transformation->module) + 1 : 0) + strlen(transformation->name) + 1));
+
+    if (transformation->module) {
+        sprintf(transformation_name, "%s.%s", transformation->module, transformation->name);
+    } else {
+        sprintf(transformation_name, "%s", transformation->name);
+    }
+
+    interpreter_print_positional_error(error, transformation->pos, transformation_name, message);
+    free(transformation_name);
+    return *error;
+}
+
+const char * interpreter_do_run_steps(const struct interpreter interpreter, struct image * image, uint32_t i,
+        const struct snapshot_key * input, char ** error) {
     const char * transformation_error;
+    const struct interpreter_step * step;
+    uint32_t failed_stage;
 
-    transformation_function transformation_function;
-    struct ast_transformation transformation;
+    for (step = interpreter.plan->steps + i; i < interpreter.plan->count; ++i, ++step) {
+        if ((transformation_error = cancel_check(cancel_current()))) {
+            return interpreter_step_error(step, transformation_error, error);
+        }
+
+        if (step->fusion) {
+            if (!(transformation_error = fusion_run(step->fusion, image, &failed_stage))) {
+                i += step->fusion->count - 1;
+                step += step->fusion->count - 1;
+                interpreter_snapshot(interpreter, input, step, *image);
+                continue;
+            }
+
+            step += failed_stage;
+        } else if (!(transformation_error = step->function(image, step->argc, step->argv))) {
+            interpreter_snapshot(interpreter, input, step, *image);
+            continue;
+        }
+
+        return interpreter_step_error(step, transformation_error, error);
+    }
+
+    return NULL;
+}
+
+/* Runs steps of plan from `i`, snapshots of input are kept if `input` is set.
+ * Current cancel token is checked before every step, kernels check it within steps.
+ * Modules take the table of interpreter pool from module_host_current while its steps run.
+ */
+const char * interpreter_run_steps(const struct interpreter interpreter, struct image * image, uint32_t i,
+        const struct snapshot_key * input, char ** error) {
+    const struct module_host * previous = pool_host_enter(interpreter.pool ? pool_host(interpreter.pool) : NULL);
+    const char * result = interpreter_do_run_steps(interpreter, image, i, input, error);
+
+    pool_host_enter(previous);
+    return result;
+}
+
+const char * interpreter_run(const struct interpreter interpreter, struct image * image, char ** error) {
+    struct snapshot_key input;
+    uint32_t i;
+
+    if (!interpreter.snapshots) {
+        return interpreter_run_steps(interpreter, image, 0, NULL, error);
+    }
+
+    input = snapshot_image_key(*image);
+    i = interpreter_resume(interpreter, input, image);
+    return interpreter_run_steps(interpreter, image, i, &input, error);
+}
+
+const char * interpreter_run_cancellable(const struct interpreter interpreter, struct image * image,
+        const struct cancel * cancel, char ** error) {
+    const struct cancel * previous = cancel_enter(cancel);
+    const char * result = interpreter_run(interpreter, image, error);
+
+    cancel_enter(previous);
+    return result;
+}
+
+const char * interpreter_run_from(const struct interpreter interpreter, struct image * image, uint32_t first, char ** error) {
+    return interpreter_run_steps(interpreter, image, first, NULL, error);
+}
+
+uint32_t interpreter_band_passes(const struct interpreter interpreter, uint32_t * steps) {
+    const struct interpreter_plan * plan = interpreter.plan;
+
+    *steps = 0;
+
+    if (plan->bands_count > 0) {
+        *steps = plan->bands[plan->bands_count - 1].first + plan->bands[plan->bands_count - 1].fusion->count;
+    }
+
+    return plan->bands_count;
+}
+
+const char * interpreter_run_band(const struct interpreter interpreter, uint32_t pass, const struct image image,
+        struct image result, uint32_t from, uint32_t to, char ** error) {
+    const struct interpreter_band * band = interpreter.plan->bands + pass;
+    const char * transformation_error;
+    uint32_t failed_stage;
+
+    if ((transformation_error = fusion_run_rows(band->fusion, image, result, from, to,
+            interpreter.pool ? pool_host(interpreter.pool) : NULL, &failed_stage))) {
+        return interpreter_step_error(interpreter.plan->steps + band->first + failed_stage, transformation_error, error);
+    }
+
+    return NULL;
+}
+
+const char * interpreter_run_sequence(const struct interpreter interpreter, struct sequence * sequence,
+        struct image * image, const struct cancel * cancel, char ** error) {
+    const struct cancel * previous = cancel_enter(cancel);
+    const struct fusion * local = interpreter.plan->local;
+    const char * transformation_error, * result;
+    uint32_t failed_stage;
+
+    if (local && (transformation_error = sequence_apply(sequence, local, image,
+            interpreter.pool ? pool_host(interpreter.pool) : NULL, &failed_stage))) {
+        result = interpreter_step_error(interpreter.plan->steps + failed_stage, transformation_error, error);
+    } else {
+        result = interpreter_run_steps(interpreter, image, local ? local->count : 0, NULL, error);
+    }
+
+    cancel_enter(previous);
+    return result;
+}
+
+bool interpreter_matrix_is_identity(const double matrix[4]) {
+    return fabs(matrix[0] - 1) < 1e-9 && fabs(matrix[1]) < 1e-9
+        && fabs(matrix[2]) < 1e-9 && fabs(matrix[3] - 1) < 1e-9;
+}
+
+/* Builds affine() call of host standard library */
+struct ast_transformation interpreter_affine_transformation(const double matrix[4], struct ast_position pos) {
+    struct ast_transformation_args * args = NULL;
+    char * number;
+    uint32_t i;
+
+    for (i = 4; i > 0; --i) {
+        number = malloc(sizeof(char) * 32);
+        sprintf(number, "%.17g", fabs(matrix[i - 1]) < 1e-12 ? 0 : matrix[i - 1]);
+
+        args = ast_transformation_args_new(ast_literal_create(L_FLOATING, number, pos), args);
+    }
+
+    return ast_transformation_create(NULL, strdup("affine"), args, pos);
+}
+
+/* Steps of rotate module that map like exact matrices without resampling */
+struct interpreter_exact {
+    double matrix[4];
+    const char * names[2]; /* applied in order, second one is NULL unless two steps are needed */
+    const char * degrees[2]; /* argument of step, NULL if it takes none */
+};
+
+#define INTERPRETER_EXACT_COUNT (7)
+
+static const struct interpreter_exact interpreter_exact_steps[INTERPRETER_EXACT_COUNT] = {
+    {{0, -1, 1, 0}, {"rotate", NULL}, {"90", NULL}},
+    {{-1, 0, 0, -1}, {"rotate", NULL}, {"180", NULL}},
+    {{0, 1, -1, 0}, {"rotate", NULL}, {"270", NULL}},
+    {{0, 1, 1, 0}, {"transpose", NULL}, {NULL, NULL}},
+    {{-1, 0, 0, 1}, {"flip_horizontal", NULL}, {NULL, NULL}},
+    {{1, 0, 0, -1}, {"flip_vertical", NULL}, {NULL, NULL}},
+    {{0, -1, -1, 0}, {"transpose", "rotate"}, {NULL, "180"}}
+};
+
+/* Adds steps of rotate module mapping like `matrix` to reversed `result`,
+ * false if matrix needs resampling or rotate module cannot be loaded
+ */
+bool interpreter_exact_transformations(struct interpreter * interpreter, const double matrix[4],
+        struct ast_position pos, struct ast_script ** result) {
+    const struct interpreter_exact * exact = NULL;
+    struct ast_transformation_args * args;
+    uint32_t i;
+
+    if (!remap_matrix_is_exact(matrix)) {
+        return false;
+    }
+
+    for (i = 0; i < INTERPRETER_EXACT_COUNT && !exact; ++i) {
+        if (matrix[0] == interpreter_exact_steps[i].matrix[0] && matrix[1] == interpreter_exact_steps[i].matrix[1]
+         && matrix[2] == interpreter_exact_steps[i].matrix[2] && matrix[3] == interpreter_exact_steps[i].matrix[3]) {
+            exact = interpreter_exact_steps + i;
+        }
+    }
+
+    if (!exact) {
+        return false;
+    }
+
+    for (i = 0; i < 2 && exact->names[i]; ++i) {
+        if (interpreter_load_symbol(interpreter, "rotate", exact->names[i])) {
+            return false;
+        }
+    }
+
+    for (i = 0; i < 2 && exact->names[i]; ++i) {
+        args = exact->degrees[i]
+            ? ast_transformation_args_new(ast_literal_create(L_INTEGER, strdup(exact->degrees[i]), pos), NULL)
+            : NULL;
+
+        *result = ast_script_new(ast_transformation_create(strdup("rotate"), strdup(exact->names[i]), args, pos), *result);
+    }
+
+    return true;
+}
+
+void interpreter_merge_add(struct interpreter_merge * merge, enum interpreter_merge_kind kind,
+        const struct ast_transformation transformation, const double matrix[4], const struct lut * lut) {
+    double composed[4];
+
+    if (merge->count == 0) {
+        merge->kind = kind;
+        memcpy(merge->matrix, matrix, sizeof(double) * 4);
+        merge->lut = *lut;
+    } else if (kind == INTERPRETER_MERGE_AFFINE) {
+        composed[0] = matrix[0] * merge->matrix[0] + matrix[1] * merge->matrix[2];
+        composed[1] = matrix[0] * merge->matrix[1] + matrix[1] * merge->matrix[3];
+        composed[2] = matrix[2] * merge->matrix[0] + matrix[3] * merge->matrix[2];
+        composed[3] = matrix[2] * merge->matrix[1] + matrix[3] * merge->matrix[3];
+        memcpy(merge->matrix, composed, sizeof(double) * 4);
+    } else {
+        lut_compose(&merge->lut, lut);
+    }
+
+    merge->steps = ast_script_new(ast_transformation_clone(transformation), merge->steps);
+    ++merge->count;
+}
+
+/* Moves pending run to reversed `result`: drops it if it is identity, replaces geometric steps
+ * with exact steps of rotate module if they only permute and flip axes, otherwise with one affine()
+ */
+const char * interpreter_merge_flush(struct interpreter * interpreter, struct interpreter_merge * merge, struct ast_script ** result) {
+    struct ast_script * last;
+    const char * error = NULL;
+
+    for (last = merge->steps; last && last->next; last = last->next);
+
+    if ((merge->kind == INTERPRETER_MERGE_AFFINE && interpreter_matrix_is_identity(merge->matrix))
+     || (merge->kind == INTERPRETER_MERGE_LUT && lut_is_identity(&merge->lut))) {
+        ast_script_delete(merge->steps);
+    } else if (merge->kind == INTERPRETER_MERGE_AFFINE && merge->count > 1
+            && interpreter_exact_transformations(interpreter, merge->matrix, last->transformation.pos, result)) {
+        ast_script_delete(merge->steps);
+    } else if (merge->kind == INTERPRETER_MERGE_AFFINE && merge->count > 1) {
+        if ((error = interpreter_load_symbol(interpreter, NULL, "affine"))) {
+            error = interpreter_print_positional_error(&interpreter->error, last->transformation.pos,
+                "cannot load transformation", error);
+        } else {
+            *result = ast_script_new(interpreter_affine_transformation(merge->matrix, last->transformation.pos), *result);
+        }
+
+        ast_script_delete(merge->steps);
+    } else if (last) {
+        last->next = *result;
+        *result = merge->steps;
+    }
+
+    merge->kind = INTERPRETER_MERGE_NONE;
+    merge->steps = NULL;
+    merge->count = 0;
+    return error;
+}
+
+/* Rewrites script: drops identity steps and idempotent repeats,
+ * merges consecutive geometric steps into exact steps or one affine resampling
+ * and drops runs of lookup table steps composed to identity
+ */
+const char * interpreter_optimize(struct interpreter * interpreter) {
+    enum interpreter_merge_kind kind = INTERPRETER_MERGE_NONE;
+    struct module_descriptor descriptor;
+    struct interpreter_merge merge;
+    struct ast_script * result = NULL;
     const struct ast_script * next;
-    struct value * args;
+    const char * error = NULL;
+    double matrix[4];
+    struct lut lut;
+
+    struct value * argv;
     uint32_t argc;
 
-    for (next = interpreter.script; next; next = next->next) {
-        transformation = next->transformation;
+    ast_script_delete(interpreter->optimized);
+    interpreter->optimized = NULL;
+
+    merge.kind = INTERPRETER_MERGE_NONE;
+    merge.steps = NULL;
+    merge.count = 0;
+
+    for (next = interpreter->script; next; next = next->next) {
+        argv = interpreter_collect_args(*interpreter, &argc, next->transformation);
+        error = interpreter_load_descriptor(*interpreter, &descriptor, next->transformation);
+
+        if (!error && descriptor.specialize) {
+            error = descriptor.specialize(&descriptor, argc, argv);
+        }
+
+        if (!error) {
+            kind = descriptor.affine ? INTERPRETER_MERGE_AFFINE
+                : descriptor.lut ? INTERPRETER_MERGE_LUT
+                : INTERPRETER_MERGE_NONE;
+        }
+
+        if (!error && kind == INTERPRETER_MERGE_AFFINE) {
+            error = descriptor.affine(matrix, argc, argv);
+        } else if (!error && kind == INTERPRETER_MERGE_LUT) {
+            error = descriptor.lut(lut.tables, argc, argv);
+        }
+
+        interpreter_delete_args(argc, argv);
+
+        if (error) {
+            error = interpreter_print_positional_error(&interpreter->error, next->transformation.pos,
+                "invalid transformation", error);
+            break;
+        }
+
+        if (descriptor.flags & MODULE_IDENTITY) {
+            continue;
+        }
+
+        if ((kind != merge.kind || kind == INTERPRETER_MERGE_NONE)
+         && (error = interpreter_merge_flush(interpreter, &merge, &result))) {
+            break;
+        }
+
+        if (kind != INTERPRETER_MERGE_NONE) {
+            interpreter_merge_add(&merge, kind, next->transformation, matrix, &lut);
+            continue;
+        }
+
+        if ((descriptor.flags & MODULE_IDEMPOTENT) && result
+         && ast_transformation_equals(result->transformation, next->transformation)) {
+            continue;
+        }
+
+        result = ast_script_new(ast_transformation_clone(next->transformation), result);
+    }
+
+    if (!error) {
+        error = interpreter_merge_flush(interpreter, &merge, &result);
+    }
+
+    if (error) {
+        ast_script_delete(merge.steps);
+        ast_script_delete(result);
+        return error;
+    }
+
+    interpreter->optimized = ast_script_reverse(result);
+    return NULL;
+}
+
+/* Reads optional descriptor of transformation, missing one describes an opaque step */
+const char * interpreter_load_descriptor(
+    const struct interpreter interpreter,
+    struct module_descriptor * descriptor,
+    const struct ast_transformation transformation
+) {
+    const struct module_descriptor * exported;
+    char * symbol_name;
+
+    memset(descriptor, 0, sizeof(struct module_descriptor));
+    descriptor->size = sizeof(struct module_descriptor);
+    descriptor->abi_version = MODULE_ABI_VERSION;
+    descriptor->access = MODULE_ACCESS_OPAQUE;
+    descriptor->layouts = MODULE_LAYOUT_RGB24;
+
+    symbol_name = malloc(sizeof(char) * (strlen(transformation.name) + strlen(MODULE_DESCRIPTOR_SUFFIX) + 1));
+    sprintf(symbol_name, "%s%s", transformation.name, MODULE_DESCRIPTOR_SUFFIX);
+
+    if (interpreter_do_load_symbol((void **) &exported, interpreter_ids_find_module(interpreter.identifiers,
+            transformation.module), symbol_name)) {
+        exported = NULL;
+    }
+
+    free(symbol_name);
+
+    if (!exported) {
+        return NULL;
+    }
+
+    if (exported->abi_version != MODULE_ABI_VERSION) {
+        return "unsupported module ABI version";
+    }
+
+    /* fields unknown to the module stay zeroed, fields unknown to the interpreter are ignored */
+    memcpy(descriptor, exported, exported->size < sizeof(struct module_descriptor)
+        ? exported->size : sizeof(struct module_descriptor));
+    descriptor->size = sizeof(struct module_descriptor);
+
+    if (!(descriptor->layouts & MODULE_LAYOUT_RGB24)) {
+        return "transformation does not support RGB24 pixel layout";
+    }
+
+    return NULL;
+}
 
-        args = interpreter_collect_args(interpreter, &argc, transformation);
-        *((void **) (&transformation_function)) = interpreter_ids_lookup(
-            interpreter.identifiers,
-            transformation.module,
-            transformation.name
+const char * interpreter_plan_compile(struct interpreter * interpreter) {
+    struct interpreter_plan * plan = malloc(sizeof(struct interpreter_plan));
+    struct snapshot_key prefix = { { 0, 0 } };
+    const struct ast_script * next;
+    struct interpreter_step * step;
+    const char * error;
+
+    interpreter_plan_delete(interpreter->plan);
+    interpreter->plan = plan;
+
+    plan->count = 0;
+    plan->passes_saved = 0;
+    plan->local = NULL;
+    plan->bands = NULL;
+    plan->bands_count = 0;
+    for (next = interpreter->optimized; next; next = next->next) {
+        ++plan->count;
+    }
+
+    plan->steps = malloc(sizeof(struct interpreter_step) * plan->count);
+
+    /* files are hashed once, prefixes of optimized script chain statements to them */
+    if (interpreter->snapshots) {
+        prefix.hash[0] = interpreter_files_hash(*interpreter, SNAPSHOT_SEED_0);
+        prefix.hash[1] = interpreter_files_hash(*interpreter, SNAPSHOT_SEED_1);
+    }
+
+    for (next = interpreter->optimized, step = plan->steps; next; next = next->next, ++step) {
+        if (interpreter->snapshots) {
+            prefix.hash[0] = ast_transformation_hash(&next->transformation, prefix.hash[0]);
+            prefix.hash[1] = ast_transformation_hash(&next->transformation, prefix.hash[1]);
+        }
+
+        step->prefix = prefix;
+        step->transformation = &next->transformation;
+        step->fusion = NULL;
+        step->lut = NULL;
+        step->argv = interpreter_collect_args(*interpreter, &step->argc, next->transformation);
+
+        *((void **) (&step->function)) = interpreter_ids_lookup(
+            interpreter->identifiers,
+            next->transformation.module,
+            next->transformation.name
         )->symbol;
 
-        transformation_error = transformation_function(image, argc, args);
-        interpreter_delete_args(argc, args);
+        error = interpreter_load_descriptor(*interpreter, &step->descriptor, next->transformation);
 
-        if (transformation_error) {
-            free(transformation_name);
+        if (!error && step->descriptor.specialize) {
+            error = step->descriptor.specialize(&step->descriptor, step->argc, step->argv);
+        }
 
-            transformation_name = malloc(sizeof(char) * ((transformation.module
-                ? strlen(transformation.module) + 1 : 0) + strlen(transformation.name) + 1));
+        if (!error && step->descriptor.lut) {
+            step->lut = malloc(sizeof(struct lut));
+            error = step->descriptor.lut(step->lut->tables, step->argc, step->argv);
+        }
 
-            if (transformation.module) {
-                sprintf(transformation_name, "%s.%s", transformation.module, transformation.name);
-            } else {
-                sprintf(transformation_name, "%s", transformation.name);
-            }
+        if (!error && step->descriptor.affine) {
+            error = interpreter_step_remap(*interpreter, step);
+        }
 
-            return interpreter_print_positional_error(transformation.pos, transformation_name, transformation_error);
+        if (error) {
+            plan->count = step - plan->steps + 1;
+            return interpreter_print_positional_error(&interpreter->error, next->transformation.pos,
+                "invalid transformation", error);
         }
     }
 
+    interpreter_plan_compose(plan);
+    interpreter_plan_fuse(plan);
+    interpreter_plan_localize(plan);
+    interpreter_plan_band(plan);
     return NULL;
 }
 
-struct interpreter_ids *
-interpreter_ids_new(const char * module, const char * name, void * handle, void * symbol, struct interpreter_ids * next) {
+/* Geometric steps which resample image run from cached inverse mapping, exact ones keep their function */
+const char * interpreter_step_remap(const struct interpreter interpreter, struct interpreter_step * step) {
+    double matrix[4];
+    const char * error;
+    uint32_t i;
+
+    if ((error = step->descriptor.affine(matrix, step->argc, step->argv))) {
+        return error;
+    }
+
+    if (remap_matrix_is_exact(matrix)) {
+        return NULL;
+    }
+
+    interpreter_delete_args(step->argc, step->argv);
+
+    step->function = remap_transformation;
+    step->argc = 5;
+    step->argv = malloc(sizeof(struct value) * 5);
+    step->argv[0] = value_from_identifier(interpreter.remaps);
+
+    for (i = 0; i < 4; ++i) {
+        step->argv[i + 1] = value_from_floating(matrix[i]);
+    }
+
+    return NULL;
+}
+
+/* Merges runs of lookup table steps, merged step applies composed tables in place */
+void interpreter_plan_compose(struct interpreter_plan * plan) {
+    struct interpreter_step * step, * last = NULL;
+    uint32_t i;
+
+    for (i = 0, step = plan->steps; i < plan->count; ++i, ++step) {
+        if (last && last->lut && step->lut) {
+            lut_compose(last->lut, step->lut);
+            free(step->lut);
+            interpreter_delete_args(step->argc, step->argv);
+
+            /* composed step makes the image of the merged one */
+            last->prefix = step->prefix;
+
+            ++plan->passes_saved;
+            continue;
+        }
+
+        last = last ? last + 1 : plan->steps;
+        *last = *step;
+    }
+
+    plan->count = last ? last - plan->steps + 1 : 0;
+
+    for (i = 0, step = plan->steps; i < plan->count; ++i, ++step) {
+        if (!step->lut) {
+            continue;
+        }
+
+        interpreter_delete_args(step->argc, step->argv);
+
+        step->function = lut_transformation;
+        step->descriptor = lut_descriptor;
+        step->argc = 1;
+        step->argv = malloc(sizeof(struct value));
+        step->argv[0] = value_from_identifier(step->lut);
+    }
+}
+
+/* Groups maximal runs of fusable steps, halo of a run is bounded */
+void interpreter_plan_fuse(struct interpreter_plan * plan) {
+    struct fusion_stage * stages = malloc(sizeof(struct fusion_stage) * plan->count);
+    struct interpreter_step * step;
+    uint32_t i, count, halo;
+
+    for (i = 0; i < plan->count; i += count > 0 ? count : 1) {
+        for (count = 0, halo = 0; i + count < plan->count; ++count) {
+            step = plan->steps + i + count;
+
+            if (!fusion_is_fusable(&step->descriptor)) {
+                break;
+            }
+
+            stages[count] = fusion_stage_create(&step->descriptor, step->argc, step->argv);
+
+            if (halo + stages[count].radius > FUSION_MAX_HALO) {
+                break;
+            }
+
+            halo += stages[count].radius;
+        }
+
+        if (count > 1) {
+            plan->steps[i].fusion = fusion_new(stages, count);
+            plan->passes_saved += count - 1;
+        }
+    }
+
+    free(stages);
+}
+
+/* Groups the longest leading run of steps computable region by region, geometric and global steps end it */
+void interpreter_plan_localize(struct interpreter_plan * plan) {
+    struct fusion_stage * stages = malloc(sizeof(struct fusion_stage) * (plan->count > 0 ? plan->count : 1));
+    struct interpreter_step * step;
+    uint32_t count, halo;
+
+    for (count = 0, halo = 0, step = plan->steps; count < plan->count; ++count, ++step) {
+        if (!fusion_is_fusable(&step->descriptor)) {
+            break;
+        }
+
+        stages[count] = fusion_stage_create(&step->descriptor, step->argc, step->argv);
+
+        if (halo + stages[count].radius > SEQUENCE_MAX_HALO) {
+            break;
+        }
+
+        halo += stages[count].radius;
+    }
+
+    if (count > 0) {
+        plan->local = fusion_new(stages, count);
+    }
+
+    free(stages);
+}
+
+/* Splits the leading run of steps computable region by region into passes, fused runs are kept whole */
+void interpreter_plan_band(struct interpreter_plan * plan) {
+    struct fusion_stage stage;
+    struct interpreter_step * step;
+    uint32_t i;
+
+    plan->bands = malloc(sizeof(struct interpreter_band) * (plan->count > 0 ? plan->count : 1));
+
+    for (i = 0; i < plan->count && fusion_is_fusable(&plan->steps[i].descriptor); ++plan->bands_count) {
+        step = plan->steps + i;
+        plan->bands[plan->bands_count].first = i;
+
+        if (step->fusion) {
+            plan->bands[plan->bands_count].fusion = fusion_new(step->fusion->stages, step->fusion->count);
+            i += step->fusion->count;
+        } else {
+            stage = fusion_stage_create(&step->descriptor, step->argc, step->argv);
+            plan->bands[plan->bands_count].fusion = fusion_new(&stage, 1);
+            ++i;
+        }
+    }
+}
+
+void interpreter_plan_delete(struct interpreter_plan * plan) {
+    uint32_t i;
+
+    if (!plan) {
+        return;
+    }
+
+    for (i = 0; i < plan->bands_count; ++i) {
+        fusion_delete(plan->bands[i].fusion);
+    }
+
+    free(plan->bands);
+    fusion_delete(plan->local);
+
+    for (i = 0; i < plan->count; ++i) {
+        fusion_delete(plan->steps[i].fusion);
+        free(plan->steps[i].lut);
+        interpreter_delete_args(plan->steps[i].argc, plan->steps[i].argv);
+    }
+
+    free(plan->steps);
+    free(plan);
+}
+
+/* FNV-1a hash of module and name, NULL module is distinct from any string */
+uint32_t interpreter_ids_hash(const char * module, const char * name) {
+    uint32_t hash = 2166136261u;
+
+    if (module) {
+        for (; *module; ++module) {
+            hash = (hash ^ (uint8_t) *module) * 16777619u;
+        }
+
+        hash = (hash ^ '.') * 16777619u;
+    }
+
+    for (; *name; ++name) {
+        hash = (hash ^ (uint8_t) *name) * 16777619u;
+    }
+
+    return hash;
+}
+
+bool interpreter_ids_module_equals(const char * a, const char * b) {
+    return a == NULL || b == NULL ? a == b : strcmp(a, b) == 0;
+}
+
+struct interpreter_ids * interpreter_ids_new(void) {
     struct interpreter_ids * interpreter_ids = malloc(sizeof(struct interpreter_ids));
 
-    interpreter_ids->module = module;
-    interpreter_ids->name = name;
-    interpreter_ids->handle = handle;
-    interpreter_ids->symbol = symbol;
-    interpreter_ids->next = next;
+    interpreter_ids->buckets_count = 16;
+    interpreter_ids->buckets = calloc(interpreter_ids->buckets_count, sizeof(struct interpreter_symbol *));
+    interpreter_ids->count = 0;
+    interpreter_ids->modules = NULL;
 
     return interpreter_ids;
 }
 
 void interpreter_ids_delete(struct interpreter_ids * interpreter_ids) {
-    struct interpreter_ids * next = interpreter_ids;
-    struct interpreter_ids * current;
+    struct interpreter_symbol * next_symbol, * current_symbol;
+    struct interpreter_module * next_module, * current_module;
+    uint32_t i;
+
+    for (i = 0; i < interpreter_ids->buckets_count; ++i) {
+        next_symbol = interpreter_ids->buckets[i];
 
-    while (next) {
-        current = next;
-        next = current->next;
+        while (next_symbol) {
+            current_symbol = next_symbol;
+            next_symbol = current_symbol->next;
 
-        dlclose(current->handle);
-        free(current);
+            free(current_symbol);
+        }
+    }
+
+    next_module = interpreter_ids->modules;
+
+    while (next_module) {
+        current_module = next_module;
+        next_module = current_module->next;
+
+        interpreter_ids_close_module(current_module);
     }
+
+    free(interpreter_ids->buckets);
+    free(interpreter_ids);
 }
 
-const struct interpreter_ids *
+const struct interpreter_symbol *
 interpreter_ids_lookup(const struct interpreter_ids * interpreter_ids, const char * module, const char * name) {
-    const struct interpreter_ids * next;
-    bool module_equals;
+    const struct interpreter_symbol * next = interpreter_ids->buckets[
+        interpreter_ids_hash(module, name) & (interpreter_ids->buckets_count - 1)];
 
-    for (next = interpreter_ids; next; next = next->next) {
-        module_equals = next->module == NULL || module == NULL
-            ? next->module == module : strcmp(next->module, module) == 0;
+    for (; next; next = next->next) {
+        if (interpreter_ids_module_equals(next->module, module) && strcmp(next->name, name) == 0) {
+            return next;
+        }
+    }
+
+    return NULL;
+}
 
-        if (module_equals && strcmp(next->name, name) == 0) {
+void interpreter_ids_insert(struct interpreter_ids * interpreter_ids, const char * module, const char * name, void * symbol) {
+    struct interpreter_symbol * entry, * next, ** buckets;
+    uint32_t i, bucket;
+
+    /* keep load factor under 1, buckets count is a power of two */
+    if (interpreter_ids->count >= interpreter_ids->buckets_count) {
+        buckets = calloc(2 * interpreter_ids->buckets_count, sizeof(struct interpreter_symbol *));
+
+        for (i = 0; i < interpreter_ids->buckets_count; ++i) {
+            for (entry = interpreter_ids->buckets[i]; entry; entry = next) {
+                next = entry->next;
+                bucket = interpreter_ids_hash(entry->module, entry->name) & (2 * interpreter_ids->buckets_count - 1);
+
+                entry->next = buckets[bucket];
+                buckets[bucket] = entry;
+            }
+        }
+
+        free(interpreter_ids->buckets);
+        interpreter_ids->buckets = buckets;
+        interpreter_ids->buckets_count *= 2;
+    }
+
+    bucket = interpreter_ids_hash(module, name) & (interpreter_ids->buckets_count - 1);
+
+    entry = malloc(sizeof(struct interpreter_symbol));
+    entry->module = module;
+    entry->name = name;
+    entry->symbol = symbol;
+    entry->next = interpreter_ids->buckets[bucket];
+
+    interpreter_ids->buckets[bucket] = entry;
+    ++interpreter_ids->count;
+}
+
+struct interpreter_module *
+interpreter_ids_find_module(const struct interpreter_ids * interpreter_ids, const char * module) {
+    struct interpreter_module * next;
+
+    for (next = interpreter_ids->modules; next; next = next->next) {
+        if (interpreter_ids_module_equals(next->name, module)) {
             return next;
         }
     }
 
     return NULL;
 }
+
+struct interpreter_module *
+interpreter_ids_add_module(struct interpreter_ids * interpreter_ids, const char * module,
+        void * handle, const struct builtin_module * builtin) {
+    struct interpreter_module * loaded = malloc(sizeof(struct interpreter_module));
+
+    loaded->name = module;
+    loaded->handle = handle;
+    loaded->builtin = builtin;
+    loaded->next = interpreter_ids->modules;
+
+    interpreter_ids->modules = loaded;
+    return loaded;
+}
+
+void interpreter_ids_close_module(struct interpreter_module * loaded) {
+    if (loaded->handle) {
+        dlclose(loaded->handle);
+    }
+
+    free(loaded);
+}
+
+/* Unloads the most recently added module */
+void interpreter_ids_remove_module(struct interpreter_ids * interpreter_ids, struct interpreter_module * loaded) {
+    interpreter_ids->modules = loaded->next;
+    interpreter_ids_close_module(loaded);
+}
@@ -1,19 +1,89 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdio.h>
+
 #include "ast.h"
 #include "image.h"
 
 struct interpreter_ids;
+struct interpreter_plan;
+struct remap_cache;
+struct pool;
+struct store;
+struct sequence;
+struct cancel;
 
 struct interpreter {
     const char * modules_prefix;
+    uint32_t threads; /* size of worker pool, 0 is CPUs available to the process */
 
     const struct ast_script * script;
     struct interpreter_ids * identifiers;
+
+    /* rewritten script, built by interpreter_process_script */
+    struct ast_script * optimized;
+
+    /* compiled by interpreter_process_script */
+    struct interpreter_plan * plan;
+
+    /* inverse mappings of geometric steps, shared by runs */
+    struct remap_cache * remaps;
+
+    /* workers shared with modules, created by interpreter_process_script unless set before */
+    struct pool * pool;
+
+    /* intermediate images are kept there and runs resume from them if set before
+     * interpreter_process_script (see snapshot.h), owned by caller
+     */
+    struct store * snapshots;
+
+    /* message of the last failed preprocessing, owned by interpreter */
+    char * error;
 };
 
 struct interpreter interpreter_create(const struct ast_script * script);
 void interpreter_discard(struct interpreter interpreter);
 
 const char * interpreter_process_script(struct interpreter * interpreter);
-const char * interpreter_run(const struct interpreter interpreter, struct image * image);
+
+/* May be called from several threads at once, message of failure is kept in `*error` to be freed by caller */
+const char * interpreter_run(const struct interpreter interpreter, struct image * image, char ** error);
+
+/* Like interpreter_run, stops within a row or a tile of work once `cancel` (may be NULL) asks so (see cancel.h),
+ * the step running then fails with message of the token
+ */
+const char * interpreter_run_cancellable(const struct interpreter interpreter, struct image * image,
+    const struct cancel * cancel, char ** error);
+
+/* Runs steps of plan from `first` on whole image, snapshots are not kept */
+const char * interpreter_run_from(const struct interpreter interpreter, struct image * image, uint32_t first, char ** error);
+
+/* Count of leading passes of plan computable band by band (pointwise and stencil steps providing `region`,
+ * a fused run is one pass), count of steps they make is set in `steps`
+ */
+uint32_t interpreter_band_passes(const struct interpreter interpreter, uint32_t * steps);
+
+/* Computes rows [from, to) of `result` by band pass `pass` from `image` of the same size,
+ * rows of `image` within halo of the pass around them are read
+ */
+const char * interpreter_run_band(const struct interpreter interpreter, uint32_t pass, const struct image image,
+    struct image result, uint32_t from, uint32_t to, char ** error);
+
+/* Runs a frame of `sequence` (see sequence.h): leading pointwise and stencil steps providing `region`
+ * recompute only tiles changed since the previous frame, the rest of script runs on whole frame.
+ * Frames of a sequence go one at a time, snapshots are not kept, `cancel` is as in interpreter_run_cancellable.
+ */
+const char * interpreter_run_sequence(const struct interpreter interpreter, struct sequence * sequence,
+    struct image * image, const struct cancel * cancel, char ** error);
+
+/* Prints optimized script */
+void interpreter_print_script(const struct interpreter interpreter, FILE * file);
+
+/* Count of passes over image avoided by fusing steps of compiled plan */
+uint32_t interpreter_passes_saved(const struct interpreter interpreter);
+
+/* Hash of processed script and identities of files it runs (executable or library with
+ * built-in modules, shared objects of other modules), so equal hashes give equal results
+ */
+uint64_t interpreter_script_hash(const struct interpreter interpreter, uint64_t seed);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "image.h"
+#include "value.h"
+#include "module.h"
+
+/* Per-channel lookup tables of a composed run of pointwise steps */
+struct lut {
+    uint8_t tables[3][256]; /* red, green, blue */
+};
+
+/* Descriptor of lookup table steps, they are pointwise and fusable */
+extern const struct module_descriptor lut_descriptor;
+
+bool lut_is_identity(const struct lut * lut);
+
+/* Makes `lut` apply `next` after itself */
+void lut_compose(struct lut * lut, const struct lut * next);
+
+void lut_apply(const struct lut * lut, const struct pixel * src, struct pixel * dst, uint32_t count);
+
+/* Step functions, the only argument is identifier pointing to struct lut */
+const char * lut_transformation(struct image * image, uint32_t argc, const struct value * argv);
+const char * lut_region(const struct module_region * region, uint32_t argc, const struct value * argv);
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
@@ -7,15 +9,16 @@
 #include "util.h"
 #include "parser.h"
 #include "interpreter.h"
+#include "batch.h"
+#include "serve.h"
+#include "watch.h"
+#include "cache.h"
+#include "snapshot.h"
+#include "sequence.h"
+#include "shard.h"
+#include "cancel.h"
 #include "bmp.h"
 
-typedef struct yy_buffer_state * YY_BUFFER_STATE;
-
-YY_BUFFER_STATE yy_create_buffer(FILE * file, int size);
-void yy_switch_to_buffer(YY_BUFFER_STATE new_buffer);
-YY_BUFFER_STATE yy_scan_string(const char * str);
-void yy_delete_buffer(YY_BUFFER_STATE buffer);
-
 struct args {
     const char * script; /* script filename */
     const char * input; /* input BMP filename */
@@ -24,10 +27,32 @@ struct args {
     bool code; /* assume that script is code instead of filename */
     char * modules_prefix; /* optional modules prefix */
     bool help; /* print help and exit */
+    bool verbose; /* print plan statistics to stderr */
+    bool optimized; /* print optimized script to stderr */
+    uint32_t threads; /* worker pool size, 0 is CPUs available to the process */
+
+    bool batch; /* apply script to many inputs */
+    const char * output_template; /* output names of batch, see batch.h */
+    char ** inputs; /* inputs of batch, manifest on stdin if empty */
+    uint32_t inputs_count;
+    uint32_t queue_depth; /* reads and writes of batch in flight or queued requests, 0 is default */
+    uint32_t memory_limit; /* MiB of batch file contents in flight, 0 is default */
+
+    const char * socket; /* serve requests on this Unix socket instead of running script */
+    const char * watch; /* process BMP files arriving to this directory in batches */
+    bool sequence; /* inputs of batch or watch mode are frames of a sequence */
+    uint32_t shards; /* worker processes of a single run, 0 runs it in this process */
+    uint32_t deadline; /* milliseconds a run (or a file or request) may take, 0 if unlimited */
+
+    const char * cache_directory; /* results are looked up and stored in this directory */
+    uint32_t cache_size; /* MiB of cache directory, 0 is default */
+
+    const char * snapshots_directory; /* intermediate images are kept in this directory */
+    uint32_t snapshots_size; /* MiB of snapshots directory, 0 is default */
 };
 
 struct args args_create() {
-    struct args args = { NULL, "-", "-", false, NULL, false };
+    struct args args = { NULL, "-", "-", false, NULL, false, false, false, 0, false, NULL, NULL, 0, 0, 0, NULL, NULL, false, 0, 0, NULL, 0, NULL, 0 };
     return args;
 }
 
@@ -35,43 +60,275 @@ void args_discard(struct args args) {
     free(args.modules_prefix);
 }
 
-bool parse_args(struct args * args, int argc, char ** argv) {
+void print_usage(FILE * file, const char * program) {
     static const char * const usage = ""
-        "Usage: %s [-c] [-p <modules_prefix>] <script> [<input>] [<output>]\n"
+        "Usage: %s [-c] [-v] [-O] [-j <threads>] [-p <modules_prefix>] <script> [<input>] [<output>]\n"
+        "       %s -b -o <output_template> [<options>] <script> [<input>...]\n"
+        "       %s --serve <socket> [-j <threads>] [-q <depth>] [-p <modules_prefix>] [--deadline <milliseconds>]\n"
+        "       %s --watch <directory> -o <output_template> [<options>] <script>\n";
+
+    static const char * const arguments = ""
         "Arguments:\n"
         "  - script - script filename\n"
-        "  - input - input BMP filename or stdin if is - (default is -)\n"
-        "  - output - output BMP filename or stdout if is - (default is -)\n"
+        "  - input - input BMP filename or stdin if is - (default is -),\n"
+        "    in batch mode BMP files, directories of them or a manifest with one path per line on stdin if omitted\n"
+        "  - output - output BMP filename or stdout if is - (default is -)\n";
+
+    static const char * const options = ""
         "Options:\n"
         "  - -c - assume that script is code instead of filename\n"
+        "  - -v - print plan statistics to stderr\n"
+        "  - -O - print optimized script to stderr\n"
+        "  - -j <threads> - set count of worker threads (default is count of CPUs available to the process)\n"
         "  - -p <modules_prefix> - set prefix for module files lookup "
         "(for example: if is ./, then all modules will be searching only in the working directory)\n";
 
+    static const char * const batch_options = ""
+        "  - -b - batch mode: parse and load script once, then apply it to every input\n"
+        "  - -o <output_template> - output filenames of batch: %n is input name without extension,\n"
+        "    %d is its directory, %i is index of input, %% is percent sign (for example: out/%n.bmp)\n"
+        "  - -q <depth> - set count of batch reads and writes in flight (default is 32)\n"
+        "    or of queued requests in serve mode (default is 64)\n"
+        "  - -m <megabytes> - limit batch files read ahead or waiting to be written (default is 256)\n";
+
+    static const char * const serve_options = ""
+        "  - --serve <socket> - serve requests of clients (see image-transformer-client) on Unix socket,\n"
+        "    scripts are compiled on first use and kept, -j sets count of workers\n"
+        "  - --watch <directory> - process BMP files as soon as they are written or moved to directory,\n"
+        "    files arriving together are run like a batch, outputs are renamed into place when complete\n";
+
+    static const char * const sequence_options = ""
+        "  - --sequence - inputs of batch or watch mode are frames of a sequence in their order, only tiles\n"
+        "    changed since the previous frame are recomputed by leading pointwise and stencil steps\n";
+
+    static const char * const shards_options = ""
+        "  - --shards <count> - run a single image in worker processes sharing it in memory, each one owning\n"
+        "    a band of rows and pinned to a slice of CPUs (up to 64, not with other modes, cache or snapshots)\n";
+
+    static const char * const deadline_options = ""
+        "  - --deadline <milliseconds> - stop a run, a file of batch or a request of serve mode that takes longer\n"
+        "    within a row or a tile of work (exit code or status is 10, not with shards)\n";
+
+    static const char * const cache_options = ""
+        "  - --cache <directory> - take results from cache directory when input pixels, script and modules\n"
+        "    are the same as before, store new results there (in every mode)\n"
+        "  - --cache-size <megabytes> - limit cache directory, the least recently used results are removed\n"
+        "    (default is 1024)\n";
+
+    static const char * const snapshots_options = ""
+        "  - --snapshots <directory> - keep image after every pass of script in directory, a run of script\n"
+        "    with edited tail resumes from the longest prefix it shares with a previous run\n"
+        "  - --snapshots-size <megabytes> - limit snapshots directory (default is 4096)\n";
+
+    fprintf(file, usage, program, program, program, program);
+    fputs(arguments, file);
+    fputs(options, file);
+    fputs(batch_options, file);
+    fputs(serve_options, file);
+    fputs(sequence_options, file);
+    fputs(shards_options, file);
+    fputs(deadline_options, file);
+    fputs(cache_options, file);
+    fputs(snapshots_options, file);
+}
+
+bool parse_args(struct args * args, int argc, char ** argv) {
+    static const struct option long_options[] = {
+        { "serve", required_argument, NULL, 's' },
+        { "watch", required_argument, NULL, 'w' },
+        { "sequence", no_argument, NULL, 'F' },
+        { "shards", required_argument, NULL, 'N' },
+        { "deadline", required_argument, NULL, 'D' },
+        { "cache", required_argument, NULL, 'C' },
+        { "cache-size", required_argument, NULL, 'M' },
+        { "snapshots", required_argument, NULL, 'S' },
+        { "snapshots-size", required_argument, NULL, 'Z' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    char * end;
     uint32_t i;
+    long value;
     int opt;
 
-    while ((opt = getopt(argc, argv, "cp:h")) != -1) {
+    while ((opt = getopt_long(argc, argv, "cvObo:q:m:j:p:h", long_options, NULL)) != -1) {
         switch (opt) {
         case 'c':
             args->code = true;
             break;
 
+        case 'v':
+            args->verbose = true;
+            break;
+
+        case 'O':
+            args->optimized = true;
+            break;
+
+        case 'b':
+            args->batch = true;
+            break;
+
+        case 'o':
+            args->output_template = optarg;
+            break;
+
+        case 'q':
+            value = strtol(optarg, &end, 10);
+
+            if (*optarg == '\0' || *end != '\0' || value < 1 || value > 4096) {
+                fputs("Queue depth should be a number from 1 to 4096.\n", stderr);
+                return false;
+            }
+
+            args->queue_depth = value;
+            break;
+
+        case 'm':
+            value = strtol(optarg, &end, 10);
+
+            if (*optarg == '\0' || *end != '\0' || value < 1 || value > 65536) {
+                fputs("Memory limit should be a number of megabytes from 1 to 65536.\n", stderr);
+                return false;
+            }
+
+            args->memory_limit = value;
+            break;
+
+        case 'j':
+            value = strtol(optarg, &end, 10);
+
+            if (*optarg == '\0' || *end != '\0' || value < 1 || value > 256) {
+                fputs("Thread count should be a number from 1 to 256.\n", stderr);
+                return false;
+            }
+
+            args->threads = value;
+            break;
+
         case 'p':
             args->modules_prefix = strdup(optarg);
             break;
 
+        case 's':
+            args->socket = optarg;
+            break;
+
+        case 'w':
+            args->watch = optarg;
+            break;
+
+        case 'F':
+            args->sequence = true;
+            break;
+
+        case 'N':
+            value = strtol(optarg, &end, 10);
+
+            if (*optarg == '\0' || *end != '\0' || value < 1 || value > SHARD_MAX_WORKERS) {
+                fputs("Count of shards should be a number from 1 to 64.\n", stderr);
+                return false;
+            }
+
+            args->shards = value;
+            break;
+
+        case 'D':
+            value = strtol(optarg, &end, 10);
+
+            if (*optarg == '\0' || *end != '\0' || value < 1 || value > 86400000) {
+                fputs("Deadline should be a number of milliseconds from 1 to 86400000.\n", stderr);
+                return false;
+            }
+
+            args->deadline = value;
+            break;
+
+        case 'C':
+            args->cache_directory = optarg;
+            break;
+
+        case 'M':
+            value = strtol(optarg, &end, 10);
+
+            if (*optarg == '\0' || *end != '\0' || value < 1 || value > 1048576) {
+                fputs("Cache size should be a number of megabytes from 1 to 1048576.\n", stderr);
+                return false;
+            }
+
+            args->cache_size = value;
+            break;
+
+        case 'S':
+            args->snapshots_directory = optarg;
+            break;
+
+        case 'Z':
+            value = strtol(optarg, &end, 10);
+
+            if (*optarg == '\0' || *end != '\0' || value < 1 || value > 1048576) {
+                fputs("Snapshots size should be a number of megabytes from 1 to 1048576.\n", stderr);
+                return false;
+            }
+
+            args->snapshots_size = value;
+            break;
+
         case 'h':
             args->help = true;
             break;
 
         default:
-            fprintf(stderr, usage, argv[0]);
+            print_usage(stderr, argv[0]);
             return false;
         }
     }
 
     if (args->help) {
-        printf(usage, argv[0]);
+        print_usage(stdout, argv[0]);
+        return true;
+    }
+
+    if (args->socket) {
+        if (optind < argc) {
+            fputs("There are some extra arguments on the tail, skipping.\n", stderr);
+        }
+
+        return true;
+    }
+
+    if (args->shards && (args->batch || args->watch || args->cache_directory || args->snapshots_directory || args->deadline)) {
+        fputs("Shards are used only in single runs without cache, snapshots and deadline.\n", stderr);
+        print_usage(stderr, argv[0]);
+        return false;
+    }
+
+    if (args->sequence && !args->batch && !args->watch) {
+        fputs("Sequence of frames is processed only in batch or watch mode.\n", stderr);
+        print_usage(stderr, argv[0]);
+        return false;
+    }
+
+    if (args->batch || args->watch) {
+        if (!args->output_template) {
+            fputs(args->watch ? "Output template is required in watch mode.\n" : "Output template is required in batch mode.\n", stderr);
+            print_usage(stderr, argv[0]);
+            return false;
+        }
+
+        if (optind >= argc) {
+            fputs("Script is not specified.\n", stderr);
+            print_usage(stderr, argv[0]);
+            return false;
+        }
+
+        if (args->watch && optind + 1 < argc) {
+            fputs("There are some extra arguments on the tail, skipping.\n", stderr);
+        }
+
+        args->script = argv[optind];
+        args->inputs = argv + optind + 1;
+        args->inputs_count = args->watch ? 0 : argc - optind - 1;
         return true;
     }
 
@@ -96,7 +353,7 @@ bool parse_args(struct args * args, int argc, char ** argv) {
 
     if (i - optind < 1) {
         fputs("Script is not specified.\n", stderr);
-        fprintf(stderr, usage, argv[0]);
+        print_usage(stderr, argv[0]);
         return false;
     }
 
@@ -104,29 +361,27 @@ bool parse_args(struct args * args, int argc, char ** argv) {
 }
 
 bool parse_script(struct ast_script ** result, const char * script, bool code) {
-    YY_BUFFER_STATE buffer_state;
     FILE * script_file = NULL;
-    char * error = NULL;
+    char * error;
+    bool parsed;
 
     if (code) {
-        buffer_state = yy_scan_string(script);
+        parsed = parser_parse_string(result, script, &error);
     } else {
         if (!(script_file = fopen(script, "r"))) {
             perror("Script file opening failed");
             return false;
         }
 
-        buffer_state = yy_create_buffer(script_file, 16384);
-        yy_switch_to_buffer(buffer_state);
+        parsed = parser_parse_file(result, script_file, &error);
     }
 
-    if (yyparse(result, &error)) {
+    if (!parsed) {
         fprintf(stderr, "Parsing failed: %s.\n", error);
+        free(error);
         return false;
     }
 
-    yy_delete_buffer(buffer_state);
-
     if (script_file) {
         if (fclose(script_file)) {
             perror("Script file closing failed");
@@ -137,10 +392,13 @@ bool parse_script(struct ast_script ** result, const char * script, bool code) {
     return true;
 }
 
-bool init_interpreter(struct interpreter * interpreter, const struct ast_script * script, const char * modules_prefix) {
+bool init_interpreter(struct interpreter * interpreter, const struct ast_script * script, const char * modules_prefix,
+        uint32_t threads, struct store * snapshots) {
     const char * error;
 
     *interpreter = interpreter_create(script);
+    interpreter->threads = threads;
+    interpreter->snapshots = snapshots;
 
     if (modules_prefix) {
         interpreter->modules_prefix = modules_prefix;
@@ -184,15 +442,18 @@ bool load_image(struct bmp_image * image, const char * filename) {
     return true;
 }
 
-bool run_interpreter(struct interpreter interpreter, struct image * image) {
-    const char * error;
+/* Returns exit code, a run stopped by deadline is told from other failures */
+int run_interpreter(struct interpreter interpreter, struct image * image, uint32_t deadline) {
+    const struct cancel cancel = cancel_create(deadline);
+    char * error = NULL;
 
-    if ((error = interpreter_run(interpreter, image))) {
+    if (interpreter_run_cancellable(interpreter, image, &cancel, &error)) {
         fprintf(stderr, "Interpretation failed: %s.\n", error);
-        return false;
+        free(error);
+        return cancel_check(&cancel) ? 10 : 5;
     }
 
-    return true;
+    return 0;
 }
 
 bool save_image(struct bmp_image image, const char * filename) {
@@ -224,12 +485,295 @@ bool save_image(struct bmp_image image, const char * filename) {
     return true;
 }
 
+/* Result should be freed */
+uint8_t * read_contents(const char * filename, size_t * size) {
+    bool stdinFilename = filename[0] == '-' && filename[1] == '\0';
+    size_t capacity = 1 << 16, count;
+    uint8_t * data;
+    FILE * file;
+
+    if (stdinFilename) {
+        file = stdin;
+    } else {
+        if (!(file = fopen(filename, "rb"))) {
+            perror("Input file opening failed");
+            return NULL;
+        }
+    }
+
+    data = malloc(capacity);
+    *size = 0;
+
+    while ((count = fread(data + *size, 1, capacity - *size, file)) > 0) {
+        if ((*size += count) == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+
+    if (ferror(file)) {
+        perror("Input file reading failed");
+        free(data);
+        data = NULL;
+    }
+
+    if (!stdinFilename) {
+        fclose(file);
+    }
+
+    return data;
+}
+
+bool write_contents(const uint8_t * data, size_t size, const char * filename) {
+    bool stdoutFilename = filename[0] == '-' && filename[1] == '\0';
+    FILE * file;
+
+    if (stdoutFilename) {
+        file = stdout;
+    } else {
+        if (!(file = fopen(filename, "wb"))) {
+            perror("Output file opening failed");
+            return false;
+        }
+    }
+
+    if (fwrite(data, 1, size, file) < size) {
+        perror("Output file writing failed");
+        return false;
+    }
+
+    if (!stdoutFilename) {
+        if (fclose(file)) {
+            perror("Output file closing failed");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Single input through cache: a hit is copied to output, a miss is transformed and stored. Returns exit code */
+int run_cached(const struct args args, const struct interpreter interpreter, struct cache * cache) {
+    struct bmp_image bmp_image;
+    struct cache_key key;
+    const char * error;
+    struct image image;
+    uint8_t * data;
+    size_t size;
+    FILE * stream;
+    int code;
+
+    if (!(data = read_contents(args.input, &size))) {
+        return 4;
+    }
+
+    key = cache_key_create(cache_script_key(interpreter), data, size);
+
+    if (cache_fetch_file(cache, key, args.output, &error)) {
+        free(data);
+
+        if (error) {
+            fprintf(stderr, "Output file writing failed: %s.\n", error);
+            return 6;
+        }
+
+        return 0;
+    }
+
+    if (!(stream = fmemopen(data, size, "rb"))) {
+        perror("Input file reading failed");
+        free(data);
+        return 4;
+    }
+
+    error = bmp_image_read(&bmp_image, stream);
+    fclose(stream);
+    free(data);
+
+    if (error) {
+        fprintf(stderr, "Input file reading failed: %s.\n", error);
+        return 4;
+    }
+
+    image = bmp_image_to_image(bmp_image);
+
+    if ((code = run_interpreter(interpreter, &image, args.deadline))) {
+        image_discard(image);
+        bmp_image_discard(bmp_image);
+        return code;
+    }
+
+    bmp_image_replace(&bmp_image, image);
+    image_discard(image);
+
+    /* stream terminates written contents with a null byte */
+    data = malloc(bmp_image.header.bfSize + 1);
+
+    if (!(stream = fmemopen(data, bmp_image.header.bfSize + 1, "wb"))) {
+        perror("Output file writing failed");
+        bmp_image_discard(bmp_image);
+        free(data);
+        return 6;
+    }
+
+    error = bmp_image_write(bmp_image, stream);
+    size = ftell(stream);
+    fclose(stream);
+    bmp_image_discard(bmp_image);
+
+    if (error) {
+        fprintf(stderr, "Output file writing failed: %s.\n", error);
+        free(data);
+        return 6;
+    }
+
+    if (!write_contents(data, size, args.output)) {
+        free(data);
+        return 6;
+    }
+
+    cache_store(cache, key, data, size);
+    free(data);
+    return 0;
+}
+
+struct batch create_batch(const struct args args, struct cache * cache) {
+    struct batch batch = batch_create(args.output_template);
+
+    if (args.queue_depth) {
+        batch.queue_depth = args.queue_depth;
+    }
+
+    if (args.memory_limit) {
+        batch.memory_limit = (size_t) args.memory_limit << 20;
+    }
+
+    batch.cache = cache;
+    batch.sequence = args.sequence ? sequence_new() : NULL;
+    batch.deadline = args.deadline;
+    return batch;
+}
+
+/* Returns exit code */
+int run_shards(const struct args args, const struct ast_script * script) {
+    struct interpreter interpreter;
+    struct bmp_image bmp_image;
+    struct shard * shard;
+    struct image image;
+    const char * message;
+    char * error = NULL;
+    uint32_t passes, steps;
+    int code = 0;
+
+    if (!load_image(&bmp_image, args.input)) {
+        return 4;
+    }
+
+    image = bmp_image_to_image(bmp_image);
+
+    /* workers are forked before threads of interpreter pool are created */
+    if (!(shard = shard_start(image, args.shards, script, args.modules_prefix, args.threads, &message))) {
+        fprintf(stderr, "Sharding failed: %s.\n", message);
+        image_discard(image);
+        bmp_image_discard(bmp_image);
+        return 8;
+    }
+
+    if (!init_interpreter(&interpreter, script, args.modules_prefix, args.threads, NULL)) {
+        shard_delete(shard);
+        image_discard(image);
+        bmp_image_discard(bmp_image);
+        return 3;
+    }
+
+    passes = interpreter_band_passes(interpreter, &steps);
+
+    if (args.verbose) {
+        fprintf(stderr, "Shards run %lu passes of %lu steps.\n", (unsigned long) passes, (unsigned long) steps);
+    }
+
+    if (shard_finish(shard, &image, &error) || interpreter_run_from(interpreter, &image, steps, &error)) {
+        fprintf(stderr, "Interpretation failed: %s.\n", error);
+        free(error);
+        code = 5;
+    }
+
+    shard_delete(shard);
+    interpreter_discard(interpreter);
+
+    if (code == 0) {
+        bmp_image_replace(&bmp_image, image);
+
+        if (!save_image(bmp_image, args.output)) {
+            code = 6;
+        }
+    }
+
+    image_discard(image);
+    bmp_image_discard(bmp_image);
+    return code;
+}
+
+/* Returns exit code */
+int run_watch(const struct args args, const struct interpreter interpreter, struct cache * cache) {
+    struct batch batch = create_batch(args, cache);
+    int code = watch_run(args.watch, &batch, interpreter, stderr) ? 0 : 8;
+
+    sequence_delete(batch.sequence);
+    batch_discard(batch);
+    return code;
+}
+
+/* Returns exit code */
+int run_batch(const struct args args, const struct interpreter interpreter, struct cache * cache) {
+    struct batch batch = create_batch(args, cache);
+    const char * error = NULL;
+    uint64_t computed, total;
+    uint32_t i, failed;
+
+    if (args.inputs_count == 0) {
+        error = batch_add_manifest(&batch, stdin);
+    }
+
+    for (i = 0; i < args.inputs_count && !error; ++i) {
+        if ((error = batch_add(&batch, args.inputs[i]))) {
+            fprintf(stderr, "%s: ", args.inputs[i]);
+        }
+    }
+
+    if (error) {
+        fprintf(stderr, "Batch inputs reading failed: %s.\n", error);
+        sequence_delete(batch.sequence);
+        batch_discard(batch);
+        return 4;
+    }
+
+    failed = batch_run(&batch, interpreter, stderr);
+
+    if (args.verbose || failed > 0) {
+        fprintf(stderr, "Batch processed %lu files, %lu failed.\n", (unsigned long) batch.count, (unsigned long) failed);
+    }
+
+    if (args.verbose && batch.sequence) {
+        sequence_statistics(batch.sequence, &computed, &total);
+        fprintf(stderr, "Sequence computed %lu of %lu tiles.\n", (unsigned long) computed, (unsigned long) total);
+    }
+
+    sequence_delete(batch.sequence);
+    batch_discard(batch);
+    return failed > 0 ? 7 : 0;
+}
+
 int main(int argc, char ** argv) {
     struct args args = args_create();
+    struct store * snapshots = NULL;
+    struct cache * cache = NULL;
     struct ast_script * script;
     struct interpreter interpreter;
     struct bmp_image bmp_image;
+    const char * error;
     struct image image;
+    int code;
 
     if (!parse_args(&args, argc, argv)) {
         return 1;
@@ -239,37 +783,105 @@ int main(int argc, char ** argv) {
         return 0;
     }
 
+    if (args.cache_directory) {
+        if (!(cache = cache_open(args.cache_directory,
+                args.cache_size ? (size_t) args.cache_size << 20 : CACHE_SIZE_LIMIT, &error))) {
+            fprintf(stderr, "Cache opening failed: %s.\n", error);
+            args_discard(args);
+            return 9;
+        }
+    }
+
+    if (args.socket) {
+        code = serve_run(args.socket, args.modules_prefix, args.threads, args.queue_depth, args.deadline, cache, stderr)
+            ? 0 : 8;
+
+        cache_close(cache);
+        args_discard(args);
+        return code;
+    }
+
+    if (args.snapshots_directory) {
+        if (!(snapshots = snapshot_open(args.snapshots_directory,
+                args.snapshots_size ? (size_t) args.snapshots_size << 20 : SNAPSHOT_SIZE_LIMIT, &error))) {
+            fprintf(stderr, "Snapshots opening failed: %s.\n", error);
+            cache_close(cache);
+            args_discard(args);
+            return 9;
+        }
+    }
+
     if (!parse_script(&script, args.script, args.code)) {
+        store_close(snapshots);
+        cache_close(cache);
         args_discard(args);
         return 2;
     }
 
-    if (!init_interpreter(&interpreter, script, args.modules_prefix)) {
+    if (args.shards) {
+        code = run_shards(args, script);
+
         ast_script_delete(script);
         args_discard(args);
+        return code;
+    }
+
+    /* pool threads of interpreter leave stopping signals to watch mode */
+    if (args.watch) {
+        watch_block_signals();
+    }
+
+    if (!init_interpreter(&interpreter, script, args.modules_prefix, args.threads, snapshots)) {
+        ast_script_delete(script);
+        store_close(snapshots);
+        cache_close(cache);
+        args_discard(args);
         return 3;
     }
 
+    if (args.optimized) {
+        interpreter_print_script(interpreter, stderr);
+    }
+
+    if (args.verbose) {
+        fprintf(stderr, "Composition and fusion saved %lu passes.\n", (unsigned long) interpreter_passes_saved(interpreter));
+    }
+
+    if (args.batch || args.watch || cache) {
+        code = args.watch ? run_watch(args, interpreter, cache)
+            : args.batch ? run_batch(args, interpreter, cache) : run_cached(args, interpreter, cache);
+
+        interpreter_discard(interpreter);
+        ast_script_delete(script);
+        store_close(snapshots);
+        cache_close(cache);
+        args_discard(args);
+        return code;
+    }
+
     if (!load_image(&bmp_image, args.input)) {
         interpreter_discard(interpreter);
         ast_script_delete(script);
+        store_close(snapshots);
         args_discard(args);
         return 4;
     }
 
     image = bmp_image_to_image(bmp_image);
 
-    if (!run_interpreter(interpreter, &image)) {
+    if ((code = run_interpreter(interpreter, &image, args.deadline))) {
         image_discard(image);
         bmp_image_discard(bmp_image);
         interpreter_discard(interpreter);
         ast_script_delete(script);
+        store_close(snapshots);
         args_discard(args);
-        return 5;
+        return code;
     }
 
     interpreter_discard(interpreter);
     ast_script_delete(script);
+    store_close(snapshots);
 
     bmp_image_replace(&bmp_image, image);
     image_discard(image);
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "image.h"
+#include "value.h"
+
+/* Module ABI
+ *
+ * Transformation `name` may be accompanied by an exported descriptor `name_descriptor`
+ * of type `const struct module_descriptor`. The descriptor tells the interpreter how the
+ * transformation accesses pixels, so steps can be scheduled safely. Transformations
+ * without descriptor are treated as opaque whole-frame calls.
+ */
+
+#define MODULE_ABI_VERSION (2)
+
+/* Suffix of descriptor symbol name */
+#define MODULE_DESCRIPTOR_SUFFIX "_descriptor"
+
+/* Host services
+ *
+ * A module may export `module_init` of type `module_init_function`. It is called
+ * right after the module is loaded with a table of services provided by the host,
+ * returned error aborts loading (e. g. if the table is too old). Every script loading the module
+ * calls it again with the table of its own pool while scripts of other pools may be running,
+ * so the module should not keep the table: transformations take it from module_host_current.
+ */
+
+#define MODULE_HOST_VERSION (3)
+
+/* Name of exported init function */
+#define MODULE_INIT_SYMBOL "module_init"
+
+/* Processes items [from, to) of a range, e. g. rows or tiles */
+typedef const char * (* module_range_function)(void * context, uint32_t from, uint32_t to);
+
+struct module_host {
+    uint32_t size; /* sizeof(struct module_host) host was built with */
+    uint32_t version; /* MODULE_HOST_VERSION */
+
+    uint32_t threads; /* workers of the host pool, including calling thread */
+
+    /* Splits [0, count) into contiguous chunks of at least `grain` items and processes them
+     * concurrently on the host pool, idle workers steal chunks of any call.
+     * Returns after all chunks are done, error is the first one reported by a chunk.
+     * Calls may nest (e. g. rows of an image processed as a task of a batch) and run concurrently.
+     */
+    const char * (* parallel_for)(const struct module_host * host, uint32_t count, uint32_t grain,
+        module_range_function function, void * context);
+
+    /* Since version 2. Returns message if the run calling it should stop (e. g. its deadline is exceeded),
+     * NULL otherwise. Long loops call it between rows or tiles and return the message after freeing their buffers.
+     * It is cheap and may be called from any thread running the step, including chunks of parallel_for.
+     */
+    const char * (* cancelled)(const struct module_host * host);
+
+    /* Since version 3. Formats `value` like value_format: numbers in `buffer` of VALUE_STRING_SIZE chars,
+     * strings are returned as is. Unlike value_to_string, the result is not overwritten by other calls.
+     */
+    const char * (* format)(struct value value, char * buffer);
+};
+
+typedef const char * (* module_init_function)(const struct module_host * host);
+
+/* Provided by the host. Table of the pool running the current step on calling thread, including chunks
+ * of its parallel_for, NULL if the step runs without pool. Valid until the transformation returns.
+ */
+const struct module_host * module_host_current(void);
+
+/* Runs `function` on host pool if `host` is set, on calling thread otherwise */
+#define MODULE_PARALLEL_FOR(host, count, grain, function, context) \
+    ((host) ? (host)->parallel_for((host), (count), (grain), (function), (context)) : (function)((context), 0, (count)))
+
+/* Returns message of cancel if `host` is set and supports it, NULL otherwise */
+#define MODULE_CANCELLED(host) \
+    ((host) && (host)->version >= 2 ? (host)->cancelled((host)) : (const char *) NULL)
+
+/* Formats `value` in `buffer` if `host` is set and supports it, with value_to_string otherwise */
+#define MODULE_FORMAT(host, value, buffer) \
+    ((host) && (host)->version >= 3 ? (host)->format((value), (buffer)) : value_to_string((value)))
+
+typedef const char * (* module_transformation)(struct image * image, uint32_t argc, const struct value * argv);
+
+enum module_access {
+    MODULE_ACCESS_OPAQUE = 0, /* unknown, whole frame */
+    MODULE_ACCESS_POINTWISE,  /* output pixel depends only on the same input pixel */
+    MODULE_ACCESS_STENCIL,    /* output pixel depends on input pixels within `radius` */
+    MODULE_ACCESS_GEOMETRIC,  /* output pixels are moved or resampled input pixels */
+    MODULE_ACCESS_GLOBAL      /* output pixel may depend on any input pixel */
+};
+
+enum module_flags {
+    MODULE_IN_PLACE = 1 << 0,    /* does not need a copy of input to produce output */
+    MODULE_THREAD_SAFE = 1 << 1, /* may be called concurrently for different images */
+    MODULE_RESIZES = 1 << 2,     /* output size may differ from input size */
+    MODULE_IDEMPOTENT = 1 << 3,  /* repeating with the same arguments changes nothing */
+    MODULE_IDENTITY = 1 << 4     /* set by specialize when arguments make the step a no-op */
+};
+
+enum module_layouts {
+    MODULE_LAYOUT_RGB24 = 1 << 0 /* struct pixel */
+};
+
+/* How stencil treats pixels outside of image */
+enum module_border {
+    MODULE_BORDER_REPLICATE = 0, /* nearest edge pixel */
+    MODULE_BORDER_ZERO           /* black pixel */
+};
+
+/* Rectangle of output pixels computed from input with halo */
+struct module_region {
+    const struct pixel * src; /* input pixel at region origin, readable within `radius` around the region */
+    uint32_t src_stride; /* in pixels */
+
+    struct pixel * dst; /* output pixel at region origin */
+    uint32_t dst_stride; /* in pixels */
+
+    uint32_t width;
+    uint32_t height;
+};
+
+typedef const char * (* module_region_function)(const struct module_region * region, uint32_t argc, const struct value * argv);
+
+/* Fills per-channel lookup tables (red, green, blue) of a pointwise transformation */
+typedef const char * (* module_lut_function)(uint8_t tables[3][256], uint32_t argc, const struct value * argv);
+
+/* Fills row-major 2x2 matrix mapping offsets from input center to offsets from output center */
+typedef const char * (* module_affine_function)(double matrix[4], uint32_t argc, const struct value * argv);
+
+struct module_descriptor {
+    uint32_t size; /* sizeof(struct module_descriptor) module was built with */
+    uint32_t abi_version; /* MODULE_ABI_VERSION */
+
+    enum module_access access;
+    uint32_t flags; /* enum module_flags */
+    uint32_t layouts; /* enum module_layouts */
+
+    uint32_t radius; /* for MODULE_ACCESS_STENCIL */
+    double cost; /* approximate nanoseconds per pixel */
+
+    /* Optional, refines fields above for specific arguments of a step.
+     * Called once when script is processed, returned error aborts processing.
+     */
+    const char * (* specialize)(struct module_descriptor * descriptor, uint32_t argc, const struct value * argv);
+
+    enum module_border border; /* for MODULE_ACCESS_STENCIL */
+
+    /* Optional, for pointwise and stencil transformations.
+     * Computes a region of output, so the step may be fused with its neighbours into one tiled pass.
+     */
+    module_region_function region;
+
+    /* Optional, for pointwise transformations mapping every channel value independently.
+     * Consecutive steps providing it are composed into one lookup when script is processed.
+     */
+    module_lut_function lut;
+
+    /* Optional, for geometric transformations that are a linear map about image center
+     * with output canvas fitted to the mapped input. Consecutive steps providing it
+     * are merged into one resampling by script optimizer.
+     */
+    module_affine_function affine;
+};
@@ -1,138 +1,584 @@
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "../image.h"
 #include "../value.h"
+#include "../module.h"
+#include "../stencil.h"
+
+/* Maximal radius of median filter, window area should fit uint16_t counters */
+#define MEDIAN_MAX_RADIUS (127)
+
+/* Minimal width of a stripe processed by one thread, in pixels */
+#define MEDIAN_MIN_STRIPE (64)
 
-typedef struct pixel (* blur_function)(uint32_t x, uint32_t y, const struct image image);
+/* Minimal count of rows (or columns) processed by one thread */
+#define BLUR_MIN_PART (16)
 
-struct image expand_image(struct image image) {
-    static const struct pixel black_pixel = { 0, 0, 0 };
-    uint32_t width, height, x, y, i;
-    struct image new_image;
+/* 3x3 kernels of do_(), they are also identifiers selecting the kernel in scripts */
 
-    width = image.width + 2;
-    height = image.height + 2;
-    new_image = image_create(width, height);
+const char * blur(void * context, const struct pixel * const * rows, struct pixel * dst, uint32_t count) {
+    uint32_t sum_r, sum_g, sum_b, x, k;
+    const struct pixel * pixel;
 
-    i = (height - 1) * width;
-    for (x = 0; x < width; ++x) {
-        new_image.pixels[x] = black_pixel;
-        new_image.pixels[i + x] = black_pixel;
+    for (x = 0; x < count; ++x) {
+        sum_r = sum_g = sum_b = 0;
+
+        for (k = 0; k < 3; ++k) {
+            for (pixel = rows[k] + x - 1; pixel < rows[k] + x + 2; ++pixel) {
+                sum_r += pixel->red;
+                sum_g += pixel->green;
+                sum_b += pixel->blue;
+            }
+        }
+
+        dst[x].red = sum_r / 9;
+        dst[x].green = sum_g / 9;
+        dst[x].blue = sum_b / 9;
     }
 
-    for (y = 1; y < height; ++y) {
-        new_image.pixels[y * width - 1] = black_pixel;
-        new_image.pixels[y * width] = black_pixel;
+    return NULL;
+}
+
+/* Keeps the last window pixel not less (`max`) or not greater than the kept one in all channels */
+void blur_extreme_row(const struct pixel * const * rows, struct pixel * dst, uint32_t count, bool max) {
+    const struct pixel * pixel;
+    struct pixel kept;
+    uint32_t x, k;
+
+    for (x = 0; x < count; ++x) {
+        kept.red = kept.green = kept.blue = max ? 0 : 255;
+
+        for (k = 0; k < 3; ++k) {
+            for (pixel = rows[k] + x - 1; pixel < rows[k] + x + 2; ++pixel) {
+                if (max
+                    ? kept.red <= pixel->red && kept.green <= pixel->green && kept.blue <= pixel->blue
+                    : kept.red >= pixel->red && kept.green >= pixel->green && kept.blue >= pixel->blue) {
+                    kept = *pixel;
+                }
+            }
+        }
+
+        dst[x] = kept;
     }
+}
+
+const char * dilate(void * context, const struct pixel * const * rows, struct pixel * dst, uint32_t count) {
+    blur_extreme_row(rows, dst, count, true);
+    return NULL;
+}
+
+const char * erode(void * context, const struct pixel * const * rows, struct pixel * dst, uint32_t count) {
+    blur_extreme_row(rows, dst, count, false);
+    return NULL;
+}
+
+const char * blur_parse_stencil(uint32_t argc, const struct value * args, struct stencil * stencil) {
+    if (argc < 1 || !value_is_identifier(args[0])) {
+        return "blur type (blur, dilate or erode) is required as first argument";
+    }
+
+    *((void **) &stencil->kernel) = value_to_identifier(args[0]);
+
+    if (stencil->kernel != blur && stencil->kernel != dilate && stencil->kernel != erode) {
+        return "wrong blur type, only blur, dilate or erode are allowed";
+    }
+
+    stencil->context = NULL;
+    stencil->radius = 1;
+    stencil->border = MODULE_BORDER_ZERO;
+    return NULL;
+}
+
+const char * do__region(const struct module_region * region, uint32_t argc, const struct value * args) {
+    struct stencil stencil;
+    const char * error;
+
+    if ((error = blur_parse_stencil(argc, args, &stencil)) != NULL) {
+        return error;
+    }
+
+    return stencil_region(&stencil, region);
+}
+
+const struct module_descriptor do__descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_STENCIL, MODULE_THREAD_SAFE, MODULE_LAYOUT_RGB24,
+    1, 15, NULL,
+    MODULE_BORDER_ZERO, do__region
+};
+
+const char * do_(struct image * image, uint32_t argc, struct value * args) {
+    struct stencil stencil;
+    const char * error;
 
-    for (y = 0, i = 0; y < image.height; ++y) {
-        for (x = 0; x < image.width; ++x, ++i) {
-            new_image.pixels[width * (y + 1) + x + 1] = image.pixels[i];
+    if ((error = blur_parse_stencil(argc, args, &stencil)) != NULL) {
+        return error;
+    }
+
+    return stencil_apply(&stencil, image, module_host_current());
+}
+
+/* Constant-time median filter (Perreault & Hebert, 2007)
+ *
+ * Each stripe keeps a histogram for every column of the window (2 * radius + 1 rows),
+ * the histograms are moved down by one pixel per row. Window histogram is summed
+ * from column histograms on two levels: 16 coarse bins are updated for each pixel,
+ * 256 fine bins are updated lazily, only for the coarse bin that contains the median.
+ */
+
+struct median_stripe {
+    const struct image * source;
+    struct image * result;
+
+    uint32_t x0, x1, radius;
+};
+
+struct median_histograms {
+    uint16_t (* fine)[3][256]; /* per column */
+    uint16_t (* coarse)[3][16]; /* per column */
+
+    uint16_t kernel_fine[3][256];
+    uint16_t kernel_coarse[3][16];
+    int64_t updated[3][16]; /* column the fine bin was last brought up to */
+};
+
+/* dst[k] += add[k] - sub[k] for 16 counters, `sub` may be NULL */
+void median_update16(uint16_t * dst, const uint16_t * add, const uint16_t * sub) {
+#ifdef __SSE2__
+    __m128i lo = _mm_add_epi16(_mm_loadu_si128((const __m128i *) dst), _mm_loadu_si128((const __m128i *) add));
+    __m128i hi = _mm_add_epi16(_mm_loadu_si128((const __m128i *) (dst + 8)), _mm_loadu_si128((const __m128i *) (add + 8)));
+
+    if (sub) {
+        lo = _mm_sub_epi16(lo, _mm_loadu_si128((const __m128i *) sub));
+        hi = _mm_sub_epi16(hi, _mm_loadu_si128((const __m128i *) (sub + 8)));
+    }
+
+    _mm_storeu_si128((__m128i *) dst, lo);
+    _mm_storeu_si128((__m128i *) (dst + 8), hi);
+#else
+    uint32_t k;
+
+    for (k = 0; k < 16; ++k) {
+        dst[k] += add[k] - (sub ? sub[k] : 0);
+    }
+#endif
+}
+
+uint32_t median_clamp(int64_t value, uint32_t size) {
+    return value < 0 ? 0 : value >= size ? size - 1 : value;
+}
+
+/* Adds (`delta` = 1) or removes (`delta` = -1) pixel row `y` to column histograms */
+void median_update_columns(struct median_histograms * histograms, const struct median_stripe stripe, int64_t y, int delta) {
+    const struct pixel * row = stripe.source->pixels + stripe.source->width * median_clamp(y, stripe.source->height);
+    const uint32_t columns = stripe.x1 - stripe.x0 + 2 * stripe.radius;
+    const struct pixel * pixel;
+    uint32_t c;
+
+    for (c = 0; c < columns; ++c) {
+        pixel = row + median_clamp((int64_t) stripe.x0 + c - stripe.radius, stripe.source->width);
+
+        histograms->fine[c][0][pixel->red] += delta;
+        histograms->fine[c][1][pixel->green] += delta;
+        histograms->fine[c][2][pixel->blue] += delta;
+        histograms->coarse[c][0][pixel->red >> 4] += delta;
+        histograms->coarse[c][1][pixel->green >> 4] += delta;
+        histograms->coarse[c][2][pixel->blue >> 4] += delta;
+    }
+}
+
+/* Finds median of channel `ch` for window starting at column `x` */
+uint8_t median_find(struct median_histograms * histograms, uint32_t ch, uint32_t x, uint32_t radius) {
+    const uint32_t rank = (2 * radius + 1) * (2 * radius + 1) / 2;
+    uint16_t * fine;
+    uint32_t sum = 0, bin, k;
+    int64_t c;
+
+    for (bin = 0; sum + histograms->kernel_coarse[ch][bin] <= rank; ++bin) {
+        sum += histograms->kernel_coarse[ch][bin];
+    }
+
+    fine = histograms->kernel_fine[ch] + 16 * bin;
+
+    if (histograms->updated[ch][bin] + 2 * radius + 1 <= x) {
+        memset(fine, 0, sizeof(uint16_t) * 16);
+
+        for (c = x; c <= x + 2 * radius; ++c) {
+            median_update16(fine, histograms->fine[c][ch] + 16 * bin, NULL);
         }
+    } else {
+        for (c = histograms->updated[ch][bin] + 1; c <= x; ++c) {
+            median_update16(fine, histograms->fine[c + 2 * radius][ch] + 16 * bin,
+                histograms->fine[c - 1][ch] + 16 * bin);
+        }
+    }
+
+    histograms->updated[ch][bin] = x;
+
+    for (k = 0; sum + fine[k] <= rank; ++k) {
+        sum += fine[k];
     }
 
-    return new_image;
+    return 16 * bin + k;
 }
 
-void do_blur(struct image image, blur_function map) {
-    struct image expanded_image = expand_image(image);
-    uint32_t x, y;
+/* Processes columns [from, to) */
+const char * median_stripe_run(void * context, uint32_t from, uint32_t to) {
+    const struct module_host * host = module_host_current();
+    struct median_stripe stripe = *((struct median_stripe *) context);
+    struct median_histograms * histograms = malloc(sizeof(struct median_histograms));
+    uint32_t x, y, c, ch, bin, columns;
+    const char * error = NULL;
+    struct pixel * pixel;
+    int64_t i;
+
+    stripe.x0 = from;
+    stripe.x1 = to;
+    columns = to - from + 2 * stripe.radius;
+
+    histograms->fine = calloc(columns, sizeof(*histograms->fine));
+    histograms->coarse = calloc(columns, sizeof(*histograms->coarse));
+
+    for (i = -(int64_t) stripe.radius; i <= (int64_t) stripe.radius; ++i) {
+        median_update_columns(histograms, stripe, i, 1);
+    }
+
+    for (y = 0; y < stripe.source->height && !(error = MODULE_CANCELLED(host)); ++y) {
+        if (y > 0) {
+            median_update_columns(histograms, stripe, (int64_t) y - stripe.radius - 1, -1);
+            median_update_columns(histograms, stripe, (int64_t) y + stripe.radius, 1);
+        }
+
+        memset(histograms->kernel_coarse, 0, sizeof(histograms->kernel_coarse));
 
-    for (y = 0; y < image.height; ++y) {
-        for (x = 0; x < image.width; ++x) {
-            image.pixels[image.width * y + x] = map(x + 1, y + 1, expanded_image);
+        for (ch = 0; ch < 3; ++ch) {
+            for (bin = 0; bin < 16; ++bin) {
+                histograms->updated[ch][bin] = -(int64_t) (2 * stripe.radius + 1);
+            }
+
+            for (c = 0; c < 2 * stripe.radius + 1; ++c) {
+                median_update16(histograms->kernel_coarse[ch], histograms->coarse[c][ch], NULL);
+            }
+        }
+
+        for (x = 0; x < stripe.x1 - stripe.x0; ++x) {
+            if (x > 0) {
+                for (ch = 0; ch < 3; ++ch) {
+                    median_update16(histograms->kernel_coarse[ch],
+                        histograms->coarse[x + 2 * stripe.radius][ch], histograms->coarse[x - 1][ch]);
+                }
+            }
+
+            pixel = stripe.result->pixels + stripe.result->width * y + stripe.x0 + x;
+            pixel->red = median_find(histograms, 0, x, stripe.radius);
+            pixel->green = median_find(histograms, 1, x, stripe.radius);
+            pixel->blue = median_find(histograms, 2, x, stripe.radius);
         }
     }
 
-    image_discard(expanded_image);
+    free(histograms->coarse);
+    free(histograms->fine);
+    free(histograms);
+    return error;
 }
 
-struct pixel blur(uint32_t x, uint32_t y, const struct image image) {
-    uint32_t sum_r = 0, sum_g = 0, sum_b = 0, i;
-    int8_t kern_x, kern_y;
-    struct pixel pixel;
+/* Splits image to vertical stripes processed in parallel */
+const char * do_median(struct image * image, uint32_t radius) {
+    const struct module_host * host = module_host_current();
+    struct image result = image_create(image->width, image->height);
+    struct median_stripe stripe;
+    const char * error;
+
+    stripe.source = image;
+    stripe.result = &result;
+    stripe.radius = radius;
+
+    if ((error = MODULE_PARALLEL_FOR(host, image->width, MEDIAN_MIN_STRIPE, median_stripe_run, &stripe))) {
+        image_discard(result);
+        return error;
+    }
+
+    image_discard(*image);
+    *image = result;
+    return NULL;
+}
+
+int64_t median_parse_radius(uint32_t argc, const struct value * args) {
+    return argc > 0 && value_is_integer(args[0]) ? value_to_integer(args[0]) : 1;
+}
+
+const char * median_specialize(struct module_descriptor * descriptor, uint32_t argc, const struct value * args) {
+    int64_t radius = median_parse_radius(argc, args);
+
+    descriptor->radius = radius < 0 ? 0 : radius;
+    return NULL;
+}
+
+const struct module_descriptor median_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_STENCIL, MODULE_THREAD_SAFE, MODULE_LAYOUT_RGB24,
+    1, 60, median_specialize
+};
+
+/* median([radius]), default radius is 1 */
+const char * median(struct image * image, uint32_t argc, struct value * args) {
+    int64_t radius = median_parse_radius(argc, args);
+
+    if (radius < 0 || radius > MEDIAN_MAX_RADIUS) {
+        return "median radius should be a number from 0 to 127";
+    }
+
+    return image->width > 0 && image->height > 0 ? do_median(image, radius) : NULL;
+}
+
+/* Recursive Gaussian filter (Young & van Vliet, 1995)
+ *
+ * Third-order causal and anti-causal recursions are applied along rows and then
+ * along columns, so cost per pixel does not depend on sigma. Intermediate values
+ * are kept in a float buffer: rows are filtered with channels in vector lanes,
+ * columns are filtered four channel values (lanes) at once by whole rows.
+ */
+
+struct gaussian_coefficients {
+    float b; /* B, gain of the input */
+    float a1, a2, a3; /* b1 / b0, b2 / b0, b3 / b0 */
+};
+
+struct gaussian_part {
+    const struct gaussian_coefficients * coefficients;
+    struct image * image;
+    float * buffer;
+};
+
+/* Vertical pass splits rows into groups of channel values, to keep vector lanes inside a group */
+#define GAUSSIAN_GROUP (4)
+
+struct gaussian_coefficients gaussian_coefficients_create(double sigma) {
+    struct gaussian_coefficients coefficients;
+    double q, b0, b1, b2, b3;
+
+    q = sigma >= 2.5
+        ? 0.98711 * sigma - 0.96330
+        : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+
+    b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+    b3 = 0.422205 * q * q * q;
+
+    coefficients.b = 1 - (b1 + b2 + b3) / b0;
+    coefficients.a1 = b1 / b0;
+    coefficients.a2 = b2 / b0;
+    coefficients.a3 = b3 / b0;
+    return coefficients;
+}
+
+uint8_t gaussian_to_byte(float value) {
+    return value <= 0 ? 0 : value >= 255 ? 255 : (uint8_t) (value + 0.5f);
+}
+
+/* Processes rows [from, to) */
+const char * gaussian_horizontal_run(void * context, uint32_t from, uint32_t to) {
+    const struct module_host * host = module_host_current();
+    const struct gaussian_part part = *((struct gaussian_part *) context);
+    const struct gaussian_coefficients c = *part.coefficients;
+    const uint32_t width = part.image->width;
+    const char * error = NULL;
+    const struct pixel * row;
+    float * out;
+    uint32_t x, y;
+
+#ifdef __SSE2__
+    const __m128 b = _mm_set1_ps(c.b), a1 = _mm_set1_ps(c.a1), a2 = _mm_set1_ps(c.a2), a3 = _mm_set1_ps(c.a3);
+    __m128 w1, w2, w3, w;
+    float lanes[4];
+
+    for (y = from; y < to && !(error = MODULE_CANCELLED(host)); ++y) {
+        row = part.image->pixels + width * y;
+        out = part.buffer + 3 * width * y;
+
+        w1 = w2 = w3 = _mm_set_ps(0, row[0].blue, row[0].green, row[0].red);
+        for (x = 0; x < width; ++x) {
+            w = _mm_add_ps(_mm_mul_ps(b, _mm_set_ps(0, row[x].blue, row[x].green, row[x].red)),
+                _mm_add_ps(_mm_mul_ps(a1, w1), _mm_add_ps(_mm_mul_ps(a2, w2), _mm_mul_ps(a3, w3))));
 
-    for (kern_y = -1; kern_y < 2; ++kern_y) {
-        for (kern_x = -1; kern_x < 2; ++kern_x) {
-            i = image.width * (y + kern_y) + x + kern_x;
+            _mm_storeu_ps(lanes, w);
+            out[3 * x] = lanes[0];
+            out[3 * x + 1] = lanes[1];
+            out[3 * x + 2] = lanes[2];
 
-            sum_r += image.pixels[i].red;
-            sum_g += image.pixels[i].green;
-            sum_b += image.pixels[i].blue;
+            w3 = w2; w2 = w1; w1 = w;
+        }
+
+        w1 = w2 = w3 = w;
+        for (x = width; x-- > 0;) {
+            w = _mm_add_ps(_mm_mul_ps(b, _mm_set_ps(0, out[3 * x + 2], out[3 * x + 1], out[3 * x])),
+                _mm_add_ps(_mm_mul_ps(a1, w1), _mm_add_ps(_mm_mul_ps(a2, w2), _mm_mul_ps(a3, w3))));
+
+            _mm_storeu_ps(lanes, w);
+            out[3 * x] = lanes[0];
+            out[3 * x + 1] = lanes[1];
+            out[3 * x + 2] = lanes[2];
+
+            w3 = w2; w2 = w1; w1 = w;
+        }
+    }
+#else
+    float w1[3], w2[3], w3[3], w;
+    uint32_t ch;
+
+    for (y = from; y < to && !(error = MODULE_CANCELLED(host)); ++y) {
+        row = part.image->pixels + width * y;
+        out = part.buffer + 3 * width * y;
+
+        for (x = 0; x < width; ++x) {
+            out[3 * x] = row[x].red;
+            out[3 * x + 1] = row[x].green;
+            out[3 * x + 2] = row[x].blue;
+        }
+
+        for (ch = 0; ch < 3; ++ch) {
+            w1[ch] = w2[ch] = w3[ch] = out[ch];
+        }
+
+        for (x = 0; x < 3 * width; ++x) {
+            ch = x % 3;
+            w = c.b * out[x] + c.a1 * w1[ch] + c.a2 * w2[ch] + c.a3 * w3[ch];
+            out[x] = w;
+            w3[ch] = w2[ch]; w2[ch] = w1[ch]; w1[ch] = w;
+        }
+
+        for (ch = 0; ch < 3; ++ch) {
+            w1[ch] = w2[ch] = w3[ch] = out[3 * (width - 1) + ch];
+        }
+
+        for (x = 3 * width; x-- > 0;) {
+            ch = x % 3;
+            w = c.b * out[x] + c.a1 * w1[ch] + c.a2 * w2[ch] + c.a3 * w3[ch];
+            out[x] = w;
+            w3[ch] = w2[ch]; w2[ch] = w1[ch]; w1[ch] = w;
         }
     }
+#endif
 
-    pixel.red   = sum_r / 9;
-    pixel.green = sum_g / 9;
-    pixel.blue  = sum_b / 9;
-    return pixel;
+    return error;
 }
 
-struct pixel dilate(uint32_t x, uint32_t y, const struct image image) {
-    uint8_t max_r = 0, max_g = 0, max_b = 0;
-    int8_t kern_x, kern_y;
-    struct pixel pixel;
-    uint32_t i;
+/* Filters values [from, to) of `count` rows, `step` is +-row size, edge rows are replicated */
+const char * gaussian_vertical_recursion(
+    const struct gaussian_coefficients c, float * first, int64_t step, uint32_t count, uint32_t from, uint32_t to
+) {
+    const struct module_host * host = module_host_current();
+    const char * error;
+    float * rows[4];
+    uint32_t y, i, k;
+
+    for (y = 0; y < count; ++y) {
+        if ((error = MODULE_CANCELLED(host))) {
+            return error;
+        }
+
+        rows[0] = first + step * y;
+
+        for (k = 1; k < 4; ++k) {
+            rows[k] = y >= k ? first + step * (y - k) : first;
+        }
+
+        i = from;
 
-    for (kern_y = -1; kern_y < 2; ++kern_y) {
-        for (kern_x = -1; kern_x < 2; ++kern_x) {
-            i = image.width * (y + kern_y) + x + kern_x;
+#ifdef __SSE2__
+        {
+            const __m128 b = _mm_set1_ps(c.b), a1 = _mm_set1_ps(c.a1), a2 = _mm_set1_ps(c.a2), a3 = _mm_set1_ps(c.a3);
 
-            if (max_r <= image.pixels[i].red
-             && max_g <= image.pixels[i].green
-             && max_b <= image.pixels[i].blue) {
-                max_r = image.pixels[i].red;
-                max_g = image.pixels[i].green;
-                max_b = image.pixels[i].blue;
+            for (; i + 4 <= to; i += 4) {
+                _mm_storeu_ps(rows[0] + i, _mm_add_ps(
+                    _mm_mul_ps(b, _mm_loadu_ps(rows[0] + i)),
+                    _mm_add_ps(_mm_mul_ps(a1, _mm_loadu_ps(rows[1] + i)),
+                        _mm_add_ps(_mm_mul_ps(a2, _mm_loadu_ps(rows[2] + i)), _mm_mul_ps(a3, _mm_loadu_ps(rows[3] + i))))
+                ));
             }
         }
+#endif
+
+        for (; i < to; ++i) {
+            rows[0][i] = c.b * rows[0][i] + c.a1 * rows[1][i] + c.a2 * rows[2][i] + c.a3 * rows[3][i];
+        }
     }
 
-    pixel.red   = max_r;
-    pixel.green = max_g;
-    pixel.blue  = max_b;
-    return pixel;
+    return NULL;
 }
 
-struct pixel erode(uint32_t x, uint32_t y, const struct image image) {
-    uint8_t min_r = 255, min_g = 255, min_b = 255;
-    int8_t kern_x, kern_y;
-    struct pixel pixel;
-    uint32_t i;
+/* Processes groups [from, to) of channel values, image is written only after both recursions */
+const char * gaussian_vertical_run(void * context, uint32_t from, uint32_t to) {
+    const struct gaussian_part part = *((struct gaussian_part *) context);
+    const uint32_t length = 3 * part.image->width, height = part.image->height;
+    uint8_t * bytes = (uint8_t *) part.image->pixels;
+    const char * error;
+    uint32_t y, i;
 
-    for (kern_y = -1; kern_y < 2; ++kern_y) {
-        for (kern_x = -1; kern_x < 2; ++kern_x) {
-            i = image.width * (y + kern_y) + x + kern_x;
+    from *= GAUSSIAN_GROUP;
+    to = GAUSSIAN_GROUP * to < length ? GAUSSIAN_GROUP * to : length;
 
-            if (min_r >= image.pixels[i].red
-             && min_g >= image.pixels[i].green
-             && min_b >= image.pixels[i].blue) {
-                min_r = image.pixels[i].red;
-                min_g = image.pixels[i].green;
-                min_b = image.pixels[i].blue;
-            }
+    if ((error = gaussian_vertical_recursion(*part.coefficients, part.buffer, length, height, from, to))
+            || (error = gaussian_vertical_recursion(*part.coefficients, part.buffer + (uint64_t) length * (height - 1),
+                -(int64_t) length, height, from, to))) {
+        return error;
+    }
+
+    for (y = 0; y < height; ++y) {
+        for (i = from; i < to; ++i) {
+            bytes[(uint64_t) length * y + i] = gaussian_to_byte(part.buffer[(uint64_t) length * y + i]);
         }
     }
 
-    pixel.red   = min_r;
-    pixel.green = min_g;
-    pixel.blue  = min_b;
-    return pixel;
+    return NULL;
 }
 
-const char * do_(struct image * image, uint32_t argc, struct value * args) {
-    blur_function map_function;
+const char * do_gaussian(struct image * image, double sigma) {
+    const struct module_host * host = module_host_current();
+    const struct gaussian_coefficients coefficients = gaussian_coefficients_create(sigma);
+    const uint32_t groups = (3 * image->width + GAUSSIAN_GROUP - 1) / GAUSSIAN_GROUP;
+    struct gaussian_part part;
+    const char * error;
 
-    if (argc < 1 || !value_is_identifier(args[0])) {
-        return "blur type (blur, dilate or erode) is required as first argument";
+    part.coefficients = &coefficients;
+    part.image = image;
+    part.buffer = malloc(sizeof(float) * 3 * image->width * image->height);
+
+    if (!(error = MODULE_PARALLEL_FOR(host, image->height, BLUR_MIN_PART, gaussian_horizontal_run, &part))) {
+        error = MODULE_PARALLEL_FOR(host, groups, BLUR_MIN_PART * 3 / GAUSSIAN_GROUP, gaussian_vertical_run, &part);
     }
 
-    *((void **) &map_function) = value_to_identifier(args[0]);
+    free(part.buffer);
+    return error;
+}
 
-    if (map_function != blur && map_function != dilate && map_function != erode) {
-        return "wrong blur type, only blur, dilate or erode are allowed";
+/* Recursion spreads every pixel over whole rows and columns */
+const struct module_descriptor gaussian_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_GLOBAL, MODULE_THREAD_SAFE | MODULE_IN_PLACE, MODULE_LAYOUT_RGB24,
+    0, 10, NULL
+};
+
+/* gaussian(sigma), sigma should be at least 0.5 */
+const char * gaussian(struct image * image, uint32_t argc, struct value * args) {
+    double sigma;
+
+    if (argc < 1 || !value_is_floating(args[0])) {
+        return "sigma is required as first argument";
     }
 
-    do_blur(*image, map_function);
-    return NULL;
+    if ((sigma = value_to_floating(args[0])) < 0.5) {
+        return "sigma should be at least 0.5";
+    }
+
+    return image->width > 0 && image->height > 0 ? do_gaussian(image, sigma) : NULL;
 }
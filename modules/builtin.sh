@@ -0,0 +1,36 @@
+#!/bin/sh
+# Prints C source registering global symbols of module object $2 as built-in module $1
+
+set -e
+
+module="$1"
+symbols=$(nm -g --defined-only "$2" | awk '$2 ~ /^[TDRBV]$/ { print $3 }' | LC_ALL=C sort)
+
+echo "/* Generated by builtin.sh from $2 */"
+echo
+echo "#include \"../../../builtin.h\""
+echo
+
+# only addresses are taken, so declared types do not matter
+for symbol in $symbols; do
+    echo "extern char $symbol[];"
+done
+
+echo
+echo "static const struct builtin_symbol builtin_symbols[] = {"
+
+for symbol in $symbols; do
+    echo "    { \"$symbol\", $symbol },"
+done
+
+echo "};"
+echo
+echo "static const struct builtin_module builtin_module = {"
+echo "    \"$module\", builtin_symbols, sizeof(builtin_symbols) / sizeof(builtin_symbols[0])"
+echo "};"
+echo
+echo "static void builtin_register_module(void) __attribute__((constructor));"
+echo
+echo "static void builtin_register_module(void) {"
+echo "    builtin_register(&builtin_module);"
+echo "}"
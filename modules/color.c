@@ -0,0 +1,338 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "../image.h"
+#include "../value.h"
+#include "../module.h"
+
+/* Maximal count of curves() points */
+#define COLOR_MAX_POINTS (256)
+
+/* Parses optional channels selector, a string of "r", "g" and "b" letters, `first` is set to index of next argument */
+const char * color_parse_channels(uint32_t argc, const struct value * argv, bool channels[3], uint32_t * first) {
+    char buffer[VALUE_STRING_SIZE];
+    const char * selector;
+
+    channels[0] = channels[1] = channels[2] = true;
+    *first = 0;
+
+    if (argc < 1 || !value_is_string(argv[0]) || value_is_floating(argv[0])) {
+        return NULL;
+    }
+
+    channels[0] = channels[1] = channels[2] = false;
+    *first = 1;
+
+    for (selector = MODULE_FORMAT(module_host_current(), argv[0], buffer); *selector; ++selector) {
+        switch (*selector) {
+        case 'r':
+            channels[0] = true;
+            break;
+
+        case 'g':
+            channels[1] = true;
+            break;
+
+        case 'b':
+            channels[2] = true;
+            break;
+
+        default:
+            return "channels should be a combination of r, g and b letters";
+        }
+    }
+
+    return NULL;
+}
+
+/* Rounds mapped values of selected channels, other channels are left as is */
+void color_fill(uint8_t tables[3][256], const bool channels[3], const double values[256]) {
+    uint32_t c, v;
+    double value;
+
+    for (c = 0; c < 3; ++c) {
+        for (v = 0; v < 256; ++v) {
+            value = channels[c] ? floor(values[v] + 0.5) : v;
+            tables[c][v] = value < 0 ? 0 : value > 255 ? 255 : value;
+        }
+    }
+}
+
+/* Parses `count` required numeric arguments after channels selector */
+const char * color_parse_numbers(uint32_t argc, const struct value * argv, uint32_t first,
+        uint32_t count, uint32_t optional, double * numbers, const char * error) {
+    uint32_t i;
+
+    if (argc < first + count || argc > first + count + optional) {
+        return error;
+    }
+
+    for (i = first; i < argc; ++i) {
+        if (!value_is_floating(argv[i])) {
+            return error;
+        }
+
+        numbers[i - first] = value_to_floating(argv[i]);
+    }
+
+    return NULL;
+}
+
+void color_apply(struct image * image, const uint8_t tables[3][256]) {
+    struct pixel * pixel, * end = image->pixels + image->width * image->height;
+
+    for (pixel = image->pixels; pixel < end; ++pixel) {
+        pixel->red = tables[0][pixel->red];
+        pixel->green = tables[1][pixel->green];
+        pixel->blue = tables[2][pixel->blue];
+    }
+}
+
+const char * color_do(struct image * image, module_lut_function lut, uint32_t argc, const struct value * argv) {
+    uint8_t tables[3][256];
+    const char * error;
+
+    if ((error = lut(tables, argc, argv))) {
+        return error;
+    }
+
+    color_apply(image, (const uint8_t (*)[256]) tables);
+    return NULL;
+}
+
+const char * brightness_lut(uint8_t tables[3][256], uint32_t argc, const struct value * argv) {
+    double values[256], delta;
+    bool channels[3];
+    const char * error;
+    uint32_t first, v;
+
+    if ((error = color_parse_channels(argc, argv, channels, &first))
+     || (error = color_parse_numbers(argc, argv, first, 1, 0, &delta, "brightness delta is required as a number"))) {
+        return error;
+    }
+
+    for (v = 0; v < 256; ++v) {
+        values[v] = v + delta;
+    }
+
+    color_fill(tables, channels, values);
+    return NULL;
+}
+
+const char * contrast_lut(uint8_t tables[3][256], uint32_t argc, const struct value * argv) {
+    double values[256], factor;
+    bool channels[3];
+    const char * error;
+    uint32_t first, v;
+
+    if ((error = color_parse_channels(argc, argv, channels, &first))
+     || (error = color_parse_numbers(argc, argv, first, 1, 0, &factor, "contrast factor is required as a number"))) {
+        return error;
+    }
+
+    if (factor < 0) {
+        return "contrast factor should not be negative";
+    }
+
+    for (v = 0; v < 256; ++v) {
+        values[v] = (v - 127.5) * factor + 127.5;
+    }
+
+    color_fill(tables, channels, values);
+    return NULL;
+}
+
+const char * gamma_lut(uint8_t tables[3][256], uint32_t argc, const struct value * argv) {
+    double values[256], gamma;
+    bool channels[3];
+    const char * error;
+    uint32_t first, v;
+
+    if ((error = color_parse_channels(argc, argv, channels, &first))
+     || (error = color_parse_numbers(argc, argv, first, 1, 0, &gamma, "gamma is required as a number"))) {
+        return error;
+    }
+
+    if (gamma <= 0) {
+        return "gamma should be positive";
+    }
+
+    for (v = 0; v < 256; ++v) {
+        values[v] = 255 * pow(v / 255.0, 1 / gamma);
+    }
+
+    color_fill(tables, channels, values);
+    return NULL;
+}
+
+const char * invert_lut(uint8_t tables[3][256], uint32_t argc, const struct value * argv) {
+    double values[256];
+    bool channels[3];
+    const char * error;
+    uint32_t first, v;
+
+    if ((error = color_parse_channels(argc, argv, channels, &first))
+     || (error = color_parse_numbers(argc, argv, first, 0, 0, NULL, "invert takes only channels"))) {
+        return error;
+    }
+
+    for (v = 0; v < 256; ++v) {
+        values[v] = 255 - v;
+    }
+
+    color_fill(tables, channels, values);
+    return NULL;
+}
+
+const char * levels_lut(uint8_t tables[3][256], uint32_t argc, const struct value * argv) {
+    double values[256], numbers[5] = { 0, 255, 1, 0, 255 }, t;
+    bool channels[3];
+    const char * error;
+    uint32_t first, v;
+
+    if ((error = color_parse_channels(argc, argv, channels, &first))
+     || (error = color_parse_numbers(argc, argv, first, 2, 3, numbers,
+            "input black and white points are required as numbers, gamma and output points are optional"))) {
+        return error;
+    }
+
+    if (argc - first == 4) {
+        return "output black and white points should be specified both";
+    }
+
+    if (numbers[0] >= numbers[1]) {
+        return "input black point should be less than white point";
+    }
+
+    if (numbers[2] <= 0) {
+        return "gamma should be positive";
+    }
+
+    for (v = 0; v < 256; ++v) {
+        t = (v - numbers[0]) / (numbers[1] - numbers[0]);
+        t = pow(t < 0 ? 0 : t > 1 ? 1 : t, 1 / numbers[2]);
+        values[v] = numbers[3] + t * (numbers[4] - numbers[3]);
+    }
+
+    color_fill(tables, channels, values);
+    return NULL;
+}
+
+/* Piecewise linear curve through (x, y) points, values outside of points range are flat */
+const char * curves_lut(uint8_t tables[3][256], uint32_t argc, const struct value * argv) {
+    double values[256], points[2 * COLOR_MAX_POINTS];
+    uint32_t first, count, v, i;
+    bool channels[3];
+    const char * error;
+
+    if ((error = color_parse_channels(argc, argv, channels, &first))) {
+        return error;
+    }
+
+    count = (argc - first) / 2;
+
+    if (count < 2 || count > COLOR_MAX_POINTS || (argc - first) % 2 != 0) {
+        return "from 2 to 256 pairs of point coordinates are required";
+    }
+
+    if ((error = color_parse_numbers(argc, argv, first, 2 * count, 0, points, "point coordinates should be numbers"))) {
+        return error;
+    }
+
+    for (i = 1; i < count; ++i) {
+        if (points[2 * i] <= points[2 * i - 2]) {
+            return "points should be sorted by strictly increasing x";
+        }
+    }
+
+    for (v = 0, i = 0; v < 256; ++v) {
+        for (; i + 1 < count && points[2 * i + 2] < v; ++i);
+
+        if (v <= points[0]) {
+            values[v] = points[1];
+        } else if (v >= points[2 * count - 2]) {
+            values[v] = points[2 * count - 1];
+        } else {
+            values[v] = points[2 * i + 1] + (points[2 * i + 3] - points[2 * i + 1])
+                * (v - points[2 * i]) / (points[2 * i + 2] - points[2 * i]);
+        }
+    }
+
+    color_fill(tables, channels, values);
+    return NULL;
+}
+
+const struct module_descriptor brightness_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_POINTWISE, MODULE_THREAD_SAFE | MODULE_IN_PLACE, MODULE_LAYOUT_RGB24,
+    0, 0.5, NULL,
+    MODULE_BORDER_REPLICATE, NULL, brightness_lut
+};
+
+const struct module_descriptor contrast_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_POINTWISE, MODULE_THREAD_SAFE | MODULE_IN_PLACE, MODULE_LAYOUT_RGB24,
+    0, 0.5, NULL,
+    MODULE_BORDER_REPLICATE, NULL, contrast_lut
+};
+
+const struct module_descriptor gamma_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_POINTWISE, MODULE_THREAD_SAFE | MODULE_IN_PLACE, MODULE_LAYOUT_RGB24,
+    0, 0.5, NULL,
+    MODULE_BORDER_REPLICATE, NULL, gamma_lut
+};
+
+const struct module_descriptor invert_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_POINTWISE, MODULE_THREAD_SAFE | MODULE_IN_PLACE, MODULE_LAYOUT_RGB24,
+    0, 0.5, NULL,
+    MODULE_BORDER_REPLICATE, NULL, invert_lut
+};
+
+const struct module_descriptor levels_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_POINTWISE, MODULE_THREAD_SAFE | MODULE_IN_PLACE, MODULE_LAYOUT_RGB24,
+    0, 0.5, NULL,
+    MODULE_BORDER_REPLICATE, NULL, levels_lut
+};
+
+const struct module_descriptor curves_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_POINTWISE, MODULE_THREAD_SAFE | MODULE_IN_PLACE, MODULE_LAYOUT_RGB24,
+    0, 0.5, NULL,
+    MODULE_BORDER_REPLICATE, NULL, curves_lut
+};
+
+/* brightness([channels,] delta), adds delta to channel values */
+const char * brightness(struct image * image, uint32_t argc, const struct value * argv) {
+    return color_do(image, brightness_lut, argc, argv);
+}
+
+/* contrast([channels,] factor), scales channel values around the middle */
+const char * contrast(struct image * image, uint32_t argc, const struct value * argv) {
+    return color_do(image, contrast_lut, argc, argv);
+}
+
+/* gamma([channels,] gamma), values above 1 brighten midtones */
+const char * gamma(struct image * image, uint32_t argc, const struct value * argv) {
+    return color_do(image, gamma_lut, argc, argv);
+}
+
+/* invert([channels]) */
+const char * invert(struct image * image, uint32_t argc, const struct value * argv) {
+    return color_do(image, invert_lut, argc, argv);
+}
+
+/* levels([channels,] in_black, in_white[, gamma[, out_black, out_white]]) */
+const char * levels(struct image * image, uint32_t argc, const struct value * argv) {
+    return color_do(image, levels_lut, argc, argv);
+}
+
+/* curves([channels,] x0, y0, x1, y1, ...) */
+const char * curves(struct image * image, uint32_t argc, const struct value * argv) {
+    return color_do(image, curves_lut, argc, argv);
+}
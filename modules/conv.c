@@ -0,0 +1,986 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../image.h"
+#include "../value.h"
+#include "../module.h"
+
+#ifndef M_PI
+#define M_PI (3.14159265358979323846)
+#endif
+
+/* Width of vertical strips the image is processed by, in pixels */
+#define CONV_STRIP (512)
+
+/* Non-separable kernels with at least this count of coefficients are applied via FFT */
+#define CONV_FFT_THRESHOLD (144)
+
+/* Maximal side of a kernel */
+#define CONV_MAX_SIZE (255)
+
+struct conv_kernel {
+    uint32_t width;
+    uint32_t height;
+
+    double * weights; /* row-major, already divided by divisor */
+    double bias;
+};
+
+/* Single term of a fixed-point filter: weight * rows[row][i + offset] */
+struct conv_tap {
+    uint32_t row;
+    uint32_t offset;
+    int16_t weight;
+};
+
+struct conv_filter {
+    struct conv_tap * taps;
+    uint32_t taps_count;
+
+    int32_t bias; /* includes rounding */
+    uint32_t shift;
+};
+
+/* Pixels a pass reads, coordinates outside of [min, max] are clamped */
+struct conv_source {
+    const struct pixel * origin; /* pixel (0, 0) */
+    uint32_t stride;
+
+    int64_t min_x, min_y;
+    int64_t max_x, max_y;
+};
+
+/* Pixels a pass writes */
+struct conv_target {
+    struct pixel * origin;
+    uint32_t stride;
+
+    uint32_t width;
+    uint32_t height;
+};
+
+struct conv_kernel conv_kernel_create(uint32_t width, uint32_t height) {
+    struct conv_kernel kernel;
+
+    kernel.width = width;
+    kernel.height = height;
+    kernel.weights = calloc(width * height, sizeof(double));
+    kernel.bias = 0;
+
+    return kernel;
+}
+
+void conv_kernel_discard(struct conv_kernel kernel) {
+    free(kernel.weights);
+}
+
+struct conv_filter conv_filter_create(uint32_t taps_count) {
+    struct conv_filter filter;
+
+    filter.taps = malloc(sizeof(struct conv_tap) * taps_count);
+    filter.taps_count = 0;
+    filter.bias = 0;
+    filter.shift = 0;
+
+    return filter;
+}
+
+void conv_filter_discard(struct conv_filter filter) {
+    free(filter.taps);
+}
+
+void conv_filter_add(struct conv_filter * filter, uint32_t row, uint32_t offset, double weight, uint32_t scale) {
+    int16_t fixed = (int16_t) floor(ldexp(weight, scale) + 0.5);
+
+    if (fixed != 0) {
+        filter->taps[filter->taps_count].row = row;
+        filter->taps[filter->taps_count].offset = offset;
+        filter->taps[filter->taps_count].weight = fixed;
+        ++filter->taps_count;
+    }
+}
+
+void conv_filter_set_bias(struct conv_filter * filter, double bias, int32_t scale, uint32_t shift) {
+    filter->shift = shift;
+    filter->bias = (int32_t) floor(ldexp(bias, scale) + 0.5) + (shift > 0 ? 1 << (shift - 1) : 0);
+}
+
+/* Returns largest fraction bits count (up to 14) that keeps weights in int16
+ * and sums of `input_max`-bounded inputs in int32
+ */
+int32_t conv_fixed_scale(double max_abs, double sum_abs, double input_max) {
+    int32_t scale = 14;
+
+    while (scale > -16 && (ldexp(max_abs, scale) > 32767 || ldexp(sum_abs * input_max, scale) > 2147483647.0)) {
+        --scale;
+    }
+
+    return scale;
+}
+
+/* Applies `filter` to `length` values of `rows`, results are saturated to int16 */
+void conv_filter_apply(const struct conv_filter filter, const int16_t * const * rows, uint32_t length, int16_t * dst) {
+    const struct conv_tap * tap;
+    uint32_t i = 0, k;
+    int32_t sum;
+
+#ifdef __SSE2__
+    __m128i sum_lo, sum_hi, a, b, weights;
+    const struct conv_tap * pair;
+
+    for (; i + 8 <= length; i += 8) {
+        sum_lo = sum_hi = _mm_set1_epi32(filter.bias);
+
+        for (k = 0; k < filter.taps_count; k += 2) {
+            tap = filter.taps + k;
+            a = _mm_loadu_si128((const __m128i *) (rows[tap->row] + i + tap->offset));
+
+            if (k + 1 < filter.taps_count) {
+                pair = tap + 1;
+                b = _mm_loadu_si128((const __m128i *) (rows[pair->row] + i + pair->offset));
+                weights = _mm_set1_epi32((int32_t) (((uint32_t) (uint16_t) pair->weight << 16)
+                    | (uint16_t) tap->weight));
+            } else {
+                b = _mm_setzero_si128();
+                weights = _mm_set1_epi32((uint16_t) tap->weight);
+            }
+
+            sum_lo = _mm_add_epi32(sum_lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights));
+            sum_hi = _mm_add_epi32(sum_hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights));
+        }
+
+        sum_lo = _mm_srai_epi32(sum_lo, filter.shift);
+        sum_hi = _mm_srai_epi32(sum_hi, filter.shift);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packs_epi32(sum_lo, sum_hi));
+    }
+#endif
+
+    for (; i < length; ++i) {
+        sum = filter.bias;
+
+        for (k = 0, tap = filter.taps; k < filter.taps_count; ++k, ++tap) {
+            sum += tap->weight * rows[tap->row][i + tap->offset];
+        }
+
+        sum >>= filter.shift;
+        dst[i] = sum < -32768 ? -32768 : sum > 32767 ? 32767 : sum;
+    }
+}
+
+/* Clamps `length` values to bytes */
+void conv_store(const int16_t * src, uint32_t length, uint8_t * dst) {
+    uint32_t i = 0;
+
+#ifdef __SSE2__
+    __m128i value;
+
+    for (; i + 16 <= length; i += 16) {
+        value = _mm_packus_epi16(
+            _mm_loadu_si128((const __m128i *) (src + i)),
+            _mm_loadu_si128((const __m128i *) (src + i + 8))
+        );
+
+        _mm_storeu_si128((__m128i *) (dst + i), value);
+    }
+#endif
+
+    for (; i < length; ++i) {
+        dst[i] = src[i] < 0 ? 0 : src[i] > 255 ? 255 : src[i];
+    }
+}
+
+/* Widens pixels [x0 - radius, x1 + radius) of row `y` to channel values, coordinates are clamped */
+void conv_widen_row(const struct conv_source source, int64_t y, uint32_t x0, uint32_t x1, uint32_t radius, int16_t * dst) {
+    const struct pixel * row;
+    int64_t x, cx;
+
+    y = y < source.min_y ? source.min_y : y > source.max_y ? source.max_y : y;
+    row = source.origin + (int64_t) source.stride * y;
+
+    for (x = (int64_t) x0 - radius; x < (int64_t) x1 + radius; ++x) {
+        cx = x < source.min_x ? source.min_x : x > source.max_x ? source.max_x : x;
+
+        *dst++ = row[cx].red;
+        *dst++ = row[cx].green;
+        *dst++ = row[cx].blue;
+    }
+}
+
+/* Finds u and v such as weights[i][j] = u[i] * v[j], returns false if kernel has rank above 1 */
+bool conv_kernel_factorize(const struct conv_kernel kernel, double * u, double * v) {
+    double max_abs = 0, max_u = 0, max_v = 0, balance;
+    uint32_t i, j, pivot_row = 0, pivot_col = 0;
+
+    for (i = 0; i < kernel.height; ++i) {
+        for (j = 0; j < kernel.width; ++j) {
+            if (fabs(kernel.weights[kernel.width * i + j]) > max_abs) {
+                max_abs = fabs(kernel.weights[kernel.width * i + j]);
+                pivot_row = i;
+                pivot_col = j;
+            }
+        }
+    }
+
+    if (max_abs == 0) {
+        return false;
+    }
+
+    for (i = 0; i < kernel.height; ++i) {
+        u[i] = kernel.weights[kernel.width * i + pivot_col];
+    }
+
+    for (j = 0; j < kernel.width; ++j) {
+        v[j] = kernel.weights[kernel.width * pivot_row + j] / kernel.weights[kernel.width * pivot_row + pivot_col];
+    }
+
+    for (i = 0; i < kernel.height; ++i) {
+        for (j = 0; j < kernel.width; ++j) {
+            if (fabs(kernel.weights[kernel.width * i + j] - u[i] * v[j]) > 1e-6 * max_abs) {
+                return false;
+            }
+        }
+    }
+
+    /* balance magnitudes of both passes */
+    for (i = 0; i < kernel.height; ++i) {
+        max_u = fabs(u[i]) > max_u ? fabs(u[i]) : max_u;
+    }
+
+    for (j = 0; j < kernel.width; ++j) {
+        max_v = fabs(v[j]) > max_v ? fabs(v[j]) : max_v;
+    }
+
+    balance = sqrt(max_u / max_v);
+
+    for (i = 0; i < kernel.height; ++i) {
+        u[i] /= balance;
+    }
+
+    for (j = 0; j < kernel.width; ++j) {
+        v[j] *= balance;
+    }
+
+    return true;
+}
+
+/* Two 1D passes, horizontal results are kept in a ring of `kernel.height` int16 rows.
+ * Cancel of `host` is checked between rows, regions pass NULL as they are checked by tiles.
+ */
+const char * conv_separable(const struct conv_source source, const struct conv_target target,
+        const struct conv_kernel kernel, const double * u, const double * v, const struct module_host * host) {
+    const uint32_t radius_x = kernel.width / 2, radius_y = kernel.height / 2;
+    double max_u = 0, sum_u = 0, max_v = 0, sum_v = 0;
+    struct conv_filter horizontal, vertical;
+    int32_t h_scale, v_scale, precision;
+    const char * error = NULL;
+
+    const int16_t ** rows;
+    int16_t * widened, * ring, * out;
+    uint32_t strip_x, strip_w, i, y;
+    int64_t next_row;
+
+    for (i = 0; i < kernel.height; ++i) {
+        max_u = fabs(u[i]) > max_u ? fabs(u[i]) : max_u;
+        sum_u += fabs(u[i]);
+    }
+
+    for (i = 0; i < kernel.width; ++i) {
+        max_v = fabs(v[i]) > max_v ? fabs(v[i]) : max_v;
+        sum_v += fabs(v[i]);
+    }
+
+    /* intermediate values are scaled by 2 ^ precision and must fit int16 */
+    for (precision = 7; precision > -16 && ldexp(sum_v * 255, precision) > 32767; --precision);
+
+    h_scale = conv_fixed_scale(max_v, sum_v, 255);
+    v_scale = conv_fixed_scale(max_u, sum_u, 32767);
+
+    if (h_scale < precision || v_scale + precision < 0) {
+        return "kernel coefficients are out of range";
+    }
+
+    horizontal = conv_filter_create(kernel.width);
+    vertical = conv_filter_create(kernel.height);
+
+    for (i = 0; i < kernel.width; ++i) {
+        conv_filter_add(&horizontal, 0, 3 * i, v[i], h_scale);
+    }
+
+    for (i = 0; i < kernel.height; ++i) {
+        conv_filter_add(&vertical, i, 0, u[i], v_scale);
+    }
+
+    conv_filter_set_bias(&horizontal, 0, 0, h_scale - precision);
+    conv_filter_set_bias(&vertical, kernel.bias, v_scale + precision, v_scale + precision);
+
+    rows = malloc(sizeof(int16_t *) * kernel.height);
+    widened = malloc(sizeof(int16_t) * 3 * (CONV_STRIP + 2 * radius_x));
+    ring = malloc(sizeof(int16_t) * 3 * CONV_STRIP * kernel.height);
+    out = malloc(sizeof(int16_t) * 3 * CONV_STRIP);
+
+    for (strip_x = 0; strip_x < target.width && !error; strip_x += CONV_STRIP) {
+        strip_w = target.width - strip_x < CONV_STRIP ? target.width - strip_x : CONV_STRIP;
+        next_row = -(int64_t) radius_y;
+
+        for (y = 0; y < target.height && !(error = MODULE_CANCELLED(host)); ++y) {
+            for (; next_row <= (int64_t) y + radius_y; ++next_row) {
+                conv_widen_row(source, next_row, strip_x, strip_x + strip_w, radius_x, widened);
+
+                rows[0] = widened;
+                conv_filter_apply(horizontal, rows, 3 * strip_w,
+                    ring + 3 * CONV_STRIP * ((next_row + radius_y) % kernel.height));
+            }
+
+            for (i = 0; i < kernel.height; ++i) {
+                rows[i] = ring + 3 * CONV_STRIP * ((y + i) % kernel.height);
+            }
+
+            conv_filter_apply(vertical, rows, 3 * strip_w, out);
+            conv_store(out, 3 * strip_w, (uint8_t *) (target.origin + target.stride * y + strip_x));
+        }
+    }
+
+    free(out);
+    free(ring);
+    free(widened);
+    free(rows);
+
+    conv_filter_discard(vertical);
+    conv_filter_discard(horizontal);
+    return error;
+}
+
+/* Single 2D pass, widened source rows are kept in a ring of `kernel.height` rows, `host` is as in conv_separable */
+const char * conv_direct(const struct conv_source source, const struct conv_target target, const struct conv_kernel kernel,
+        const struct module_host * host) {
+    const uint32_t radius_x = kernel.width / 2, radius_y = kernel.height / 2;
+    const uint32_t row_length = 3 * (CONV_STRIP + 2 * radius_x);
+    double max_abs = 0, sum_abs = 0;
+    const char * error = NULL;
+    struct conv_filter filter;
+    int32_t scale;
+
+    const int16_t ** rows;
+    int16_t * ring, * out;
+    uint32_t strip_x, strip_w, i, j, y;
+    int64_t next_row;
+
+    for (i = 0; i < kernel.width * kernel.height; ++i) {
+        max_abs = fabs(kernel.weights[i]) > max_abs ? fabs(kernel.weights[i]) : max_abs;
+        sum_abs += fabs(kernel.weights[i]);
+    }
+
+    if ((scale = conv_fixed_scale(max_abs, sum_abs, 255)) < 0) {
+        return "kernel coefficients are out of range";
+    }
+
+    filter = conv_filter_create(kernel.width * kernel.height);
+
+    for (i = 0; i < kernel.height; ++i) {
+        for (j = 0; j < kernel.width; ++j) {
+            conv_filter_add(&filter, i, 3 * j, kernel.weights[kernel.width * i + j], scale);
+        }
+    }
+
+    conv_filter_set_bias(&filter, kernel.bias, scale, scale);
+
+    rows = malloc(sizeof(int16_t *) * kernel.height);
+    ring = malloc(sizeof(int16_t) * row_length * kernel.height);
+    out = malloc(sizeof(int16_t) * 3 * CONV_STRIP);
+
+    for (strip_x = 0; strip_x < target.width && !error; strip_x += CONV_STRIP) {
+        strip_w = target.width - strip_x < CONV_STRIP ? target.width - strip_x : CONV_STRIP;
+        next_row = -(int64_t) radius_y;
+
+        for (y = 0; y < target.height && !(error = MODULE_CANCELLED(host)); ++y) {
+            for (; next_row <= (int64_t) y + radius_y; ++next_row) {
+                conv_widen_row(source, next_row, strip_x, strip_x + strip_w, radius_x,
+                    ring + row_length * ((next_row + radius_y) % kernel.height));
+            }
+
+            for (i = 0; i < kernel.height; ++i) {
+                rows[i] = ring + row_length * ((y + i) % kernel.height);
+            }
+
+            conv_filter_apply(filter, rows, 3 * strip_w, out);
+            conv_store(out, 3 * strip_w, (uint8_t *) (target.origin + target.stride * y + strip_x));
+        }
+    }
+
+    free(out);
+    free(ring);
+    free(rows);
+
+    conv_filter_discard(filter);
+    return error;
+}
+
+struct conv_fft_plan {
+    uint32_t size;
+
+    double * cos_table;
+    double * sin_table;
+    uint32_t * reversed;
+};
+
+struct conv_fft_plan conv_fft_plan_create(uint32_t size) {
+    struct conv_fft_plan plan;
+    uint32_t i, j, bits;
+
+    plan.size = size;
+    plan.cos_table = malloc(sizeof(double) * size / 2);
+    plan.sin_table = malloc(sizeof(double) * size / 2);
+    plan.reversed = malloc(sizeof(uint32_t) * size);
+
+    for (i = 0; i < size / 2; ++i) {
+        plan.cos_table[i] = cos(2 * M_PI * i / size);
+        plan.sin_table[i] = sin(2 * M_PI * i / size);
+    }
+
+    for (bits = 0; (1u << bits) < size; ++bits);
+
+    for (i = 0; i < size; ++i) {
+        plan.reversed[i] = 0;
+
+        for (j = 0; j < bits; ++j) {
+            plan.reversed[i] |= ((i >> j) & 1) << (bits - 1 - j);
+        }
+    }
+
+    return plan;
+}
+
+void conv_fft_plan_discard(struct conv_fft_plan plan) {
+    free(plan.cos_table);
+    free(plan.sin_table);
+    free(plan.reversed);
+}
+
+/* In-place iterative radix-2 FFT of `plan.size` values taken with `stride` */
+void conv_fft(const struct conv_fft_plan plan, double * re, double * im, uint32_t stride, bool inverse) {
+    const uint32_t n = plan.size;
+    uint32_t i, j, k, half, step;
+    double tr, ti, wr, wi, buffer;
+
+    for (i = 0; i < n; ++i) {
+        j = plan.reversed[i];
+
+        if (i < j) {
+            buffer = re[i * stride]; re[i * stride] = re[j * stride]; re[j * stride] = buffer;
+            buffer = im[i * stride]; im[i * stride] = im[j * stride]; im[j * stride] = buffer;
+        }
+    }
+
+    for (half = 1; half < n; half *= 2) {
+        step = n / (2 * half);
+
+        for (i = 0; i < n; i += 2 * half) {
+            for (k = 0; k < half; ++k) {
+                wr = plan.cos_table[k * step];
+                wi = inverse ? plan.sin_table[k * step] : -plan.sin_table[k * step];
+
+                j = (i + k + half) * stride;
+                tr = re[j] * wr - im[j] * wi;
+                ti = re[j] * wi + im[j] * wr;
+
+                re[j] = re[(i + k) * stride] - tr;
+                im[j] = im[(i + k) * stride] - ti;
+                re[(i + k) * stride] += tr;
+                im[(i + k) * stride] += ti;
+            }
+        }
+    }
+}
+
+void conv_fft2d(const struct conv_fft_plan plan, double * re, double * im, bool inverse) {
+    uint32_t i;
+
+    for (i = 0; i < plan.size; ++i) {
+        conv_fft(plan, re + plan.size * i, im + plan.size * i, 1, inverse);
+    }
+
+    for (i = 0; i < plan.size; ++i) {
+        conv_fft(plan, re + i, im + i, plan.size, inverse);
+    }
+}
+
+/* Overlap-save FFT convolution by square tiles
+ *
+ * Red and green channels are transformed together as real and imaginary parts
+ * (kernel is real, so results do not mix), blue channel is transformed alone.
+ */
+const char * conv_fft_tiled(struct image * image, const struct conv_kernel kernel) {
+    const struct module_host * host = module_host_current();
+    const uint32_t radius_x = kernel.width / 2, radius_y = kernel.height / 2;
+    const uint32_t max_side = kernel.width > kernel.height ? kernel.width : kernel.height;
+    uint32_t size, tile, tile_x, tile_y, tile_w, tile_h, x, y, i, j, k;
+    double * kernel_re, * kernel_im, * re, * im, * blue_re, * blue_im, tr, value;
+    const char * error = NULL;
+    struct conv_fft_plan plan;
+    struct image result;
+    const struct pixel * source;
+    struct pixel * pixel;
+    int64_t sx, sy;
+
+    for (size = 64; size < 4 * max_side; size *= 2);
+    tile = size - max_side + 1;
+
+    plan = conv_fft_plan_create(size);
+    kernel_re = calloc(size * size, sizeof(double));
+    kernel_im = calloc(size * size, sizeof(double));
+    re = malloc(sizeof(double) * size * size);
+    im = malloc(sizeof(double) * size * size);
+    blue_re = malloc(sizeof(double) * size * size);
+    blue_im = malloc(sizeof(double) * size * size);
+
+    /* correlation is convolution with mirrored kernel, normalization of inverse FFT is folded in */
+    for (i = 0; i < kernel.height; ++i) {
+        for (j = 0; j < kernel.width; ++j) {
+            kernel_re[size * ((size - i) % size) + (size - j) % size]
+                = kernel.weights[kernel.width * i + j] / ((double) size * size);
+        }
+    }
+
+    conv_fft2d(plan, kernel_re, kernel_im, false);
+    result = image_create(image->width, image->height);
+
+    for (tile_y = 0; tile_y < image->height && !error; tile_y += tile) {
+        tile_h = image->height - tile_y < tile ? image->height - tile_y : tile;
+
+        for (tile_x = 0; tile_x < image->width && !(error = MODULE_CANCELLED(host)); tile_x += tile) {
+            tile_w = image->width - tile_x < tile ? image->width - tile_x : tile;
+
+            for (y = 0; y < size; ++y) {
+                sy = (int64_t) tile_y + y - radius_y;
+                sy = sy < 0 ? 0 : sy >= image->height ? image->height - 1 : sy;
+
+                for (x = 0; x < size; ++x) {
+                    sx = (int64_t) tile_x + x - radius_x;
+                    sx = sx < 0 ? 0 : sx >= image->width ? image->width - 1 : sx;
+
+                    source = image->pixels + image->width * sy + sx;
+                    re[size * y + x] = source->red;
+                    im[size * y + x] = source->green;
+                    blue_re[size * y + x] = source->blue;
+                    blue_im[size * y + x] = 0;
+                }
+            }
+
+            conv_fft2d(plan, re, im, false);
+            conv_fft2d(plan, blue_re, blue_im, false);
+
+            for (k = 0; k < size * size; ++k) {
+                tr = re[k] * kernel_re[k] - im[k] * kernel_im[k];
+                im[k] = re[k] * kernel_im[k] + im[k] * kernel_re[k];
+                re[k] = tr;
+
+                tr = blue_re[k] * kernel_re[k] - blue_im[k] * kernel_im[k];
+                blue_im[k] = blue_re[k] * kernel_im[k] + blue_im[k] * kernel_re[k];
+                blue_re[k] = tr;
+            }
+
+            conv_fft2d(plan, re, im, true);
+            conv_fft2d(plan, blue_re, blue_im, true);
+
+            for (y = 0; y < tile_h; ++y) {
+                for (x = 0; x < tile_w; ++x) {
+                    pixel = result.pixels + result.width * (tile_y + y) + tile_x + x;
+                    k = size * y + x;
+
+                    value = floor(re[k] + kernel.bias + 0.5);
+                    pixel->red = value < 0 ? 0 : value > 255 ? 255 : value;
+
+                    value = floor(im[k] + kernel.bias + 0.5);
+                    pixel->green = value < 0 ? 0 : value > 255 ? 255 : value;
+
+                    value = floor(blue_re[k] + kernel.bias + 0.5);
+                    pixel->blue = value < 0 ? 0 : value > 255 ? 255 : value;
+                }
+            }
+        }
+    }
+
+    free(blue_im);
+    free(blue_re);
+    free(im);
+    free(re);
+    free(kernel_im);
+    free(kernel_re);
+    conv_fft_plan_discard(plan);
+
+    if (error) {
+        image_discard(result);
+        return error;
+    }
+
+    image_discard(*image);
+    *image = result;
+    return NULL;
+}
+
+/* Applies kernel in fixed point, large non-separable kernels are left to FFT when `fft` is set */
+const char * conv_apply(const struct conv_source source, const struct conv_target target,
+        const struct conv_kernel kernel, bool fft, const struct module_host * host, bool * done) {
+    const char * error = NULL;
+    double * u, * v;
+
+    u = malloc(sizeof(double) * kernel.height);
+    v = malloc(sizeof(double) * kernel.width);
+    *done = true;
+
+    if (conv_kernel_factorize(kernel, u, v)) {
+        error = conv_separable(source, target, kernel, u, v, host);
+    } else if (fft && kernel.width * kernel.height >= CONV_FFT_THRESHOLD) {
+        *done = false;
+    } else {
+        error = conv_direct(source, target, kernel, host);
+    }
+
+    free(v);
+    free(u);
+    return error;
+}
+
+const char * do_convolve(struct image * image, const struct conv_kernel kernel) {
+    struct conv_source source;
+    struct conv_target target;
+    struct image result;
+    const char * error;
+    bool done;
+
+    if (image->width == 0 || image->height == 0) {
+        return NULL;
+    }
+
+    result = image_create(image->width, image->height);
+
+    source.origin = image->pixels;
+    source.stride = image->width;
+    source.min_x = source.min_y = 0;
+    source.max_x = image->width - 1;
+    source.max_y = image->height - 1;
+
+    target.origin = result.pixels;
+    target.stride = target.width = result.width;
+    target.height = result.height;
+
+    if ((error = conv_apply(source, target, kernel, true, module_host_current(), &done)) != NULL || !done) {
+        image_discard(result);
+        return error != NULL ? error : conv_fft_tiled(image, kernel);
+    }
+
+    image_discard(*image);
+    *image = result;
+    return NULL;
+}
+
+/* Region has a halo of kernel radius, so clamping never takes place */
+const char * do_convolve_region(const struct module_region * region, const struct conv_kernel kernel) {
+    const uint32_t radius_x = kernel.width / 2, radius_y = kernel.height / 2;
+    struct conv_source source;
+    struct conv_target target;
+    bool done;
+
+    source.origin = region->src;
+    source.stride = region->src_stride;
+    source.min_x = -(int64_t) radius_x;
+    source.min_y = -(int64_t) radius_y;
+    source.max_x = (int64_t) region->width - 1 + radius_x;
+    source.max_y = (int64_t) region->height - 1 + radius_y;
+
+    target.origin = region->dst;
+    target.stride = region->dst_stride;
+    target.width = region->width;
+    target.height = region->height;
+
+    return conv_apply(source, target, kernel, false, NULL, &done);
+}
+/* Divides weights by their sum unless it is zero */
+void conv_kernel_normalize(struct conv_kernel kernel) {
+    double sum = 0;
+    uint32_t i;
+
+    for (i = 0; i < kernel.width * kernel.height; ++i) {
+        sum += kernel.weights[i];
+    }
+
+    if (sum != 0) {
+        for (i = 0; i < kernel.width * kernel.height; ++i) {
+            kernel.weights[i] /= sum;
+        }
+    }
+}
+
+static const double conv_sharpen_weights[] = {
+     0, -1,  0,
+    -1,  5, -1,
+     0, -1,  0
+};
+
+static const double conv_emboss_weights[] = {
+    -2, -1,  0,
+    -1,  1,  1,
+     0,  1,  2
+};
+
+static const double conv_edge_detect_weights[] = {
+    -1, -1, -1,
+    -1,  8, -1,
+    -1, -1, -1
+};
+
+struct conv_kernel conv_preset_kernel(uint32_t size, const double * weights) {
+    struct conv_kernel kernel = conv_kernel_create(size, size);
+
+    memcpy(kernel.weights, weights, sizeof(double) * size * size);
+    return kernel;
+}
+
+/* Parses arguments of convolve() */
+const char * conv_parse_kernel(uint32_t argc, const struct value * argv, struct conv_kernel * kernel) {
+    int64_t width, height;
+    double divisor;
+    uint32_t i;
+
+    if (argc < 2 || !value_is_integer(argv[0]) || !value_is_integer(argv[1])) {
+        return "kernel width and height are required as first arguments";
+    }
+
+    width = value_to_integer(argv[0]);
+    height = value_to_integer(argv[1]);
+
+    if (width < 1 || height < 1 || width > CONV_MAX_SIZE || height > CONV_MAX_SIZE
+     || width % 2 == 0 || height % 2 == 0) {
+        return "kernel width and height should be odd numbers from 1 to 255";
+    }
+
+    if (argc < 2 + width * height || argc > 4 + width * height) {
+        return "kernel coefficients count should be equal to width * height";
+    }
+
+    for (i = 2; i < argc; ++i) {
+        if (!value_is_floating(argv[i])) {
+            return "kernel coefficients, divisor and bias should be numbers";
+        }
+    }
+
+    if (argc > 2 + width * height && value_to_floating(argv[2 + width * height]) == 0) {
+        return "divisor should not be zero";
+    }
+
+    *kernel = conv_kernel_create(width, height);
+
+    for (i = 0; i < width * height; ++i) {
+        kernel->weights[i] = value_to_floating(argv[2 + i]);
+    }
+
+    if (argc > 2 + width * height) {
+        divisor = value_to_floating(argv[2 + width * height]);
+
+        for (i = 0; i < width * height; ++i) {
+            kernel->weights[i] /= divisor;
+        }
+    } else {
+        conv_kernel_normalize(*kernel);
+    }
+
+    if (argc > 3 + width * height) {
+        kernel->bias = value_to_floating(argv[3 + width * height]);
+    }
+
+    return NULL;
+}
+
+int64_t box_parse_radius(uint32_t argc, const struct value * argv) {
+    return argc > 0 && value_is_integer(argv[0]) ? value_to_integer(argv[0]) : 1;
+}
+
+/* Parses arguments of box() */
+const char * conv_parse_box(uint32_t argc, const struct value * argv, struct conv_kernel * kernel) {
+    int64_t radius = box_parse_radius(argc, argv);
+    uint32_t i;
+
+    if (radius < 0 || 2 * radius + 1 > CONV_MAX_SIZE) {
+        return "radius should be a number from 0 to 127";
+    }
+
+    *kernel = conv_kernel_create(2 * radius + 1, 2 * radius + 1);
+
+    for (i = 0; i < kernel->width * kernel->height; ++i) {
+        kernel->weights[i] = 1.0 / (kernel->width * kernel->height);
+    }
+
+    return NULL;
+}
+
+const char * convolve_specialize(struct module_descriptor * descriptor, uint32_t argc, const struct value * argv) {
+    int64_t width = argc > 0 ? value_to_integer(argv[0]) : 1;
+    int64_t height = argc > 1 ? value_to_integer(argv[1]) : 1;
+
+    if (width > 0 && height > 0 && width <= CONV_MAX_SIZE && height <= CONV_MAX_SIZE) {
+        descriptor->radius = (width > height ? width : height) / 2;
+        descriptor->cost = width * height >= CONV_FFT_THRESHOLD ? 400 : 2 + width * height / 4.0;
+    }
+
+    return NULL;
+}
+
+const char * box_specialize(struct module_descriptor * descriptor, uint32_t argc, const struct value * argv) {
+    int64_t radius = box_parse_radius(argc, argv);
+
+    descriptor->radius = radius < 0 ? 0 : radius;
+
+    if (radius == 0) {
+        descriptor->flags |= MODULE_IDENTITY;
+    }
+
+    return NULL;
+}
+
+const char * convolve_region(const struct module_region * region, uint32_t argc, const struct value * argv) {
+    struct conv_kernel kernel;
+    const char * error;
+
+    if ((error = conv_parse_kernel(argc, argv, &kernel)) != NULL) {
+        return error;
+    }
+
+    error = do_convolve_region(region, kernel);
+    conv_kernel_discard(kernel);
+    return error;
+}
+
+const char * sharpen_region(const struct module_region * region, uint32_t argc, const struct value * argv) {
+    struct conv_kernel kernel = conv_preset_kernel(3, conv_sharpen_weights);
+    const char * error = do_convolve_region(region, kernel);
+
+    conv_kernel_discard(kernel);
+    return error;
+}
+
+const char * emboss_region(const struct module_region * region, uint32_t argc, const struct value * argv) {
+    struct conv_kernel kernel = conv_preset_kernel(3, conv_emboss_weights);
+    const char * error = do_convolve_region(region, kernel);
+
+    conv_kernel_discard(kernel);
+    return error;
+}
+
+const char * edge_detect_region(const struct module_region * region, uint32_t argc, const struct value * argv) {
+    struct conv_kernel kernel = conv_preset_kernel(3, conv_edge_detect_weights);
+    const char * error = do_convolve_region(region, kernel);
+
+    conv_kernel_discard(kernel);
+    return error;
+}
+
+const char * box_region(const struct module_region * region, uint32_t argc, const struct value * argv) {
+    struct conv_kernel kernel;
+    const char * error;
+
+    if ((error = conv_parse_box(argc, argv, &kernel)) != NULL) {
+        return error;
+    }
+
+    error = do_convolve_region(region, kernel);
+    conv_kernel_discard(kernel);
+    return error;
+}
+
+const struct module_descriptor convolve_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_STENCIL, MODULE_THREAD_SAFE, MODULE_LAYOUT_RGB24,
+    1, 5, convolve_specialize,
+    MODULE_BORDER_REPLICATE, convolve_region
+};
+
+const struct module_descriptor sharpen_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_STENCIL, MODULE_THREAD_SAFE, MODULE_LAYOUT_RGB24,
+    1, 5, NULL,
+    MODULE_BORDER_REPLICATE, sharpen_region
+};
+
+const struct module_descriptor emboss_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_STENCIL, MODULE_THREAD_SAFE, MODULE_LAYOUT_RGB24,
+    1, 5, NULL,
+    MODULE_BORDER_REPLICATE, emboss_region
+};
+
+const struct module_descriptor edge_detect_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_STENCIL, MODULE_THREAD_SAFE, MODULE_LAYOUT_RGB24,
+    1, 5, NULL,
+    MODULE_BORDER_REPLICATE, edge_detect_region
+};
+
+const struct module_descriptor box_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_STENCIL, MODULE_THREAD_SAFE, MODULE_LAYOUT_RGB24,
+    1, 4, box_specialize,
+    MODULE_BORDER_REPLICATE, box_region
+};
+
+/* convolve(width, height, coefficients...[, divisor[, bias]])
+ *
+ * Kernel is applied as written (correlation) and centered, so sizes must be odd.
+ * Divisor defaults to coefficients sum (or 1 if the sum is zero), bias defaults to 0.
+ */
+const char * convolve(struct image * image, uint32_t argc, const struct value * argv) {
+    struct conv_kernel kernel;
+    const char * error;
+
+    if ((error = conv_parse_kernel(argc, argv, &kernel)) != NULL) {
+        return error;
+    }
+
+    error = do_convolve(image, kernel);
+    conv_kernel_discard(kernel);
+    return error;
+}
+
+const char * sharpen(struct image * image, uint32_t argc, const struct value * argv) {
+    struct conv_kernel kernel = conv_preset_kernel(3, conv_sharpen_weights);
+    const char * error = do_convolve(image, kernel);
+
+    conv_kernel_discard(kernel);
+    return error;
+}
+
+const char * emboss(struct image * image, uint32_t argc, const struct value * argv) {
+    struct conv_kernel kernel = conv_preset_kernel(3, conv_emboss_weights);
+    const char * error = do_convolve(image, kernel);
+
+    conv_kernel_discard(kernel);
+    return error;
+}
+
+const char * edge_detect(struct image * image, uint32_t argc, const struct value * argv) {
+    struct conv_kernel kernel = conv_preset_kernel(3, conv_edge_detect_weights);
+    const char * error = do_convolve(image, kernel);
+
+    conv_kernel_discard(kernel);
+    return error;
+}
+
+/* box([radius]), default radius is 1 */
+const char * box(struct image * image, uint32_t argc, const struct value * argv) {
+    struct conv_kernel kernel;
+    const char * error;
+
+    if ((error = conv_parse_box(argc, argv, &kernel)) != NULL) {
+        return error;
+    }
+
+    error = do_convolve(image, kernel);
+    conv_kernel_discard(kernel);
+    return error;
+}
@@ -0,0 +1,539 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "../image.h"
+#include "../value.h"
+#include "../module.h"
+
+#ifndef M_PI
+#define M_PI (3.14159265358979323846)
+#endif
+
+/* Maximal side of resulting image */
+#define RESIZE_MAX_SIZE (1 << 20)
+
+/* Minimal count of output rows processed by one thread */
+#define RESIZE_MIN_BAND (8)
+
+/* Fraction bits of weights and of intermediate (horizontally resampled) values */
+#define RESIZE_WEIGHT_BITS (14)
+#define RESIZE_VALUE_BITS (6)
+
+typedef double (* resize_filter)(double x);
+
+/* Contribution of source pixels [start, start + count) to each output pixel */
+struct resize_weights {
+    uint32_t * start;
+    uint32_t * count;
+    int16_t * weights; /* `max_count` per output pixel */
+
+    uint32_t max_count;
+};
+
+struct resize_band {
+    const struct image * source;
+    struct image * result;
+
+    const struct resize_weights * horizontal;
+    const struct resize_weights * vertical;
+};
+
+struct resize_blocks {
+    const struct image * source;
+    struct image * result;
+
+    uint32_t factor_x, factor_y;
+};
+
+double resize_sinc(double x) {
+    return x == 0 ? 1 : sin(M_PI * x) / (M_PI * x);
+}
+
+/* Filters are exported to be passed as identifiers: resize.resize(w, h, lanczos) */
+
+double area(double x) {
+    return x >= -0.5 && x < 0.5 ? 1 : 0;
+}
+
+double bilinear(double x) {
+    return x < 0 ? (x > -1 ? 1 + x : 0) : (x < 1 ? 1 - x : 0);
+}
+
+double lanczos(double x) {
+    return x > -3 && x < 3 ? resize_sinc(x) * resize_sinc(x / 3) : 0;
+}
+
+double resize_filter_radius(resize_filter filter) {
+    return filter == area ? 0.5 : filter == bilinear ? 1 : 3;
+}
+
+/* Builds fixed-point weights mapping `src_size` pixels to `dst_size` ones
+ *
+ * Taps outside of the source are clamped to the edge pixel, weights of each output
+ * pixel sum exactly to 1 << RESIZE_WEIGHT_BITS.
+ */
+struct resize_weights resize_weights_create(uint32_t src_size, uint32_t dst_size, resize_filter filter) {
+    const double scale = (double) src_size / dst_size;
+    const double filter_scale = scale > 1 ? scale : 1;
+    const double support = resize_filter_radius(filter) * filter_scale;
+    struct resize_weights weights;
+    double center, sum, * values;
+    int64_t first, last, j, k;
+    int32_t fixed_sum, best;
+    uint32_t i;
+
+    weights.max_count = (uint32_t) ceil(2 * support) + 2;
+    if (weights.max_count > src_size) {
+        weights.max_count = src_size;
+    }
+
+    weights.start = malloc(sizeof(uint32_t) * dst_size);
+    weights.count = malloc(sizeof(uint32_t) * dst_size);
+    weights.weights = calloc((size_t) dst_size * weights.max_count, sizeof(int16_t));
+    values = malloc(sizeof(double) * weights.max_count);
+
+    for (i = 0; i < dst_size; ++i) {
+        center = (i + 0.5) * scale - 0.5;
+        first = (int64_t) floor(center - support);
+        last = (int64_t) ceil(center + support);
+
+        first = first < 0 ? 0 : first;
+        last = last >= src_size ? src_size - 1 : last;
+        if (last - first + 1 > weights.max_count) {
+            first = last - weights.max_count + 1;
+        }
+
+        memset(values, 0, sizeof(double) * weights.max_count);
+        sum = 0;
+
+        for (j = (int64_t) floor(center - support); j <= (int64_t) ceil(center + support); ++j) {
+            k = j < first ? first : j > last ? last : j;
+            values[k - first] += filter((j - center) / filter_scale);
+        }
+
+        for (k = 0; k <= last - first; ++k) {
+            sum += values[k];
+        }
+
+        if (sum == 0) { /* fall back to the nearest pixel */
+            k = (int64_t) floor(center + 0.5);
+            values[(k < first ? first : k > last ? last : k) - first] = sum = 1;
+        }
+
+        fixed_sum = 0;
+        best = 0;
+
+        for (k = 0; k <= last - first; ++k) {
+            weights.weights[(size_t) weights.max_count * i + k]
+                = (int16_t) floor(ldexp(values[k] / sum, RESIZE_WEIGHT_BITS) + 0.5);
+
+            fixed_sum += weights.weights[(size_t) weights.max_count * i + k];
+            if (values[k] > values[best]) {
+                best = k;
+            }
+        }
+
+        weights.weights[(size_t) weights.max_count * i + best] += (1 << RESIZE_WEIGHT_BITS) - fixed_sum;
+        weights.start[i] = first;
+        weights.count[i] = last - first + 1;
+    }
+
+    free(values);
+    return weights;
+}
+
+void resize_weights_discard(struct resize_weights weights) {
+    free(weights.start);
+    free(weights.count);
+    free(weights.weights);
+}
+
+/* Resamples source row to `width` intermediate values per channel */
+void resize_horizontal(const struct pixel * src, const struct resize_weights weights, uint32_t width, int16_t * dst) {
+    const int16_t * w;
+    const struct pixel * p;
+    int32_t red, green, blue;
+    uint32_t x, k;
+
+    for (x = 0; x < width; ++x) {
+        w = weights.weights + (size_t) weights.max_count * x;
+        p = src + weights.start[x];
+        red = green = blue = 1 << (RESIZE_WEIGHT_BITS - RESIZE_VALUE_BITS - 1);
+
+        for (k = 0; k < weights.count[x]; ++k) {
+            red += w[k] * p[k].red;
+            green += w[k] * p[k].green;
+            blue += w[k] * p[k].blue;
+        }
+
+        dst[3 * x] = red >> (RESIZE_WEIGHT_BITS - RESIZE_VALUE_BITS);
+        dst[3 * x + 1] = green >> (RESIZE_WEIGHT_BITS - RESIZE_VALUE_BITS);
+        dst[3 * x + 2] = blue >> (RESIZE_WEIGHT_BITS - RESIZE_VALUE_BITS);
+    }
+}
+
+/* Blends `count` intermediate rows into `length` bytes */
+void resize_vertical(const int16_t * const * rows, const int16_t * weights, uint32_t count, uint32_t length, uint8_t * dst) {
+    const int32_t rounding = 1 << (RESIZE_WEIGHT_BITS + RESIZE_VALUE_BITS - 1);
+    uint32_t i = 0, k;
+    int32_t sum;
+
+#ifdef __SSE2__
+    __m128i sum_lo, sum_hi, a, b, pair;
+
+    for (; i + 8 <= length; i += 8) {
+        sum_lo = sum_hi = _mm_set1_epi32(rounding);
+
+        for (k = 0; k < count; k += 2) {
+            a = _mm_loadu_si128((const __m128i *) (rows[k] + i));
+
+            if (k + 1 < count) {
+                b = _mm_loadu_si128((const __m128i *) (rows[k + 1] + i));
+                pair = _mm_set1_epi32((int32_t) (((uint32_t) (uint16_t) weights[k + 1] << 16) | (uint16_t) weights[k]));
+            } else {
+                b = _mm_setzero_si128();
+                pair = _mm_set1_epi32((uint16_t) weights[k]);
+            }
+
+            sum_lo = _mm_add_epi32(sum_lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), pair));
+            sum_hi = _mm_add_epi32(sum_hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), pair));
+        }
+
+        a = _mm_packs_epi32(
+            _mm_srai_epi32(sum_lo, RESIZE_WEIGHT_BITS + RESIZE_VALUE_BITS),
+            _mm_srai_epi32(sum_hi, RESIZE_WEIGHT_BITS + RESIZE_VALUE_BITS)
+        );
+
+        _mm_storel_epi64((__m128i *) (dst + i), _mm_packus_epi16(a, a));
+    }
+#endif
+
+    for (; i < length; ++i) {
+        sum = rounding;
+
+        for (k = 0; k < count; ++k) {
+            sum += weights[k] * rows[k][i];
+        }
+
+        sum >>= RESIZE_WEIGHT_BITS + RESIZE_VALUE_BITS;
+        dst[i] = sum < 0 ? 0 : sum > 255 ? 255 : sum;
+    }
+}
+
+/* Resamples output rows [from, to), horizontally resampled source rows are kept in a ring */
+const char * resize_band_run(void * context, uint32_t from, uint32_t to) {
+    const struct module_host * host = module_host_current();
+    const struct resize_band band = *((struct resize_band *) context);
+    const uint32_t length = 3 * band.result->width, ring_size = band.vertical->max_count;
+    int16_t * ring = malloc(sizeof(int16_t) * length * ring_size);
+    const int16_t ** rows = malloc(sizeof(int16_t *) * ring_size);
+    uint32_t y, k, start, next_row = 0;
+    const char * error = NULL;
+
+    for (y = from; y < to && !(error = MODULE_CANCELLED(host)); ++y) {
+        start = band.vertical->start[y];
+
+        if (next_row < start) {
+            next_row = start;
+        }
+
+        for (; next_row < start + band.vertical->count[y]; ++next_row) {
+            resize_horizontal(band.source->pixels + (size_t) band.source->width * next_row, *band.horizontal,
+                band.result->width, ring + (size_t) length * (next_row % ring_size));
+        }
+
+        for (k = 0; k < band.vertical->count[y]; ++k) {
+            rows[k] = ring + (size_t) length * ((start + k) % ring_size);
+        }
+
+        resize_vertical(rows, band.vertical->weights + (size_t) band.vertical->max_count * y,
+            band.vertical->count[y], length, (uint8_t *) (band.result->pixels + (size_t) band.result->width * y));
+    }
+
+    free(rows);
+    free(ring);
+    return error;
+}
+
+#ifdef __SSSE3__
+
+/* Loads 4 pixels as 16-bit lanes of pixels 0 and 2 in `even`, 1 and 3 in `odd` (4 lanes per pixel) */
+void resize_load_pairs(const uint8_t * bytes, __m128i * even, __m128i * odd) {
+    static const uint8_t even_mask[16] = { 0, 0x80, 1, 0x80, 2, 0x80, 0x80, 0x80, 6, 0x80, 7, 0x80, 8, 0x80, 0x80, 0x80 };
+    static const uint8_t odd_mask[16] = { 3, 0x80, 4, 0x80, 5, 0x80, 0x80, 0x80, 9, 0x80, 10, 0x80, 11, 0x80, 0x80, 0x80 };
+    __m128i value;
+    uint32_t tail;
+
+    memcpy(&tail, bytes + 8, sizeof(tail));
+    value = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *) bytes), _mm_cvtsi32_si128(tail));
+
+    *even = _mm_shuffle_epi8(value, _mm_loadu_si128((const __m128i *) even_mask));
+    *odd = _mm_shuffle_epi8(value, _mm_loadu_si128((const __m128i *) odd_mask));
+}
+
+/* Packs two vectors of 2 pixels (4 16-bit lanes each) to 4 packed pixels */
+void resize_store_pixels4(uint8_t * bytes, __m128i first, __m128i second) {
+    static const uint8_t compress_mask[16] = { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0x80, 0x80, 0x80, 0x80 };
+    __m128i value = _mm_shuffle_epi8(_mm_packus_epi16(first, second), _mm_loadu_si128((const __m128i *) compress_mask));
+    uint32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(value, 8));
+
+    _mm_storel_epi64((__m128i *) bytes, value);
+    memcpy(bytes + 8, &tail, sizeof(tail));
+}
+
+/* Sums of pixel pairs (0 + 1, 2 + 3) of 4 pixels */
+__m128i resize_sum_pairs(const uint8_t * bytes) {
+    __m128i even, odd;
+
+    resize_load_pairs(bytes, &even, &odd);
+    return _mm_add_epi16(even, odd);
+}
+
+/* Reduces 8x2 pixels to 4 ones, returns count of processed output pixels */
+uint32_t resize_blocks_2x2(const uint8_t * row0, const uint8_t * row1, uint8_t * dst, uint32_t width) {
+    const __m128i rounding = _mm_set1_epi16(2);
+    __m128i first, second;
+    uint32_t x;
+
+    for (x = 0; x + 4 <= width; x += 4, row0 += 24, row1 += 24, dst += 12) {
+        first = _mm_add_epi16(_mm_add_epi16(resize_sum_pairs(row0), resize_sum_pairs(row1)), rounding);
+        second = _mm_add_epi16(_mm_add_epi16(resize_sum_pairs(row0 + 12), resize_sum_pairs(row1 + 12)), rounding);
+
+        resize_store_pixels4(dst, _mm_srli_epi16(first, 2), _mm_srli_epi16(second, 2));
+    }
+
+    return x;
+}
+
+/* Sum of 4x4 pixels block in lanes 0-2 */
+__m128i resize_sum_block4x4(const uint8_t * const * rows, uint32_t offset) {
+    __m128i sum = _mm_setzero_si128();
+    uint32_t k;
+
+    for (k = 0; k < 4; ++k) {
+        sum = _mm_add_epi16(sum, resize_sum_pairs(rows[k] + offset));
+    }
+
+    return _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+}
+
+/* Reduces 16x4 pixels to 4 ones, returns count of processed output pixels */
+uint32_t resize_blocks_4x4(const uint8_t * const * rows, uint8_t * dst, uint32_t width) {
+    const __m128i rounding = _mm_set1_epi16(8);
+    __m128i sums[4];
+    uint32_t x, k;
+
+    for (x = 0; x + 4 <= width; x += 4, dst += 12) {
+        for (k = 0; k < 4; ++k) {
+            sums[k] = _mm_srli_epi16(_mm_add_epi16(resize_sum_block4x4(rows, 12 * (x + k)), rounding), 4);
+        }
+
+        resize_store_pixels4(dst, _mm_unpacklo_epi64(sums[0], sums[1]), _mm_unpacklo_epi64(sums[2], sums[3]));
+    }
+
+    return x;
+}
+
+#endif
+
+/* Averages `factor_x`x`factor_y` blocks of output rows [from, to) */
+const char * resize_blocks_run(void * context, uint32_t from, uint32_t to) {
+    const struct module_host * host = module_host_current();
+    const struct resize_blocks blocks = *((struct resize_blocks *) context);
+    const uint32_t area_size = blocks.factor_x * blocks.factor_y;
+    const struct pixel * src, * p;
+    uint32_t red, green, blue;
+    const char * error = NULL;
+    uint32_t x, y, i, j;
+    struct pixel * dst;
+
+#ifdef __SSSE3__
+    const uint8_t * rows[4];
+#endif
+
+    for (y = from; y < to && !(error = MODULE_CANCELLED(host)); ++y) {
+        src = blocks.source->pixels + (size_t) blocks.source->width * blocks.factor_y * y;
+        dst = blocks.result->pixels + (size_t) blocks.result->width * y;
+        x = 0;
+
+#ifdef __SSSE3__
+        if (blocks.factor_x == 2 && blocks.factor_y == 2) {
+            x = resize_blocks_2x2((const uint8_t *) src, (const uint8_t *) (src + blocks.source->width),
+                (uint8_t *) dst, blocks.result->width);
+        } else if (blocks.factor_x == 4 && blocks.factor_y == 4) {
+            for (i = 0; i < 4; ++i) {
+                rows[i] = (const uint8_t *) (src + (size_t) blocks.source->width * i);
+            }
+
+            x = resize_blocks_4x4(rows, (uint8_t *) dst, blocks.result->width);
+        }
+#endif
+
+        for (; x < blocks.result->width; ++x) {
+            red = green = blue = area_size / 2;
+
+            for (i = 0; i < blocks.factor_y; ++i) {
+                p = src + (size_t) blocks.source->width * i + blocks.factor_x * x;
+
+                for (j = 0; j < blocks.factor_x; ++j) {
+                    red += p[j].red;
+                    green += p[j].green;
+                    blue += p[j].blue;
+                }
+            }
+
+            dst[x].red = red / area_size;
+            dst[x].green = green / area_size;
+            dst[x].blue = blue / area_size;
+        }
+    }
+
+    return error;
+}
+
+/* Bands of output rows are processed in parallel on host pool */
+const char * do_resize(struct image * image, uint32_t width, uint32_t height, resize_filter filter) {
+    const struct module_host * host = module_host_current();
+    struct image result = image_create(width, height);
+    struct resize_weights horizontal, vertical;
+    struct resize_blocks blocks;
+    struct resize_band band;
+    const char * error;
+
+    if ((!filter || filter == area) && image->width % width == 0 && image->height % height == 0) {
+        blocks.source = image;
+        blocks.result = &result;
+        blocks.factor_x = image->width / width;
+        blocks.factor_y = image->height / height;
+
+        error = MODULE_PARALLEL_FOR(host, height, RESIZE_MIN_BAND, resize_blocks_run, &blocks);
+    } else {
+        horizontal = resize_weights_create(image->width, width, filter ? filter : lanczos);
+        vertical = resize_weights_create(image->height, height, filter ? filter : lanczos);
+
+        band.source = image;
+        band.result = &result;
+        band.horizontal = &horizontal;
+        band.vertical = &vertical;
+
+        error = MODULE_PARALLEL_FOR(host, height, RESIZE_MIN_BAND, resize_band_run, &band);
+
+        resize_weights_discard(vertical);
+        resize_weights_discard(horizontal);
+    }
+
+    if (error) {
+        image_discard(result);
+        return error;
+    }
+
+    image_discard(*image);
+    *image = result;
+    return NULL;
+}
+
+const char * resize_parse_filter(resize_filter * filter, uint32_t argc, const struct value * argv, uint32_t index) {
+    *filter = NULL;
+
+    if (argc <= index) {
+        return NULL;
+    }
+
+    if (!value_is_identifier(argv[index])) {
+        return "filter should be an identifier (area, bilinear or lanczos)";
+    }
+
+    *((void **) filter) = value_to_identifier(argv[index]);
+
+    if (*filter != area && *filter != bilinear && *filter != lanczos) {
+        return "wrong filter, only area, bilinear or lanczos are allowed";
+    }
+
+    return NULL;
+}
+
+/* Resampling to the same size keeps image as is */
+const char * scale_specialize(struct module_descriptor * descriptor, uint32_t argc, const struct value * argv) {
+    if (argc > 0 && value_is_floating(argv[0]) && value_to_floating(argv[0]) == 1) {
+        descriptor->flags |= MODULE_IDENTITY;
+    }
+
+    return NULL;
+}
+
+const struct module_descriptor resize_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_GEOMETRIC, MODULE_THREAD_SAFE | MODULE_RESIZES | MODULE_IDEMPOTENT, MODULE_LAYOUT_RGB24,
+    0, 6, NULL
+};
+
+const struct module_descriptor scale_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_GEOMETRIC, MODULE_THREAD_SAFE | MODULE_RESIZES, MODULE_LAYOUT_RGB24,
+    0, 6, scale_specialize
+};
+
+/* resize(width, height[, filter])
+ *
+ * Without filter integer downscaling averages blocks and other scaling uses lanczos.
+ */
+const char * resize(struct image * image, uint32_t argc, const struct value * argv) {
+    int64_t width, height;
+    resize_filter filter;
+    const char * error;
+
+    if (argc < 2 || !value_is_integer(argv[0]) || !value_is_integer(argv[1])) {
+        return "width and height are required as first arguments";
+    }
+
+    width = value_to_integer(argv[0]);
+    height = value_to_integer(argv[1]);
+
+    if (width < 1 || height < 1 || width > RESIZE_MAX_SIZE || height > RESIZE_MAX_SIZE) {
+        return "width and height should be positive numbers up to 1048576";
+    }
+
+    if ((error = resize_parse_filter(&filter, argc, argv, 2))) {
+        return error;
+    }
+
+    return image->width > 0 && image->height > 0 ? do_resize(image, width, height, filter) : NULL;
+}
+
+/* scale(factor[, filter]) */
+const char * scale(struct image * image, uint32_t argc, const struct value * argv) {
+    double factor, width, height;
+    resize_filter filter;
+    const char * error;
+
+    if (argc < 1 || !value_is_floating(argv[0])) {
+        return "scale factor is required as first argument";
+    }
+
+    factor = value_to_floating(argv[0]);
+    width = floor(image->width * factor + 0.5);
+    height = floor(image->height * factor + 0.5);
+
+    if (!(factor > 0) || width > RESIZE_MAX_SIZE || height > RESIZE_MAX_SIZE) {
+        return "scale factor is out of range";
+    }
+
+    if ((error = resize_parse_filter(&filter, argc, argv, 1))) {
+        return error;
+    }
+
+    return image->width > 0 && image->height > 0
+        ? do_resize(image, width < 1 ? 1 : width, height < 1 ? 1 : height, filter)
+        : NULL;
+}
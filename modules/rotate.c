@@ -1,16 +1,327 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include <float.h>
 #include <math.h>
 
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
 #include "../image.h"
 #include "../value.h"
+#include "../module.h"
 
 #ifndef M_PI
 #define M_PI (3.14159265358979323846)
 #endif
 
+/* Side of the square tile used by blocked transposition, in pixels.
+ * Source and destination tiles (2 * 32 * 32 * 3 bytes) fit in L1 together.
+ */
+#define ROTATE_TILE (32)
+
+/* Minimal count of rows processed by one thread */
+#define ROTATE_MIN_ROWS (32)
+
+struct rotate_job {
+    const struct image * source;
+    struct image * result;
+
+    bool flip_rows, flip_cols;
+};
+
+#ifdef __SSSE3__
+
+/* Shuffle masks for the SIMD kernels.
+ *
+ * expand/compress convert 4 packed 24-bit pixels to 4 dwords and back.
+ * reverse[k][m] selects bytes of input register m that land in output register k
+ * when 16 packed pixels (3 registers) are reversed.
+ */
+static const uint8_t rotate_mask_expand[16] = {
+    0, 1, 2, 0x80, 3, 4, 5, 0x80, 6, 7, 8, 0x80, 9, 10, 11, 0x80
+};
+
+static const uint8_t rotate_mask_compress[16] = {
+    0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0x80, 0x80, 0x80, 0x80
+};
+
+static const uint8_t rotate_mask_reverse[3][3][16] = {
+    {
+        { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+        { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 14 },
+        { 13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, 0x80 }
+    },
+    {
+        { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 15, 0x80 },
+        { 15, 0x80, 11, 12, 13, 8, 9, 10, 5, 6, 7, 2, 3, 4, 0x80, 0 },
+        { 0x80, 0, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 }
+    },
+    {
+        { 0x80, 12, 13, 14, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2 },
+        { 1, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+        { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 }
+    }
+};
+
+__m128i load_pixels4(const struct pixel * pixels) {
+    uint32_t tail;
+
+    memcpy(&tail, ((const uint8_t *) pixels) + 8, sizeof(tail));
+    return _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *) pixels), _mm_cvtsi32_si128(tail));
+}
+
+void store_pixels4(struct pixel * pixels, __m128i value) {
+    uint32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(value, 8));
+
+    _mm_storel_epi64((__m128i *) pixels, value);
+    memcpy(((uint8_t *) pixels) + 8, &tail, sizeof(tail));
+}
+
+/* Transposes 4x4 pixels block, rows are taken in order of `src` pointers */
+void transpose_pixels4x4(const struct pixel * const src[4], struct pixel * const dst[4]) {
+    const __m128i expand = _mm_loadu_si128((const __m128i *) rotate_mask_expand);
+    const __m128i compress = _mm_loadu_si128((const __m128i *) rotate_mask_compress);
+    __m128i r0, r1, r2, r3, t0, t1, t2, t3;
+
+    r0 = _mm_shuffle_epi8(load_pixels4(src[0]), expand);
+    r1 = _mm_shuffle_epi8(load_pixels4(src[1]), expand);
+    r2 = _mm_shuffle_epi8(load_pixels4(src[2]), expand);
+    r3 = _mm_shuffle_epi8(load_pixels4(src[3]), expand);
+
+    t0 = _mm_unpacklo_epi32(r0, r1);
+    t1 = _mm_unpacklo_epi32(r2, r3);
+    t2 = _mm_unpackhi_epi32(r0, r1);
+    t3 = _mm_unpackhi_epi32(r2, r3);
+
+    store_pixels4(dst[0], _mm_shuffle_epi8(_mm_unpacklo_epi64(t0, t1), compress));
+    store_pixels4(dst[1], _mm_shuffle_epi8(_mm_unpackhi_epi64(t0, t1), compress));
+    store_pixels4(dst[2], _mm_shuffle_epi8(_mm_unpacklo_epi64(t2, t3), compress));
+    store_pixels4(dst[3], _mm_shuffle_epi8(_mm_unpackhi_epi64(t2, t3), compress));
+}
+
+/* Reverses order of 16 pixels packed in 3 registers */
+void reverse_pixels16(__m128i * value) {
+    __m128i result[3];
+    uint32_t k, m;
+
+    for (k = 0; k < 3; ++k) {
+        result[k] = _mm_setzero_si128();
+
+        for (m = 0; m < 3; ++m) {
+            result[k] = _mm_or_si128(result[k], _mm_shuffle_epi8(value[m],
+                _mm_loadu_si128((const __m128i *) rotate_mask_reverse[k][m])));
+        }
+    }
+
+    value[0] = result[0];
+    value[1] = result[1];
+    value[2] = result[2];
+}
+
+#endif
+
+/* Reverses order of `count` pixels in place */
+void reverse_pixels(struct pixel * pixels, uint32_t count) {
+    struct pixel * first = pixels;
+    struct pixel * last = pixels + count;
+    struct pixel buffer;
+
+#ifdef __SSSE3__
+    __m128i head[3], tail[3];
+    uint32_t k;
+
+    for (; last - first >= 32; first += 16, last -= 16) {
+        for (k = 0; k < 3; ++k) {
+            head[k] = _mm_loadu_si128(((const __m128i *) first) + k);
+            tail[k] = _mm_loadu_si128(((const __m128i *) (last - 16)) + k);
+        }
+
+        reverse_pixels16(head);
+        reverse_pixels16(tail);
+
+        for (k = 0; k < 3; ++k) {
+            _mm_storeu_si128(((__m128i *) first) + k, tail[k]);
+            _mm_storeu_si128(((__m128i *) (last - 16)) + k, head[k]);
+        }
+    }
+#endif
+
+    for (; last - first > 1; ++first) {
+        --last;
+
+        buffer = *first;
+        *first = *last;
+        *last = buffer;
+    }
+}
+
+/* Copies `w`x`h` rectangle at (`x0`, `y0`) of `image` transposed into `result` */
+void transpose_rect(
+    const struct image image, struct image result,
+    uint32_t x0, uint32_t y0, uint32_t w, uint32_t h,
+    bool flip_rows, bool flip_cols
+) {
+    uint32_t x, y, dst_x, dst_y;
+
+    for (y = y0; y < y0 + h; ++y) {
+        dst_x = flip_cols ? image.height - 1 - y : y;
+
+        for (x = x0; x < x0 + w; ++x) {
+            dst_y = flip_rows ? image.width - 1 - x : x;
+            result.pixels[result.width * dst_y + dst_x] = image.pixels[image.width * y + x];
+        }
+    }
+}
+
+/* Copies rows of tiles [from, to) transposed, inner 4x4 blocks are transposed in registers.
+ * A stopped run is noticed between rows of tiles.
+ */
+const char * transpose_tiles_run(void * context, uint32_t from, uint32_t to) {
+    const struct module_host * host = module_host_current();
+    const struct rotate_job job = *((struct rotate_job *) context);
+    const struct image * image = job.source;
+    const bool flip_rows = job.flip_rows, flip_cols = job.flip_cols;
+    uint32_t tile_x, tile_y, tile_w, tile_h, block_w, block_h;
+    const char * error;
+
+#ifdef __SSSE3__
+    const struct pixel * src_rows[4];
+    struct pixel * dst_rows[4];
+    uint32_t x, y, k, dst_x, dst_y;
+#endif
+
+    for (tile_y = from * ROTATE_TILE; tile_y < image->height && tile_y < to * ROTATE_TILE; tile_y += ROTATE_TILE) {
+        tile_h = image->height - tile_y < ROTATE_TILE ? image->height - tile_y : ROTATE_TILE;
+
+        if ((error = MODULE_CANCELLED(host))) {
+            return error;
+        }
+
+        for (tile_x = 0; tile_x < image->width; tile_x += ROTATE_TILE) {
+            tile_w = image->width - tile_x < ROTATE_TILE ? image->width - tile_x : ROTATE_TILE;
+            block_w = block_h = 0;
+
+#ifdef __SSSE3__
+            block_w = tile_w & ~3u;
+            block_h = tile_h & ~3u;
+
+            for (y = tile_y; y < tile_y + block_h; y += 4) {
+                dst_x = flip_cols ? image->height - 4 - y : y;
+
+                for (x = tile_x; x < tile_x + block_w; x += 4) {
+                    for (k = 0; k < 4; ++k) {
+                        src_rows[k] = image->pixels + image->width * (y + (flip_cols ? 3 - k : k)) + x;
+
+                        dst_y = flip_rows ? image->width - 1 - (x + k) : x + k;
+                        dst_rows[k] = job.result->pixels + job.result->width * dst_y + dst_x;
+                    }
+
+                    transpose_pixels4x4(src_rows, dst_rows);
+                }
+            }
+#endif
+
+            transpose_rect(*image, *job.result, tile_x + block_w, tile_y, tile_w - block_w, block_h, flip_rows, flip_cols);
+            transpose_rect(*image, *job.result, tile_x, tile_y + block_h, tile_w, tile_h - block_h, flip_rows, flip_cols);
+        }
+    }
+
+    return NULL;
+}
+
+/* Copies pixel (x, y) of the image to (y, x) of a new one
+ *
+ * If `flip_rows` is set destination row is mirrored (width - 1 - x),
+ * if `flip_cols` is set destination column is mirrored (height - 1 - y).
+ * Copy is done by square tiles, rows of tiles are processed in parallel.
+ */
+const char * do_transpose(struct image * image, bool flip_rows, bool flip_cols) {
+    const struct module_host * host = module_host_current();
+    struct image result = image_create(image->height, image->width);
+    struct rotate_job job;
+    const char * error;
+
+    job.source = image;
+    job.result = &result;
+    job.flip_rows = flip_rows;
+    job.flip_cols = flip_cols;
+
+    if ((error = MODULE_PARALLEL_FOR(host, (image->height + ROTATE_TILE - 1) / ROTATE_TILE,
+            ROTATE_MIN_ROWS / ROTATE_TILE, transpose_tiles_run, &job))) {
+        image_discard(result);
+        return error;
+    }
+
+    image_discard(*image);
+    *image = result;
+    return NULL;
+}
+
+const char * flip_horizontal_run(void * context, uint32_t from, uint32_t to) {
+    struct image * image = ((struct rotate_job *) context)->result;
+    uint32_t y;
+
+    for (y = from; y < to; ++y) {
+        reverse_pixels(image->pixels + image->width * y, image->width);
+    }
+
+    return NULL;
+}
+
+void do_flip_horizontal(struct image * image) {
+    const struct module_host * host = module_host_current();
+    struct rotate_job job;
+
+    job.source = job.result = image;
+    MODULE_PARALLEL_FOR(host, image->height, ROTATE_MIN_ROWS, flip_horizontal_run, &job);
+}
+
+/* Swaps rows y and height - 1 - y for y in [from, to) */
+const char * flip_vertical_run(void * context, uint32_t from, uint32_t to) {
+    struct image * image = ((struct rotate_job *) context)->result;
+    const size_t row_size = sizeof(struct pixel) * image->width;
+    struct pixel * buffer = malloc(row_size);
+    uint32_t y;
+
+    for (y = from; y < to; ++y) {
+        memcpy(buffer, image->pixels + image->width * y, row_size);
+        memcpy(image->pixels + image->width * y, image->pixels + image->width * (image->height - 1 - y), row_size);
+        memcpy(image->pixels + image->width * (image->height - 1 - y), buffer, row_size);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+void do_flip_vertical(struct image * image) {
+    const struct module_host * host = module_host_current();
+    struct rotate_job job;
+
+    job.source = job.result = image;
+    MODULE_PARALLEL_FOR(host, image->height / 2, ROTATE_MIN_ROWS, flip_vertical_run, &job);
+}
+
+/* Rotates image by `quarters` * 90 degrees exactly, without resampling */
+const char * do_rotate_exact(struct image * image, int32_t quarters) {
+    switch (((quarters % 4) + 4) % 4) {
+    case 1:
+        return do_transpose(image, false, true);
+
+    case 2:
+        reverse_pixels(image->pixels, image->width * image->height);
+        break;
+
+    case 3:
+        return do_transpose(image, true, false);
+    }
+
+    return NULL;
+}
+
 double min(double a, double b) {
     return a < b ? a : b;
 }
@@ -123,11 +434,125 @@ void do_rotate(struct image * image, double angle) {
     free(pixels);
 }
 
+double rotate_parse_degrees(uint32_t argc, const struct value * argv) {
+    return argc > 0 && value_is_floating(argv[0])
+        ? value_to_floating(argv[0])
+        : 90;
+}
+
+const char * rotate_specialize(struct module_descriptor * descriptor, uint32_t argc, const struct value * argv) {
+    double degrees = rotate_parse_degrees(argc, argv);
+
+    if (fmod(degrees, 360) == 0) {
+        descriptor->flags |= MODULE_IDENTITY;
+    }
+
+    if (fmod(degrees, 180) == 0) {
+        descriptor->flags = (descriptor->flags | MODULE_IN_PLACE) & ~MODULE_RESIZES;
+        descriptor->cost = 0.5;
+    } else if (fmod(degrees, 90) == 0) {
+        descriptor->cost = 1;
+    }
+
+    return NULL;
+}
+
+/* Quarter turns have exact matrices, so their compositions stay exact */
+const char * rotate_affine(double matrix[4], uint32_t argc, const struct value * argv) {
+    double degrees = rotate_parse_degrees(argc, argv), c, s;
+
+    if (fmod(degrees, 90) == 0) {
+        switch (((int64_t) fmod(degrees / 90, 4) + 4) % 4) {
+        case 0: c = 1; s = 0; break;
+        case 1: c = 0; s = 1; break;
+        case 2: c = -1; s = 0; break;
+        default: c = 0; s = -1; break;
+        }
+    } else {
+        c = cos(degrees * M_PI / 180);
+        s = sin(degrees * M_PI / 180);
+    }
+
+    matrix[0] = c;
+    matrix[1] = -s;
+    matrix[2] = s;
+    matrix[3] = c;
+    return NULL;
+}
+
+const char * transpose_affine(double matrix[4], uint32_t argc, const struct value * argv) {
+    matrix[0] = 0;
+    matrix[1] = 1;
+    matrix[2] = 1;
+    matrix[3] = 0;
+    return NULL;
+}
+
+const char * flip_horizontal_affine(double matrix[4], uint32_t argc, const struct value * argv) {
+    matrix[0] = -1;
+    matrix[1] = 0;
+    matrix[2] = 0;
+    matrix[3] = 1;
+    return NULL;
+}
+
+const char * flip_vertical_affine(double matrix[4], uint32_t argc, const struct value * argv) {
+    matrix[0] = 1;
+    matrix[1] = 0;
+    matrix[2] = 0;
+    matrix[3] = -1;
+    return NULL;
+}
+
+const struct module_descriptor rotate_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_GEOMETRIC, MODULE_THREAD_SAFE | MODULE_RESIZES, MODULE_LAYOUT_RGB24,
+    0, 40, rotate_specialize,
+    MODULE_BORDER_REPLICATE, NULL, NULL, rotate_affine
+};
+
+const struct module_descriptor transpose_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_GEOMETRIC, MODULE_THREAD_SAFE | MODULE_RESIZES, MODULE_LAYOUT_RGB24,
+    0, 1, NULL,
+    MODULE_BORDER_REPLICATE, NULL, NULL, transpose_affine
+};
+
+const struct module_descriptor flip_horizontal_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_GEOMETRIC, MODULE_THREAD_SAFE | MODULE_IN_PLACE, MODULE_LAYOUT_RGB24,
+    0, 0.5, NULL,
+    MODULE_BORDER_REPLICATE, NULL, NULL, flip_horizontal_affine
+};
+
+const struct module_descriptor flip_vertical_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_GEOMETRIC, MODULE_THREAD_SAFE | MODULE_IN_PLACE, MODULE_LAYOUT_RGB24,
+    0, 0.3, NULL,
+    MODULE_BORDER_REPLICATE, NULL, NULL, flip_vertical_affine
+};
+
 const char * rotate(struct image * image, uint32_t argc, const struct value * argv) {
-    double angle = argc > 0 && value_is_floating(argv[0])
-        ? value_to_floating(argv[0]) * M_PI / 180
-        : M_PI / 2;
+    double degrees = rotate_parse_degrees(argc, argv);
+
+    if (fmod(degrees, 90) == 0 && fabs(degrees) < INT32_MAX) {
+        return do_rotate_exact(image, (int32_t) (degrees / 90));
+    }
+
+    do_rotate(image, degrees * M_PI / 180);
+    return NULL;
+}
+
+const char * transpose(struct image * image, uint32_t argc, const struct value * argv) {
+    return do_transpose(image, false, false);
+}
+
+const char * flip_horizontal(struct image * image, uint32_t argc, const struct value * argv) {
+    do_flip_horizontal(image);
+    return NULL;
+}
 
-    do_rotate(image, angle);
+const char * flip_vertical(struct image * image, uint32_t argc, const struct value * argv) {
+    do_flip_vertical(image);
     return NULL;
 }
@@ -1,4 +1,8 @@
-%parse-param {struct ast_script ** result} {char ** error}
+%define api.pure full
+%locations
+
+%lex-param {yyscan_t scanner}
+%parse-param {yyscan_t scanner} {struct ast_script ** result} {char ** error}
 
 %{
 #include <string.h>
@@ -6,14 +10,39 @@
 #include <stdio.h>
 
 #include "ast.h"
-
-int yylex(void);
-
-void yyerror(struct ast_script ** result, char ** error, const char * str);
+#include "util.h"
 %}
 
 %code requires {
+#include <stdbool.h>
+#include <stdio.h>
+
 #include "ast.h"
+
+/* Reentrant scanner state, also defined by the lexer */
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void * yyscan_t;
+#endif
+}
+
+%code provides {
+/* Parse script code, on failure return false and set `error` to message to be freed */
+bool parser_parse_string(struct ast_script ** result, const char * code, char ** error);
+bool parser_parse_file(struct ast_script ** result, FILE * file, char ** error);
+}
+
+%code {
+typedef struct yy_buffer_state * YY_BUFFER_STATE;
+
+int yylex_init(yyscan_t * scanner);
+int yylex_destroy(yyscan_t scanner);
+void yyset_in(FILE * file, yyscan_t scanner);
+YY_BUFFER_STATE yy_scan_string(const char * str, yyscan_t scanner);
+
+int yylex(YYSTYPE * value, YYLTYPE * location, yyscan_t scanner);
+
+void yyerror(YYLTYPE * location, yyscan_t scanner, struct ast_script ** result, char ** error, const char * str);
 }
 
 %union {
@@ -32,6 +61,13 @@ void yyerror(struct ast_script ** result, char ** error, const char * str);
 %type<literal> literal
 %type<token> T_IDENTIFIER T_INTEGER T_FLOATING T_STRING
 
+/* values discarded on syntax error, so a failed parse leaves nothing behind */
+%destructor { free($$); } <token>
+%destructor { ast_script_delete($$); } <script>
+%destructor { ast_transformation_discard($$); } <transformation>
+%destructor { ast_transformation_args_delete($$); } <transformation_args>
+%destructor { ast_literal_discard($$); } <literal>
+
 %%
 
 file
@@ -73,9 +109,42 @@ literal
 
 %%
 
-void yyerror(struct ast_script ** result, char ** error, const char * str) {
+void yyerror(YYLTYPE * location, yyscan_t scanner, struct ast_script ** result, char ** error, const char * str) {
     free(*error);
 
     *error = malloc(strlen(str) + 56);
-    sprintf(*error, "at %d:%d: %s", yylloc.first_line, yylloc.first_column, str);
+    sprintf(*error, "at %d:%d: %s", location->first_line, location->first_column, str);
+}
+
+/* Every call owns its scanner, so scripts may be parsed from several threads at once */
+bool parser_parse(struct ast_script ** result, const char * code, FILE * file, char ** error) {
+    yyscan_t scanner;
+    bool parsed;
+
+    *result = NULL;
+    *error = NULL;
+
+    if (yylex_init(&scanner)) {
+        *error = strdup("cannot create scanner");
+        return false;
+    }
+
+    if (code) {
+        yy_scan_string(code, scanner);
+    } else {
+        yyset_in(file, scanner);
+    }
+
+    parsed = yyparse(scanner, result, error) == 0;
+
+    yylex_destroy(scanner);
+    return parsed;
+}
+
+bool parser_parse_string(struct ast_script ** result, const char * code, char ** error) {
+    return parser_parse(result, code, NULL, error);
+}
+
+bool parser_parse_file(struct ast_script ** result, FILE * file, char ** error) {
+    return parser_parse(result, NULL, file, error);
 }
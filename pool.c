@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+
+#include "pool.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "cancel.h"
+
+/* Upper bound of pool size */
+#define POOL_MAX_THREADS (256)
+
+/* Ranges are split down to leaves of about count / (threads * POOL_SPLIT) items,
+ * so idle workers find something to steal while leaves stay coarse
+ */
+#define POOL_SPLIT (8)
+
+/* Initial capacity of a deque, in tasks */
+#define POOL_DEQUE_CAPACITY (64)
+
+/* Tasks of one parallel_for call */
+struct pool_group {
+    uint32_t pending; /* pushed and not completed yet, guarded by pool mutex */
+    const char * error;
+};
+
+/* Range of items, it is split in halves before running while it is larger than a leaf */
+struct pool_task {
+    module_range_function function;
+    void * context;
+
+    uint32_t from;
+    uint32_t to;
+    uint32_t leaf;
+
+    uint32_t level; /* depth of parallel_for calls, e. g. 1 for files of a batch and 2 for their rows */
+    struct pool_group * group;
+
+    const struct cancel * cancel; /* current for the thread which called parallel_for */
+};
+
+/* Owner pushes and pops the newest tasks, thieves steal the oldest ones */
+struct pool_deque {
+    pthread_mutex_t mutex;
+
+    struct pool_task * tasks; /* from the oldest */
+    uint32_t count;
+    uint32_t capacity;
+};
+
+/* Thread running tasks, kept in pool key */
+struct pool_thread {
+    uint32_t deque; /* own deque */
+    uint32_t level; /* of running task, only deeper tasks are taken while it waits for its group */
+};
+
+struct pool_worker {
+    struct pool * pool;
+    pthread_t thread;
+    uint32_t index; /* of own deque */
+};
+
+struct pool {
+    struct module_host host; /* must be the first member */
+
+    struct pool_worker * workers; /* host.threads - 1 */
+    struct pool_deque * deques; /* one per worker, the last one is shared by other threads */
+    pthread_key_t key; /* struct pool_thread of calling thread */
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+
+    uint64_t epoch; /* incremented when a task is pushed or a group is done, guarded by mutex */
+    uint32_t refs; /* owners, the last one stops workers */
+    bool stopping;
+};
+
+const char * pool_parallel_for(const struct module_host * host, uint32_t count, uint32_t grain,
+    module_range_function function, void * context);
+const char * pool_cancelled(const struct module_host * host);
+
+/* Table of current step of a thread, created once per process */
+static pthread_key_t pool_current_key;
+static pthread_once_t pool_current_once = PTHREAD_ONCE_INIT;
+
+/* Returns 0 if quota is not set */
+uint32_t pool_cgroup_quota(void) {
+    double quota = 0, period = 0;
+    FILE * file;
+
+    if ((file = fopen("/sys/fs/cgroup/cpu.max", "r"))) {
+        /* "max <period>" if unlimited, such line does not match */
+        if (fscanf(file, "%lf %lf", &quota, &period) != 2) {
+            quota = 0;
+        }
+
+        fclose(file);
+    } else if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))) {
+        if (fscanf(file, "%lf", &quota) != 1) {
+            quota = 0;
+        }
+
+        fclose(file);
+
+        if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))) {
+            if (fscanf(file, "%lf", &period) != 1) {
+                period = 0;
+            }
+
+            fclose(file);
+        }
+    }
+
+    return quota > 0 && period > 0 ? ceil(quota / period) : 0;
+}
+
+uint32_t pool_default_threads(void) {
+    uint32_t threads = 1, quota = pool_cgroup_quota();
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        threads = CPU_COUNT(&allowed);
+    }
+
+    if (quota > 0 && quota < threads) {
+        threads = quota;
+    }
+
+    return threads < 1 ? 1 : threads > POOL_MAX_THREADS ? POOL_MAX_THREADS : threads;
+}
+
+/* Pins workers to distinct allowed CPUs, if there are enough of them */
+void pool_pin_workers(struct pool * pool, uint32_t count) {
+    cpu_set_t allowed, target;
+    uint32_t i = 0, seen = 0;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) < (int) pool->host.threads) {
+        return;
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE && i < count; ++cpu) {
+        /* first allowed CPU is left to calling thread */
+        if (!CPU_ISSET(cpu, &allowed) || seen++ == 0) {
+            continue;
+        }
+
+        CPU_ZERO(&target);
+        CPU_SET(cpu, &target);
+        pthread_setaffinity_np(pool->workers[i++].thread, sizeof(target), &target);
+    }
+}
+
+void pool_deque_push(struct pool_deque * deque, const struct pool_task * task) {
+    pthread_mutex_lock(&deque->mutex);
+
+    if (deque->count == deque->capacity) {
+        deque->capacity *= 2;
+        deque->tasks = realloc(deque->tasks, sizeof(struct pool_task) * deque->capacity);
+    }
+
+    deque->tasks[deque->count++] = *task;
+    pthread_mutex_unlock(&deque->mutex);
+}
+
+/* Takes the newest or the oldest task deeper than `level` */
+bool pool_deque_take(struct pool_deque * deque, uint32_t level, bool newest, struct pool_task * task) {
+    uint32_t i, k;
+    bool found = false;
+
+    pthread_mutex_lock(&deque->mutex);
+
+    for (k = 0; k < deque->count && !found; ++k) {
+        i = newest ? deque->count - 1 - k : k;
+
+        if (deque->tasks[i].level > level) {
+            *task = deque->tasks[i];
+            memmove(deque->tasks + i, deque->tasks + i + 1, sizeof(struct pool_task) * (deque->count - i - 1));
+            --deque->count;
+            found = true;
+        }
+    }
+
+    pthread_mutex_unlock(&deque->mutex);
+    return found;
+}
+
+/* Own deque first, then steals from the others starting from the next one */
+bool pool_find_task(struct pool * pool, const struct pool_thread * self, struct pool_task * task) {
+    const uint32_t count = pool->host.threads;
+    uint32_t k;
+
+    if (pool_deque_take(pool->deques + self->deque, self->level, true, task)) {
+        return true;
+    }
+
+    for (k = 1; k < count; ++k) {
+        if (pool_deque_take(pool->deques + (self->deque + k) % count, self->level, false, task)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void pool_push(struct pool * pool, uint32_t deque, const struct pool_task * task) {
+    pthread_mutex_lock(&pool->mutex);
+
+    ++task->group->pending;
+    pool_deque_push(pool->deques + deque, task);
+
+    ++pool->epoch;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_run_task(struct pool * pool, struct pool_thread * self, struct pool_task task) {
+    const uint32_t level = self->level;
+    const struct module_host * previous_host;
+    const struct cancel * previous;
+    struct pool_task half;
+    const char * error;
+
+    /* upper halves are left to thieves, the owner takes them back from the lowest one */
+    while (task.to - task.from > task.leaf) {
+        half = task;
+        half.from = task.from + (task.to - task.from) / 2;
+        task.to = half.from;
+
+        pool_push(pool, self->deque, &half);
+    }
+
+    /* chunks of a stopped run are skipped, so its group is done without computing them */
+    self->level = task.level;
+    previous = cancel_enter(task.cancel);
+    previous_host = pool_host_enter(&pool->host);
+
+    if (!(error = cancel_check(task.cancel))) {
+        error = task.function(task.context, task.from, task.to);
+    }
+
+    pool_host_enter(previous_host);
+    cancel_enter(previous);
+    self->level = level;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (error && !task.group->error) {
+        task.group->error = error;
+    }
+
+    if (--task.group->pending == 0) {
+        ++pool->epoch;
+        pthread_cond_broadcast(&pool->wake);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Runs tasks until `group` is done, or until pool is stopped if `group` is NULL */
+void pool_help(struct pool * pool, struct pool_thread * self, const struct pool_group * group) {
+    struct pool_task task;
+    uint64_t epoch;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+
+        if (group ? group->pending == 0 : pool->stopping) {
+            pthread_mutex_unlock(&pool->mutex);
+            return;
+        }
+
+        epoch = pool->epoch;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (pool_find_task(pool, self, &task)) {
+            pool_run_task(pool, self, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+
+        while (pool->epoch == epoch && !(group ? group->pending == 0 : pool->stopping)) {
+            pthread_cond_wait(&pool->wake, &pool->mutex);
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+void * pool_worker_run(void * arg) {
+    struct pool_worker * worker = arg;
+    struct pool_thread self;
+
+    self.deque = worker->index;
+    self.level = 0;
+    pthread_setspecific(worker->pool->key, &self);
+
+    pool_help(worker->pool, &self, NULL);
+    return NULL;
+}
+
+void pool_deque_init(struct pool_deque * deque) {
+    pthread_mutex_init(&deque->mutex, NULL);
+    deque->tasks = malloc(sizeof(struct pool_task) * POOL_DEQUE_CAPACITY);
+    deque->count = 0;
+    deque->capacity = POOL_DEQUE_CAPACITY;
+}
+
+void pool_deque_destroy(struct pool_deque * deque) {
+    free(deque->tasks);
+    pthread_mutex_destroy(&deque->mutex);
+}
+
+struct pool * pool_new(uint32_t threads) {
+    struct pool * pool = malloc(sizeof(struct pool));
+    uint32_t i;
+
+    if (threads == 0) {
+        threads = pool_default_threads();
+    }
+
+    if (threads > POOL_MAX_THREADS) {
+        threads = POOL_MAX_THREADS;
+    }
+
+    pool->host.size = sizeof(struct module_host);
+    pool->host.version = MODULE_HOST_VERSION;
+    pool->host.parallel_for = pool_parallel_for;
+    pool->host.cancelled = pool_cancelled;
+    pool->host.format = value_format;
+
+    pool->workers = malloc(sizeof(struct pool_worker) * threads);
+    pool->deques = malloc(sizeof(struct pool_deque) * threads);
+    pthread_key_create(&pool->key, NULL);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    pool->epoch = 0;
+    pool->refs = 1;
+    pool->stopping = false;
+
+    for (i = 0; i < threads; ++i) {
+        pool_deque_init(pool->deques + i);
+    }
+
+    /* workers wait for the mutex before they look at deques */
+    pthread_mutex_lock(&pool->mutex);
+
+    for (i = 0; i + 1 < threads; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+
+        if (pthread_create(&pool->workers[i].thread, NULL, pool_worker_run, pool->workers + i)) {
+            break;
+        }
+    }
+
+    /* runs with fewer threads if some could not be started */
+    pool->host.threads = i + 1;
+
+    for (++i; i < threads; ++i) {
+        pool_deque_destroy(pool->deques + i);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    pool_pin_workers(pool, pool->host.threads - 1);
+
+    return pool;
+}
+
+struct pool * pool_retain(struct pool * pool) {
+    pthread_mutex_lock(&pool->mutex);
+    ++pool->refs;
+    pthread_mutex_unlock(&pool->mutex);
+
+    return pool;
+}
+
+void pool_delete(struct pool * pool) {
+    uint32_t i;
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (--pool->refs > 0) {
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i + 1 < pool->host.threads; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (i = 0; i < pool->host.threads; ++i) {
+        pool_deque_destroy(pool->deques + i);
+    }
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_key_delete(pool->key);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool);
+}
+
+const struct module_host * pool_host(const struct pool * pool) {
+    return &pool->host;
+}
+
+void pool_current_key_create(void) {
+    pthread_key_create(&pool_current_key, NULL);
+}
+
+const struct module_host * pool_host_enter(const struct module_host * host) {
+    const struct module_host * previous;
+
+    pthread_once(&pool_current_once, pool_current_key_create);
+    previous = pthread_getspecific(pool_current_key);
+
+    if (previous != host) {
+        pthread_setspecific(pool_current_key, host);
+    }
+
+    return previous;
+}
+
+const struct module_host * module_host_current(void) {
+    pthread_once(&pool_current_once, pool_current_key_create);
+    return pthread_getspecific(pool_current_key);
+}
+
+/* Calling thread pushes the whole range to its deque and runs tasks until the range is done,
+ * other threads use the shared deque
+ */
+const char * pool_parallel_for(const struct module_host * host, uint32_t count, uint32_t grain,
+        module_range_function function, void * context) {
+    struct pool * pool = (struct pool *) host;
+    struct pool_thread * self = pthread_getspecific(pool->key);
+    struct pool_thread outsider;
+    struct pool_group group;
+    struct pool_task task;
+    uint32_t leaf;
+
+    if (grain < 1) {
+        grain = 1;
+    }
+
+    if (count == 0) {
+        return NULL;
+    }
+
+    if (host->threads < 2 || count <= grain) {
+        return function(context, 0, count);
+    }
+
+    leaf = (count + host->threads * POOL_SPLIT - 1) / (host->threads * POOL_SPLIT);
+
+    if (!self) {
+        outsider.deque = host->threads - 1;
+        outsider.level = 0;
+        self = &outsider;
+        pthread_setspecific(pool->key, self);
+    }
+
+    group.pending = 0;
+    group.error = NULL;
+
+    task.function = function;
+    task.context = context;
+    task.from = 0;
+    task.to = count;
+    task.leaf = leaf > grain ? leaf : grain;
+    task.level = self->level + 1;
+    task.group = &group;
+    task.cancel = cancel_current();
+
+    pool_push(pool, self->deque, &task);
+    pool_help(pool, self, &group);
+
+    if (self == &outsider) {
+        pthread_setspecific(pool->key, NULL);
+    }
+
+    return group.error;
+}
+
+const char * pool_cancelled(const struct module_host * host) {
+    return cancel_check(cancel_current());
+}
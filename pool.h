@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "module.h"
+
+/* Persistent workers serving parallel_for of module host table
+ *
+ * Work-stealing scheduler: every worker has a deque of range tasks, a task splits its range
+ * in halves pushing upper ones to its deque and idle workers steal the oldest (largest) ones.
+ * A thread calling parallel_for runs tasks until its range is done, so calls nest:
+ * files of a batch are tasks which spawn tasks for rows or tiles of their images,
+ * and any idle worker takes either kind.
+ */
+struct pool;
+
+/* Zero `threads` means pool_default_threads() */
+struct pool * pool_new(uint32_t threads);
+
+/* Pool may be shared by several owners, each of them calls pool_delete */
+struct pool * pool_retain(struct pool * pool);
+void pool_delete(struct pool * pool);
+
+/* Table passed to module_init */
+const struct module_host * pool_host(const struct pool * pool);
+
+/* Makes `host` (may be NULL) the result of module_host_current for calling thread,
+ * returns the previous one to be restored. Tasks of a pool run with its table.
+ */
+const struct module_host * pool_host_enter(const struct module_host * host);
+
+/* CPUs the process may run on, limited by cgroup CPU quota */
+uint32_t pool_default_threads(void);
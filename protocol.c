@@ -0,0 +1,67 @@
+#define _GNU_SOURCE
+
+#include "protocol.h"
+
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+bool protocol_read(int fd, void * buffer, size_t size) {
+    uint8_t * next = buffer;
+    ssize_t count;
+
+    while (size > 0) {
+        if ((count = read(fd, next, size)) <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (count == 0) {
+                errno = 0;
+            }
+
+            return false;
+        }
+
+        next += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+bool protocol_write(int fd, const void * buffer, size_t size) {
+    const uint8_t * next = buffer;
+    ssize_t count;
+
+    while (size > 0) {
+        /* peer closing connection is reported as EPIPE instead of a signal */
+        if ((count = send(fd, next, size, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        next += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+/* Byte swaps are involutions, so the same conversion works both ways */
+void protocol_request_order(struct protocol_request * request) {
+    request->magic = htole32(request->magic);
+    request->script = htole32(request->script);
+    request->script_length = htole32(request->script_length);
+    request->image_length = htole32(request->image_length);
+}
+
+void protocol_response_order(struct protocol_response * response) {
+    response->status = htole32(response->status);
+    response->script_id = htole32(response->script_id);
+    response->length = htole32(response->length);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Wire format of serve mode
+ *
+ * A connection carries any count of requests, each one is answered before the next one is read.
+ * Request is a header, `script_length` bytes of script code (or 4 bytes of script id) and
+ * `image_length` bytes of BMP file. Response is a header and `length` bytes of BMP file
+ * or of error message. Fields are little-endian.
+ */
+
+#define PROTOCOL_MAGIC (0x31525449) /* "ITR1" */
+
+/* Limits of lengths accepted by server */
+#define PROTOCOL_MAX_SCRIPT ((uint32_t) 1 << 16)
+#define PROTOCOL_MAX_IMAGE ((uint32_t) 1 << 28)
+
+enum protocol_script {
+    PROTOCOL_SCRIPT_CODE = 0, /* compiled on first use and kept, response tells its id */
+    PROTOCOL_SCRIPT_ID = 1    /* id of a script sent as code before, unknown once server drops it */
+};
+
+/* Status codes of response, matching exit codes of a single run where there are ones */
+enum protocol_status {
+    PROTOCOL_OK = 0,
+    PROTOCOL_BAD_REQUEST = 1,
+    PROTOCOL_SCRIPT_FAILED = 2,  /* parsing or preprocessing, message tells which */
+    PROTOCOL_UNKNOWN_SCRIPT = 3,
+    PROTOCOL_INPUT_FAILED = 4,
+    PROTOCOL_INTERPRETATION_FAILED = 5,
+    PROTOCOL_OUTPUT_FAILED = 6,
+    PROTOCOL_DEADLINE_EXCEEDED = 10 /* transformation took longer than deadline of server */
+};
+
+struct protocol_request {
+    uint32_t magic;
+    uint32_t script; /* enum protocol_script */
+    uint32_t script_length;
+    uint32_t image_length;
+};
+
+struct protocol_response {
+    uint32_t status; /* enum protocol_status */
+    uint32_t script_id;
+    uint32_t length;
+};
+
+/* Transfer whole buffer, false on failure or end of stream (errno is 0 then) */
+bool protocol_read(int fd, void * buffer, size_t size);
+bool protocol_write(int fd, const void * buffer, size_t size);
+
+/* Convert header fields between host and wire order in place */
+void protocol_request_order(struct protocol_request * request);
+void protocol_response_order(struct protocol_response * response);
@@ -0,0 +1,328 @@
+#include "remap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "cancel.h"
+
+/* Cached table, `table` must be the first member */
+struct remap_entry {
+    struct remap_table table;
+    size_t size; /* in bytes */
+
+    uint32_t refs;
+    bool evicted; /* freed on last release */
+
+    struct remap_entry * prev;
+    struct remap_entry * next;
+};
+
+struct remap_cache {
+    pthread_mutex_t mutex;
+
+    size_t capacity;
+    size_t size;
+
+    struct remap_entry * head; /* most recently used */
+    struct remap_entry * tail;
+};
+
+/* Fixed-point coordinate of the nearest left (or top) neighbour and weight of the right one */
+void remap_split(double position, uint32_t size, uint32_t * base, uint8_t * weight) {
+    double floor_position = floor(position);
+    int64_t integer = (int64_t) floor_position;
+    uint32_t fixed = (uint32_t) floor((position - floor_position) * 256 + 0.5);
+
+    if (fixed == 256) {
+        ++integer;
+        fixed = 0;
+    }
+
+    if (integer < 0) {
+        integer = 0;
+        fixed = 0;
+    } else if (integer >= (int64_t) size - 1) {
+        integer = size - 1;
+        fixed = 0;
+    }
+
+    *base = integer;
+    *weight = fixed;
+}
+
+const char * remap_table_create(struct remap_table * table, uint32_t src_width, uint32_t src_height, const double matrix[4]) {
+    double det = matrix[0] * matrix[3] - matrix[1] * matrix[2];
+    double inverse[4], extent_x, extent_y, sx, sy;
+    struct remap_point * point;
+    uint32_t x, y, x0, y0;
+    const char * error;
+
+    if (fabs(det) < 1e-9) {
+        return "matrix should be invertible";
+    }
+
+    inverse[0] = matrix[3] / det;
+    inverse[1] = -matrix[1] / det;
+    inverse[2] = -matrix[2] / det;
+    inverse[3] = matrix[0] / det;
+
+    extent_x = fabs(matrix[0]) * src_width + fabs(matrix[1]) * src_height;
+    extent_y = fabs(matrix[2]) * src_width + fabs(matrix[3]) * src_height;
+
+    if (extent_x > REMAP_MAX_SIZE || extent_y > REMAP_MAX_SIZE) {
+        return "result is too large";
+    }
+
+    table->src_width = src_width;
+    table->src_height = src_height;
+    memcpy(table->matrix, matrix, sizeof(double) * 4);
+
+    table->width = ceil(extent_x - 1e-6);
+    table->height = ceil(extent_y - 1e-6);
+    table->points = malloc(sizeof(struct remap_point) * table->width * table->height);
+
+    for (y = 0, point = table->points; y < table->height; ++y) {
+        if ((error = cancel_check(cancel_current()))) {
+            free(table->points);
+            return error;
+        }
+
+        sx = inverse[0] * (0.5 - table->width / 2.0) + inverse[1] * (y + 0.5 - table->height / 2.0) + src_width / 2.0 - 0.5;
+        sy = inverse[2] * (0.5 - table->width / 2.0) + inverse[3] * (y + 0.5 - table->height / 2.0) + src_height / 2.0 - 0.5;
+
+        for (x = 0; x < table->width; ++x, ++point, sx += inverse[0], sy += inverse[2]) {
+            if (sx < -0.5 || sy < -0.5 || sx > src_width - 0.5 || sy > src_height - 0.5) {
+                point->index = REMAP_OUTSIDE;
+                point->fx = point->fy = 0;
+                continue;
+            }
+
+            remap_split(sx, src_width, &x0, &point->fx);
+            remap_split(sy, src_height, &y0, &point->fy);
+            point->index = src_width * y0 + x0;
+        }
+    }
+
+    return NULL;
+}
+
+void remap_table_discard(struct remap_table table) {
+    free(table.points);
+}
+
+uint8_t remap_blend(uint32_t top_left, uint32_t top_right, uint32_t bottom_left, uint32_t bottom_right, uint32_t fx, uint32_t fy) {
+    uint32_t top = top_left * (256 - fx) + top_right * fx;
+    uint32_t bottom = bottom_left * (256 - fx) + bottom_right * fx;
+
+    return (top * (256 - fy) + bottom * fy + 32768) >> 16;
+}
+
+const char * remap_table_apply(const struct remap_table * table, const struct image src, struct image dst) {
+    static const struct pixel black_pixel = { 0, 0, 0 };
+    const struct remap_point * point = table->points;
+    struct pixel * pixel = dst.pixels, * end = dst.pixels + dst.width * dst.height, * row_end = pixel;
+    const struct pixel * p;
+    uint32_t right, below;
+    const char * error;
+
+    for (; pixel < end; ++pixel, ++point) {
+        if (pixel == row_end) {
+            if ((error = cancel_check(cancel_current()))) {
+                return error;
+            }
+
+            row_end += dst.width;
+        }
+
+        if (point->index == REMAP_OUTSIDE) {
+            *pixel = black_pixel;
+            continue;
+        }
+
+        /* neighbours with zero weight are not read, they may be outside of image */
+        p = src.pixels + point->index;
+        right = point->fx ? 1 : 0;
+        below = point->fy ? src.width : 0;
+
+        pixel->red = remap_blend(p[0].red, p[right].red, p[below].red, p[below + right].red, point->fx, point->fy);
+        pixel->green = remap_blend(p[0].green, p[right].green, p[below].green, p[below + right].green, point->fx, point->fy);
+        pixel->blue = remap_blend(p[0].blue, p[right].blue, p[below].blue, p[below + right].blue, point->fx, point->fy);
+    }
+
+    return NULL;
+}
+
+bool remap_matrix_is_exact(const double matrix[4]) {
+    uint32_t i;
+
+    for (i = 0; i < 4; ++i) {
+        if (matrix[i] != 0 && matrix[i] != 1 && matrix[i] != -1) {
+            return false;
+        }
+    }
+
+    return fabs(matrix[0] * matrix[3] - matrix[1] * matrix[2]) == 1;
+}
+
+struct remap_cache * remap_cache_new(size_t capacity) {
+    struct remap_cache * cache = malloc(sizeof(struct remap_cache));
+
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->capacity = capacity;
+    cache->size = 0;
+    cache->head = cache->tail = NULL;
+
+    return cache;
+}
+
+void remap_cache_entry_delete(struct remap_entry * entry) {
+    remap_table_discard(entry->table);
+    free(entry);
+}
+
+void remap_cache_unlink(struct remap_cache * cache, struct remap_entry * entry) {
+    *(entry->prev ? &entry->prev->next : &cache->head) = entry->next;
+    *(entry->next ? &entry->next->prev : &cache->tail) = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+void remap_cache_push(struct remap_cache * cache, struct remap_entry * entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    *(cache->head ? &cache->head->prev : &cache->tail) = entry;
+    cache->head = entry;
+}
+
+void remap_cache_delete(struct remap_cache * cache) {
+    struct remap_entry * entry, * next;
+
+    if (!cache) {
+        return;
+    }
+
+    for (entry = cache->head; entry; entry = next) {
+        next = entry->next;
+        remap_cache_entry_delete(entry);
+    }
+
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
+
+/* Tables in use are unlinked and freed when released */
+void remap_cache_evict(struct remap_cache * cache) {
+    struct remap_entry * entry;
+
+    while (cache->size > cache->capacity && (entry = cache->tail)) {
+        remap_cache_unlink(cache, entry);
+        cache->size -= entry->size;
+
+        if (entry->refs > 0) {
+            entry->evicted = true;
+        } else {
+            remap_cache_entry_delete(entry);
+        }
+    }
+}
+
+struct remap_entry * remap_cache_find(const struct remap_cache * cache, uint32_t src_width, uint32_t src_height, const double matrix[4]) {
+    struct remap_entry * entry;
+
+    for (entry = cache->head; entry; entry = entry->next) {
+        if (entry->table.src_width == src_width && entry->table.src_height == src_height
+         && memcmp(entry->table.matrix, matrix, sizeof(double) * 4) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+const char * remap_cache_acquire(struct remap_cache * cache, uint32_t src_width, uint32_t src_height,
+        const double matrix[4], const struct remap_table ** table) {
+    struct remap_entry * entry;
+    const char * error;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    if ((entry = remap_cache_find(cache, src_width, src_height, matrix))) {
+        remap_cache_unlink(cache, entry);
+        remap_cache_push(cache, entry);
+        ++entry->refs;
+
+        pthread_mutex_unlock(&cache->mutex);
+        *table = &entry->table;
+        return NULL;
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+
+    /* built without lock, concurrent misses of the same key may build it twice */
+    entry = malloc(sizeof(struct remap_entry));
+
+    if ((error = remap_table_create(&entry->table, src_width, src_height, matrix))) {
+        free(entry);
+        return error;
+    }
+
+    entry->size = sizeof(struct remap_entry) + sizeof(struct remap_point) * entry->table.width * entry->table.height;
+    entry->refs = 1;
+    entry->evicted = entry->size > cache->capacity;
+    entry->prev = entry->next = NULL;
+
+    if (!entry->evicted) {
+        pthread_mutex_lock(&cache->mutex);
+
+        remap_cache_push(cache, entry);
+        cache->size += entry->size;
+        remap_cache_evict(cache);
+
+        pthread_mutex_unlock(&cache->mutex);
+    }
+
+    *table = &entry->table;
+    return NULL;
+}
+
+void remap_cache_release(struct remap_cache * cache, const struct remap_table * table) {
+    struct remap_entry * entry = (struct remap_entry *) table;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    if (--entry->refs == 0 && entry->evicted) {
+        remap_cache_entry_delete(entry);
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+const char * remap_transformation(struct image * image, uint32_t argc, const struct value * argv) {
+    const struct remap_table * table;
+    struct image result;
+    double matrix[4];
+    const char * error;
+    uint32_t i;
+
+    for (i = 0; i < 4; ++i) {
+        matrix[i] = value_to_floating(argv[i + 1]);
+    }
+
+    if ((error = remap_cache_acquire(value_to_identifier(argv[0]), image->width, image->height, matrix, &table))) {
+        return error;
+    }
+
+    result = image_create(table->width, table->height);
+    error = remap_table_apply(table, *image, result);
+    remap_cache_release(value_to_identifier(argv[0]), table);
+
+    if (error) {
+        image_discard(result);
+        return error;
+    }
+
+    image_discard(*image);
+    *image = result;
+    return NULL;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+#include "value.h"
+
+/* Largest side of remapped image */
+#define REMAP_MAX_SIZE (1 << 20)
+
+/* Marks output pixels outside of source image */
+#define REMAP_OUTSIDE (UINT32_MAX)
+
+/* Source of output pixel: top-left neighbour and Q8 bilinear weights of right and bottom ones */
+struct remap_point {
+    uint32_t index; /* in source pixels or REMAP_OUTSIDE */
+    uint8_t fx;
+    uint8_t fy;
+};
+
+/* Output pixels of linear map about image center, see affine() of standard library */
+struct remap_table {
+    uint32_t src_width;
+    uint32_t src_height;
+    double matrix[4];
+
+    uint32_t width;
+    uint32_t height;
+    struct remap_point * points;
+};
+
+const char * remap_table_create(struct remap_table * table, uint32_t src_width, uint32_t src_height, const double matrix[4]);
+void remap_table_discard(struct remap_table table);
+
+/* `dst` should have size of table. Like remap_table_create, it stops between rows
+ * if current cancel token asks so (see cancel.h).
+ */
+const char * remap_table_apply(const struct remap_table * table, const struct image src, struct image dst);
+
+/* True if matrix only permutes and flips axes, such maps need no resampling */
+bool remap_matrix_is_exact(const double matrix[4]);
+
+/* Least recently used tables, bounded by total size in bytes, may be shared by threads */
+struct remap_cache;
+
+struct remap_cache * remap_cache_new(size_t capacity);
+void remap_cache_delete(struct remap_cache * cache);
+
+/* Acquired table stays valid until released */
+const char * remap_cache_acquire(struct remap_cache * cache, uint32_t src_width, uint32_t src_height,
+    const double matrix[4], const struct remap_table ** table);
+void remap_cache_release(struct remap_cache * cache, const struct remap_table * table);
+
+/* Step function, arguments are identifier pointing to remap cache and four matrix coefficients */
+const char * remap_transformation(struct image * image, uint32_t argc, const struct value * argv);
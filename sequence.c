@@ -0,0 +1,238 @@
+#include "sequence.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hash.h"
+
+/* Tiles of a chunk of work, computing a tile costs about as much as a row of image */
+#define SEQUENCE_GRAIN (4)
+
+struct sequence {
+    struct image output; /* of the previous frame */
+    uint64_t * hashes; /* of tiles of the previous frame, row by row */
+    uint32_t columns;
+    uint32_t rows;
+    bool valid; /* output and hashes belong to the previous frame */
+
+    uint64_t computed;
+    uint64_t total;
+};
+
+/* Frame being applied, shared by chunks */
+struct sequence_job {
+    const struct fusion * fusion;
+    struct image input;
+    struct image output;
+    uint32_t columns;
+
+    uint64_t * hashes; /* of tiles of input */
+    uint32_t * tiles; /* indices of tiles to compute */
+
+    pthread_mutex_t mutex;
+    const char * error; /* the first one */
+    uint32_t failed_stage;
+};
+
+struct sequence * sequence_new(void) {
+    struct sequence * sequence = malloc(sizeof(struct sequence));
+
+    sequence->output.width = sequence->output.height = 0;
+    sequence->output.pixels = NULL;
+    sequence->hashes = NULL;
+    sequence->columns = sequence->rows = 0;
+    sequence->valid = false;
+    sequence->computed = sequence->total = 0;
+
+    return sequence;
+}
+
+void sequence_delete(struct sequence * sequence) {
+    if (!sequence) {
+        return;
+    }
+
+    image_discard(sequence->output);
+    free(sequence->hashes);
+    free(sequence);
+}
+
+/* Hashes tiles of rows of tiles [from, to), pixel rows of a tile are chained */
+const char * sequence_hash_rows(void * context, uint32_t from, uint32_t to) {
+    struct sequence_job * job = context;
+    const struct image input = job->input;
+    uint32_t x, y, y1, width;
+    const struct pixel * row;
+    uint64_t * hashes;
+
+    for (; from < to; ++from) {
+        hashes = job->hashes + (size_t) job->columns * from;
+        memset(hashes, 0, sizeof(uint64_t) * job->columns);
+
+        y1 = (from + 1) * SEQUENCE_TILE < input.height ? (from + 1) * SEQUENCE_TILE : input.height;
+
+        for (y = from * SEQUENCE_TILE; y < y1; ++y) {
+            row = input.pixels + (size_t) input.width * y;
+
+            for (x = 0; x < input.width; x += SEQUENCE_TILE) {
+                width = input.width - x < SEQUENCE_TILE ? input.width - x : SEQUENCE_TILE;
+                hashes[x / SEQUENCE_TILE] = hash_bytes(row + x, sizeof(struct pixel) * width, hashes[x / SEQUENCE_TILE]);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Computes tiles [from, to) of job list with buffers of the chunk */
+const char * sequence_compute_tiles(void * context, uint32_t from, uint32_t to) {
+    struct sequence_job * job = context;
+    const uint32_t side = SEQUENCE_TILE + 2 * job->fusion->halo;
+    uint32_t tile_x, tile_y, failed_stage;
+    const char * error = NULL;
+    struct pixel * buffers[2];
+
+    buffers[0] = malloc(sizeof(struct pixel) * side * side);
+    buffers[1] = malloc(sizeof(struct pixel) * side * side);
+
+    for (; from < to && !error; ++from) {
+        tile_x = job->tiles[from] % job->columns * SEQUENCE_TILE;
+        tile_y = job->tiles[from] / job->columns * SEQUENCE_TILE;
+
+        error = fusion_run_tile(job->fusion, buffers, job->input, job->output, tile_x, tile_y,
+            job->input.width - tile_x < SEQUENCE_TILE ? job->input.width - tile_x : SEQUENCE_TILE,
+            job->input.height - tile_y < SEQUENCE_TILE ? job->input.height - tile_y : SEQUENCE_TILE,
+            &failed_stage);
+    }
+
+    free(buffers[1]);
+    free(buffers[0]);
+
+    if (error) {
+        pthread_mutex_lock(&job->mutex);
+
+        if (!job->error) {
+            job->error = error;
+            job->failed_stage = failed_stage;
+        }
+
+        pthread_mutex_unlock(&job->mutex);
+    }
+
+    return error;
+}
+
+/* Lists tiles within `reach` tiles of a changed one, every tile if previous frame is not kept */
+uint32_t sequence_list_tiles(const struct sequence * sequence, struct sequence_job * job, uint32_t reach) {
+    const uint32_t columns = sequence->columns, rows = sequence->rows;
+    uint32_t x, y, i, count = 0;
+    bool * changed;
+
+    if (!sequence->valid) {
+        for (i = 0; i < columns * rows; ++i) {
+            job->tiles[count++] = i;
+        }
+
+        return count;
+    }
+
+    changed = malloc(sizeof(bool) * (columns * rows > 0 ? columns * rows : 1));
+
+    for (i = 0; i < columns * rows; ++i) {
+        changed[i] = job->hashes[i] != sequence->hashes[i];
+    }
+
+    /* a tile is computed from pixels within halo around it */
+    for (y = 0; y < rows; ++y) {
+        for (x = 0; x < columns; ++x) {
+            uint32_t x0 = x > reach ? x - reach : 0, x1 = x + reach < columns ? x + reach + 1 : columns;
+            uint32_t y0 = y > reach ? y - reach : 0, y1 = y + reach < rows ? y + reach + 1 : rows;
+            uint32_t cx, cy;
+            bool found = false;
+
+            for (cy = y0; cy < y1 && !found; ++cy) {
+                for (cx = x0; cx < x1 && !found; ++cx) {
+                    found = changed[columns * cy + cx];
+                }
+            }
+
+            if (found) {
+                job->tiles[count++] = columns * y + x;
+            }
+        }
+    }
+
+    free(changed);
+    return count;
+}
+
+const char * sequence_apply(struct sequence * sequence, const struct fusion * fusion, struct image * image,
+        const struct module_host * host, uint32_t * failed_stage) {
+    const uint32_t columns = (image->width + SEQUENCE_TILE - 1) / SEQUENCE_TILE;
+    const uint32_t rows = (image->height + SEQUENCE_TILE - 1) / SEQUENCE_TILE;
+    const uint32_t reach = (fusion->halo + SEQUENCE_TILE - 1) / SEQUENCE_TILE;
+    struct sequence_job job;
+    const char * error;
+    uint32_t count = 0;
+
+    if (sequence->output.width != image->width || sequence->output.height != image->height) {
+        image_discard(sequence->output);
+        sequence->output = image_create(image->width, image->height);
+        sequence->valid = false;
+    }
+
+    if (sequence->columns != columns || sequence->rows != rows) {
+        free(sequence->hashes);
+        sequence->hashes = malloc(sizeof(uint64_t) * (columns * rows > 0 ? columns * rows : 1));
+        sequence->columns = columns;
+        sequence->rows = rows;
+        sequence->valid = false;
+    }
+
+    job.fusion = fusion;
+    job.input = *image;
+    job.output = sequence->output;
+    job.columns = columns;
+    job.hashes = malloc(sizeof(uint64_t) * (columns * rows > 0 ? columns * rows : 1));
+    job.tiles = malloc(sizeof(uint32_t) * (columns * rows > 0 ? columns * rows : 1));
+    job.error = NULL;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    /* chunks of a stopped run are skipped by host pool, then the previous frame is kept if hashing did not finish */
+    if (!(error = MODULE_PARALLEL_FOR(host, rows, 1, sequence_hash_rows, &job))) {
+        count = sequence_list_tiles(sequence, &job, reach);
+
+        /* output is partially updated until tiles are done, so hashes of the previous frame are dropped */
+        sequence->valid = false;
+
+        if (count > 0) {
+            error = MODULE_PARALLEL_FOR(host, count, SEQUENCE_GRAIN, sequence_compute_tiles, &job);
+        }
+    }
+
+    pthread_mutex_destroy(&job.mutex);
+    free(job.tiles);
+
+    if (error) {
+        free(job.hashes);
+        *failed_stage = job.error ? job.failed_stage : 0;
+        return job.error ? job.error : error;
+    }
+
+    free(sequence->hashes);
+    sequence->hashes = job.hashes;
+    sequence->valid = true;
+
+    sequence->computed += count;
+    sequence->total += columns * rows;
+
+    memcpy(image->pixels, sequence->output.pixels, sizeof(struct pixel) * image->width * image->height);
+    return NULL;
+}
+
+void sequence_statistics(const struct sequence * sequence, uint64_t * computed, uint64_t * total) {
+    *computed = sequence->computed;
+    *total = sequence->total;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "fusion.h"
+#include "image.h"
+#include "module.h"
+
+/* Frame sequences: consecutive images of a stream which are mostly equal
+ *
+ * Every frame is split into tiles which are hashed and compared with tiles of the previous frame.
+ * The leading steps of a script computable region by region (see interpreter_run_sequence) recompute
+ * only changed tiles and tiles within their halo, results of the previous frame are kept elsewhere.
+ */
+
+/* Side of square tile, in pixels */
+#define SEQUENCE_TILE (32)
+
+/* Largest sum of radii of steps computed by tiles, halo is recomputed for every changed tile */
+#define SEQUENCE_MAX_HALO (SEQUENCE_TILE / 2)
+
+struct sequence;
+
+struct sequence * sequence_new(void);
+void sequence_delete(struct sequence * sequence);
+
+/* Replaces `image` with result of `fusion`, frames of a sequence go one at a time.
+ * On error `failed_stage` is set to index of stage returned it and the next frame is computed whole.
+ */
+const char * sequence_apply(struct sequence * sequence, const struct fusion * fusion, struct image * image,
+    const struct module_host * host, uint32_t * failed_stage);
+
+/* Tiles computed and tiles of all frames applied */
+void sequence_statistics(const struct sequence * sequence, uint64_t * computed, uint64_t * total);
@@ -0,0 +1,804 @@
+#define _GNU_SOURCE
+
+#include "serve.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "bmp.h"
+#include "cache.h"
+#include "cancel.h"
+#include "pool.h"
+#include "protocol.h"
+#include "transformer.h"
+#include "util.h"
+
+/* Upper bound of scripts kept compiled, the least recently used one is dropped for a new one */
+#define SERVE_MAX_SCRIPTS (256)
+
+/* Events handled by one wait */
+#define SERVE_EVENTS (64)
+
+/* Seconds a stopping daemon waits for clients to take pending responses */
+#define SERVE_TIMEOUT (10)
+
+struct serve_script {
+    uint32_t id; /* never reused, so requests with id of a dropped script are told it is unknown */
+    char * code;
+    struct transformer_script * script;
+    struct cache_key key; /* script part of cache keys */
+
+    uint32_t users; /* requests being answered with the script, it is not dropped meanwhile */
+    uint64_t used; /* tick of the last request */
+};
+
+/* Client connection, the event loop reads its requests and sends its responses without blocking.
+ * A complete request is queued (or waits in pending list while queue is full), the worker answering it
+ * gives the connection back through done list.
+ */
+struct serve_connection {
+    int fd;
+    bool busy; /* request is queued, answered or its response is being sent */
+    bool closing; /* closed once response is sent, the rest of stream cannot be parsed */
+
+    struct protocol_request request; /* in host order once received */
+    uint8_t * data; /* script terminated by null byte, then image */
+    size_t data_capacity;
+    size_t received; /* bytes of header and data */
+
+    struct protocol_response response; /* in wire order once answered */
+    uint8_t * body;
+    size_t body_capacity;
+    size_t body_length;
+    size_t sent; /* bytes of header and body */
+
+    struct serve_connection * previous; /* of all connections, kept by the event loop */
+    struct serve_connection * next;
+    struct serve_connection * pending; /* next complete request waiting for room in queue */
+    struct serve_connection * done; /* next answered one */
+};
+
+struct serve {
+    struct transformer_context * context;
+    struct cache * cache;
+    uint32_t deadline; /* milliseconds of transformation of a request, 0 if unlimited */
+
+    int listener;
+    int signals;
+    int wake; /* eventfd written by workers when done list is not empty */
+    int epoll;
+
+    pthread_mutex_t scripts_mutex; /* also serializes compilation of a new script */
+    struct serve_script * scripts;
+    uint32_t scripts_count;
+    uint32_t next_id;
+    uint64_t tick;
+
+    struct serve_connection * connections;
+    uint32_t busy; /* connections with requests pending, queued, in workers or with responses not sent yet */
+    struct serve_connection * pending_head; /* complete requests not queued yet, oldest first */
+    struct serve_connection * pending_tail;
+    bool stopping; /* requests are not read, connections are closed once answered */
+
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    struct serve_connection ** queue; /* ring of complete requests */
+    uint32_t queue_head;
+    uint32_t queue_count;
+    uint32_t queue_capacity;
+    struct serve_connection * done; /* answered connections to be given back to the event loop */
+    bool finished; /* workers return once queue is empty */
+};
+
+/* Images of a worker, reused between requests */
+struct serve_buffers {
+    struct bmp_image bmp_image;
+    struct image image;
+};
+
+struct serve_worker {
+    struct serve * serve;
+    pthread_t thread;
+};
+
+uint8_t * serve_reserve(uint8_t ** buffer, size_t * capacity, size_t size) {
+    if (*capacity < size) {
+        free(*buffer);
+        *buffer = malloc(size);
+        *capacity = size;
+    }
+
+    return *buffer;
+}
+
+/* Least recently used script without requests being answered, NULL if every one has some */
+struct serve_script * serve_script_unused(struct serve * serve) {
+    struct serve_script * unused = NULL;
+    uint32_t i;
+
+    for (i = 0; i < serve->scripts_count; ++i) {
+        if (serve->scripts[i].users == 0 && (!unused || serve->scripts[i].used < unused->used)) {
+            unused = serve->scripts + i;
+        }
+    }
+
+    return unused;
+}
+
+/* Returns script of request or NULL with status and message, returned script should be released */
+struct serve_script * serve_script(struct serve * serve, const struct protocol_request request,
+        const char * code, uint32_t * id, enum protocol_status * status, char ** error) {
+    struct serve_script * script = NULL, * slot;
+    struct transformer_script * compiled;
+    uint32_t i;
+
+    pthread_mutex_lock(&serve->scripts_mutex);
+
+    if (request.script == PROTOCOL_SCRIPT_ID) {
+        memcpy(id, code, sizeof(uint32_t));
+        *id = le32toh(*id);
+
+        for (i = 0; i < serve->scripts_count && serve->scripts[i].id != *id; ++i) {
+        }
+
+        if (i < serve->scripts_count) {
+            script = serve->scripts + i;
+        } else {
+            *status = PROTOCOL_UNKNOWN_SCRIPT;
+            *error = strdup("unknown script id");
+        }
+    } else {
+        for (i = 0; i < serve->scripts_count && strcmp(serve->scripts[i].code, code) != 0; ++i) {
+        }
+
+        *id = 0;
+        slot = serve->scripts_count < SERVE_MAX_SCRIPTS ? serve->scripts + serve->scripts_count : serve_script_unused(serve);
+
+        if (i < serve->scripts_count) {
+            script = serve->scripts + i;
+        } else if (!slot) {
+            *status = PROTOCOL_SCRIPT_FAILED;
+            *error = strdup("too many scripts in use");
+        } else if ((compiled = transformer_compile(serve->context, code, error))) {
+            /* the dropped script is replaced only once the new one compiles */
+            if (slot == serve->scripts + serve->scripts_count) {
+                ++serve->scripts_count;
+            } else {
+                transformer_script_delete(slot->script);
+                free(slot->code);
+            }
+
+            slot->id = serve->next_id++;
+            slot->code = strdup(code);
+            slot->script = compiled;
+            slot->key = cache_transformer_key(compiled);
+            slot->users = 0;
+
+            script = slot;
+        } else {
+            *status = PROTOCOL_SCRIPT_FAILED;
+        }
+    }
+
+    if (script) {
+        ++script->users;
+        script->used = ++serve->tick;
+        *id = script->id;
+    }
+
+    pthread_mutex_unlock(&serve->scripts_mutex);
+    return script;
+}
+
+void serve_script_release(struct serve * serve, struct serve_script * script) {
+    pthread_mutex_lock(&serve->scripts_mutex);
+    --script->users;
+    pthread_mutex_unlock(&serve->scripts_mutex);
+}
+
+/* Encodes result to response buffer, returns message and sets status on failure */
+const char * serve_transform(const struct transformer_script * script, const uint8_t * image, uint32_t length,
+        uint32_t deadline, struct serve_buffers * buffers, uint8_t ** result, size_t * result_capacity,
+        size_t * result_length, enum protocol_status * status, char ** error) {
+    struct cancel cancel;
+    const char * message;
+    FILE * stream;
+
+    if (!(stream = fmemopen((void *) image, length, "rb"))) {
+        *status = PROTOCOL_INPUT_FAILED;
+        return strerror(errno);
+    }
+
+    message = bmp_image_read_reusing(&buffers->bmp_image, stream);
+    fclose(stream);
+
+    if (message) {
+        *status = PROTOCOL_INPUT_FAILED;
+        return message;
+    }
+
+    buffers->image = bmp_image_to_image_reusing(buffers->bmp_image, buffers->image);
+    cancel = cancel_create(deadline);
+
+    if (!transformer_run_cancellable(script, &buffers->image, &cancel, error)) {
+        *status = cancel_check(&cancel) ? PROTOCOL_DEADLINE_EXCEEDED : PROTOCOL_INTERPRETATION_FAILED;
+        return *error;
+    }
+
+    bmp_image_replace(&buffers->bmp_image, buffers->image);
+
+    /* stream terminates written contents with a null byte */
+    serve_reserve(result, result_capacity, buffers->bmp_image.header.bfSize + 1);
+
+    if (!(stream = fmemopen(*result, buffers->bmp_image.header.bfSize + 1, "wb"))) {
+        *status = PROTOCOL_OUTPUT_FAILED;
+        return strerror(errno);
+    }
+
+    message = bmp_image_write(buffers->bmp_image, stream);
+    *result_length = ftell(stream);
+
+    if (fclose(stream) && !message) {
+        message = strerror(errno);
+    }
+
+    if (message) {
+        *status = PROTOCOL_OUTPUT_FAILED;
+        return message;
+    }
+
+    return NULL;
+}
+
+/* Prepares response with `length` bytes of body to be sent */
+void serve_respond(struct serve_connection * connection, enum protocol_status status, uint32_t script_id, size_t length) {
+    connection->response.status = status;
+    connection->response.script_id = script_id;
+    connection->response.length = length;
+    connection->body_length = length;
+    connection->sent = 0;
+
+    protocol_response_order(&connection->response);
+}
+
+void serve_respond_message(struct serve_connection * connection, enum protocol_status status, uint32_t script_id,
+        const char * message) {
+    const size_t length = strlen(message);
+
+    memcpy(serve_reserve(&connection->body, &connection->body_capacity, length + 1), message, length + 1);
+    serve_respond(connection, status, script_id, length);
+}
+
+bool serve_request_valid(const struct protocol_request request) {
+    return request.magic == PROTOCOL_MAGIC
+        && (request.script == PROTOCOL_SCRIPT_CODE || request.script == PROTOCOL_SCRIPT_ID)
+        && (request.script != PROTOCOL_SCRIPT_ID || request.script_length == sizeof(uint32_t))
+        && request.script_length <= PROTOCOL_MAX_SCRIPT && request.image_length <= PROTOCOL_MAX_IMAGE;
+}
+
+/* Answers complete request of connection into its response, runs on a worker */
+void serve_answer(struct serve * serve, struct serve_connection * connection, struct serve_buffers * buffers) {
+    const struct protocol_request request = connection->request;
+    const uint8_t * image = connection->data + request.script_length + 1;
+    enum protocol_status status = PROTOCOL_OK;
+    struct serve_script * script;
+    const char * message = NULL;
+    uint32_t script_id = 0;
+    char * error = NULL;
+    struct cache_key key;
+    size_t length = 0;
+
+    if (!(script = serve_script(serve, request, (const char *) connection->data, &script_id, &status, &error))) {
+        message = error;
+    } else if (!serve->cache) {
+        message = serve_transform(script->script, image, request.image_length, serve->deadline, buffers,
+            &connection->body, &connection->body_capacity, &length, &status, &error);
+    } else {
+        key = cache_key_create(script->key, image, request.image_length);
+
+        if (!cache_fetch(serve->cache, key, &connection->body, &connection->body_capacity, &length)
+                && !(message = serve_transform(script->script, image, request.image_length, serve->deadline,
+                    buffers, &connection->body, &connection->body_capacity, &length, &status, &error))) {
+            cache_store(serve->cache, key, connection->body, length);
+        }
+    }
+
+    if (script) {
+        serve_script_release(serve, script);
+    }
+
+    if (message) {
+        serve_respond_message(connection, status, script_id, message);
+    } else {
+        serve_respond(connection, status, script_id, length);
+    }
+
+    free(error);
+}
+
+void * serve_worker_run(void * context) {
+    struct serve * serve = ((struct serve_worker *) context)->serve;
+    struct serve_connection * connection;
+    struct serve_buffers buffers;
+    const uint64_t one = 1;
+    bool full;
+
+    memset(&buffers, 0, sizeof(buffers));
+
+    for (;;) {
+        pthread_mutex_lock(&serve->mutex);
+
+        while (serve->queue_count == 0 && !serve->finished) {
+            pthread_cond_wait(&serve->not_empty, &serve->mutex);
+        }
+
+        if (serve->queue_count == 0) {
+            pthread_mutex_unlock(&serve->mutex);
+            break;
+        }
+
+        connection = serve->queue[serve->queue_head];
+        serve->queue_head = (serve->queue_head + 1) % serve->queue_capacity;
+        full = serve->queue_count-- == serve->queue_capacity;
+        pthread_mutex_unlock(&serve->mutex);
+
+        /* the event loop may have pending requests for the freed room */
+        if (full && write(serve->wake, &one, sizeof(one)) < 0) {
+            /* counter is already nonzero */
+        }
+
+        serve_answer(serve, connection, &buffers);
+
+        /* the event loop sends response */
+        pthread_mutex_lock(&serve->mutex);
+        connection->done = serve->done;
+        serve->done = connection;
+        pthread_mutex_unlock(&serve->mutex);
+
+        if (write(serve->wake, &one, sizeof(one)) < 0) {
+            /* counter is already nonzero */
+        }
+    }
+
+    bmp_image_discard(buffers.bmp_image);
+    image_discard(buffers.image);
+    return NULL;
+}
+
+/* Moves pending requests to queue while there is room in it, never waits for workers */
+void serve_push(struct serve * serve) {
+    struct serve_connection * connection;
+
+    pthread_mutex_lock(&serve->mutex);
+
+    while ((connection = serve->pending_head) && serve->queue_count < serve->queue_capacity) {
+        serve->pending_head = connection->pending;
+        serve->queue[(serve->queue_head + serve->queue_count) % serve->queue_capacity] = connection;
+        ++serve->queue_count;
+
+        pthread_cond_signal(&serve->not_empty);
+    }
+
+    pthread_mutex_unlock(&serve->mutex);
+
+    if (!serve->pending_head) {
+        serve->pending_tail = NULL;
+    }
+}
+
+/* Complete requests are queued in order they were received */
+void serve_enqueue(struct serve * serve, struct serve_connection * connection) {
+    connection->pending = NULL;
+    *(serve->pending_tail ? &serve->pending_tail->pending : &serve->pending_head) = connection;
+    serve->pending_tail = connection;
+
+    serve_push(serve);
+}
+
+bool serve_watch(struct serve * serve, struct serve_connection * connection, int operation, uint32_t events) {
+    struct epoll_event event;
+
+    event.events = events;
+    event.data.ptr = connection;
+    return epoll_ctl(serve->epoll, operation, connection->fd, &event) == 0;
+}
+
+void serve_close(struct serve * serve, struct serve_connection * connection) {
+    if (connection->busy) {
+        --serve->busy;
+    }
+
+    if (connection->previous) {
+        connection->previous->next = connection->next;
+    } else {
+        serve->connections = connection->next;
+    }
+
+    if (connection->next) {
+        connection->next->previous = connection->previous;
+    }
+
+    /* closing removes it from epoll */
+    close(connection->fd);
+    free(connection->data);
+    free(connection->body);
+    free(connection);
+}
+
+/* Reads available bytes of request and queues it once complete, returns false if connection should be closed */
+bool serve_receive(struct serve * serve, struct serve_connection * connection) {
+    const size_t header = sizeof(struct protocol_request);
+    const struct protocol_request * request = &connection->request;
+    size_t offset, size;
+    uint8_t * next;
+    ssize_t count;
+
+    for (;;) {
+        if (connection->received < header) {
+            next = (uint8_t *) &connection->request + connection->received;
+            size = header - connection->received;
+        } else if ((offset = connection->received - header) < request->script_length) {
+            next = connection->data + offset;
+            size = request->script_length - offset;
+        } else if (offset < (size_t) request->script_length + request->image_length) {
+            next = connection->data + offset + 1;
+            size = (size_t) request->script_length + request->image_length - offset;
+        } else {
+            break;
+        }
+
+        if ((count = read(connection->fd, next, size)) <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+
+            /* end of stream or error, also within a request */
+            return count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+
+        connection->received += count;
+
+        if (connection->received != header) {
+            continue;
+        }
+
+        protocol_request_order(&connection->request);
+
+        if (!serve_request_valid(connection->request)) {
+            connection->busy = connection->closing = true;
+            ++serve->busy;
+
+            serve_respond_message(connection, PROTOCOL_BAD_REQUEST, 0, "bad request");
+            return serve_watch(serve, connection, EPOLL_CTL_MOD, EPOLLOUT);
+        }
+
+        serve_reserve(&connection->data, &connection->data_capacity,
+            (size_t) request->script_length + 1 + request->image_length);
+    }
+
+    /* script is terminated to be compiled in place */
+    connection->data[request->script_length] = '\0';
+    connection->busy = true;
+    ++serve->busy;
+
+    /* next requests of the connection wait in its socket */
+    epoll_ctl(serve->epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+    serve_enqueue(serve, connection);
+    return true;
+}
+
+/* Sends available part of response, returns false if connection should be closed */
+bool serve_send(struct serve * serve, struct serve_connection * connection) {
+    const size_t header = sizeof(struct protocol_response), total = header + connection->body_length;
+    const uint8_t * next;
+    ssize_t count;
+
+    while (connection->sent < total) {
+        if (connection->sent < header) {
+            next = (const uint8_t *) &connection->response + connection->sent;
+            count = send(connection->fd, next, header - connection->sent, MSG_NOSIGNAL);
+        } else {
+            next = connection->body + (connection->sent - header);
+            count = send(connection->fd, next, total - connection->sent, MSG_NOSIGNAL);
+        }
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* peer closing connection is reported as EPIPE instead of a signal */
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        connection->sent += count;
+    }
+
+    connection->busy = false;
+    --serve->busy;
+
+    if (connection->closing || serve->stopping) {
+        return false;
+    }
+
+    connection->received = 0;
+    return serve_watch(serve, connection, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+/* Watches answered connections for sending their responses and queues pending requests */
+void serve_collect(struct serve * serve) {
+    struct serve_connection * connection, * next;
+    uint64_t value;
+
+    if (read(serve->wake, &value, sizeof(value)) < 0) {
+        /* woken by a worker that was already collected */
+    }
+
+    pthread_mutex_lock(&serve->mutex);
+    connection = serve->done;
+    serve->done = NULL;
+    pthread_mutex_unlock(&serve->mutex);
+
+    for (; connection; connection = next) {
+        next = connection->done;
+
+        if (!serve_watch(serve, connection, EPOLL_CTL_ADD, EPOLLOUT)) {
+            serve_close(serve, connection);
+        }
+    }
+
+    serve_push(serve);
+}
+
+void serve_accept(struct serve * serve) {
+    struct serve_connection * connection;
+    int fd;
+
+    while ((fd = accept4(serve->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        connection = calloc(1, sizeof(struct serve_connection));
+        connection->fd = fd;
+        connection->next = serve->connections;
+
+        if (serve->connections) {
+            serve->connections->previous = connection;
+        }
+
+        serve->connections = connection;
+
+        if (!serve_watch(serve, connection, EPOLL_CTL_ADD, EPOLLIN)) {
+            serve_close(serve, connection);
+        }
+    }
+}
+
+/* Stops reading requests, connections without one in progress are closed */
+void serve_stop(struct serve * serve) {
+    struct serve_connection * connection, * next;
+
+    serve->stopping = true;
+    epoll_ctl(serve->epoll, EPOLL_CTL_DEL, serve->listener, NULL);
+
+    for (connection = serve->connections; connection; connection = next) {
+        next = connection->next;
+
+        if (!connection->busy) {
+            serve_close(serve, connection);
+        }
+    }
+}
+
+/* Returns message of failed call */
+const char * serve_listen(struct serve * serve, const char * socket_path) {
+    struct sockaddr_un address;
+    struct epoll_event event;
+    struct stat st;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        return "socket path is too long";
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    /* socket of a previous run is replaced */
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);
+    }
+
+    if ((serve->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0
+     || bind(serve->listener, (const struct sockaddr *) &address, sizeof(address))
+     || listen(serve->listener, SOMAXCONN)) {
+        return strerror(errno);
+    }
+
+    if ((serve->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+     || (serve->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        return strerror(errno);
+    }
+
+    /* connections are told from these by their pointers */
+    event.events = EPOLLIN;
+    event.data.ptr = &serve->listener;
+
+    if (epoll_ctl(serve->epoll, EPOLL_CTL_ADD, serve->listener, &event)) {
+        return strerror(errno);
+    }
+
+    event.data.ptr = &serve->signals;
+
+    if (epoll_ctl(serve->epoll, EPOLL_CTL_ADD, serve->signals, &event)) {
+        return strerror(errno);
+    }
+
+    event.data.ptr = &serve->wake;
+
+    if (epoll_ctl(serve->epoll, EPOLL_CTL_ADD, serve->wake, &event)) {
+        return strerror(errno);
+    }
+
+    return NULL;
+}
+
+bool serve_run(const char * socket_path, const char * modules_prefix, uint32_t threads, uint32_t queue_depth,
+        uint32_t deadline, struct cache * cache, FILE * log) {
+    struct epoll_event events[SERVE_EVENTS];
+    struct signalfd_siginfo signal_info;
+    struct serve_connection * connection;
+    struct serve_worker * workers;
+    sigset_t signals, previous;
+    bool stopping = false;
+    const char * error;
+    struct serve serve;
+    uint32_t i;
+    int count;
+
+    threads = threads ? threads : pool_default_threads();
+
+    /* signals are taken from signalfd, so every thread created below blocks them */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+    serve.listener = serve.wake = serve.epoll = -1;
+    serve.signals = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    if ((error = serve_listen(&serve, socket_path))) {
+        fprintf(log, "Serving %s failed: %s.\n", socket_path, error);
+
+        if (serve.epoll >= 0) {
+            close(serve.epoll);
+        }
+
+        if (serve.wake >= 0) {
+            close(serve.wake);
+        }
+
+        if (serve.listener >= 0) {
+            close(serve.listener);
+        }
+
+        close(serve.signals);
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+        return false;
+    }
+
+    serve.context = transformer_context_new(modules_prefix, threads);
+    serve.cache = cache;
+    serve.deadline = deadline;
+    serve.scripts = malloc(sizeof(struct serve_script) * SERVE_MAX_SCRIPTS);
+    serve.scripts_count = 0;
+    serve.next_id = 0;
+    serve.tick = 0;
+    pthread_mutex_init(&serve.scripts_mutex, NULL);
+
+    serve.connections = NULL;
+    serve.busy = 0;
+    serve.pending_head = serve.pending_tail = NULL;
+    serve.stopping = false;
+
+    serve.queue_capacity = queue_depth ? queue_depth : SERVE_QUEUE_DEPTH;
+    serve.queue = malloc(sizeof(struct serve_connection *) * serve.queue_capacity);
+    serve.queue_head = serve.queue_count = 0;
+    serve.done = NULL;
+    serve.finished = false;
+    pthread_mutex_init(&serve.mutex, NULL);
+    pthread_cond_init(&serve.not_empty, NULL);
+
+    workers = malloc(sizeof(struct serve_worker) * threads);
+
+    for (i = 0; i < threads; ++i) {
+        workers[i].serve = &serve;
+        pthread_create(&workers[i].thread, NULL, serve_worker_run, workers + i);
+    }
+
+    fprintf(log, "Serving %s with %lu workers.\n", socket_path, (unsigned long) threads);
+
+    /* after a signal, pending responses are sent unless clients do not take them for a while */
+    while (!serve.stopping || serve.busy > 0) {
+        if ((count = epoll_wait(serve.epoll, events, SERVE_EVENTS, serve.stopping ? SERVE_TIMEOUT * 1000 : -1)) <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (count < 0) {
+                fprintf(log, "Serving %s failed: %s.\n", socket_path, strerror(errno));
+            }
+
+            break;
+        }
+
+        for (i = 0; i < (uint32_t) count; ++i) {
+            if (events[i].data.ptr == &serve.signals) {
+                if (read(serve.signals, &signal_info, sizeof(signal_info)) == sizeof(signal_info)) {
+                    stopping = true;
+                }
+            } else if (events[i].data.ptr == &serve.listener) {
+                serve_accept(&serve);
+            } else if (events[i].data.ptr == &serve.wake) {
+                serve_collect(&serve);
+            } else {
+                connection = events[i].data.ptr;
+
+                if (!(connection->busy ? serve_send(&serve, connection) : serve_receive(&serve, connection))) {
+                    serve_close(&serve, connection);
+                }
+            }
+        }
+
+        /* connections closed by stopping may have events of this wait */
+        if (stopping && !serve.stopping) {
+            serve_stop(&serve);
+        }
+    }
+
+    /* queued requests are answered before workers stop, their responses are not sent after the loop */
+    pthread_mutex_lock(&serve.mutex);
+    serve.finished = true;
+    pthread_cond_broadcast(&serve.not_empty);
+    pthread_mutex_unlock(&serve.mutex);
+
+    for (i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    while (serve.connections) {
+        serve_close(&serve, serve.connections);
+    }
+
+    unlink(socket_path);
+    close(serve.listener);
+    close(serve.epoll);
+    close(serve.wake);
+    close(serve.signals);
+
+    for (i = 0; i < serve.scripts_count; ++i) {
+        transformer_script_delete(serve.scripts[i].script);
+        free(serve.scripts[i].code);
+    }
+
+    transformer_context_delete(serve.context);
+
+    pthread_cond_destroy(&serve.not_empty);
+    pthread_mutex_destroy(&serve.mutex);
+    pthread_mutex_destroy(&serve.scripts_mutex);
+
+    free(workers);
+    free(serve.queue);
+    free(serve.scripts);
+
+    fprintf(log, "Serving %s stopped.\n", socket_path);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cache.h"
+
+/* Serve mode: a daemon answering requests of protocol.h on a Unix domain socket
+ *
+ * Scripts are compiled on first use and kept with their modules loaded, so a request
+ * costs only transformation and copies. Up to 256 scripts are kept, the least recently used one
+ * no request is being answered with is dropped for a new one. The calling thread reads requests and sends responses
+ * without blocking, only complete requests are queued, so slow or idle clients do not hold
+ * worker threads. Workers take a request, answer it and give the connection back.
+ * When the queue is full, complete requests wait in the calling thread, which keeps accepting
+ * connections and sending responses, and next requests of their connections wait in sockets.
+ */
+
+/* Default count of queued requests */
+#define SERVE_QUEUE_DEPTH (64)
+
+/* Zero `threads` means CPUs available to the process, it is count of workers and of pool threads.
+ * A request is stopped when its transformation takes longer than `deadline` milliseconds unless it is 0.
+ * Results are looked up in `cache` and stored there unless it is NULL.
+ * Returns after SIGINT or SIGTERM once queued requests are answered, false if socket cannot be served (reported to `log`).
+ */
+bool serve_run(const char * socket_path, const char * modules_prefix, uint32_t threads, uint32_t queue_depth,
+    uint32_t deadline, struct cache * cache, FILE * log);
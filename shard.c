@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+
+#include "shard.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/mempolicy.h>
+
+#include "interpreter.h"
+#include "util.h"
+
+/* Words of node mask passed to mbind */
+#define SHARD_NODE_WORDS (16)
+
+/* Start of shared memory segment, pixel buffers follow it at page boundaries */
+struct shard_header {
+    pthread_barrier_t barrier; /* of workers, after compilation and after every pass */
+    pthread_mutex_t mutex;
+
+    bool failed; /* written under mutex, read after barrier */
+    char error[SHARD_ERROR_LENGTH];
+
+    uint32_t passes; /* result is in buffer of this parity */
+};
+
+struct shard {
+    struct shard_header * header;
+    struct pixel * buffers[2]; /* input of a pass and its result */
+    size_t size; /* of segment */
+
+    uint32_t width;
+    uint32_t height;
+
+    pid_t * workers; /* 0 after worker is reaped */
+    uint32_t count;
+};
+
+size_t shard_page_align(size_t size) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+
+    return (size + page - 1) / page * page;
+}
+
+/* Restricts calling process to its slice of allowed CPUs, returns NUMA node it runs on or -1 */
+int shard_pin(uint32_t index, uint32_t count) {
+    uint32_t cpus[CPU_SETSIZE], allowed_count = 0, i;
+    cpu_set_t allowed, target;
+    unsigned cpu, node;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &allowed)) {
+            cpus[allowed_count++] = i;
+        }
+    }
+
+    CPU_ZERO(&target);
+
+    /* consecutive CPUs usually share a node, workers share CPUs if there are not enough of them */
+    if (allowed_count >= count) {
+        for (i = allowed_count * index / count; i < allowed_count * (index + 1) / count; ++i) {
+            CPU_SET(cpus[i], &target);
+        }
+    } else {
+        CPU_SET(cpus[index % allowed_count], &target);
+    }
+
+    if (sched_setaffinity(0, sizeof(target), &target) != 0 || syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return -1;
+    }
+
+    return node;
+}
+
+/* Prefers pages of rows [from, to) of both buffers on `node`, pages shared with neighbour bands are left */
+void shard_bind(const struct shard * shard, uint32_t from, uint32_t to, int node) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    unsigned long mask[SHARD_NODE_WORDS];
+    size_t start, end;
+    uint32_t i;
+
+    if (node < 0 || node >= (int) (sizeof(mask) * 8)) {
+        return;
+    }
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / (sizeof(unsigned long) * 8)] = 1UL << (node % (sizeof(unsigned long) * 8));
+
+    for (i = 0; i < 2; ++i) {
+        start = (size_t) (shard->buffers[i] + (size_t) shard->width * from);
+        end = (size_t) (shard->buffers[i] + (size_t) shard->width * to);
+        start = (start + page - 1) / page * page;
+        end = end / page * page;
+
+        /* failure (e. g. in a container without the permission) leaves placement to the kernel */
+        if (start < end) {
+            syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+        }
+    }
+}
+
+/* Records the first failure of workers */
+void shard_fail(struct shard_header * header, const char * message) {
+    pthread_mutex_lock(&header->mutex);
+
+    if (!header->failed) {
+        header->failed = true;
+        strncpy(header->error, message, SHARD_ERROR_LENGTH - 1);
+        header->error[SHARD_ERROR_LENGTH - 1] = '\0';
+    }
+
+    pthread_mutex_unlock(&header->mutex);
+}
+
+/* Body of worker process, every worker waits at the barrier the same number of times */
+void shard_work(struct shard * shard, uint32_t index, const struct image input, const struct ast_script * script,
+        const char * modules_prefix, uint32_t threads) {
+    struct shard_header * header = shard->header;
+    const uint32_t from = (uint64_t) shard->height * index / shard->count;
+    const uint32_t to = (uint64_t) shard->height * (index + 1) / shard->count;
+    struct interpreter interpreter;
+    struct image images[2];
+    uint32_t passes, steps, i;
+    char * error = NULL;
+    const char * message;
+
+    /* pages of the band are touched first by its worker, after they are bound */
+    shard_bind(shard, from, to, shard_pin(index, shard->count));
+    memcpy(shard->buffers[0] + (size_t) shard->width * from, input.pixels + (size_t) input.width * from,
+        sizeof(struct pixel) * input.width * (to - from));
+
+    interpreter = interpreter_create(script);
+    interpreter.threads = threads;
+
+    if (modules_prefix) {
+        interpreter.modules_prefix = modules_prefix;
+    }
+
+    if ((message = interpreter_process_script(&interpreter))) {
+        shard_fail(header, message);
+    }
+
+    pthread_barrier_wait(&header->barrier);
+
+    if (header->failed) {
+        interpreter_discard(interpreter);
+        _exit(0);
+    }
+
+    passes = interpreter_band_passes(interpreter, &steps);
+
+    if (index == 0) {
+        header->passes = passes;
+    }
+
+    for (i = 0; i < 2; ++i) {
+        images[i].width = shard->width;
+        images[i].height = shard->height;
+        images[i].pixels = shard->buffers[i];
+    }
+
+    for (i = 0; i < passes; ++i) {
+        if (!header->failed && interpreter_run_band(interpreter, i, images[i % 2], images[(i + 1) % 2], from, to, &error)) {
+            shard_fail(header, error);
+            free(error);
+            error = NULL;
+        }
+
+        pthread_barrier_wait(&header->barrier);
+    }
+
+    interpreter_discard(interpreter);
+    _exit(0);
+}
+
+void shard_delete(struct shard * shard) {
+    uint32_t i;
+
+    if (!shard) {
+        return;
+    }
+
+    for (i = 0; i < shard->count; ++i) {
+        if (shard->workers[i] > 0) {
+            kill(shard->workers[i], SIGKILL);
+            waitpid(shard->workers[i], NULL, 0);
+        }
+    }
+
+    munmap(shard->header, shard->size);
+    free(shard->workers);
+    free(shard);
+}
+
+/* Segment is unlinked right away, it lives while it is mapped by coordinator and workers */
+const char * shard_map(struct shard * shard) {
+    const size_t header_size = shard_page_align(sizeof(struct shard_header));
+    const size_t buffer_size = shard_page_align(sizeof(struct pixel) * shard->width * shard->height);
+    pthread_barrierattr_t barrier_attributes;
+    pthread_mutexattr_t mutex_attributes;
+    char name[64];
+    void * segment;
+    int fd;
+
+    sprintf(name, "/image-transformer.%lu", (unsigned long) getpid());
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+        return strerror(errno);
+    }
+
+    shm_unlink(name);
+    shard->size = header_size + 2 * buffer_size;
+
+    if (ftruncate(fd, shard->size) != 0
+            || (segment = mmap(NULL, shard->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return strerror(errno);
+    }
+
+    close(fd);
+
+    shard->header = segment;
+    shard->buffers[0] = (struct pixel *) ((char *) segment + header_size);
+    shard->buffers[1] = (struct pixel *) ((char *) segment + header_size + buffer_size);
+
+    pthread_barrierattr_init(&barrier_attributes);
+    pthread_barrierattr_setpshared(&barrier_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&shard->header->barrier, &barrier_attributes, shard->count);
+    pthread_barrierattr_destroy(&barrier_attributes);
+
+    pthread_mutexattr_init(&mutex_attributes);
+    pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&shard->header->mutex, &mutex_attributes);
+    pthread_mutexattr_destroy(&mutex_attributes);
+
+    shard->header->failed = false;
+    shard->header->error[0] = '\0';
+    shard->header->passes = 0;
+    return NULL;
+}
+
+struct shard * shard_start(const struct image image, uint32_t workers, const struct ast_script * script,
+        const char * modules_prefix, uint32_t threads, const char ** error) {
+    struct shard * shard = malloc(sizeof(struct shard));
+    uint32_t i;
+    pid_t pid;
+
+    shard->header = NULL;
+    shard->width = image.width;
+    shard->height = image.height;
+    shard->count = workers;
+    shard->workers = calloc(workers, sizeof(pid_t));
+
+    if ((*error = shard_map(shard))) {
+        free(shard->workers);
+        free(shard);
+        return NULL;
+    }
+
+    /* buffered output is not written twice by workers */
+    fflush(NULL);
+
+    for (i = 0; i < workers; ++i) {
+        if ((pid = fork()) < 0) {
+            *error = strerror(errno);
+            shard_delete(shard);
+            return NULL;
+        }
+
+        if (pid == 0) {
+            shard_work(shard, i, image, script, modules_prefix, threads);
+        }
+
+        shard->workers[i] = pid;
+    }
+
+    return shard;
+}
+
+const char * shard_finish(struct shard * shard, struct image * image, char ** error) {
+    char message[SHARD_ERROR_LENGTH + 64];
+    uint32_t remaining, i;
+    bool failed = false;
+    int status;
+    pid_t pid;
+
+    /* a worker that died leaves the others waiting at the barrier, so they are killed */
+    for (remaining = shard->count; remaining > 0; --remaining) {
+        while ((pid = waitpid(-1, &status, 0)) < 0 && errno == EINTR) {
+        }
+
+        for (i = 0; i < shard->count && shard->workers[i] != pid; ++i) {
+        }
+
+        if (pid < 0 || i == shard->count) {
+            break;
+        }
+
+        shard->workers[i] = 0;
+
+        if (failed || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            continue;
+        }
+
+        if (WIFSIGNALED(status)) {
+            sprintf(message, "worker %lu was killed by signal %d", (unsigned long) i, WTERMSIG(status));
+        } else {
+            sprintf(message, "worker %lu exited with code %d", (unsigned long) i, WEXITSTATUS(status));
+        }
+
+        failed = true;
+
+        for (i = 0; i < shard->count; ++i) {
+            if (shard->workers[i] > 0) {
+                kill(shard->workers[i], SIGKILL);
+            }
+        }
+    }
+
+    if (!failed && shard->header->failed) {
+        strcpy(message, shard->header->error);
+        failed = true;
+    }
+
+    if (failed) {
+        *error = strdup(message);
+        return *error;
+    }
+
+    memcpy(image->pixels, shard->buffers[shard->header->passes % 2], sizeof(struct pixel) * image->width * image->height);
+    return NULL;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "ast.h"
+#include "image.h"
+
+/* Sharding: one image transformed by several worker processes
+ *
+ * Image is placed in a POSIX shared memory segment and workers are forked, each owning
+ * a horizontal band of rows. Every worker compiles script itself and runs leading band passes
+ * of it (see interpreter_band_passes) on its band, between passes workers meet at a process-shared
+ * barrier, so halo rows of the next pass are read from neighbour bands in the segment. A worker is
+ * restricted to its slice of allowed CPUs and prefers memory of the NUMA node of them for its band.
+ * Steps after band passes are left to the caller.
+ */
+
+/* Upper bound of worker processes */
+#define SHARD_MAX_WORKERS (64)
+
+/* Longest error message reported by a worker */
+#define SHARD_ERROR_LENGTH (512)
+
+struct shard;
+
+/* Forks workers, should be called before the process creates threads.
+ * Returns NULL and sets `error` on failure.
+ */
+struct shard * shard_start(const struct image image, uint32_t workers, const struct ast_script * script,
+    const char * modules_prefix, uint32_t threads, const char ** error);
+
+/* Waits for workers, then replaces pixels of `image` with result of band passes.
+ * Message of failure is kept in `*error` to be freed by caller.
+ */
+const char * shard_finish(struct shard * shard, struct image * image, char ** error);
+
+/* Kills workers still running */
+void shard_delete(struct shard * shard);
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "hash.h"
+
+/* "ITSN" in little-endian */
+#define SNAPSHOT_MAGIC (0x4e535449)
+
+/* Pixels follow the header */
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+};
+
+struct store * snapshot_open(const char * directory, size_t limit, const char ** error) {
+    return store_open(directory, ".snapshot", limit, error);
+}
+
+struct snapshot_key snapshot_image_key(const struct image image) {
+    struct snapshot_key key;
+    uint32_t size[2];
+
+    size[0] = image.width;
+    size[1] = image.height;
+
+    key.hash[0] = hash_bytes(size, sizeof(size), SNAPSHOT_SEED_0);
+    key.hash[0] = hash_bytes(image.pixels, sizeof(struct pixel) * image.width * image.height, key.hash[0]);
+    key.hash[1] = hash_bytes(size, sizeof(size), SNAPSHOT_SEED_1);
+    key.hash[1] = hash_bytes(image.pixels, sizeof(struct pixel) * image.width * image.height, key.hash[1]);
+
+    return key;
+}
+
+struct snapshot_key snapshot_key_combine(const struct snapshot_key input, const struct snapshot_key prefix) {
+    struct snapshot_key key;
+
+    key.hash[0] = hash_bytes(&prefix.hash[0], sizeof(uint64_t), input.hash[0]);
+    key.hash[1] = hash_bytes(&prefix.hash[1], sizeof(uint64_t), input.hash[1]);
+
+    return key;
+}
+
+bool snapshot_load(struct store * store, const struct snapshot_key key, struct image * image) {
+    const struct snapshot_header * header;
+    size_t pixels;
+    struct stat st;
+    void * mapped;
+    int fd;
+
+    if ((fd = store_open_entry(store, key.hash, &st)) < 0) {
+        return false;
+    }
+
+    mapped = (size_t) st.st_size >= sizeof(struct snapshot_header)
+        ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    header = mapped;
+    pixels = (size_t) header->width * header->height;
+
+    if (header->magic != SNAPSHOT_MAGIC
+     || sizeof(struct snapshot_header) + sizeof(struct pixel) * pixels != (size_t) st.st_size) {
+        munmap(mapped, st.st_size);
+        return false;
+    }
+
+    /* pixels of an image of the same size are reused */
+    if ((size_t) image->width * image->height != pixels) {
+        image_discard(*image);
+        *image = image_create(header->width, header->height);
+    }
+
+    image->width = header->width;
+    image->height = header->height;
+    memcpy(image->pixels, header + 1, sizeof(struct pixel) * pixels);
+
+    munmap(mapped, st.st_size);
+    return true;
+}
+
+void snapshot_store(struct store * store, const struct snapshot_key key, const struct image image) {
+    const size_t size = sizeof(struct snapshot_header) + sizeof(struct pixel) * image.width * image.height;
+    struct snapshot_header * header;
+    bool written = false;
+    char * path;
+    int fd;
+
+    if ((fd = store_create(store, &path)) < 0) {
+        return;
+    }
+
+    /* blocks are allocated first, so a full disk fails here instead of in stores to mapping */
+    if (posix_fallocate(fd, 0, size) == 0
+     && (header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+        header->magic = SNAPSHOT_MAGIC;
+        header->width = image.width;
+        header->height = image.height;
+        header->reserved = 0;
+        memcpy(header + 1, image.pixels, sizeof(struct pixel) * image.width * image.height);
+
+        written = munmap(header, size) == 0;
+    }
+
+    store_commit(store, key.hash, fd, path, size, written);
+}
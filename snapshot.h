@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+#include "store.h"
+
+/* Snapshots of intermediate images of runs
+ *
+ * An image made by a prefix of script is kept in a store (see store.h) under a key of
+ * the input image and the prefix, so a run of a script with an edited tail resumes from
+ * the longest prefix it shares with a previous run. Snapshots are memory mapped files.
+ */
+
+/* Default limit of directory size, in bytes */
+#define SNAPSHOT_SIZE_LIMIT ((size_t) 4 << 30)
+
+/* Seeds of the two hashes of keys */
+#define SNAPSHOT_SEED_0 UINT64_C(0x736e617073686f74)
+#define SNAPSHOT_SEED_1 UINT64_C(0x707265666978656e)
+
+struct snapshot_key {
+    uint64_t hash[2];
+};
+
+/* Creates directory if it is missing, returns NULL and sets `error` on failure */
+struct store * snapshot_open(const char * directory, size_t limit, const char ** error);
+
+/* Key of size and pixels of image */
+struct snapshot_key snapshot_image_key(const struct image image);
+
+/* Key of image made by script prefix of hash `prefix` from image of key `input` */
+struct snapshot_key snapshot_key_combine(const struct snapshot_key input, const struct snapshot_key prefix);
+
+/* Returns false on miss, on hit image is replaced with snapshot */
+bool snapshot_load(struct store * store, const struct snapshot_key key, struct image * image);
+
+/* Failure to store only loses the snapshot */
+void snapshot_store(struct store * store, const struct snapshot_key key, const struct image image);
@@ -1,20 +1,25 @@
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 
 #include "image.h"
 #include "value.h"
-#include "util.h"
+#include "module.h"
+#include "remap.h"
 
 const char * echo(const struct image * image, uint32_t argc, const struct value * args) {
-    puts(argc > 0 && value_is_string(args[0]) ? value_to_string(args[0]) : "");
+    char buffer[VALUE_STRING_SIZE];
+
+    puts(argc > 0 && value_is_string(args[0]) ? value_format(args[0], buffer) : "");
     return NULL;
 }
 
+/* Message is owned by arguments of the step, so it outlives the call */
 const char * die(const struct image * image, uint32_t argc, const struct value * args) {
-    static char * message;
-
-    return argc > 0 && value_is_string(args[0])
-        ? strset(&message, value_to_string(args[0]))
+    return argc > 0 && args[0].type == V_STRING
+        ? args[0].value.string
         : "suicide";
 }
 
@@ -35,8 +40,75 @@ void do_print_ansi(const struct image image, const char * pixel_string) {
 }
 
 const char * print_ansi(const struct image * image, uint32_t argc, const struct value * args) {
+    char buffer[VALUE_STRING_SIZE];
+
     do_print_ansi(*image, argc > 0 && value_is_string(args[0])
-            ? value_to_string(args[0]) : "  ");
+            ? value_format(args[0], buffer) : "  ");
+
+    return NULL;
+}
+
+const char * affine_matrix(double matrix[4], uint32_t argc, const struct value * args) {
+    uint32_t i;
+
+    if (argc != 4) {
+        return "matrix coefficients a, b, c and d are required as numbers";
+    }
+
+    for (i = 0; i < 4; ++i) {
+        if (!value_is_floating(args[i])) {
+            return "matrix coefficients a, b, c and d are required as numbers";
+        }
+
+        matrix[i] = value_to_floating(args[i]);
+    }
+
+    if (fabs(matrix[0] * matrix[3] - matrix[1] * matrix[2]) < 1e-9) {
+        return "matrix should be invertible";
+    }
 
     return NULL;
 }
+
+const struct module_descriptor affine_descriptor = {
+    sizeof(struct module_descriptor), MODULE_ABI_VERSION,
+    MODULE_ACCESS_GEOMETRIC, MODULE_THREAD_SAFE | MODULE_RESIZES, MODULE_LAYOUT_RGB24,
+    0, 10, NULL,
+    MODULE_BORDER_REPLICATE, NULL, NULL, affine_matrix
+};
+
+/* Maps every output pixel back to input, so image is resampled once */
+const char * do_affine(struct image * image, const double matrix[4]) {
+    struct remap_table table;
+    struct image result;
+    const char * error;
+
+    if ((error = remap_table_create(&table, image->width, image->height, matrix))) {
+        return error;
+    }
+
+    result = image_create(table.width, table.height);
+    error = remap_table_apply(&table, *image, result);
+    remap_table_discard(table);
+
+    if (error) {
+        image_discard(result);
+        return error;
+    }
+
+    image_discard(*image);
+    *image = result;
+    return NULL;
+}
+
+/* affine(a, b, c, d), maps offset (x, y) from image center to (a * x + b * y, c * x + d * y) */
+const char * affine(struct image * image, uint32_t argc, const struct value * args) {
+    double matrix[4];
+    const char * error;
+
+    if ((error = affine_matrix(matrix, argc, args))) {
+        return error;
+    }
+
+    return do_affine(image, matrix);
+}
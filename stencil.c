@@ -0,0 +1,132 @@
+#include "stencil.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cancel.h"
+
+struct stencil_job {
+    const struct stencil * stencil;
+    const struct image * source;
+    struct image * result;
+};
+
+/* Copies pixels [x0 - radius, x1 + radius) of row `y` to `dst`, pixels outside of image follow border mode */
+void stencil_load_row(const struct stencil * stencil, const struct image source, int64_t y,
+        uint32_t x0, uint32_t x1, struct pixel * dst) {
+    static const struct pixel black_pixel = { 0, 0, 0 };
+    const bool zero = stencil->border == MODULE_BORDER_ZERO;
+    const int64_t left = (int64_t) x0 - stencil->radius, right = (int64_t) x1 + stencil->radius;
+    const int64_t from = left < 0 ? 0 : left, to = right > source.width ? source.width : right;
+    const struct pixel * row;
+    int64_t x;
+
+    if (y < 0 || y >= source.height) {
+        if (zero) {
+            memset(dst, 0, sizeof(struct pixel) * (right - left));
+            return;
+        }
+
+        y = y < 0 ? 0 : source.height - 1;
+    }
+
+    row = source.pixels + source.width * y;
+    memcpy(dst + (from - left), row + from, sizeof(struct pixel) * (to - from));
+
+    for (x = left; x < from; ++x) {
+        dst[x - left] = zero ? black_pixel : row[0];
+    }
+
+    for (x = to; x < right; ++x) {
+        dst[x - left] = zero ? black_pixel : row[source.width - 1];
+    }
+}
+
+/* Processes rows [from, to) strip by strip, input row y is kept in ring slot (y + radius) % size.
+ * Current cancel token is checked before every row of a strip.
+ */
+const char * stencil_band_run(void * context, uint32_t from, uint32_t to) {
+    const struct stencil_job job = *((struct stencil_job *) context);
+    const uint32_t radius = job.stencil->radius, size = 2 * radius + 1, width = job.source->width;
+    const size_t stride = (sizeof(struct pixel) * (STENCIL_STRIP + 2 * radius) + STENCIL_ALIGNMENT - 1)
+        / STENCIL_ALIGNMENT * STENCIL_ALIGNMENT;
+    uint8_t * block = malloc(sizeof(struct pixel) * radius + STENCIL_ALIGNMENT + stride * size);
+    const struct pixel ** rows = malloc(sizeof(const struct pixel *) * size);
+    const char * error = NULL;
+    uint32_t x0, x1, y, k;
+    uint8_t * ring;
+
+    /* first pixel of strip is aligned in every slot */
+    ring = block + sizeof(struct pixel) * radius;
+    ring += (STENCIL_ALIGNMENT - (uintptr_t) ring % STENCIL_ALIGNMENT) % STENCIL_ALIGNMENT;
+
+    for (x0 = 0; x0 < width && !error; x0 = x1) {
+        x1 = width - x0 < STENCIL_STRIP ? width : x0 + STENCIL_STRIP;
+
+        for (k = 0; k < size - 1; ++k) {
+            stencil_load_row(job.stencil, *job.source, (int64_t) from - radius + k, x0, x1,
+                (struct pixel *) (ring + stride * ((from + k) % size)) - radius);
+        }
+
+        for (y = from; y < to && !error && !(error = cancel_check(cancel_current())); ++y) {
+            stencil_load_row(job.stencil, *job.source, (int64_t) y + radius, x0, x1,
+                (struct pixel *) (ring + stride * ((y + 2 * radius) % size)) - radius);
+
+            for (k = 0; k < size; ++k) {
+                rows[k] = (const struct pixel *) (ring + stride * ((y + k) % size));
+            }
+
+            error = job.stencil->kernel(job.stencil->context, rows,
+                job.result->pixels + (size_t) job.result->width * y + x0, x1 - x0);
+        }
+    }
+
+    free(rows);
+    free(block);
+    return error;
+}
+
+const char * stencil_apply(const struct stencil * stencil, struct image * image, const struct module_host * host) {
+    struct stencil_job job;
+    struct image result;
+    const char * error;
+
+    if (image->width == 0 || image->height == 0) {
+        return NULL;
+    }
+
+    result = image_create(image->width, image->height);
+
+    job.stencil = stencil;
+    job.source = image;
+    job.result = &result;
+
+    if ((error = MODULE_PARALLEL_FOR(host, image->height, STENCIL_MIN_ROWS, stencil_band_run, &job))) {
+        image_discard(result);
+        return error;
+    }
+
+    image_discard(*image);
+    *image = result;
+    return NULL;
+}
+
+const char * stencil_region(const struct stencil * stencil, const struct module_region * region) {
+    const uint32_t size = 2 * stencil->radius + 1;
+    const struct pixel ** rows = malloc(sizeof(const struct pixel *) * size);
+    const char * error = NULL;
+    uint32_t y, k;
+
+    for (y = 0; y < region->height && !error; ++y) {
+        for (k = 0; k < size; ++k) {
+            rows[k] = region->src + ((int64_t) y + k - stencil->radius) * region->src_stride;
+        }
+
+        error = stencil->kernel(stencil->context, rows, region->dst + (size_t) region->dst_stride * y, region->width);
+    }
+
+    free(rows);
+    return error;
+}
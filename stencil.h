@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "image.h"
+#include "value.h"
+#include "module.h"
+
+/* Stencil framework for modules
+ *
+ * A stencil transformation only provides a row kernel and a radius, the framework
+ * walks the image: it splits it into bands processed on host pool and strips that fit
+ * in cache, keeps 2 * radius + 1 input rows with border pixels in a ring buffer
+ * and calls the kernel for every output row segment.
+ */
+
+/* Width of a strip walked by one ring buffer, in pixels */
+#define STENCIL_STRIP (512)
+
+/* Minimal count of rows processed by one thread */
+#define STENCIL_MIN_ROWS (16)
+
+/* Alignment of ring buffer rows at the first pixel of a segment, in bytes */
+#define STENCIL_ALIGNMENT (64)
+
+/* Computes `count` output pixels of a row segment.
+ * rows[k] is input row y - radius + k at the first pixel of the segment, readable
+ * from -radius to count + radius - 1. Rows are aligned to STENCIL_ALIGNMENT
+ * when stencil is applied to image.
+ */
+typedef const char * (* stencil_kernel)(void * context, const struct pixel * const * rows, struct pixel * dst, uint32_t count);
+
+struct stencil {
+    stencil_kernel kernel;
+    void * context;
+
+    uint32_t radius;
+    enum module_border border;
+};
+
+/* Replaces image with result, `host` may be NULL */
+const char * stencil_apply(const struct stencil * stencil, struct image * image, const struct module_host * host);
+
+/* Computes region of a fused run, source halo is provided by the interpreter */
+const char * stencil_region(const struct stencil * stencil, const struct module_region * region);
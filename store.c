@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+
+#include "store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "util.h"
+
+/* Eviction leaves this part of the limit, so it does not run on every commit */
+#define STORE_EVICT_PERCENT (90)
+
+/* Hex digits of entry name */
+#define STORE_KEY_LENGTH (32)
+
+/* Longest suffix of entry names */
+#define STORE_SUFFIX_LENGTH (15)
+
+struct store {
+    char * directory;
+    char suffix[STORE_SUFFIX_LENGTH + 1];
+    size_t limit;
+
+    pthread_mutex_t mutex;
+    size_t size; /* of entries, estimated between scans of directory */
+    uint32_t temporaries; /* count of temporary files created, makes their names unique */
+};
+
+struct store_entry {
+    char name[STORE_KEY_LENGTH + STORE_SUFFIX_LENGTH + 1];
+    size_t size;
+    struct timespec used;
+};
+
+/* Result should be freed */
+char * store_path(const struct store * store, const char * name) {
+    char * path = malloc(sizeof(char) * (strlen(store->directory) + strlen(name) + 2));
+
+    sprintf(path, "%s/%s", store->directory, name);
+    return path;
+}
+
+char * store_entry_path(const struct store * store, const uint64_t key[2]) {
+    char name[STORE_KEY_LENGTH + STORE_SUFFIX_LENGTH + 1];
+
+    sprintf(name, "%016lx%016lx%s", (unsigned long) key[0], (unsigned long) key[1], store->suffix);
+    return store_path(store, name);
+}
+
+bool store_is_entry(const struct store * store, const char * name) {
+    return strspn(name, "0123456789abcdef") == STORE_KEY_LENGTH && strcmp(name + STORE_KEY_LENGTH, store->suffix) == 0;
+}
+
+int store_entry_compare(const void * a, const void * b) {
+    const struct timespec x = ((const struct store_entry *) a)->used, y = ((const struct store_entry *) b)->used;
+
+    if (x.tv_sec != y.tv_sec) {
+        return x.tv_sec < y.tv_sec ? -1 : 1;
+    }
+
+    return (x.tv_nsec > y.tv_nsec) - (x.tv_nsec < y.tv_nsec);
+}
+
+/* Scans directory, then removes the least recently used entries if it exceeds `keep` bytes.
+ * Called with mutex locked.
+ */
+void store_evict(struct store * store, size_t keep) {
+    struct store_entry * entries = NULL;
+    uint32_t count = 0, capacity = 0, i;
+    const struct dirent * dirent;
+    struct stat st;
+    char * path;
+    DIR * dir;
+
+    if (!(dir = opendir(store->directory))) {
+        return;
+    }
+
+    store->size = 0;
+
+    while ((dirent = readdir(dir))) {
+        if (!store_is_entry(store, dirent->d_name) || fstatat(dirfd(dir), dirent->d_name, &st, 0)) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, sizeof(struct store_entry) * capacity);
+        }
+
+        strcpy(entries[count].name, dirent->d_name);
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtim;
+        ++count;
+
+        store->size += st.st_size;
+    }
+
+    closedir(dir);
+
+    if (store->size > keep) {
+        qsort(entries, count, sizeof(struct store_entry), store_entry_compare);
+
+        for (i = 0; i < count && store->size > keep; ++i) {
+            path = store_path(store, entries[i].name);
+
+            if (unlink(path) == 0 || errno == ENOENT) {
+                store->size -= entries[i].size;
+            }
+
+            free(path);
+        }
+    }
+
+    free(entries);
+}
+
+struct store * store_open(const char * directory, const char * suffix, size_t limit, const char ** error) {
+    struct store * store;
+
+    if (strlen(suffix) > STORE_SUFFIX_LENGTH) {
+        *error = "suffix of entries is too long";
+        return NULL;
+    }
+
+    if (mkdir(directory, 0777) && errno != EEXIST) {
+        *error = strerror(errno);
+        return NULL;
+    }
+
+    store = malloc(sizeof(struct store));
+    store->directory = strdup(directory);
+    strcpy(store->suffix, suffix);
+    store->limit = limit;
+    store->size = 0;
+    store->temporaries = 0;
+    pthread_mutex_init(&store->mutex, NULL);
+
+    store_evict(store, store->limit);
+    return store;
+}
+
+void store_close(struct store * store) {
+    if (!store) {
+        return;
+    }
+
+    pthread_mutex_destroy(&store->mutex);
+    free(store->directory);
+    free(store);
+}
+
+int store_open_entry(struct store * store, const uint64_t key[2], struct stat * st) {
+    char * path = store_entry_path(store, key);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    free(path);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, st)) {
+        close(fd);
+        return -1;
+    }
+
+    futimens(fd, NULL);
+    return fd;
+}
+
+int store_create(struct store * store, char ** path) {
+    char name[64];
+    int fd;
+
+    pthread_mutex_lock(&store->mutex);
+    sprintf(name, ".%lu.%lu.tmp", (unsigned long) getpid(), (unsigned long) store->temporaries++);
+    pthread_mutex_unlock(&store->mutex);
+
+    *path = store_path(store, name);
+
+    if ((fd = open(*path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) < 0) {
+        free(*path);
+        *path = NULL;
+    }
+
+    return fd;
+}
+
+void store_commit(struct store * store, const uint64_t key[2], int fd, char * path, size_t size, bool written) {
+    char * entry = store_entry_path(store, key);
+
+    if (close(fd) || !written || size > store->limit || rename(path, entry)) {
+        unlink(path);
+    } else {
+        pthread_mutex_lock(&store->mutex);
+        store->size += size;
+
+        if (store->size > store->limit) {
+            store_evict(store, store->limit / 100 * STORE_EVICT_PERCENT);
+        }
+
+        pthread_mutex_unlock(&store->mutex);
+    }
+
+    free(path);
+    free(entry);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Directory of files named by 128-bit keys
+ *
+ * Entries are written to temporary files and renamed, so processes may share a directory
+ * and an entry appears whole or not at all. Opening an entry refreshes its modification time
+ * and the least recently used entries are removed when directory exceeds the limit.
+ * Every function may be called from several threads at once.
+ */
+struct store;
+
+/* Creates directory if it is missing, entries are named `<32 hex digits><suffix>`.
+ * Returns NULL and sets `error` on failure.
+ */
+struct store * store_open(const char * directory, const char * suffix, size_t limit, const char ** error);
+void store_close(struct store * store);
+
+/* Opens entry for reading and marks it as recently used, returns -1 on miss */
+int store_open_entry(struct store * store, const uint64_t key[2], struct stat * st);
+
+/* Creates a temporary file to be passed to store_commit, returns -1 on failure */
+int store_create(struct store * store, char ** path);
+
+/* Closes temporary file, it becomes entry of `key` if `written`, otherwise or if it
+ * does not fit the limit it is removed. Failure to commit only loses the entry.
+ */
+void store_commit(struct store * store, const uint64_t key[2], int fd, char * path, size_t size, bool written);
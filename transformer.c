@@ -0,0 +1,117 @@
+#include "transformer.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ast.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "pool.h"
+#include "util.h"
+
+struct transformer_context {
+    char * modules_prefix;
+    struct pool * pool;
+
+    pthread_mutex_t mutex; /* serializes loading and initialization of modules */
+};
+
+struct transformer_script {
+    struct ast_script * script;
+    char * modules_prefix; /* referenced by interpreter */
+
+    struct interpreter interpreter;
+};
+
+struct transformer_context * transformer_context_new(const char * modules_prefix, uint32_t threads) {
+    struct transformer_context * context = malloc(sizeof(struct transformer_context));
+
+    context->modules_prefix = strdup(modules_prefix ? modules_prefix : "");
+    context->pool = pool_new(threads);
+    pthread_mutex_init(&context->mutex, NULL);
+
+    return context;
+}
+
+void transformer_context_delete(struct transformer_context * context) {
+    if (!context) {
+        return;
+    }
+
+    pthread_mutex_destroy(&context->mutex);
+    pool_delete(context->pool);
+    free(context->modules_prefix);
+    free(context);
+}
+
+/* Takes ownership of parsed `ast` */
+struct transformer_script *
+transformer_compile_ast(struct transformer_context * context, struct ast_script * ast, char ** error) {
+    struct transformer_script * script = malloc(sizeof(struct transformer_script));
+    const char * process_error;
+
+    script->script = ast;
+    script->modules_prefix = strdup(context->modules_prefix);
+
+    script->interpreter = interpreter_create(ast);
+    script->interpreter.modules_prefix = script->modules_prefix;
+    script->interpreter.pool = pool_retain(context->pool);
+
+    pthread_mutex_lock(&context->mutex);
+    process_error = interpreter_process_script(&script->interpreter);
+    pthread_mutex_unlock(&context->mutex);
+
+    if (process_error) {
+        *error = strdup(process_error);
+        transformer_script_delete(script);
+        return NULL;
+    }
+
+    return script;
+}
+
+struct transformer_script * transformer_compile(struct transformer_context * context, const char * code, char ** error) {
+    struct ast_script * ast;
+
+    if (!parser_parse_string(&ast, code, error)) {
+        return NULL;
+    }
+
+    return transformer_compile_ast(context, ast, error);
+}
+
+struct transformer_script * transformer_compile_file(struct transformer_context * context, FILE * file, char ** error) {
+    struct ast_script * ast;
+
+    if (!parser_parse_file(&ast, file, error)) {
+        return NULL;
+    }
+
+    return transformer_compile_ast(context, ast, error);
+}
+
+void transformer_script_delete(struct transformer_script * script) {
+    if (!script) {
+        return;
+    }
+
+    interpreter_discard(script->interpreter);
+    ast_script_delete(script->script);
+    free(script->modules_prefix);
+    free(script);
+}
+
+bool transformer_run(const struct transformer_script * script, struct image * image, char ** error) {
+    *error = NULL;
+    return interpreter_run(script->interpreter, image, error) == NULL;
+}
+
+bool transformer_run_cancellable(const struct transformer_script * script, struct image * image,
+        const struct cancel * cancel, char ** error) {
+    *error = NULL;
+    return interpreter_run_cancellable(script->interpreter, image, cancel, error) == NULL;
+}
+
+uint64_t transformer_script_hash(const struct transformer_script * script, uint64_t seed) {
+    return interpreter_script_hash(script->interpreter, seed);
+}
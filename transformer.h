@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "image.h"
+#include "cancel.h"
+
+/* Embeddable API of libimage-transformer
+ *
+ * A context owns the worker pool shared with modules by scripts compiled in it.
+ * Compiled script is immutable, so it may run images from several threads at once,
+ * every failed call reports its own message to be freed by caller.
+ */
+struct transformer_context;
+struct transformer_script;
+
+/* `modules_prefix` may be NULL, zero `threads` means CPUs available to the process */
+struct transformer_context * transformer_context_new(const char * modules_prefix, uint32_t threads);
+void transformer_context_delete(struct transformer_context * context);
+
+/* Return NULL and set `error` to message to be freed on failure, may be called from several threads */
+struct transformer_script * transformer_compile(struct transformer_context * context, const char * code, char ** error);
+struct transformer_script * transformer_compile_file(struct transformer_context * context, FILE * file, char ** error);
+
+/* Script stays valid after its context is deleted */
+void transformer_script_delete(struct transformer_script * script);
+
+/* Replaces image with result, on failure returns false and sets `error` to message to be freed */
+bool transformer_run(const struct transformer_script * script, struct image * image, char ** error);
+
+/* Like transformer_run, stops within a row or a tile of work once `cancel` asks so, e. g. its deadline
+ * is exceeded. `cancel` may be requested from another thread, cancel_check tells why a run failed.
+ */
+bool transformer_run_cancellable(const struct transformer_script * script, struct image * image,
+    const struct cancel * cancel, char ** error);
+
+/* Hash of script and identities of module files it runs, equal hashes give equal results for equal images */
+uint64_t transformer_script_hash(const struct transformer_script * script, uint64_t seed);
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Rings are shared with the kernel, the other side of each index is accessed atomically */
+struct uring {
+    int fd; /* -1 when requests are performed synchronously */
+
+    uint32_t queued; /* pushed to submission ring and not submitted yet */
+    uint32_t in_flight; /* submitted and not reaped yet */
+    uint32_t depth;
+
+    void * sq_ring;
+    size_t sq_ring_size;
+    uint32_t * sq_tail;
+    uint32_t sq_mask;
+    uint32_t * sq_array;
+    struct io_uring_sqe * sqes;
+    size_t sqes_size;
+
+    void * cq_ring;
+    size_t cq_ring_size;
+    uint32_t * cq_head;
+    uint32_t * cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe * cqes;
+
+    struct uring_completion * done; /* completions of synchronous requests */
+    uint32_t done_count;
+};
+
+int uring_setup(uint32_t entries, struct io_uring_params * params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_enter(int fd, uint32_t submit, uint32_t wait, uint32_t flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+/* Leaves uring synchronous if rings cannot be set up */
+void uring_map(struct uring * uring) {
+    struct io_uring_params params;
+    uint8_t * sq;
+    uint8_t * cq;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+
+    if ((fd = uring_setup(uring->depth, &params)) < 0) {
+        return;
+    }
+
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_ring_size > uring->sq_ring_size) {
+            uring->sq_ring_size = uring->cq_ring_size;
+        }
+
+        uring->cq_ring_size = 0;
+    }
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uring->cq_ring = uring->sq_ring;
+
+    if (uring->sq_ring != MAP_FAILED && uring->cq_ring_size > 0) {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        if (uring->sqes != MAP_FAILED) {
+            munmap(uring->sqes, uring->sqes_size);
+        }
+
+        if (uring->cq_ring != MAP_FAILED && uring->cq_ring_size > 0) {
+            munmap(uring->cq_ring, uring->cq_ring_size);
+        }
+
+        if (uring->sq_ring != MAP_FAILED) {
+            munmap(uring->sq_ring, uring->sq_ring_size);
+        }
+
+        close(fd);
+        return;
+    }
+
+    sq = uring->sq_ring;
+    cq = uring->cq_ring;
+
+    uring->sq_tail = (uint32_t *) (sq + params.sq_off.tail);
+    uring->sq_mask = *((uint32_t *) (sq + params.sq_off.ring_mask));
+    uring->sq_array = (uint32_t *) (sq + params.sq_off.array);
+
+    uring->cq_head = (uint32_t *) (cq + params.cq_off.head);
+    uring->cq_tail = (uint32_t *) (cq + params.cq_off.tail);
+    uring->cq_mask = *((uint32_t *) (cq + params.cq_off.ring_mask));
+    uring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    uring->fd = fd;
+}
+
+struct uring * uring_new(uint32_t depth) {
+    struct uring * uring = malloc(sizeof(struct uring));
+
+    uring->fd = -1;
+    uring->queued = 0;
+    uring->in_flight = 0;
+    uring->depth = depth ? depth : 1;
+    uring->done = NULL;
+    uring->done_count = 0;
+
+    uring_map(uring);
+
+    if (uring->fd < 0) {
+        uring->done = malloc(sizeof(struct uring_completion) * uring->depth);
+    }
+
+    return uring;
+}
+
+void uring_delete(struct uring * uring) {
+    if (uring->fd >= 0) {
+        munmap(uring->sqes, uring->sqes_size);
+
+        if (uring->cq_ring_size > 0) {
+            munmap(uring->cq_ring, uring->cq_ring_size);
+        }
+
+        munmap(uring->sq_ring, uring->sq_ring_size);
+        close(uring->fd);
+    }
+
+    free(uring->done);
+    free(uring);
+}
+
+bool uring_async(const struct uring * uring) {
+    return uring->fd >= 0;
+}
+
+void uring_push(struct uring * uring, uint8_t opcode, int fd, const void * buffer, uint32_t length,
+        uint64_t offset, void * tag) {
+    const uint32_t tail = *uring->sq_tail, index = tail & uring->sq_mask;
+    struct io_uring_sqe * sqe = uring->sqes + index;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t) tag;
+
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ++uring->queued;
+}
+
+void uring_complete_now(struct uring * uring, ssize_t result, void * tag) {
+    uring->done[uring->done_count].tag = tag;
+    uring->done[uring->done_count].result = result < 0 ? -errno : (int32_t) result;
+    ++uring->done_count;
+}
+
+void uring_read(struct uring * uring, int fd, void * buffer, uint32_t length, uint64_t offset, void * tag) {
+    if (uring->fd < 0) {
+        uring_complete_now(uring, pread(fd, buffer, length, offset), tag);
+        return;
+    }
+
+    uring_push(uring, IORING_OP_READ, fd, buffer, length, offset, tag);
+}
+
+void uring_write(struct uring * uring, int fd, const void * buffer, uint32_t length, uint64_t offset, void * tag) {
+    if (uring->fd < 0) {
+        uring_complete_now(uring, pwrite(fd, buffer, length, offset), tag);
+        return;
+    }
+
+    uring_push(uring, IORING_OP_WRITE, fd, buffer, length, offset, tag);
+}
+
+/* Returns false on failure of io_uring_enter other than interruption */
+bool uring_do_enter(struct uring * uring, uint32_t wait) {
+    int submitted;
+
+    while ((submitted = uring_enter(uring->fd, uring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0)) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return false;
+        }
+    }
+
+    uring->queued -= submitted;
+    uring->in_flight += submitted;
+    return true;
+}
+
+void uring_submit(struct uring * uring) {
+    if (uring->fd >= 0 && uring->queued > 0) {
+        uring_do_enter(uring, 0);
+    }
+}
+
+/* Takes a completion from queue if there is one */
+bool uring_take(struct uring * uring, struct uring_completion * completion) {
+    const struct io_uring_cqe * cqe;
+    uint32_t head = *uring->cq_head;
+
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    cqe = uring->cqes + (head & uring->cq_mask);
+    completion->tag = (void *) (uintptr_t) cqe->user_data;
+    completion->result = cqe->res;
+
+    __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+    --uring->in_flight;
+    return true;
+}
+
+bool uring_wait(struct uring * uring, struct uring_completion * completion) {
+    if (uring->fd < 0) {
+        return uring_peek(uring, completion);
+    }
+
+    while (!uring_take(uring, completion)) {
+        if (uring->queued + uring->in_flight == 0 || !uring_do_enter(uring, 1)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool uring_peek(struct uring * uring, struct uring_completion * completion) {
+    if (uring->fd < 0) {
+        if (uring->done_count == 0) {
+            return false;
+        }
+
+        *completion = uring->done[--uring->done_count];
+        return true;
+    }
+
+    return uring_take(uring, completion);
+}
+
+uint32_t uring_pending(const struct uring * uring) {
+    return uring->fd < 0 ? uring->done_count : uring->queued + uring->in_flight;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Asynchronous file I/O on io_uring
+ *
+ * Reads and writes are queued with a tag and submitted by the next uring_submit or
+ * uring_wait, the kernel performs them while the caller does something else.
+ * If io_uring is not available (old kernel or forbidden by seccomp), requests are
+ * performed synchronously when queued and their completions are returned the same way.
+ */
+struct uring;
+
+struct uring_completion {
+    void * tag;
+    int32_t result; /* count of bytes transferred or -errno */
+};
+
+/* At most `depth` requests may be queued or in flight */
+struct uring * uring_new(uint32_t depth);
+/* Requests in flight are not cancelled, the kernel may access their buffers until they complete */
+void uring_delete(struct uring * uring);
+
+/* Whether requests go through io_uring */
+bool uring_async(const struct uring * uring);
+
+void uring_read(struct uring * uring, int fd, void * buffer, uint32_t length, uint64_t offset, void * tag);
+void uring_write(struct uring * uring, int fd, const void * buffer, uint32_t length, uint64_t offset, void * tag);
+
+/* Submits queued requests without waiting */
+void uring_submit(struct uring * uring);
+
+/* Submits queued requests and waits for a completion.
+ * Returns false if no request is in flight or io_uring failed.
+ */
+bool uring_wait(struct uring * uring, struct uring_completion * completion);
+
+/* Takes a completion without submitting or waiting, returns false if none is ready */
+bool uring_peek(struct uring * uring, struct uring_completion * completion);
+
+/* Count of requests queued or in flight */
+uint32_t uring_pending(const struct uring * uring);
@@ -25,5 +25,5 @@ char * strset(char ** dst, const char * src) {
         return (*dst = NULL);
     }
 
-    return strcpy(*dst = malloc(sizeof(char) * strlen(src)), src);
+    return strcpy(*dst = malloc(sizeof(char) * (strlen(src) + 1)), src);
 }
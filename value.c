@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
+
 #include "value.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "util.h"
 
@@ -57,18 +60,14 @@ double value_parse_floating(const char * string) {
     return end == string ? .0 : value;
 }
 
-const char * value_integer_to_string(int64_t integer) {
-    static char value[24];
-
-    sprintf(value, "%ld", integer);
-    return value;
+const char * value_integer_to_string(int64_t integer, char * buffer) {
+    sprintf(buffer, "%ld", integer);
+    return buffer;
 }
 
-const char * value_floating_to_string(double floating) {
-    static char value[256];
-
-    sprintf(value, "%.127f", floating);
-    return value;
+const char * value_floating_to_string(double floating, char * buffer) {
+    sprintf(buffer, "%.127f", floating);
+    return buffer;
 }
 
 bool value_is_integer(struct value value) {
@@ -154,13 +153,38 @@ double value_to_floating(struct value value) {
     }
 }
 
+/* Buffer of value_to_string per thread, created once per process */
+static pthread_key_t value_buffer_key;
+static pthread_once_t value_buffer_once = PTHREAD_ONCE_INIT;
+
+void value_buffer_key_create(void) {
+    pthread_key_create(&value_buffer_key, free);
+}
+
 const char * value_to_string(struct value value) {
+    char * buffer;
+
+    if (value.type != V_INTEGER && value.type != V_FLOATING) {
+        return value_format(value, NULL);
+    }
+
+    pthread_once(&value_buffer_once, value_buffer_key_create);
+
+    if (!(buffer = pthread_getspecific(value_buffer_key))) {
+        buffer = malloc(sizeof(char) * VALUE_STRING_SIZE);
+        pthread_setspecific(value_buffer_key, buffer);
+    }
+
+    return value_format(value, buffer);
+}
+
+const char * value_format(struct value value, char * buffer) {
     switch (value.type) {
     case V_INTEGER:
-        return value_integer_to_string(value.value.integer);
+        return value_integer_to_string(value.value.integer, buffer);
 
     case V_FLOATING:
-        return value_floating_to_string(value.value.floating);
+        return value_floating_to_string(value.value.floating, buffer);
 
     case V_STRING:
         return value.value.string;
@@ -3,6 +3,9 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+/* Size of buffer value_format formats numbers in */
+#define VALUE_STRING_SIZE (512)
+
 struct value {
     enum {
         V_INTEGER,
@@ -32,5 +35,8 @@ bool value_is_identifier(struct value value);
 
 int64_t value_to_integer(struct value value);
 double value_to_floating(struct value value);
+/* Numbers are formatted in a buffer of calling thread valid until its next call, strings are returned as is */
 const char * value_to_string(struct value value);
+/* Like value_to_string, but numbers are formatted in `buffer` of VALUE_STRING_SIZE chars */
+const char * value_format(struct value value, char * buffer);
 void * value_to_identifier(struct value value);
@@ -0,0 +1,421 @@
+#define _GNU_SOURCE
+
+#include "watch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "util.h"
+
+/* Buffer of inotify events, fits at least one event with the longest name */
+#define WATCH_EVENTS_BUFFER (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+/* Initial buckets of table of added files, a power of two */
+#define WATCH_FILES_CAPACITY (256)
+
+/* File added to a burst, rescans of the directory skip it while it is the same */
+struct watch_file {
+    char * name;
+
+    ino_t inode;
+    off_t size;
+    struct timespec changed; /* also updated by rename */
+
+    struct watch_file * next;
+};
+
+struct watch {
+    const char * directory;
+    struct batch * batch;
+    FILE * log;
+
+    int inotify;
+    int signals;
+
+    struct timespec ready[WATCH_BURST]; /* of inputs of batch */
+    uint32_t lost; /* overflows of inotify queue */
+
+    /* hash table by name, files deleted or moved away are removed */
+    struct watch_file ** files;
+    uint32_t files_capacity;
+    uint32_t files_count;
+
+    bool rescan; /* directory should be read from the start */
+    DIR * scan; /* of a rescan paused by full burst */
+};
+
+double watch_elapsed(const struct timespec from) {
+    struct timespec to;
+
+    clock_gettime(CLOCK_MONOTONIC, &to);
+    return (to.tv_sec - from.tv_sec) * 1e3 + (to.tv_nsec - from.tv_nsec) / 1e6;
+}
+
+void watch_block_signals(void) {
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+void watch_finished(void * context, uint32_t index, bool succeeded) {
+    const struct watch * watch = context;
+
+    if (succeeded) {
+        fprintf(watch->log, "%s: written in %.2f ms.\n", watch->batch->inputs[index], watch_elapsed(watch->ready[index]));
+    }
+}
+
+struct watch_file ** watch_file_find(struct watch_file ** files, uint32_t capacity, const char * name) {
+    struct watch_file ** link = files + (hash_bytes(name, strlen(name), 0) & (capacity - 1));
+
+    while (*link && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+void watch_files_grow(struct watch * watch) {
+    const uint32_t capacity = watch->files_capacity * 2;
+    struct watch_file ** files = calloc(capacity, sizeof(struct watch_file *));
+    struct watch_file * file, * next, ** link;
+    uint32_t i;
+
+    for (i = 0; i < watch->files_capacity; ++i) {
+        for (file = watch->files[i]; file; file = next) {
+            next = file->next;
+            link = watch_file_find(files, capacity, file->name);
+            file->next = NULL;
+            *link = file;
+        }
+    }
+
+    free(watch->files);
+    watch->files = files;
+    watch->files_capacity = capacity;
+}
+
+void watch_file_remember(struct watch * watch, const char * name, const struct stat * st) {
+    struct watch_file ** link = watch_file_find(watch->files, watch->files_capacity, name);
+    struct watch_file * file = *link;
+
+    if (!file) {
+        file = malloc(sizeof(struct watch_file));
+        file->name = strdup(name);
+        file->next = NULL;
+        *link = file;
+        ++watch->files_count;
+    }
+
+    file->inode = st->st_ino;
+    file->size = st->st_size;
+    file->changed = st->st_ctim;
+
+    if (watch->files_count > watch->files_capacity) {
+        watch_files_grow(watch);
+    }
+}
+
+void watch_file_forget(struct watch * watch, const char * name) {
+    struct watch_file ** link = watch_file_find(watch->files, watch->files_capacity, name);
+    struct watch_file * file = *link;
+
+    if (file) {
+        *link = file->next;
+        free(file->name);
+        free(file);
+        --watch->files_count;
+    }
+}
+
+bool watch_file_unchanged(const struct watch * watch, const char * name, const struct stat * st) {
+    const struct watch_file * file = *watch_file_find(watch->files, watch->files_capacity, name);
+
+    return file && file->inode == st->st_ino && file->size == st->st_size
+        && file->changed.tv_sec == st->st_ctim.tv_sec && file->changed.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+void watch_files_delete(struct watch * watch) {
+    struct watch_file * file, * next;
+    uint32_t i;
+
+    for (i = 0; i < watch->files_capacity; ++i) {
+        for (file = watch->files[i]; file; file = next) {
+            next = file->next;
+            free(file->name);
+            free(file);
+        }
+    }
+
+    free(watch->files);
+}
+
+/* Input names of a burst are unique, a file closed twice is processed once.
+ * A file found by rescan is skipped if it was added before and is the same since.
+ */
+void watch_add(struct watch * watch, const char * name, bool rescanned) {
+    const size_t length = strlen(name);
+    struct batch * batch = watch->batch;
+    struct stat st;
+    bool regular;
+    char * path;
+    uint32_t i;
+
+    if (name[0] == '.' || length < 4 || strcasecmp(name + length - 4, ".bmp") != 0) {
+        return;
+    }
+
+    path = malloc(sizeof(char) * (strlen(watch->directory) + length + 2));
+    sprintf(path, "%s/%s", watch->directory, name);
+
+    regular = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+
+    if (rescanned && (!regular || watch_file_unchanged(watch, name, &st))) {
+        free(path);
+        return;
+    }
+
+    /* a file removed meanwhile is reported by batch */
+    if (regular) {
+        watch_file_remember(watch, name, &st);
+    }
+
+    for (i = 0; i < batch->count && strcmp(batch->inputs[i], path) != 0; ++i) {
+    }
+
+    if (i < batch->count) {
+        free(path);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, watch->ready + batch->count);
+    batch_add(batch, path);
+    free(path);
+}
+
+/* Adds files of events read until queue is empty or burst is full,
+ * files of lost events or of events past full burst are left to a rescan
+ */
+void watch_read(struct watch * watch) {
+    union {
+        struct inotify_event event; /* aligns buffer */
+        char bytes[WATCH_EVENTS_BUFFER];
+    } buffer;
+
+    const struct inotify_event * event;
+    ssize_t length;
+    char * next;
+
+    while (watch->batch->count < WATCH_BURST && (length = read(watch->inotify, buffer.bytes, sizeof(buffer))) > 0) {
+        for (next = buffer.bytes; next < buffer.bytes + length; next += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) next;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                ++watch->lost;
+                watch->rescan = true;
+            } else if (event->len == 0 || (event->mask & IN_ISDIR)) {
+                continue;
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                watch_file_forget(watch, event->name);
+            } else if (watch->batch->count < WATCH_BURST) {
+                watch_add(watch, event->name, false);
+            } else {
+                watch->rescan = true;
+            }
+        }
+    }
+}
+
+/* Reads directory until the burst is full, a new rescan starts from the beginning */
+void watch_rescan(struct watch * watch) {
+    const struct dirent * entry;
+
+    if (watch->rescan) {
+        watch->rescan = false;
+
+        if (watch->scan) {
+            closedir(watch->scan);
+        }
+
+        if (!(watch->scan = opendir(watch->directory))) {
+            fprintf(watch->log, "Watching %s: reading directory failed: %s.\n", watch->directory, strerror(errno));
+            return;
+        }
+    }
+
+    while (watch->scan && watch->batch->count < WATCH_BURST) {
+        if ((entry = readdir(watch->scan))) {
+            watch_add(watch, entry->d_name, true);
+        } else {
+            closedir(watch->scan);
+            watch->scan = NULL;
+        }
+    }
+}
+
+/* Milliseconds to wait for the rest of a burst, -1 while there are no files and nothing to rescan */
+int watch_timeout(const struct watch * watch) {
+    double waited;
+
+    if (watch->batch->count == 0) {
+        return watch->rescan || watch->scan ? 0 : -1;
+    }
+
+    if (watch->batch->count == WATCH_BURST || (waited = watch_elapsed(watch->ready[0])) >= WATCH_DELAY) {
+        return 0;
+    }
+
+    return WATCH_DELAY - waited < WATCH_QUIET ? (int) (WATCH_DELAY - waited) : WATCH_QUIET;
+}
+
+/* Returns message of failed call */
+const char * watch_open(struct watch * watch) {
+    sigset_t signals;
+
+    if ((watch->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        return strerror(errno);
+    }
+
+    if (inotify_add_watch(watch->inotify, watch->directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR) < 0) {
+        return strerror(errno);
+    }
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    if ((watch->signals = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        return strerror(errno);
+    }
+
+    return NULL;
+}
+
+/* Outputs written to the watched directory would be picked up as inputs */
+bool watch_loops(const struct watch * watch) {
+    char * input = malloc(sizeof(char) * (strlen(watch->directory) + sizeof("/input.bmp")));
+    char * output, * separator, * resolved[2];
+    bool loops;
+
+    sprintf(input, "%s/input.bmp", watch->directory);
+    output = batch_output_name(watch->batch->output_template, input, 0);
+
+    if ((separator = strrchr(output, '/'))) {
+        *separator = '\0';
+    }
+
+    resolved[0] = realpath(watch->directory, NULL);
+    resolved[1] = realpath(separator ? (separator == output ? "/" : output) : ".", NULL);
+    loops = resolved[0] && resolved[1] && strcmp(resolved[0], resolved[1]) == 0;
+
+    free(resolved[0]);
+    free(resolved[1]);
+    free(output);
+    free(input);
+    return loops;
+}
+
+bool watch_run(const char * directory, struct batch * batch, const struct interpreter interpreter, FILE * log) {
+    struct signalfd_siginfo signal_info;
+    struct pollfd fds[2];
+    bool stopping = false;
+    const char * error;
+    struct watch watch;
+    uint32_t lost = 0;
+    int ready = 0;
+
+    watch.directory = directory;
+    watch.batch = batch;
+    watch.log = log;
+    watch.inotify = watch.signals = -1;
+    watch.lost = 0;
+    watch.files_capacity = WATCH_FILES_CAPACITY;
+    watch.files_count = 0;
+    watch.scan = NULL;
+
+    batch->atomic = true;
+    batch->finished = watch_finished;
+    batch->context = &watch;
+
+    if (watch_loops(&watch)) {
+        error = "outputs would be written to the watched directory";
+    } else {
+        error = watch_open(&watch);
+    }
+
+    if (error) {
+        fprintf(log, "Watching %s failed: %s.\n", directory, error);
+
+        if (watch.inotify >= 0) {
+            close(watch.inotify);
+        }
+
+        return false;
+    }
+
+    fprintf(log, "Watching %s.\n", directory);
+
+    /* files already in the directory are read after the watch is added, so none is missed in between */
+    watch.files = calloc(watch.files_capacity, sizeof(struct watch_file *));
+    watch.rescan = true;
+
+    fds[0].fd = watch.inotify;
+    fds[1].fd = watch.signals;
+    fds[0].events = fds[1].events = POLLIN;
+
+    /* files of a burst wait until it is quiet, full or delayed too long, pending burst is run before stopping */
+    while (!stopping || batch->count > 0) {
+        if (!stopping && (ready = poll(fds, 2, watch_timeout(&watch))) < 0 && errno != EINTR) {
+            fprintf(log, "Watching %s failed: %s.\n", directory, strerror(errno));
+            break;
+        }
+
+        if (read(watch.signals, &signal_info, sizeof(signal_info)) == sizeof(signal_info)) {
+            stopping = true;
+        }
+
+        watch_read(&watch);
+
+        if (watch.lost > lost) {
+            fprintf(log, "Watching %s: events were lost, reading directory again.\n", directory);
+            lost = watch.lost;
+        }
+
+        if (!stopping) {
+            watch_rescan(&watch);
+        }
+
+        /* poll timed out, so burst is quiet or delayed too long */
+        if (batch->count > 0 && (stopping || ready == 0 || watch_timeout(&watch) == 0)) {
+            batch_run(batch, interpreter, log);
+            batch_clear(batch);
+        }
+    }
+
+    if (watch.scan) {
+        closedir(watch.scan);
+    }
+
+    watch_files_delete(&watch);
+    close(watch.signals);
+    close(watch.inotify);
+
+    fprintf(log, "Watching %s stopped.\n", directory);
+    return true;
+}
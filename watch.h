@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "batch.h"
+#include "interpreter.h"
+
+/* Watch mode: a hot folder processed as files arrive
+ *
+ * BMP files written or moved into the directory are picked up by inotify as soon as they
+ * are closed. Files arriving together are coalesced into one run of batch pipeline, outputs
+ * are written to temporary files and renamed. Time from a file being ready to its output
+ * being renamed is reported to log. Names starting with a dot are ignored.
+ *
+ * Files already in the directory are processed at start. The directory is read again when
+ * the inotify queue overflows or a burst cannot take all events, then files added before
+ * are skipped unless they changed since (inode, size or change time differ).
+ */
+
+/* Milliseconds without new files that end a burst */
+#define WATCH_QUIET (1)
+
+/* Upper bound of milliseconds a file waits for the rest of its burst */
+#define WATCH_DELAY (10)
+
+/* Upper bound of files in a burst */
+#define WATCH_BURST (256)
+
+/* Blocks SIGINT and SIGTERM in the calling thread to be taken by watch_run,
+ * so it should be called before threads (interpreter pool) are created
+ */
+void watch_block_signals(void);
+
+/* Inputs of `batch` are replaced by every burst, its other settings are kept.
+ * Returns after SIGINT or SIGTERM, false if directory cannot be watched (reported to `log`).
+ */
+bool watch_run(const char * directory, struct batch * batch, const struct interpreter interpreter, FILE * log);